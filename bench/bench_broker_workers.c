@@ -0,0 +1,86 @@
+/* bench_broker_workers.c: Benchmark aggregate broker throughput from many client processes */
+
+#include "mq/client.h"
+
+#include <assert.h>
+#include <sys/mman.h>
+#include <sys/wait.h>
+#include <time.h>
+#include <unistd.h>
+
+/* Constants */
+
+size_t       NCLIENTS  = 16;
+size_t       NMESSAGES = 200;
+
+/* Functions */
+
+double now() {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+/**
+ * Publish messages to own topic and retrieve them all again.
+ */
+void client(const char *host, const char *port, size_t id) {
+    char name[BUFSIZ];
+    sprintf(name, "bench_workers_%d_%zu", getppid(), id);
+
+    MessageQueue *mq = mq_create(name, host, port);
+    assert(mq);
+    mq_subscribe(mq, name);
+    mq_start(mq);
+
+    for (size_t m = 0; m < NMESSAGES; m++) {
+        mq_publish(mq, name, "payload");
+    }
+    for (size_t m = 0; m < NMESSAGES; m++) {
+        char *message = mq_retrieve(mq);
+        assert(message);
+        free(message);
+    }
+
+    mq_stop(mq);
+    mq_delete(mq);
+}
+
+/* Main execution */
+
+int main(int argc, char *argv[]) {
+    char *host = "localhost";
+    char *port = "9620";
+
+    if (argc > 1) { host = argv[1]; }
+    if (argc > 2) { port = argv[2]; }
+    if (argc > 3) { NCLIENTS  = strtoul(argv[3], NULL, 10); }
+    if (argc > 4) { NMESSAGES = strtoul(argv[4], NULL, 10); }
+
+    pid_t  pids[NCLIENTS];
+    double start = now();
+    for (size_t i = 0; i < NCLIENTS; i++) {
+        pids[i] = fork();
+        assert(pids[i] >= 0);
+        if (pids[i] == 0) {
+            client(host, port, i);
+            _exit(EXIT_SUCCESS);
+        }
+    }
+
+    int failures = 0;
+    for (size_t i = 0; i < NCLIENTS; i++) {
+        int status;
+        waitpid(pids[i], &status, 0);
+        failures += !WIFEXITED(status) || WEXITSTATUS(status) != EXIT_SUCCESS;
+    }
+    double elapsed = now() - start;
+
+    size_t messages = NCLIENTS * NMESSAGES;
+    printf("clients             %zu (%d failed)\n", NCLIENTS, failures);
+    printf("published           %zu in %.2f s (%.0f msgs/s)\n", messages, elapsed, messages / elapsed);
+    printf("requests            %.0f requests/s (publish and retrieve)\n", 2 * messages / elapsed);
+    return failures ? EXIT_FAILURE : EXIT_SUCCESS;
+}
+
+/* vim: set expandtab sts=4 sw=4 ts=8 ft=c: */
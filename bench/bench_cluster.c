@@ -0,0 +1,98 @@
+/* bench_cluster.c: Benchmark aggregate throughput of a cluster map of brokers */
+
+#include "mq/client.h"
+
+#include <assert.h>
+#include <sys/wait.h>
+#include <time.h>
+#include <unistd.h>
+
+/* Constants */
+
+size_t       NCLIENTS  = 8;
+size_t       NTOPICS   = 8;
+size_t       NMESSAGES = 200;
+
+/* Functions */
+
+double now() {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+/**
+ * Publish messages round-robin to own topics (spread over the brokers of the
+ * cluster map by hash) and retrieve them all again.
+ */
+void client(const char *host, const char *port, size_t id) {
+    char name[64];
+    char topic[BUFSIZ];
+    sprintf(name, "bench_cluster_%d_%zu", getppid(), id);
+
+    MessageQueue *mq = mq_create(name, host, port);
+    assert(mq);
+    for (size_t t = 0; t < NTOPICS; t++) {
+        snprintf(topic, sizeof(topic), "%s_%zu", name, t);
+        mq_subscribe(mq, topic);
+    }
+    mq_start(mq);
+
+    for (size_t m = 0; m < NMESSAGES; m++) {
+        snprintf(topic, sizeof(topic), "%s_%zu", name, m % NTOPICS);
+        mq_publish(mq, topic, "payload");
+    }
+    for (size_t m = 0; m < NMESSAGES; m++) {
+        char *message = mq_retrieve(mq);
+        assert(message);
+        free(message);
+    }
+
+    mq_stop(mq);
+    mq_delete(mq);
+}
+
+/* Main execution */
+
+int main(int argc, char *argv[]) {
+    char *host = "localhost";
+    char *port = "9620";
+
+    if (argc > 1) { host = argv[1]; }
+    if (argc > 2) { port = argv[2]; }
+    if (argc > 3) { NCLIENTS  = strtoul(argv[3], NULL, 10); }
+    if (argc > 4) { NMESSAGES = strtoul(argv[4], NULL, 10); }
+
+    size_t brokers = 1;
+    for (char *c = host; *c; c++) {
+        brokers += *c == ';';
+    }
+
+    pid_t  pids[NCLIENTS];
+    double start = now();
+    for (size_t i = 0; i < NCLIENTS; i++) {
+        pids[i] = fork();
+        assert(pids[i] >= 0);
+        if (pids[i] == 0) {
+            client(host, port, i);
+            _exit(EXIT_SUCCESS);
+        }
+    }
+
+    int failures = 0;
+    for (size_t i = 0; i < NCLIENTS; i++) {
+        int status;
+        waitpid(pids[i], &status, 0);
+        failures += !WIFEXITED(status) || WEXITSTATUS(status) != EXIT_SUCCESS;
+    }
+    double elapsed = now() - start;
+
+    size_t messages = NCLIENTS * NMESSAGES;
+    printf("brokers             %zu\n", brokers);
+    printf("clients             %zu (%d failed)\n", NCLIENTS, failures);
+    printf("published           %zu in %.2f s (%.0f msgs/s)\n", messages, elapsed, messages / elapsed);
+    printf("per broker          %.0f msgs/s\n", messages / elapsed / brokers);
+    return failures ? EXIT_FAILURE : EXIT_SUCCESS;
+}
+
+/* vim: set expandtab sts=4 sw=4 ts=8 ft=c: */
@@ -0,0 +1,107 @@
+/* bench_compress.c: Benchmark LZ compression ratio and throughput */
+
+#include "mq/compress.h"
+
+#include <assert.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+/* Constants */
+
+const double DURATION = 0.25;       // Seconds spent measuring each payload
+
+/* Functions */
+
+double now() {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+/**
+ * Generate JSON array of records similar to our multi-kilobyte topic blobs.
+ */
+size_t generate_json(char *buffer, size_t length) {
+    const char *names[]  = { "alpha", "bravo", "charlie", "delta", "echo", "foxtrot" };
+    const char *states[] = { "PENDING", "ACTIVE", "SUSPENDED", "CLOSED" };
+    size_t n = 0;
+
+    n += sprintf(buffer, "[");
+    for (size_t i = 0; n + 256 < length; i++) {
+        n += sprintf(buffer + n,
+            "{\"id\": %zu, \"name\": \"%s-%d\", \"state\": \"%s\", \"price\": %d.%02d, "
+            "\"tags\": [\"%s\", \"%s\"], \"updated\": \"2020-10-%02dT%02d:%02d:%02dZ\"},",
+            i, names[rand() % 6], rand() % 1000, states[rand() % 4], rand() % 10000, rand() % 100,
+            names[rand() % 6], states[rand() % 4], rand() % 28 + 1, rand() % 24, rand() % 60, rand() % 60);
+    }
+    buffer[n - 1] = ']';
+    return n;
+}
+
+size_t generate_log(char *buffer, size_t length) {
+    const char *levels[] = { "DEBUG", "INFO ", "ERROR" };
+    size_t n = 0;
+    while (n + 128 < length) {
+        n += sprintf(buffer + n, "[%09d] %s client.c:%d:mq_pusher: sent request %d to localhost:9620\n",
+            rand(), levels[rand() % 3], rand() % 500, rand());
+    }
+    return n;
+}
+
+size_t generate_random(char *buffer, size_t length) {
+    for (size_t i = 0; i < length; i++) {
+        buffer[i] = rand();
+    }
+    return length;
+}
+
+void measure(const char *name, char *input, size_t length) {
+    size_t capacity   = lz_bound(length);
+    char  *compressed = malloc(capacity);
+    char  *output     = malloc(length);
+    size_t n          = 0;
+    size_t rounds     = 0;
+
+    double start = now();
+    do {
+        n = lz_compress(input, length, compressed, capacity);
+        rounds++;
+    } while (now() - start < DURATION);
+    double compress = rounds * length / (now() - start) / (1<<20);
+
+    rounds = 0;
+    start  = now();
+    do {
+        assert(lz_decompress(compressed, n, output, length) == (ssize_t)length);
+        rounds++;
+    } while (now() - start < DURATION);
+    double decompress = rounds * length / (now() - start) / (1<<20);
+
+    assert(memcmp(input, output, length) == 0);
+    printf("%-8s %8zu -> %8zu bytes  ratio %5.2f  compress %8.1f MB/s  decompress %8.1f MB/s\n",
+        name, length, n, (double)length / n, compress, decompress);
+
+    free(compressed);
+    free(output);
+}
+
+/* Main execution */
+
+int main(int argc, char *argv[]) {
+    size_t sizes[] = { 1<<10, 4<<10, 16<<10, 64<<10, 1<<20 };
+    char  *buffer  = malloc(sizes[4]);
+
+    srand(0);
+    for (size_t s = 0; s < sizeof(sizes) / sizeof(sizes[0]); s++) {
+        measure("json", buffer, generate_json(buffer, sizes[s]));
+    }
+    measure("log", buffer, generate_log(buffer, 16<<10));
+    measure("random", buffer, generate_random(buffer, 16<<10));
+
+    free(buffer);
+    return EXIT_SUCCESS;
+}
+
+/* vim: set expandtab sts=4 sw=4 ts=8 ft=c: */
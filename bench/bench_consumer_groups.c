@@ -0,0 +1,128 @@
+/* bench_consumer_groups.c: Benchmark consumption as consumer group members are added */
+
+#include "mq/client.h"
+
+#include <assert.h>
+#include <signal.h>
+#include <sys/mman.h>
+#include <sys/wait.h>
+#include <time.h>
+#include <unistd.h>
+
+/* Constants */
+
+size_t       NMESSAGES  = 400;
+const size_t MAXMEMBERS = 8;
+const size_t WORK       = 2000;     // Microseconds of processing per message
+
+/* Functions */
+
+double now() {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+/**
+ * Consume messages as a member of group until killed.
+ */
+void member(const char *host, const char *port, const char *group, size_t id, enum GROUP_POLICY policy, size_t *consumed) {
+    char name[BUFSIZ];
+    sprintf(name, "%s_member_%zu", group, id);
+
+    MessageQueue *mq = mq_create(name, host, port);
+    assert(mq);
+    if (policy == LEAST_OUTSTANDING) {
+        mq_set_lease(mq, 30);
+    }
+    mq_join(mq, group, group, policy);
+    mq_start(mq);
+
+    while (true) {
+        char *message = mq_retrieve(mq);
+        if (message) {
+            usleep(WORK);
+            free(message);
+            __atomic_add_fetch(consumed, 1, __ATOMIC_SEQ_CST);
+        }
+    }
+}
+
+/**
+ * Publish backlog to group and measure how long members take to consume it.
+ * @return  Messages consumed per second.
+ */
+double run(const char *host, const char *port, size_t members, enum GROUP_POLICY policy, size_t *consumed) {
+    char group[64];
+    sprintf(group, "bench_group_%d_%d_%zu", getpid(), policy, members);
+
+    /* Fill group queue (stopping the publisher so no threads are forked);
+     * joining subscribes the group to the topic */
+    char name[BUFSIZ];
+    sprintf(name, "%s_publisher", group);
+    MessageQueue *mq = mq_create(name, host, port);
+    assert(mq);
+    mq_join(mq, group, group, policy);
+    mq_leave(mq, group);
+    mq_start(mq);
+    for (size_t m = 0; m < NMESSAGES; m++) {
+        mq_publish(mq, group, "payload");
+    }
+    mq_stop(mq);
+    mq_delete(mq);
+
+    /* Consume with member processes */
+    pid_t  pids[members];
+    double start = now();
+    *consumed = 0;
+    for (size_t i = 0; i < members; i++) {
+        pids[i] = fork();
+        assert(pids[i] >= 0);
+        if (pids[i] == 0) {
+            member(host, port, group, i, policy, consumed);
+            _exit(EXIT_SUCCESS);
+        }
+    }
+
+    while (__atomic_load_n(consumed, __ATOMIC_SEQ_CST) < NMESSAGES) {
+        usleep(1000);
+    }
+    double elapsed = now() - start;
+
+    for (size_t i = 0; i < members; i++) {
+        kill(pids[i], SIGKILL);
+        waitpid(pids[i], NULL, 0);
+    }
+    return NMESSAGES / elapsed;
+}
+
+/* Main execution */
+
+int main(int argc, char *argv[]) {
+    char *host = "localhost";
+    char *port = "9620";
+
+    if (argc > 1) { host = argv[1]; }
+    if (argc > 2) { port = argv[2]; }
+    if (argc > 3) { NMESSAGES = strtoul(argv[3], NULL, 10); }
+
+    size_t *consumed = mmap(NULL, sizeof(size_t), PROT_READ | PROT_WRITE, MAP_SHARED | MAP_ANONYMOUS, -1, 0);
+    assert(consumed != MAP_FAILED);
+
+    printf("%zu messages, %zu us of work each\n", NMESSAGES, WORK);
+    printf("%-8s %18s %18s\n", "members", "round-robin", "least-outstanding");
+    double baseline = 0;
+    for (size_t members = 1; members <= MAXMEMBERS; members *= 2) {
+        double rr = run(host, port, members, ROUND_ROBIN, consumed);
+        double lo = run(host, port, members, LEAST_OUTSTANDING, consumed);
+        if (members == 1) {
+            baseline = rr;
+        }
+        printf("%-8zu %10.0f msgs/s %10.0f msgs/s  (%.2fx)\n", members, rr, lo, rr / baseline);
+    }
+
+    munmap(consumed, sizeof(size_t));
+    return EXIT_SUCCESS;
+}
+
+/* vim: set expandtab sts=4 sw=4 ts=8 ft=c: */
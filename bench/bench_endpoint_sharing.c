@@ -0,0 +1,96 @@
+/* bench_endpoint_sharing.c: Benchmark many MessageQueues sharing one broker */
+
+#include "mq/client.h"
+
+#include <assert.h>
+#include <time.h>
+#include <unistd.h>
+
+/* Constants */
+
+size_t       NQUEUES   = 100;
+const size_t NMESSAGES = 20;
+
+/* Functions */
+
+double now() {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+/* Threads */
+
+void *consumer_thread(void *arg) {
+    MessageQueue *mq = (MessageQueue *)arg;
+    for (size_t m = 0; m < NMESSAGES; m++) {
+        char *message = mq_retrieve(mq);
+        assert(message);
+        free(message);
+    }
+    return NULL;
+}
+
+/* Main execution */
+
+int main(int argc, char *argv[]) {
+    char *host = "localhost";
+    char *port = "9620";
+
+    if (argc > 1) { host = argv[1]; }
+    if (argc > 2) { port = argv[2]; }
+    if (argc > 3) { NQUEUES = strtoul(argv[3], NULL, 10); }
+
+    MessageQueue *mqs[NQUEUES];
+    Thread        consumers[NQUEUES];
+    char          name[BUFSIZ];
+
+    /* Create queues, each subscribed to its own topic */
+    for (size_t q = 0; q < NQUEUES; q++) {
+        sprintf(name, "bench_sharing_%d_%zu", getpid(), q);
+        mqs[q] = mq_create(name, host, port);
+        assert(mqs[q]);
+        mq_subscribe(mqs[q], name);
+        mq_start(mqs[q]);
+    }
+
+    /* Publish and retrieve through every queue concurrently */
+    double start = now();
+    for (size_t q = 0; q < NQUEUES; q++) {
+        thread_create(&consumers[q], NULL, consumer_thread, mqs[q]);
+    }
+    for (size_t m = 0; m < NMESSAGES; m++) {
+        for (size_t q = 0; q < NQUEUES; q++) {
+            sprintf(name, "bench_sharing_%d_%zu", getpid(), q);
+            mq_publish(mqs[q], name, "payload");
+        }
+    }
+    for (size_t q = 0; q < NQUEUES; q++) {
+        thread_join(consumers[q], NULL);
+    }
+    double elapsed = now() - start;
+
+    /* Report connection statistics */
+    EndpointStats s;
+    endpoint_stats(mqs[0]->endpoint, &s);
+
+    size_t messages = NQUEUES * NMESSAGES;
+    printf("queues              %zu\n", s.references);
+    printf("messages            %zu in %.2f s (%.0f msgs/s)\n", messages, elapsed, messages / elapsed);
+    printf("requests            %zu (%zu bytes)\n", s.requests, s.bytes);
+    printf("sockets opened      %zu (%zu open)\n", s.opened, s.connections);
+    printf("sockets saved       %zu vs. one per request, %zu vs. two per queue\n",
+        s.requests - s.opened, 2 * NQUEUES > s.opened ? 2 * NQUEUES - s.opened : 0);
+    printf("per connection      %.0f requests/s, %.0f bytes/s\n",
+        s.requests / s.elapsed / s.opened, s.bytes / s.elapsed / s.opened);
+
+    for (size_t q = 0; q < NQUEUES; q++) {
+        mq_stop(mqs[q]);
+    }
+    for (size_t q = 0; q < NQUEUES; q++) {
+        mq_delete(mqs[q]);
+    }
+    return EXIT_SUCCESS;
+}
+
+/* vim: set expandtab sts=4 sw=4 ts=8 ft=c: */
@@ -0,0 +1,128 @@
+/* bench_logging.c: Benchmark cost per call of logging macros */
+
+#include "mq/logging.h"
+#include "mq/thread.h"
+
+#include <assert.h>
+#include <stdbool.h>
+#include <time.h>
+
+/* Constants */
+
+size_t NCALLS = 1<<17;          // Calls per thread
+size_t NBATCH = 128;            // Calls timed between flushes (half a ring)
+
+/* Structures */
+
+typedef struct {
+    const char *name;
+    void      (*call)(size_t i);
+    bool        flush;          // Drain rings between batches (untimed)
+} Mode;
+
+typedef struct {
+    Mode   *mode;
+    double  elapsed;
+} Caller;
+
+/* Variables */
+
+FILE *DevNull = NULL;
+
+/* Functions */
+
+double now() {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+/* Former synchronous macro: one write to unbuffered stderr per call */
+void call_fprintf(size_t i) {
+    fprintf(DevNull, "[%09lu] ERROR " "Unable to send request %zu to %s:%s" "\n", (unsigned long) pthread_self(), i, "localhost", "9620");
+}
+
+void call_async(size_t i) {
+    error("Unable to send request %zu to %s:%s", i, "localhost", "9620");
+}
+
+void call_filtered(size_t i) {
+    debug("Sent request %zu to %s:%s", i, "localhost", "9620");
+}
+
+/* Threads */
+
+void *caller(void *arg) {
+    Caller *c = (Caller *)arg;
+    for (size_t i = 0; i < NCALLS; ) {
+        double start = now();
+        for (size_t b = 0; b < NBATCH && i < NCALLS; b++, i++) {
+            c->mode->call(i);
+        }
+        c->elapsed += now() - start;
+        if (c->mode->flush) {
+            log_flush();
+        }
+    }
+    return NULL;
+}
+
+/* Benchmark */
+
+/**
+ * Return mean time spent in each call (excluding flushes) in nanoseconds.
+ */
+double run(Mode *mode, size_t nthreads) {
+    Thread threads[nthreads];
+    Caller callers[nthreads];
+    double elapsed = 0;
+
+    for (size_t t = 0; t < nthreads; t++) {
+        callers[t] = (Caller){ mode, 0 };
+        thread_create(&threads[t], NULL, caller, &callers[t]);
+    }
+    for (size_t t = 0; t < nthreads; t++) {
+        thread_join(threads[t], NULL);
+        elapsed += callers[t].elapsed;
+    }
+    return elapsed * 1e9 / (nthreads * NCALLS);
+}
+
+/* Main execution */
+
+int main(int argc, char *argv[]) {
+    if (argc > 1) { NCALLS = strtoul(argv[1], NULL, 10); }
+
+    DevNull = fopen("/dev/null", "w");
+    assert(DevNull);
+    setvbuf(DevNull, NULL, _IONBF, 0);
+    log_set_stream(DevNull);
+
+    Mode modes[] = {
+        { "fprintf"     , call_fprintf , false },
+        { "async"       , call_async   , true  },
+        { "async-full"  , call_async   , false },
+        { "rate-limited", call_async   , false },
+        { "filtered"    , call_filtered, false },
+    };
+
+    printf("Logging: %zu calls per thread (ns per call by number of threads)\n", NCALLS);
+    printf("%-14s %8s %8s %8s %8s %10s\n", "mode", "1", "2", "4", "8", "dropped");
+    for (size_t m = 0; m < sizeof(modes) / sizeof(modes[0]); m++) {
+        log_set_burst(strcmp(modes[m].name, "rate-limited") == 0 ? 20 : 0);
+        log_set_level(strcmp(modes[m].name, "filtered") == 0 ? LOG_LEVEL_INFO : LOG_LEVEL_DEBUG);
+        log_flush();
+
+        unsigned long dropped = log_dropped();
+        printf("%-14s", modes[m].name);
+        for (size_t nthreads = 1; nthreads <= 8; nthreads *= 2) {
+            printf(" %8.1f", run(&modes[m], nthreads));
+        }
+        printf(" %9.1f%%\n", 100.0 * (log_dropped() - dropped) / (15 * NCALLS));
+    }
+
+    log_flush();
+    return EXIT_SUCCESS;
+}
+
+/* vim: set expandtab sts=4 sw=4 ts=8 ft=c: */
@@ -0,0 +1,294 @@
+/* bench_queue.c: Microbenchmark queue backends across contention profiles */
+
+#include "mq/queue.h"
+#include "mq/stats.h"
+
+#include <assert.h>
+#include <errno.h>
+#include <stdbool.h>
+#include <sys/resource.h>
+#include <unistd.h>
+
+/* Constants */
+
+#define MAX_SWEEP   16
+
+/* Structures */
+
+typedef struct {
+    size_t  values[MAX_SWEEP];
+    size_t  count;
+} Sweep;
+
+typedef struct {
+    Queue *     q;
+    size_t      messages;
+    size_t      batch;
+    const char *payload;
+    Histogram   latency;        // Per push or pop (nanoseconds)
+} Worker;
+
+typedef struct {
+    const char *backend;
+    size_t      producers;
+    size_t      consumers;
+    size_t      batch;
+    size_t      size;
+    double      elapsed;
+    uint64_t    operations;
+    Histogram   push;
+    Histogram   pop;
+    uint64_t    lock_waits;
+    uint64_t    lock_wait_ns;
+    long        voluntary;      // Context switches from blocking (ie. futex waits)
+    long        involuntary;    // Context switches from preemption
+} Result;
+
+/* Global Variables */
+
+size_t      Messages  = 1<<15;  // Messages pushed (and popped) per run
+const char *Backend   = NULL;   // Backend to run (NULL runs every backend)
+const char *Output    = NULL;   // File results are appended to as JSON
+Sweep       Producers = { {1, 2, 4, 8}, 4 };
+Sweep       Consumers = { {1, 2, 4}, 3 };
+Sweep       Batches   = { {1, 32}, 2 };
+Sweep       Sizes     = { {16, 1024}, 2 };
+
+/* Functions */
+
+void sweep_parse(Sweep *s, char *list) {
+    s->count = 0;
+    for (char *value = strtok(list, ","); value && s->count < MAX_SWEEP; value = strtok(NULL, ",")) {
+        s->values[s->count++] = strtoul(value, NULL, 10);
+    }
+}
+
+void histogram_sum(Histogram *h, const Histogram *other) {
+    h->count += other->count;
+    h->total += other->total;
+    for (size_t b = 0; b < HISTOGRAM_BUCKETS; b++) {
+        h->buckets[b] += other->buckets[b];
+    }
+}
+
+Queue * backend_create(const char *name, size_t producers) {
+    if (strcmp(name, LockedQueue.name) == 0) {
+        return queue_create();
+    }
+    if (strcmp(name, ShardedQueue.name) == 0) {
+        return queue_create_sharded(producers);
+    }
+    if (strcmp(name, PriorityQueue.name) == 0) {
+        return queue_create_priority();
+    }
+    if (strcmp(name, SPSCQueue.name) == 0) {
+        return queue_create_spsc(QUEUE_RING_CAPACITY);
+    }
+    return NULL;
+}
+
+/* Threads */
+
+/**
+ * Create a batch of requests, then push them one at a time (only the pushes
+ * are timed).
+ */
+void *producer(void *arg) {
+    Worker  *w = (Worker *)arg;
+    Request *batch[w->batch];
+
+    for (size_t m = 0; m < w->messages; m += w->batch) {
+        size_t n = w->messages - m < w->batch ? w->messages - m : w->batch;
+        for (size_t i = 0; i < n; i++) {
+            batch[i] = request_create("PUT", "/queue/bench", w->payload);
+        }
+        for (size_t i = 0; i < n; i++) {
+            uint64_t start = stats_now();
+            queue_push(w->q, batch[i]);
+            histogram_add(&w->latency, stats_now() - start);
+        }
+    }
+    return NULL;
+}
+
+/**
+ * Pop a batch of requests one at a time (only the pops are timed), then
+ * read and delete them.
+ */
+void *consumer(void *arg) {
+    Worker  *w = (Worker *)arg;
+    Request *batch[w->batch];
+    size_t   checksum = 0;
+
+    for (size_t m = 0; m < w->messages; m += w->batch) {
+        size_t n = w->messages - m < w->batch ? w->messages - m : w->batch;
+        for (size_t i = 0; i < n; i++) {
+            uint64_t start = stats_now();
+            batch[i] = queue_pop(w->q);
+            histogram_add(&w->latency, stats_now() - start);
+        }
+        for (size_t i = 0; i < n; i++) {
+            checksum += batch[i]->length + batch[i]->body[batch[i]->length - 1];
+            request_delete(batch[i]);
+        }
+    }
+    return (void *)checksum;
+}
+
+/* Benchmark */
+
+void run(Result *result) {
+    size_t  nproducers = result->producers;
+    size_t  nconsumers = result->consumers;
+    Queue  *q          = backend_create(result->backend, nproducers);
+    Thread  threads[nproducers + nconsumers];
+    Worker  workers[nproducers + nconsumers];
+    char   *payload    = malloc(result->size + 1);
+
+    assert(q);
+    memset(payload, 'x', result->size);
+    payload[result->size] = '\0';
+
+    for (size_t t = 0; t < nproducers + nconsumers; t++) {
+        size_t n     = t < nconsumers ? nconsumers : nproducers;
+        size_t index = t < nconsumers ? t : t - nconsumers;
+        workers[t] = (Worker){ q, Messages / n + (index < Messages % n), result->batch, payload, {0} };
+    }
+
+    struct rusage before, after;
+    getrusage(RUSAGE_SELF, &before);
+    uint64_t start = stats_now();
+    for (size_t c = 0; c < nconsumers; c++) {
+        thread_create(&threads[c], NULL, consumer, &workers[c]);
+    }
+    for (size_t p = nconsumers; p < nconsumers + nproducers; p++) {
+        thread_create(&threads[p], NULL, producer, &workers[p]);
+    }
+    for (size_t t = 0; t < nproducers + nconsumers; t++) {
+        thread_join(threads[t], NULL);
+    }
+    result->elapsed = (stats_now() - start) / 1e9;
+    getrusage(RUSAGE_SELF, &after);
+
+    assert(queue_size(q) == 0);
+    result->operations  = 2 * Messages;
+    result->voluntary   = after.ru_nvcsw  - before.ru_nvcsw;
+    result->involuntary = after.ru_nivcsw - before.ru_nivcsw;
+    queue_lock_wait(q, &result->lock_waits, &result->lock_wait_ns);
+    memset(&result->push, 0, sizeof(Histogram));
+    memset(&result->pop , 0, sizeof(Histogram));
+    for (size_t t = 0; t < nproducers + nconsumers; t++) {
+        histogram_sum(t < nconsumers ? &result->pop : &result->push, &workers[t].latency);
+    }
+
+    queue_delete(q);
+    free(payload);
+}
+
+void report(FILE *stream, bool json, const Result *r) {
+    if (json) {
+        fprintf(stream,
+            "{\"backend\": \"%s\", \"producers\": %zu, \"consumers\": %zu, \"batch\": %zu, \"size\": %zu, "
+            "\"messages\": %zu, \"elapsed\": %.6f, \"ops_per_sec\": %.0f, "
+            "\"push_ns\": {\"mean\": %.0f, \"p50\": %lu, \"p99\": %lu, \"p999\": %lu}, "
+            "\"pop_ns\": {\"mean\": %.0f, \"p50\": %lu, \"p99\": %lu, \"p999\": %lu}, "
+            "\"lock_waits\": %lu, \"lock_wait_ns\": %lu, \"voluntary_switches\": %ld, \"involuntary_switches\": %ld}\n",
+            r->backend, r->producers, r->consumers, r->batch, r->size,
+            Messages, r->elapsed, r->operations / r->elapsed,
+            (double)r->push.total / r->push.count, histogram_percentile(&r->push, 50), histogram_percentile(&r->push, 99), histogram_percentile(&r->push, 99.9),
+            (double)r->pop.total / r->pop.count, histogram_percentile(&r->pop, 50), histogram_percentile(&r->pop, 99), histogram_percentile(&r->pop, 99.9),
+            r->lock_waits, r->lock_wait_ns, r->voluntary, r->involuntary);
+        return;
+    }
+
+    fprintf(stream, "%-8s %3zu %3zu %5zu %5zu %11.0f %8lu %8lu %8lu %8lu %8lu %9.3f %8ld %8ld\n",
+        r->backend, r->producers, r->consumers, r->batch, r->size, r->operations / r->elapsed,
+        histogram_percentile(&r->push, 50), histogram_percentile(&r->push, 99),
+        histogram_percentile(&r->pop, 50), histogram_percentile(&r->pop, 99),
+        r->lock_waits, r->lock_wait_ns / 1e6, r->voluntary, r->involuntary);
+}
+
+void usage(const char *program, int status) {
+    fprintf(stderr, "Usage: %s [options]\n\n", program);
+    fprintf(stderr, "Options:\n");
+    fprintf(stderr, "    -b BACKEND      Queue backend to run: %s, %s, %s or %s (default: all)\n", LockedQueue.name, ShardedQueue.name, PriorityQueue.name, SPSCQueue.name);
+    fprintf(stderr, "    -m MESSAGES     Messages per run (default: %zu)\n", Messages);
+    fprintf(stderr, "    -p LIST         Producer counts to sweep (default: 1,2,4,8)\n");
+    fprintf(stderr, "    -c LIST         Consumer counts to sweep (default: 1,2,4)\n");
+    fprintf(stderr, "    -B LIST         Batch sizes to sweep (default: 1,32)\n");
+    fprintf(stderr, "    -s LIST         Payload sizes to sweep (default: 16,1024)\n");
+    fprintf(stderr, "    -o FILE         Append results to FILE as JSON lines\n");
+    exit(status);
+}
+
+/* Main execution */
+
+int main(int argc, char *argv[]) {
+    int option;
+    while ((option = getopt(argc, argv, "b:m:p:c:B:s:o:h")) != -1) {
+        switch (option) {
+            case 'b': Backend  = optarg; break;
+            case 'm': Messages = strtoul(optarg, NULL, 10); break;
+            case 'p': sweep_parse(&Producers, optarg); break;
+            case 'c': sweep_parse(&Consumers, optarg); break;
+            case 'B': sweep_parse(&Batches, optarg); break;
+            case 's': sweep_parse(&Sizes, optarg); break;
+            case 'o': Output   = optarg; break;
+            case 'h': usage(argv[0], EXIT_SUCCESS); break;
+            default:  usage(argv[0], EXIT_FAILURE); break;
+        }
+    }
+
+    const char *backends[] = { LockedQueue.name, ShardedQueue.name, PriorityQueue.name, SPSCQueue.name };
+    if (Backend && strcmp(Backend, LockedQueue.name) != 0 && strcmp(Backend, ShardedQueue.name) != 0 && strcmp(Backend, PriorityQueue.name) != 0 && strcmp(Backend, SPSCQueue.name) != 0) {
+        usage(argv[0], EXIT_FAILURE);
+    }
+
+    FILE *output = NULL;
+    if (Output && (output = fopen(Output, "a")) == NULL) {
+        fprintf(stderr, "bench_queue: unable to open %s: %s\n", Output, strerror(errno));
+        return EXIT_FAILURE;
+    }
+
+    printf("%zu messages per run, latencies are upper bounds of log2 buckets\n\n", Messages);
+    printf("%-8s %3s %3s %5s %5s %11s %8s %8s %8s %8s %8s %9s %8s %8s\n",
+        "backend", "P", "C", "batch", "size", "ops/s", "push p50", "push p99", "pop p50", "pop p99",
+        "waits", "wait ms", "vcsw", "ivcsw");
+
+    for (size_t b = 0; b < sizeof(backends) / sizeof(backends[0]); b++) {
+        if (Backend && strcmp(Backend, backends[b]) != 0) {
+            continue;
+        }
+        for (size_t p = 0; p < Producers.count; p++) {
+            for (size_t c = 0; c < Consumers.count; c++) {
+                // The ring only supports a single producer and consumer
+                if (backends[b] == SPSCQueue.name && (Producers.values[p] > 1 || Consumers.values[c] > 1)) {
+                    continue;
+                }
+                for (size_t n = 0; n < Batches.count; n++) {
+                    for (size_t s = 0; s < Sizes.count; s++) {
+                        Result result = {
+                            .backend   = backends[b],
+                            .producers = Producers.values[p] ? Producers.values[p] : 1,
+                            .consumers = Consumers.values[c] ? Consumers.values[c] : 1,
+                            .batch     = Batches.values[n] ? Batches.values[n] : 1,
+                            .size      = Sizes.values[s] ? Sizes.values[s] : 1,
+                        };
+                        run(&result);
+                        report(stdout, false, &result);
+                        if (output) {
+                            report(output, true, &result);
+                        }
+                    }
+                }
+            }
+        }
+    }
+
+    if (output) {
+        fclose(output);
+    }
+    return EXIT_SUCCESS;
+}
+
+/* vim: set expandtab sts=4 sw=4 ts=8 ft=c: */
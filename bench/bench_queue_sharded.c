@@ -0,0 +1,92 @@
+/* bench_queue_sharded.c: Benchmark sharded queue against the locked queue */
+
+#include "mq/queue.h"
+
+#include <assert.h>
+#include <time.h>
+
+/* Constants */
+
+size_t NTHREADS  = 32;          // Half producers, half consumers
+size_t NMESSAGES = 1<<16;       // Messages per producer
+
+/* Structures */
+
+typedef struct {
+    Queue  *q;
+    size_t  messages;
+} Worker;
+
+/* Functions */
+
+double now() {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+/* Threads */
+
+void *consumer(void *arg) {
+    Worker *w = (Worker *)arg;
+    for (size_t m = 0; m < w->messages; m++) {
+        Request *r = queue_pop(w->q);
+        assert(r);
+        request_delete(r);
+    }
+    return NULL;
+}
+
+void *producer(void *arg) {
+    Worker *w = (Worker *)arg;
+    for (size_t m = 0; m < w->messages; m++) {
+        queue_push(w->q, request_create("1", "2", "3"));
+    }
+    return NULL;
+}
+
+/* Benchmark */
+
+double run(Queue *q, size_t nproducers, size_t nconsumers) {
+    Thread threads[nproducers + nconsumers];
+    Worker producers = { q, NMESSAGES };
+    Worker consumers = { q, NMESSAGES * nproducers / nconsumers };
+
+    double start = now();
+    for (size_t c = 0; c < nconsumers; c++) {
+        thread_create(&threads[c], NULL, consumer, &consumers);
+    }
+    for (size_t p = 0; p < nproducers; p++) {
+        thread_create(&threads[nconsumers + p], NULL, producer, &producers);
+    }
+    for (size_t t = 0; t < nproducers + nconsumers; t++) {
+        thread_join(threads[t], NULL);
+    }
+    double elapsed = now() - start;
+
+    assert(q->size == 0);
+    queue_delete(q);
+    return elapsed;
+}
+
+/* Main execution */
+
+int main(int argc, char *argv[]) {
+    if (argc > 1) { NTHREADS  = strtoul(argv[1], NULL, 10); }
+    if (argc > 2) { NMESSAGES = strtoul(argv[2], NULL, 10); }
+
+    size_t nproducers = NTHREADS / 2;
+    size_t nconsumers = NTHREADS - nproducers;
+    size_t operations = 2 * nproducers * NMESSAGES;
+
+    printf("%zu producers, %zu consumers, %zu messages per producer\n", nproducers, nconsumers, NMESSAGES);
+
+    double locked  = run(queue_create(), nproducers, nconsumers);
+    printf("%-8s %8.3f s  %12.0f ops/s\n", LockedQueue.name, locked, operations / locked);
+
+    double sharded = run(queue_create_sharded(nproducers), nproducers, nconsumers);
+    printf("%-8s %8.3f s  %12.0f ops/s  (%.2fx)\n", ShardedQueue.name, sharded, operations / sharded, locked / sharded);
+    return EXIT_SUCCESS;
+}
+
+/* vim: set expandtab sts=4 sw=4 ts=8 ft=c: */
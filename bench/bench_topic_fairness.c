@@ -0,0 +1,156 @@
+/* bench_topic_fairness.c: Benchmark latency of a quiet topic next to a hot one */
+
+#include "mq/client.h"
+
+#include <assert.h>
+#include <time.h>
+#include <unistd.h>
+
+/* Constants */
+
+const char * HOT_TOPIC  = "bench_hot";
+const char * COLD_TOPIC = "bench_cold";
+size_t       NHOT       = 2000;
+size_t       NCOLD      = 20;
+const size_t HOT_WORK   = 3000;     // Microseconds spent processing each hot message
+const size_t COLD_RATE  = 50;       // Milliseconds between cold messages
+
+/* Structures */
+
+typedef struct {
+    MessageQueue *mq;
+    double        total;            // Sum of cold message latencies (ms)
+    double        worst;            // Worst cold message latency (ms)
+    size_t        hot;              // Hot messages processed
+    size_t        cold;             // Cold messages processed
+} Consumer;
+
+/* Functions */
+
+double now_ms() {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec * 1000.0 + ts.tv_nsec / 1000000.0;
+}
+
+void consume(Consumer *c, char *message) {
+    if (strncmp(message, "cold ", 5) == 0) {
+        double latency = now_ms() - atof(message + 5);
+        c->total += latency;
+        c->worst  = latency > c->worst ? latency : c->worst;
+        c->cold++;
+    } else {
+        usleep(HOT_WORK);
+        c->hot++;
+    }
+    free(message);
+}
+
+/* Threads */
+
+void *shared_thread(void *arg) {
+    Consumer *c = (Consumer *)arg;
+    while (c->hot < NHOT || c->cold < NCOLD) {
+        char *message = mq_retrieve(c->mq);
+        if (!message) break;
+        consume(c, message);
+    }
+    return NULL;
+}
+
+void *hot_thread(void *arg) {
+    Consumer *c = (Consumer *)arg;
+    while (c->hot < NHOT) {
+        char *message = mq_retrieve_topic(c->mq, HOT_TOPIC);
+        if (!message) break;
+        consume(c, message);
+    }
+    return NULL;
+}
+
+void *cold_thread(void *arg) {
+    Consumer *c = (Consumer *)arg;
+    while (c->cold < NCOLD) {
+        char *message = mq_retrieve_topic(c->mq, COLD_TOPIC);
+        if (!message) break;
+        consume(c, message);
+    }
+    return NULL;
+}
+
+/* Benchmark */
+
+void run(const char *mode, const char *host, const char *port, bool demux) {
+    char name[BUFSIZ];
+    Consumer hot  = {0};
+    Consumer cold = {0};
+
+    sprintf(name, "bench_fairness_%d_%s", getpid(), mode);
+    MessageQueue *consumer = mq_create(name, host, port);
+    sprintf(name, "bench_fairness_%d_%s_hot", getpid(), mode);
+    MessageQueue *producer = mq_create(name, host, port);
+    sprintf(name, "bench_fairness_%d_%s_cold", getpid(), mode);
+    MessageQueue *pinger   = mq_create(name, host, port);
+    assert(consumer && producer && pinger);
+
+    mq_subscribe(consumer, HOT_TOPIC);
+    mq_subscribe(consumer, COLD_TOPIC);
+    mq_start(consumer);
+    mq_start(producer);
+    mq_start(pinger);
+
+    hot.mq = cold.mq = consumer;
+    Thread threads[2];
+    if (demux) {
+        thread_create(&threads[0], NULL, hot_thread, &hot);
+        thread_create(&threads[1], NULL, cold_thread, &cold);
+    } else {
+        thread_create(&threads[0], NULL, shared_thread, &cold);
+    }
+    sleep(1);
+
+    /* Publish hot messages in a burst while cold messages trickle in */
+    double start = now_ms();
+    char body[BUFSIZ];
+    for (size_t m = 0; m < NHOT; m++) {
+        mq_publish(producer, HOT_TOPIC, "hot");
+    }
+    for (size_t m = 0; m < NCOLD; m++) {
+        usleep(COLD_RATE * 1000);
+        sprintf(body, "cold %.3f", now_ms());
+        mq_publish(pinger, COLD_TOPIC, body);
+    }
+
+    thread_join(threads[0], NULL);
+    if (demux) {
+        thread_join(threads[1], NULL);
+    }
+    double elapsed = now_ms() - start;
+
+    printf("%-10s cold latency avg %8.2f ms  max %8.2f ms  (%zu hot, %zu cold in %.0f ms)\n",
+        mode, cold.total / cold.cold, cold.worst, hot.hot + cold.hot, cold.cold, elapsed);
+
+    mq_stop(consumer);
+    mq_stop(producer);
+    mq_stop(pinger);
+    mq_delete(consumer);
+    mq_delete(producer);
+    mq_delete(pinger);
+}
+
+/* Main execution */
+
+int main(int argc, char *argv[]) {
+    char *host = "localhost";
+    char *port = "9620";
+
+    if (argc > 1) { host = argv[1]; }
+    if (argc > 2) { port = argv[2]; }
+    if (argc > 3) { NHOT = strtoul(argv[3], NULL, 10); }
+
+    run("shared", host, port, false);
+    run("per-topic", host, port, true);
+    return EXIT_SUCCESS;
+}
+
+/* vim: set expandtab sts=4 sw=4 ts=8 ft=c: */
@@ -0,0 +1,461 @@
+/* mq_bench.c: Load generator measuring end-to-end throughput and latency */
+
+#include "mq/client.h"
+#include "mq/socket.h"
+
+#include <assert.h>
+#include <errno.h>
+#include <inttypes.h>
+#include <poll.h>
+#include <sys/resource.h>
+#include <time.h>
+#include <unistd.h>
+
+/* Constants */
+
+#define SUB_BITS        4                       // Sub-buckets per power of two (about 6% precision)
+#define SUB_BUCKETS     (1 << SUB_BITS)
+#define BUCKETS         (64 << SUB_BITS)
+
+const size_t WINDOW     = 64;                   // Outstanding publishes per producer without a target rate
+const char * IDLE_POLL  = "GET /queues HTTP/1.0\r\nConnection: keep-alive\r\nContent-Length: %zu\r\n\r\n%s";
+
+/* Structures */
+
+typedef struct {
+    uint64_t    count;
+    uint64_t    total;
+    uint64_t    max;
+    uint64_t    buckets[BUCKETS];
+} Latency;
+
+typedef struct {
+    char        host[NI_MAXHOST];
+    char        port[NI_MAXSERV];
+    size_t      producers;
+    size_t      consumers;
+    size_t      topics;
+    size_t      fanout;
+    size_t      size;
+    size_t      connections;
+    double      rate;                           // Messages per second (0 is as fast as possible)
+    double      duration;                       // Seconds of publishing
+    double      warmup;                         // Seconds of publishing left out of latencies
+    double      drain;                          // Seconds to wait for deliveries afterwards
+    const char *output;                         // File results are appended to as JSON
+} Options;
+
+typedef struct {
+    size_t          id;
+    MessageQueue *  mq;
+    uint64_t        sent;
+    uint64_t        received;
+    Latency         latency;
+} Worker;
+
+/* Global Variables */
+
+Options  Opt = { "localhost", "9620", 1, 1, 1, 1, 64, 0, 1000, 10, 1, 5, NULL };
+char     Prefix[64];                            // Prefix of topic and queue names of this run
+uint64_t Start;                                 // When publishing started
+bool     Stopping = false;                      // Whether idle connections should close
+
+/* Functions */
+
+uint64_t now_ns() {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000000000UL + ts.tv_nsec;
+}
+
+void sleep_until(uint64_t deadline) {
+    struct timespec ts = { deadline / 1000000000UL, deadline % 1000000000UL };
+    while (clock_nanosleep(CLOCK_MONOTONIC, TIMER_ABSTIME, &ts, NULL) != 0);
+}
+
+void topic_name(char *buffer, size_t topic) {
+    sprintf(buffer, "%s_topic_%zu", Prefix, topic);
+}
+
+/**
+ * Return latency bucket of ns: exact below SUB_BUCKETS, then SUB_BUCKETS
+ * linear sub-buckets for every power of two.
+ */
+size_t latency_bucket(uint64_t ns) {
+    if (ns < SUB_BUCKETS) {
+        return ns;
+    }
+    int exponent = 63 - __builtin_clzll(ns);
+    return ((exponent - SUB_BITS + 1) << SUB_BITS) + ((ns >> (exponent - SUB_BITS)) & (SUB_BUCKETS - 1));
+}
+
+/**
+ * Return largest latency (ns) counted in bucket.
+ */
+uint64_t latency_bound(size_t bucket) {
+    if (bucket < SUB_BUCKETS) {
+        return bucket;
+    }
+    int exponent = (bucket >> SUB_BITS) + SUB_BITS - 1;
+    return ((uint64_t)(SUB_BUCKETS + (bucket & (SUB_BUCKETS - 1)) + 1) << (exponent - SUB_BITS)) - 1;
+}
+
+void latency_add(Latency *l, uint64_t ns) {
+    l->buckets[latency_bucket(ns)]++;
+    l->count++;
+    l->total += ns;
+    l->max    = ns > l->max ? ns : l->max;
+}
+
+void latency_merge(Latency *l, const Latency *other) {
+    for (size_t b = 0; b < BUCKETS; b++) {
+        l->buckets[b] += other->buckets[b];
+    }
+    l->count += other->count;
+    l->total += other->total;
+    l->max    = other->max > l->max ? other->max : l->max;
+}
+
+double latency_percentile(const Latency *l, double percentile) {
+    uint64_t rank = (uint64_t)(l->count * percentile / 100.0 + 0.5);
+    uint64_t seen = 0;
+    for (size_t b = 0; b < BUCKETS && l->count; b++) {
+        seen += l->buckets[b];
+        if (seen && seen >= rank) {
+            uint64_t bound = latency_bound(b);
+            return (bound < l->max ? bound : l->max) / 1e6;
+        }
+    }
+    return 0;
+}
+
+/* Threads */
+
+/**
+ * Publish to the topics in turn, each message scheduled at its intended
+ * time for the target rate.  Messages carry their intended (rather than
+ * actual) send time, so a stalled producer does not hide the latency of
+ * the messages it should have sent meanwhile (coordinated omission).
+ */
+void *producer(void *arg) {
+    Worker  *w        = (Worker *)arg;
+    double   rate     = Opt.rate / Opt.producers;
+    uint64_t interval = rate > 0 ? (uint64_t)(1e9 / rate) : 0;
+    uint64_t end      = Start + (uint64_t)(Opt.duration * 1e9);
+    char     topic[BUFSIZ];
+
+    for (uint64_t m = 0; ; m++) {
+        uint64_t intended = interval ? Start + w->id * interval / Opt.producers + m * interval : now_ns();
+        if (intended >= end) {
+            break;
+        }
+        if (interval) {
+            sleep_until(intended);
+        } else {
+            while (queue_size(w->mq->outgoing) >= WINDOW) {
+                usleep(50);
+            }
+        }
+
+        char  *body   = malloc(Opt.size + 32);
+        size_t length = sprintf(body, "%" PRIu64 " ", intended);
+        if (length < Opt.size) {
+            memset(body + length, 'x', Opt.size - length);
+            length = Opt.size;
+        }
+        body[length] = '\0';
+
+        topic_name(topic, (w->id + m * Opt.producers) % Opt.topics);
+        mq_publish_buf(w->mq, topic, body, length, free);
+        w->sent++;
+    }
+    return NULL;
+}
+
+/**
+ * Retrieve messages until stopped, recording latency from their intended
+ * send time (after the warmup).
+ */
+void *consumer(void *arg) {
+    Worker  *w      = (Worker *)arg;
+    uint64_t warmup = Start + (uint64_t)(Opt.warmup * 1e9);
+    char    *body;
+
+    while ((body = mq_retrieve(w->mq))) {
+        uint64_t received = now_ns();
+        uint64_t intended = strtoull(body, NULL, 10);
+        if (intended >= warmup) {
+            latency_add(&w->latency, received > intended ? received - intended : 0);
+        }
+        __atomic_add_fetch(&w->received, 1, __ATOMIC_RELAXED);
+        free(body);
+    }
+    return NULL;
+}
+
+/**
+ * Hold connections long polling idle queues, reissuing each poll as its
+ * empty (204) response arrives and reconnecting any that are closed.
+ */
+void *idler(void *arg) {
+    size_t         n       = Opt.connections;
+    struct pollfd *fds     = calloc(n, sizeof(struct pollfd));
+    FILE         **streams = calloc(n, sizeof(FILE *));
+    char           request[BUFSIZ];
+    char           buffer[BUFSIZ];
+    size_t         failed  = 0;
+
+    for (size_t i = 0; i < n; i++) {
+        char name[128];
+        sprintf(name, "%s_idle_%zu", Prefix, i);
+        sprintf(request, IDLE_POLL, strlen(name), name);
+        streams[i] = socket_connect(Opt.host, Opt.port);
+        if (streams[i] == NULL) {
+            fds[i].fd = -1;
+            failed++;
+            continue;
+        }
+        fds[i].fd     = fileno(streams[i]);
+        fds[i].events = POLLIN;
+        if (write(fds[i].fd, request, strlen(request)) < 0) {
+            failed++;
+        }
+    }
+    if (failed) {
+        fprintf(stderr, "mq_bench: %zu of %zu idle connections failed\n", failed, n);
+    }
+
+    while (!__atomic_load_n(&Stopping, __ATOMIC_SEQ_CST)) {
+        if (poll(fds, n, 100) <= 0) {
+            continue;
+        }
+        for (size_t i = 0; i < n; i++) {
+            if (fds[i].revents == 0) {
+                continue;
+            }
+            char name[128];
+            sprintf(name, "%s_idle_%zu", Prefix, i);
+            sprintf(request, IDLE_POLL, strlen(name), name);
+
+            ssize_t nread = read(fds[i].fd, buffer, sizeof(buffer) - 1);
+            if (nread <= 0) {
+                fclose(streams[i]);
+                streams[i] = socket_connect(Opt.host, Opt.port);
+                fds[i].fd  = streams[i] ? fileno(streams[i]) : -1;
+                if (streams[i] && write(fds[i].fd, request, strlen(request)) < 0) {
+                    fds[i].fd = -1;
+                }
+                continue;
+            }
+            buffer[nread] = '\0';
+            if (strstr(buffer, "\r\n\r\n") && write(fds[i].fd, request, strlen(request)) < 0) {
+                fds[i].fd = -1;
+            }
+        }
+    }
+
+    for (size_t i = 0; i < n; i++) {
+        if (streams[i]) {
+            fclose(streams[i]);
+        }
+    }
+    free(streams);
+    free(fds);
+    return NULL;
+}
+
+/* Results */
+
+void report(FILE *stream, bool json, uint64_t published, uint64_t accepted, uint64_t delivered, uint64_t errors, double elapsed, const Latency *l) {
+    double p50  = latency_percentile(l, 50);
+    double p99  = latency_percentile(l, 99);
+    double p999 = latency_percentile(l, 99.9);
+    double max  = l->max / 1e6;
+    double mean = l->count ? l->total / 1e6 / l->count : 0;
+
+    if (json) {
+        fprintf(stream,
+            "{\"producers\": %zu, \"consumers\": %zu, \"topics\": %zu, \"fanout\": %zu, \"size\": %zu, "
+            "\"rate\": %.1f, \"connections\": %zu, \"duration\": %.1f, "
+            "\"published\": %" PRIu64 ", \"accepted\": %" PRIu64 ", \"delivered\": %" PRIu64 ", \"errors\": %" PRIu64 ", "
+            "\"publish_rate\": %.1f, \"delivery_rate\": %.1f, "
+            "\"latency_ms\": {\"mean\": %.3f, \"p50\": %.3f, \"p99\": %.3f, \"p999\": %.3f, \"max\": %.3f, \"samples\": %" PRIu64 "}}\n",
+            Opt.producers, Opt.consumers, Opt.topics, Opt.fanout, Opt.size,
+            Opt.rate, Opt.connections, Opt.duration,
+            published, accepted, delivered, errors,
+            accepted / elapsed, delivered / elapsed,
+            mean, p50, p99, p999, max, l->count);
+        return;
+    }
+
+    fprintf(stream, "%-12s %10" PRIu64 " (%" PRIu64 " accepted, %" PRIu64 " errors, %.1f msg/s)\n",
+        "published", published, accepted, errors, accepted / elapsed);
+    fprintf(stream, "%-12s %10" PRIu64 " of %" PRIu64 " (%.1f msg/s)\n",
+        "delivered", delivered, accepted * Opt.fanout, delivered / elapsed);
+    fprintf(stream, "%-12s mean %.3f  p50 %.3f  p99 %.3f  p99.9 %.3f  max %.3f ms (%" PRIu64 " samples)\n",
+        "latency", mean, p50, p99, p999, max, l->count);
+}
+
+void usage(const char *program, int status) {
+    fprintf(stderr, "Usage: %s [options] [HOST [PORT]]\n\n", program);
+    fprintf(stderr, "Options:\n");
+    fprintf(stderr, "    -p PRODUCERS    Publishing clients (default: %zu)\n", Opt.producers);
+    fprintf(stderr, "    -c CONSUMERS    Subscribing clients (default: %zu)\n", Opt.consumers);
+    fprintf(stderr, "    -t TOPICS       Topics published to in turn (default: %zu)\n", Opt.topics);
+    fprintf(stderr, "    -f FANOUT       Consumers subscribed to each topic (default: %zu)\n", Opt.fanout);
+    fprintf(stderr, "    -s SIZE         Message size in bytes (default: %zu)\n", Opt.size);
+    fprintf(stderr, "    -r RATE         Target publishes per second, 0 for maximum (default: %.0f)\n", Opt.rate);
+    fprintf(stderr, "    -d SECONDS      Duration of publishing (default: %.0f)\n", Opt.duration);
+    fprintf(stderr, "    -w SECONDS      Warmup left out of latencies (default: %.0f)\n", Opt.warmup);
+    fprintf(stderr, "    -n CONNECTIONS  Extra idle connections long polling (default: %zu)\n", Opt.connections);
+    fprintf(stderr, "    -o FILE         Append results to FILE as a JSON line\n");
+    exit(status);
+}
+
+/* Main execution */
+
+int main(int argc, char *argv[]) {
+    int option;
+    while ((option = getopt(argc, argv, "p:c:t:f:s:r:d:w:n:o:h")) != -1) {
+        switch (option) {
+            case 'p': Opt.producers   = strtoul(optarg, NULL, 10); break;
+            case 'c': Opt.consumers   = strtoul(optarg, NULL, 10); break;
+            case 't': Opt.topics      = strtoul(optarg, NULL, 10); break;
+            case 'f': Opt.fanout      = strtoul(optarg, NULL, 10); break;
+            case 's': Opt.size        = strtoul(optarg, NULL, 10); break;
+            case 'r': Opt.rate        = strtod(optarg, NULL); break;
+            case 'd': Opt.duration    = strtod(optarg, NULL); break;
+            case 'w': Opt.warmup      = strtod(optarg, NULL); break;
+            case 'n': Opt.connections = strtoul(optarg, NULL, 10); break;
+            case 'o': Opt.output      = optarg; break;
+            case 'h': usage(argv[0], EXIT_SUCCESS); break;
+            default:  usage(argv[0], EXIT_FAILURE); break;
+        }
+    }
+    if (optind < argc) { snprintf(Opt.host, sizeof(Opt.host), "%s", argv[optind++]); }
+    if (optind < argc) { snprintf(Opt.port, sizeof(Opt.port), "%s", argv[optind++]); }
+    if (!Opt.producers || !Opt.consumers || !Opt.topics || !Opt.fanout) {
+        usage(argv[0], EXIT_FAILURE);
+    }
+    if (Opt.fanout > Opt.consumers) {
+        Opt.fanout = Opt.consumers;
+    }
+    sprintf(Prefix, "mq_bench_%d", getpid());
+
+    /* Idle connections need a descriptor each */
+    struct rlimit limit;
+    if (Opt.connections && getrlimit(RLIMIT_NOFILE, &limit) == 0) {
+        limit.rlim_cur = limit.rlim_max;
+        setrlimit(RLIMIT_NOFILE, &limit);
+    }
+
+    printf("mq_bench: %zu producers, %zu consumers, %zu topics (fan-out %zu), %zu byte messages, ",
+        Opt.producers, Opt.consumers, Opt.topics, Opt.fanout, Opt.size);
+    if (Opt.rate > 0) {
+        printf("%.0f msg/s", Opt.rate);
+    } else {
+        printf("maximum rate");
+    }
+    printf(" for %.0f s, %zu idle connections\n", Opt.duration, Opt.connections);
+
+    /* Subscribe each topic's consumers (topic t to consumers t * fanout onwards) */
+    Worker *consumers = calloc(Opt.consumers, sizeof(Worker));
+    Worker *producers = calloc(Opt.producers, sizeof(Worker));
+    char    name[BUFSIZ];
+    char    topic[BUFSIZ];
+    for (size_t c = 0; c < Opt.consumers; c++) {
+        sprintf(name, "%s_consumer_%zu", Prefix, c);
+        consumers[c].id = c;
+        consumers[c].mq = mq_create(name, Opt.host, Opt.port);
+        assert(consumers[c].mq);
+    }
+    for (size_t t = 0; t < Opt.topics; t++) {
+        topic_name(topic, t);
+        for (size_t k = 0; k < Opt.fanout; k++) {
+            mq_subscribe(consumers[(t * Opt.fanout + k) % Opt.consumers].mq, topic);
+        }
+    }
+    for (size_t p = 0; p < Opt.producers; p++) {
+        sprintf(name, "%s_producer_%zu", Prefix, p);
+        producers[p].id = p;
+        producers[p].mq = mq_create(name, Opt.host, Opt.port);
+        assert(producers[p].mq);
+    }
+
+    Thread idle;
+    if (Opt.connections) {
+        thread_create(&idle, NULL, idler, NULL);
+    }
+
+    Thread threads[Opt.producers + Opt.consumers];
+    Start = now_ns() + 500000000UL;             // Leave time for subscriptions to be sent
+    for (size_t c = 0; c < Opt.consumers; c++) {
+        mq_start(consumers[c].mq);
+        thread_create(&threads[c], NULL, consumer, &consumers[c]);
+    }
+    for (size_t p = 0; p < Opt.producers; p++) {
+        mq_start(producers[p].mq);
+    }
+    sleep_until(Start);
+    for (size_t p = 0; p < Opt.producers; p++) {
+        thread_create(&threads[Opt.consumers + p], NULL, producer, &producers[p]);
+    }
+
+    /* Flush publishes, then wait for their deliveries */
+    uint64_t published = 0;
+    uint64_t accepted  = 0;
+    uint64_t errors    = 0;
+    for (size_t p = 0; p < Opt.producers; p++) {
+        MQStats stats;
+        thread_join(threads[Opt.consumers + p], NULL);
+        mq_stop(producers[p].mq);
+        mq_stats(producers[p].mq, &stats);
+        published += producers[p].sent;
+        accepted  += stats.published;
+        errors    += stats.errors;
+    }
+    double elapsed = (now_ns() - Start) / 1e9;
+
+    uint64_t delivered = 0;
+    uint64_t deadline  = now_ns() + (uint64_t)(Opt.drain * 1e9);
+    do {
+        delivered = 0;
+        for (size_t c = 0; c < Opt.consumers; c++) {
+            delivered += __atomic_load_n(&consumers[c].received, __ATOMIC_RELAXED);
+        }
+    } while (delivered < accepted * Opt.fanout && now_ns() < deadline && usleep(10000) == 0);
+
+    Latency latency = {0};
+    for (size_t c = 0; c < Opt.consumers; c++) {
+        mq_stop(consumers[c].mq);
+        thread_join(threads[c], NULL);
+        latency_merge(&latency, &consumers[c].latency);
+    }
+    if (Opt.connections) {
+        __atomic_store_n(&Stopping, true, __ATOMIC_SEQ_CST);
+        thread_join(idle, NULL);
+    }
+
+    report(stdout, false, published, accepted, delivered, errors, elapsed, &latency);
+    if (Opt.output) {
+        FILE *stream = fopen(Opt.output, "a");
+        if (stream == NULL) {
+            fprintf(stderr, "mq_bench: unable to open %s: %s\n", Opt.output, strerror(errno));
+        } else {
+            report(stream, true, published, accepted, delivered, errors, elapsed, &latency);
+            fclose(stream);
+        }
+    }
+
+    for (size_t c = 0; c < Opt.consumers; c++) {
+        mq_delete(consumers[c].mq);
+    }
+    for (size_t p = 0; p < Opt.producers; p++) {
+        mq_delete(producers[p].mq);
+    }
+    free(consumers);
+    free(producers);
+    return delivered < accepted * Opt.fanout ? EXIT_FAILURE : EXIT_SUCCESS;
+}
+
+/* vim: set expandtab sts=4 sw=4 ts=8 ft=c: */
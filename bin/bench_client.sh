@@ -0,0 +1,63 @@
+#!/bin/bash
+
+# Run client benchmark program against a freshly started local broker:
+#
+#   bin/bench_client.sh bin/bench_topic_fairness [ARGUMENTS...]
+#
+# The program is invoked as: PROGRAM localhost $PORT [ARGUMENTS...]
+#
+# Extra broker options can be passed in MQ_SERVER_ARGS (ie. --workers=4).
+#
+# With MQ_BROKERS=N, N brokers are started on consecutive free ports and the
+# program is invoked with their cluster map as host (and the first port).
+#
+# With MQ_REPLICA=1, a replica of the (first) broker is started as well, so
+# the program measures the broker while it streams its journal to a replica.
+
+BENCHMARK=$1
+shift
+
+find_port() {
+    for port in $(seq ${1:-9000} 9999); do
+    	if ! ss -H4tlpn | awk '{print $4}' | cut -d : -f 2 | grep -q $port; then
+    	    echo $port
+    	    break
+	fi
+    done
+}
+
+cleanup() {
+    kill $SERVERPIDS
+}
+
+if [ ! -x "$BENCHMARK" ]; then
+    echo "Failure: $BENCHMARK is not executable!"
+    exit 1
+fi
+
+PORT=$(find_port)
+FIRST=$PORT
+CLUSTER=
+
+trap "cleanup" EXIT
+for broker in $(seq ${MQ_BROKERS:-1}); do
+    PORT=$(find_port $PORT)
+    ./bin/mq_server.py --port=$PORT $MQ_SERVER_ARGS > /dev/null 2>&1 &
+    SERVERPIDS="$SERVERPIDS $!"
+    CLUSTER="${CLUSTER:+$CLUSTER;}localhost:$PORT"
+    PORT=$((PORT + 1))
+done
+if [ ${MQ_REPLICA:-0} -ne 0 ]; then
+    REPLICA=$(find_port $PORT)
+    ./bin/mq_server.py --port=$REPLICA --replicate-from=localhost:$FIRST $MQ_SERVER_ARGS > /dev/null 2>&1 &
+    SERVERPIDS="$SERVERPIDS $!"
+fi
+sleep 1
+
+if [ ${MQ_BROKERS:-1} -gt 1 ]; then
+    echo "Benchmarking $(basename $BENCHMARK) ($MQ_BROKERS brokers${MQ_SERVER_ARGS:+, $MQ_SERVER_ARGS})..."
+    $BENCHMARK "$CLUSTER" $FIRST "$@"
+else
+    echo "Benchmarking $(basename $BENCHMARK)${REPLICA:+ (replica)}${MQ_SERVER_ARGS:+ ($MQ_SERVER_ARGS)}..."
+    $BENCHMARK localhost $FIRST "$@"
+fi
@@ -0,0 +1,104 @@
+#!/usr/bin/env python3
+
+''' Benchmark broker restart time over a durable queue with a large retained
+backlog: replaying every record, recovering without a snapshot (scanning the
+active segment and starting at the oldest record) and recovering from a
+snapshot (verifying only the records after it and seeking the read cursor
+through the sparse index).
+
+    usage: bench_mq_restart.py [messages] [size] [directory]
+'''
+
+import os
+import shutil
+import sys
+import tempfile
+import time
+
+import tornado.ioloop
+
+import mq_storage
+
+# Message
+
+class Message(object):
+    def __init__(self, topic, body, headers=()):
+        self.topic   = topic
+        self.body    = body
+        self.headers = list(headers)
+
+# Functions
+
+def populate(directory, messages, size):
+    ''' Fill lane with messages, consume half of them, snapshot and then
+    append a further 1000 messages after the snapshot. '''
+    storage = mq_storage.Storage(directory, sync='none')
+    storage.subscriptions = {'bench': {'bench'}}
+    lane    = storage.lane('bench', 'bench', Message)
+    message = Message('bench', b'x' * size)
+
+    for _ in range(messages - 1000):
+        lane.append(message)
+    for _ in range(messages // 2):
+        lane.popleft()
+    storage.snapshot()
+    for _ in range(1000):
+        lane.append(message)
+
+    storage.sync = 'group'
+    storage.flush()
+    for lane in storage.lanes:
+        lane.close()
+
+def restart(directory):
+    ''' Open storage and return elapsed time and retained messages. '''
+    started = time.time()
+    storage = mq_storage.Storage(directory)
+    lanes   = [lane for _, _, lane in storage.load(Message)]
+    elapsed = time.time() - started
+    backlog = sum(len(lane) for lane in lanes)
+    storage.snapshotter.stop()
+    for lane in lanes:
+        lane.close()
+    return elapsed, backlog
+
+def replay(directory):
+    ''' Verify every record in every segment, as a rebuild would. '''
+    started = time.time()
+    records = 0
+    for root, _, files in os.walk(directory):
+        for name in sorted(files):
+            if name.endswith(mq_storage.SUFFIX):
+                segment  = mq_storage.Segment(root, int(name[:-len(mq_storage.SUFFIX)]))
+                records += segment.recover()
+                segment.close()
+    return time.time() - started, records
+
+# Main execution
+
+if __name__ == '__main__':
+    messages  = int(sys.argv[1]) if len(sys.argv) > 1 else 10000000
+    size      = int(sys.argv[2]) if len(sys.argv) > 2 else 16
+    directory = sys.argv[3] if len(sys.argv) > 3 else tempfile.mkdtemp(prefix='bench_mq_restart.')
+    ioloop    = tornado.ioloop.IOLoop()
+
+    try:
+        started = time.time()
+        populate(directory, messages, size)
+        print('Populated {} messages of {} bytes in {:.1f}s'.format(messages, size, time.time() - started))
+
+        elapsed, records = replay(directory)
+        print('   Full replay: {:8.3f}s ({} records)'.format(elapsed, records))
+
+        os.rename(os.path.join(directory, mq_storage.SNAPSHOT), os.path.join(directory, 'snapshot.saved'))
+        elapsed, backlog = restart(directory)
+        print(' No snapshot:   {:8.3f}s ({} retained)'.format(elapsed, backlog))
+
+        os.rename(os.path.join(directory, 'snapshot.saved'), os.path.join(directory, mq_storage.SNAPSHOT))
+        elapsed, backlog = restart(directory)
+        print('    Snapshot:   {:8.3f}s ({} retained)'.format(elapsed, backlog))
+    finally:
+        ioloop.close()
+        shutil.rmtree(directory)
+
+# vim: set sts=4 sw=4 ts=8 expandtab ft=python:
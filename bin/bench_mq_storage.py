@@ -0,0 +1,81 @@
+#!/usr/bin/env python3
+
+''' Benchmark durable queue storage: publish throughput when every message is
+fdatasync'd individually versus batched by group commit, followed by mmap read
+throughput of the resulting backlog.
+
+    usage: bench_mq_storage.py [messages] [publishers] [size]
+'''
+
+import shutil
+import sys
+import tempfile
+import time
+
+import tornado.gen
+import tornado.ioloop
+
+import mq_storage
+
+# Message
+
+class Message(object):
+    def __init__(self, topic, body, headers=()):
+        self.topic   = topic
+        self.body    = body
+        self.headers = list(headers)
+
+# Functions
+
+def benchmark(sync, messages, publishers, size):
+    directory = tempfile.mkdtemp(prefix='bench_mq_storage.')
+    ioloop    = tornado.ioloop.IOLoop()
+    body      = b'x' * size
+
+    async def publisher(storage, lane, count):
+        for _ in range(count):
+            lane.append(Message('bench', body))
+            await storage.commit()
+
+    async def publish():
+        storage = mq_storage.Storage(directory, sync=sync)
+        lane    = storage.lane('bench', 'bench', Message)
+        started = time.time()
+        await tornado.gen.multi([publisher(storage, lane, messages // publishers) for _ in range(publishers)])
+        storage.flush()
+        elapsed = time.time() - started
+
+        started = time.time()
+        while lane:
+            lane.popleft()
+        reading = time.time() - started
+
+        storage.close()
+        return elapsed, reading, storage.syncs
+
+    try:
+        elapsed, reading, syncs = ioloop.run_sync(publish)
+    finally:
+        ioloop.close()
+        shutil.rmtree(directory)
+
+    total = messages // publishers * publishers
+    print('{:>8}: {:10.0f} msgs/s publish, {:8d} fdatasyncs, {:10.0f} msgs/s read'.format(
+        sync, total / elapsed, syncs, total / reading,
+    ))
+    return total / elapsed
+
+# Main execution
+
+if __name__ == '__main__':
+    messages   = int(sys.argv[1]) if len(sys.argv) > 1 else 20000
+    publishers = int(sys.argv[2]) if len(sys.argv) > 2 else 64
+    size       = int(sys.argv[3]) if len(sys.argv) > 3 else 256
+
+    print('Storage: {} messages of {} bytes from {} concurrent publishers'.format(messages, size, publishers))
+    always = benchmark('always', messages, publishers, size)
+    group  = benchmark('group' , messages, publishers, size)
+    benchmark('none', messages, publishers, size)
+    print('Group commit speedup: {:.2f}x'.format(group / always))
+
+# vim: set sts=4 sw=4 ts=8 expandtab ft=python:
@@ -0,0 +1,79 @@
+#!/usr/bin/env python3
+
+''' Benchmark publish matching against many wildcard subscriptions: the
+subscription trie versus naively testing every pattern, across topic depths.
+
+    usage: bench_mq_trie.py [subscriptions] [topics]
+'''
+
+import random
+import sys
+import time
+
+import mq_trie
+
+# Functions
+
+def naive_match(levels, pattern):
+    ''' Match topic levels against pattern levels one subscription at a time. '''
+    if not pattern:
+        return not levels
+    if pattern[0] == mq_trie.MULTIPLE:
+        return any(naive_match(levels[rest:], pattern[1:]) for rest in range(len(levels) + 1))
+    if not levels:
+        return False
+    if pattern[0] != mq_trie.SINGLE and pattern[0] != levels[0]:
+        return False
+    return naive_match(levels[1:], pattern[1:])
+
+def generate(random, depth, wildcards=True):
+    ''' Return random name (or pattern) with given depth. '''
+    levels = []
+    for _ in range(depth):
+        choice = random.random()
+        if wildcards and choice < 0.10:
+            levels.append(mq_trie.SINGLE)
+        elif wildcards and choice < 0.15:
+            levels.append(mq_trie.MULTIPLE)
+        else:
+            levels.append('l{}'.format(random.randrange(32)))
+    return mq_trie.SEPARATOR.join(levels)
+
+def benchmark(subscriptions, topics, depth):
+    generator = random.Random(depth)
+    patterns  = [generate(generator, generator.randint(1, depth)) for _ in range(subscriptions)]
+    names     = [generate(generator, depth, False) for _ in range(topics)]
+    trie      = mq_trie.TopicTrie()
+
+    for index, pattern in enumerate(patterns):
+        trie.add(pattern, 'queue{}'.format(index))
+
+    started = time.time()
+    matched = sum(len(trie.match(name)) for name in names)
+    trie_rate = topics / (time.time() - started)
+
+    # Naive matching is orders of magnitude slower, so only sample it
+    sample   = names[:max(1, topics // 100)]
+    compiled = [(pattern.split(mq_trie.SEPARATOR), 'queue{}'.format(index)) for index, pattern in enumerate(patterns)]
+    started  = time.time()
+    for name in sample:
+        levels = name.split(mq_trie.SEPARATOR)
+        set(queue for pattern, queue in compiled if naive_match(levels, pattern))
+    naive_rate = len(sample) / (time.time() - started)
+
+    print('{:5d} {:12.0f} {:12.0f} {:10.1f}x {:10.1f}'.format(
+        depth, trie_rate, naive_rate, trie_rate / naive_rate, matched / topics,
+    ))
+
+# Main execution
+
+if __name__ == '__main__':
+    subscriptions = int(sys.argv[1]) if len(sys.argv) > 1 else 100000
+    topics        = int(sys.argv[2]) if len(sys.argv) > 2 else 10000
+
+    print('Topic matching: {} wildcard subscriptions, {} publishes'.format(subscriptions, topics))
+    print('{:>5} {:>12} {:>12} {:>11} {:>10}'.format('depth', 'trie pub/s', 'naive pub/s', 'speedup', 'matches'))
+    for depth in (2, 4, 6, 8):
+        benchmark(subscriptions, topics, depth)
+
+# vim: set sts=4 sw=4 ts=8 expandtab ft=python:
@@ -0,0 +1,83 @@
+#!/usr/bin/env python3
+
+''' Benchmark scheduling delayed messages: inserting and expiring timers on
+the hierarchical timing wheel versus a binary heap, as the number of pending
+timers grows.
+
+    usage: bench_mq_wheel.py [timers] [horizon]
+'''
+
+import heapq
+import random
+import sys
+import time
+
+import tornado.ioloop
+
+import mq_wheel
+
+# Functions
+
+def bench_wheel(deadlines, horizon):
+    clock = [0.0]
+    fired = [0]
+    def fire(item):
+        fired[0] += 1
+
+    wheel   = mq_wheel.TimingWheel(fire, clock=lambda: clock[0])
+    started = time.time()
+    for index, deadline in enumerate(deadlines):
+        wheel.schedule(deadline, index)
+    inserted = time.time() - started
+
+    started = time.time()
+    while clock[0] <= horizon + wheel.tick:
+        clock[0] += wheel.tick
+        wheel.advance()
+    expired = time.time() - started
+
+    wheel.stop()
+    assert fired[0] == len(deadlines)
+    return inserted, expired
+
+def bench_heap(deadlines, horizon, tick=mq_wheel.TimingWheel.TICK):
+    heap    = []
+    started = time.time()
+    for index, deadline in enumerate(deadlines):
+        heapq.heappush(heap, (deadline, index))
+    inserted = time.time() - started
+
+    now     = 0.0
+    fired   = 0
+    started = time.time()
+    while now <= horizon + tick:
+        now += tick
+        while heap and heap[0][0] <= now:
+            heapq.heappop(heap)
+            fired += 1
+    expired = time.time() - started
+
+    assert fired == len(deadlines)
+    return inserted, expired
+
+# Main execution
+
+if __name__ == '__main__':
+    timers  = int(sys.argv[1]) if len(sys.argv) > 1 else 1000000
+    horizon = float(sys.argv[2]) if len(sys.argv) > 2 else 60.0
+    ioloop  = tornado.ioloop.IOLoop()
+
+    print('Delayed delivery: timers due within {:.0f}s'.format(horizon))
+    print('{:>9} {:>7} {:>16} {:>16}'.format('timers', '', 'insert ns/timer', 'expire ns/timer'))
+    generator = random.Random(0)
+    count     = 1000
+    while count <= timers:
+        deadlines = [generator.uniform(0, horizon) for _ in range(count)]
+        for name, bench in (('wheel', bench_wheel), ('heap', bench_heap)):
+            inserted, expired = bench(deadlines, horizon)
+            print('{:9d} {:>7} {:16.0f} {:16.0f}'.format(count, name, inserted / count * 1e9, expired / count * 1e9))
+        count *= 10
+
+    ioloop.close()
+
+# vim: set sts=4 sw=4 ts=8 expandtab ft=python:
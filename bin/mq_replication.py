@@ -0,0 +1,211 @@
+#!/usr/bin/env python3
+
+''' MQ Replication: Primary/replica replication for the Message Queue Server
+
+A replica broker (started with --replicate-from=host:port) keeps a copy of
+the state of its primary: subscriptions, limits, compacted topics, groups
+and every queue's backlog.  It streams the primary's journal over a single
+long-lived GET /replication response and applies each operation through
+the same shard operations (do_*) the primary performed, so anything it
+applies is journaled again and replicas can be chained.
+
+The primary records every operation that changes its state in its Journal:
+appends to queues, messages taken from them, lease expiries and the
+subscription, limit, compaction and group changes.  Recording costs a
+tuple append per connected replica (and nothing without one).  Each replica
+is sent a snapshot of the whole state first, then its pending operations in
+batches: once operations are pending, the primary waits BATCH_DELAY seconds
+for more (unless BATCH_SIZE are pending already) and sends all of them in
+one frame, so a busy primary sends few, large frames.  Frames are length
+prefixed pickles of (sequence, time, operations), as between workers (see
+Mailbox), so the replication port must only be reachable by trusted hosts.
+An idle primary sends an empty frame every HEARTBEAT seconds.
+
+A replica answers every request but GET /stats and GET /replication with
+503 and an X-Replica header naming its primary, so clients fail over to the
+next endpoint on their list.  Once no frame has arrived for --failover-
+timeout seconds, the replica promotes itself: it stops following and
+serves clients from the state it has applied.  Operations the primary
+accepted but had not yet sent are lost, as are leased (in-flight) and
+scheduled messages, and the deduplication windows of producers, which are
+not replicated.
+
+Replication lag is reported by GET /stats: a replica reports the seconds
+between the primary sending the last frame and the replica applying it, and
+a primary the operations still pending for its replicas.
+'''
+
+import logging
+import pickle
+import struct
+import time
+
+import tornado.gen
+import tornado.httpclient
+import tornado.ioloop
+import tornado.locks
+
+# Constants
+
+FRAME            = struct.Struct('<I')
+HEARTBEAT        = 0.5              # Seconds between frames sent by an idle primary
+BATCH_DELAY      = 0.01             # Seconds to wait for more operations before sending
+BATCH_SIZE       = 1024             # Operations sent without waiting for more
+MAX_PENDING      = 1000000          # Operations pending before a replica is dropped
+FAILOVER_TIMEOUT = 2.0              # Seconds without a frame before a replica promotes itself
+RECONNECT        = 0.25             # Seconds between attempts to reach the primary
+
+# Functions
+
+def encode(sequence, operations):
+    ''' Return frame of operations, which bring a replica up to sequence. '''
+    data = pickle.dumps((sequence, time.time(), operations), pickle.HIGHEST_PROTOCOL)
+    return FRAME.pack(len(data)) + data
+
+# Follower
+
+class Follower(object):
+    ''' Operations pending for one connected replica. '''
+
+    def __init__(self, address, snapshot):
+        self.address = address
+        self.pending = snapshot
+        self.ready   = tornado.locks.Condition()
+        self.dropped = False
+
+    @tornado.gen.coroutine
+    def batch(self):
+        ''' Wait for pending operations (up to HEARTBEAT seconds) and return
+        all of them, or None once the replica has fallen too far behind. '''
+        ioloop = tornado.ioloop.IOLoop.current()
+        if not self.pending:
+            yield self.ready.wait(timeout=ioloop.time() + HEARTBEAT)
+        if self.pending and len(self.pending) < BATCH_SIZE:
+            yield tornado.gen.sleep(BATCH_DELAY)
+        if self.dropped:
+            return None
+        operations, self.pending = self.pending, []
+        return operations
+
+# Journal
+
+class Journal(object):
+    ''' Operations of a primary, numbered in order and buffered for each
+    connected replica. '''
+
+    def __init__(self):
+        self.sequence  = 0
+        self.followers = []
+
+    def record(self, operation, *args):
+        self.sequence += 1
+        for follower in self.followers:
+            follower.pending.append((operation, args))
+            if len(follower.pending) == 1:
+                follower.ready.notify()
+            elif len(follower.pending) > MAX_PENDING and not follower.dropped:
+                follower.dropped = True
+                follower.ready.notify()
+
+    def follow(self, address, snapshot):
+        ''' Return Follower for replica, starting with snapshot operations. '''
+        follower = Follower(address, snapshot)
+        self.followers.append(follower)
+        return follower
+
+    def unfollow(self, follower):
+        if follower in self.followers:
+            self.followers.remove(follower)
+
+    def pending(self):
+        ''' Return operations pending for the replica furthest behind. '''
+        return max((len(follower.pending) for follower in self.followers), default=0)
+
+# Replicator
+
+class Replicator(object):
+    ''' Replica end: streams the primary's journal and applies it to the
+    application (a MessageQueue) until it is promoted. '''
+
+    def __init__(self, application, primary, failover_timeout=FAILOVER_TIMEOUT):
+        self.application      = application
+        self.primary          = primary
+        self.failover_timeout = failover_timeout
+        self.following        = True
+        self.connected        = False
+        self.sequence         = 0
+        self.applied          = 0
+        self.lag              = 0.0
+        self.contact          = None
+        self.buffer           = bytearray()
+        self.logger           = logging.getLogger()
+        self.client           = tornado.httpclient.AsyncHTTPClient(force_instance=True, max_body_size=1 << 62)
+        self.checker          = tornado.ioloop.PeriodicCallback(self.check, RECONNECT * 1000)
+
+    def start(self):
+        self.contact = tornado.ioloop.IOLoop.current().time()
+        self.checker.start()
+        tornado.ioloop.IOLoop.current().spawn_callback(self.follow)
+
+    def stop(self):
+        self.following = False
+        self.checker.stop()
+
+    @tornado.gen.coroutine
+    def follow(self):
+        ''' Stream the journal, reconnecting (for a new snapshot) whenever
+        the stream ends, until promoted. '''
+        url = 'http://{}/replication'.format(self.primary)
+        while self.following:
+            self.buffer = bytearray()
+            try:
+                yield self.client.fetch(url, streaming_callback=self.receive, connect_timeout=RECONNECT, request_timeout=0)
+            except Exception as e:
+                if self.following and self.connected:
+                    self.logger.warning('Lost primary {}: {}'.format(self.primary, e))
+            self.connected = False
+            if self.following:
+                yield tornado.gen.sleep(RECONNECT)
+
+    def receive(self, chunk):
+        ''' Apply every complete frame received so far. '''
+        if not self.following:
+            raise RuntimeError('Promoted to primary')
+
+        self.buffer += chunk
+        while len(self.buffer) >= FRAME.size:
+            length, = FRAME.unpack_from(self.buffer)
+            if len(self.buffer) < FRAME.size + length:
+                break
+            sequence, sent, operations = pickle.loads(bytes(self.buffer[FRAME.size:FRAME.size + length]))
+            del self.buffer[:FRAME.size + length]
+            self.apply(sequence, sent, operations)
+
+    def apply(self, sequence, sent, operations):
+        if not self.connected:
+            self.logger.info('Replicating from primary {}'.format(self.primary))
+            self.connected = True
+        for operation, args in operations:
+            self.application.perform(operation, args)
+        self.sequence = sequence
+        self.applied += len(operations)
+        self.lag      = max(time.time() - sent, 0.0)
+        self.contact  = tornado.ioloop.IOLoop.current().time()
+
+    def check(self):
+        ''' Promote replica once the primary has been silent for too long. '''
+        silent = tornado.ioloop.IOLoop.current().time() - self.contact
+        if self.following and silent > self.failover_timeout:
+            self.logger.warning('Promoting to primary: no frame from {} for {:.1f} seconds'.format(self.primary, silent))
+            self.stop()
+
+    def stats(self):
+        return {
+            'role'     : 'replica' if self.following else 'primary',
+            'connected': int(self.connected and self.following),
+            'sequence' : self.sequence,
+            'applied'  : self.applied,
+            'lag'      : self.lag if self.following else 0.0,
+        }
+
+# vim: set sts=4 sw=4 ts=8 expandtab ft=python:
@@ -4,28 +4,740 @@
 
 This Message Queue Server supports the following REST API:
 
-    PUT     /topic/$topic               Publish message to $topic.
+    PUT     /topic/$topic               Publish message to $topic (after
+                                        X-Delay milliseconds or at the
+                                        X-Deliver-At Unix time, if set).
 
-    GET     /queue/$queue               Retrieve one message from $queue.
+    GET     /queue/$queue               Retrieve one message from $queue (the
+                                        message's topic is returned in the
+                                        X-Topic header).
+    GET     /queues                     Retrieve one message from any of the
+                                        queues named in the request body (one
+                                        per line, optionally followed by a
+                                        lease in seconds), returned with
+                                        X-Queue and X-Topic headers, or 204
+                                        after waiting one second.
+    PUT     /ack                        Acknowledge leased deliveries.
 
-    PUT     /subscription/$queue/$topic Subscribe $queue to $topic.
+    PUT     /subscription/$queue/$topic Subscribe $queue to $topic (which
+                                        may contain * and # wildcard levels,
+                                        see mq_trie.py).
     DELETE  /subscription/$queue/$topic Unsubscribe $queue from $topic.
+
+    PUT     /group/$group/$member       Add $member queue to consumer $group
+                                        (X-Policy selects round-robin or
+                                        least-outstanding).
+    DELETE  /group/$group/$member       Remove $member queue from $group.
+
+    PUT     /limits/queue/$queue        Limit backlog of $queue (X-Max-Messages,
+                                        X-Max-Bytes, X-TTL in seconds and
+                                        X-Overflow policy headers).
+    PUT     /limits/topic/$topic        Limit lane of every queue for $topic.
+    DELETE  /limits/queue/$queue        Revert $queue to default limits.
+    DELETE  /limits/topic/$topic        Remove limits of $topic.
+
+    PUT     /compacted/$topic           Compact $topic: each queue keeps only
+                                        the latest pending message for every
+                                        X-Key published to it.
+    DELETE  /compacted/$topic           Stop compacting $topic.
+
+    GET     /stats                      Report per-queue, per-topic and
+                                        request latency metrics of every
+                                        worker as JSON (or in Prometheus
+                                        text format, if the Accept header
+                                        asks for text/plain or ?format=
+                                        prometheus, see mq_stats.py).
+
+    GET     /replication                Stream the journal of this broker to
+                                        a replica (see mq_replication.py).
+
+A consumer group is a queue shared by its members: topics are subscribed to
+with the group name as queue, and each message is retrieved by only one of
+the members polling /queues, returned with X-Queue set to the member and
+X-Group to the group.
+
+Publishes with an X-Trace header are traced: they keep their X-Trace and
+X-Trace-Published headers and are returned with the times they were
+enqueued and dequeued (see Message), so clients can break their latency
+down by hop.
+
+A GET with an X-Lease header (seconds) leases the message instead of
+removing it: it is returned with an X-Delivery id and redelivered once the
+lease expires unless that id is acknowledged first.  Acknowledgements are
+sent as a comma separated X-Ack header, which is accepted on any request so
+clients can piggyback them on their next GET.  In-flight messages are kept
+in memory, even with --data-dir.
+
+Publishes with X-Producer and X-Sequence headers are deduplicated: the shard
+owning the topic keeps a window of the sequence numbers recently accepted
+from each producer (see DedupWindow) and answers replays with X-Duplicate
+instead of publishing them again, so clients can safely resend.
+
+Publishes with an X-Priority header (1 to 3) are delivered ahead of the
+messages of lower priority pending in each queue, unless those have been
+passed over Queue.BURST times in a row.  They are returned with their
+X-Priority header and kept in lanes of their own level, which are subject
+to the same limits and storage as any other lane.
+
+Delayed messages are answered with 202 and kept on a timing wheel by the
+shard that owns their topic until they are due, when they are published to
+the queues subscribed at that time.  They are only held in memory, even
+with --data-dir.
+
+Backlogs are bounded by the limits of their queue and topics (see
+Retention): a publish that every subscribed queue refuses fails with 503.
+Limits are applied to messages as they are appended and are not persisted.
+
+When started with --data-dir, queue backlogs are kept in durable log files
+(see mq_storage.py) instead of memory, published messages are acknowledged
+once they are synced according to --sync, and the backlogs and subscriptions
+are reloaded from the last snapshot on restart.
+
+When started with --replicate-from=host:port, the broker is a replica of
+the primary at that address: it applies the primary's journal, refuses
+client requests with 503 and an X-Replica header, and promotes itself to
+primary once the primary has been silent for --failover-timeout seconds
+(see mq_replication.py).  Replication needs a single worker on both ends.
 '''
 
 import collections
+import itertools
 import logging
+import os
+import pickle
+import shutil
 import signal
 import socket
+import struct
 import sys
+import tempfile
 import time
+import zlib
 
+import tornado.concurrent
 import tornado.gen
+import tornado.iostream
+import tornado.locks
 import tornado.options
 import tornado.web
 
+import mq_replication
+import mq_stats
+import mq_storage
+import mq_trie
+import mq_wheel
+
+# Message
+
+class Message(object):
+    ''' Published message body along with the topic it was published to and
+    its X- headers (ie. X-Codec), which are returned unchanged on retrieval.
+
+    Messages published with an X-Trace header are returned stamped with
+    the Unix time in microseconds they were appended to the queue
+    (X-Trace-Enqueued) and popped from it (X-Trace-Dequeued).
+
+    The priority of a message is taken from its X-Priority header (0, the
+    default, to PRIORITIES - 1).
+    '''
+    __slots__  = ('topic', 'body', 'headers', 'traced', 'priority')
+    PRIORITIES = 4
+
+    def __init__(self, topic, body, headers=()):
+        self.topic    = topic
+        self.body     = body
+        self.headers  = [(name, value) for name, value in headers if name.startswith('X-')]
+        self.traced   = any(name == 'X-Trace' for name, _ in self.headers)
+        priority      = next((value for name, value in self.headers if name == 'X-Priority'), '0')
+        self.priority = min(int(priority), self.PRIORITIES - 1) if priority.isdigit() else 0
+
+    def stamped(self, age=None):
+        ''' Return copy of traced message stamped as dequeued now and
+        enqueued age seconds ago (if known, otherwise the enqueue stamp of
+        an earlier delivery is kept). '''
+        now     = time.time()
+        headers = [
+            (name, value) for name, value in self.headers
+            if name != 'X-Trace-Dequeued' and (age is None or name != 'X-Trace-Enqueued')
+        ]
+        if age is not None:
+            headers.append(('X-Trace-Enqueued', str(int((now - age) * 1000000))))
+        headers.append(('X-Trace-Dequeued', str(int(now * 1000000))))
+        return Message(self.topic, self.body, headers)
+
+# Dedup Window
+
+class DedupWindow(object):
+    ''' Sequence numbers recently published by one producer: the highest one
+    and a bitmask of which of the SIZE below it have been seen.  Sequence
+    numbers that fall behind the window are treated as duplicates. '''
+    __slots__ = ('high', 'seen')
+    SIZE      = 1024
+
+    def __init__(self):
+        self.high = 0
+        self.seen = 0
+
+    def add(self, sequence):
+        ''' Record sequence and return whether it was not seen before. '''
+        if sequence > self.high:
+            if sequence - self.high >= self.SIZE:
+                self.seen = 1   # Jumped past the whole window
+            else:
+                self.seen = ((self.seen << (sequence - self.high)) | 1) & ((1 << self.SIZE) - 1)
+            self.high = sequence
+            return True
+
+        offset = self.high - sequence
+        if offset >= self.SIZE or self.seen & (1 << offset):
+            return False
+        self.seen |= 1 << offset
+        return True
+
+    def discard(self, sequence):
+        ''' Forget sequence (whose publish failed) so it may be resent. '''
+        offset = self.high - sequence
+        if 0 <= offset < self.SIZE:
+            self.seen &= ~(1 << offset)
+
+# Limits
+
+class Limits(object):
+    ''' Retention limits: maximum messages, maximum bytes and message TTL in
+    seconds (None for no limit), and the overflow policy applied once either
+    maximum would be exceeded. '''
+    __slots__ = ('messages', 'bytes', 'ttl', 'overflow')
+    POLICIES  = ('drop-oldest', 'reject-new', 'spill-to-disk')
+
+    def __init__(self, messages=None, bytes=None, ttl=None, overflow='drop-oldest'):
+        if overflow not in self.POLICIES:
+            raise ValueError('Unknown overflow policy: {}'.format(overflow))
+
+        self.messages = messages
+        self.bytes    = bytes
+        self.ttl      = ttl
+        self.overflow = overflow
+
+    def exceeded(self, messages, size):
+        return (self.messages is not None and messages > self.messages) or \
+               (self.bytes    is not None and size     > self.bytes)
+
+# Retention
+
+class Retention(object):
+    ''' Backlog limits of the queues of one shard.
+
+    Queue limits bound the whole backlog of a queue and topic limits the
+    lane of every queue for that topic; queues without limits of their own
+    use the --max-messages, --max-bytes, --ttl and --overflow defaults.
+    Once a limit would be exceeded, the overflow policy either drops the
+    oldest messages (drop-oldest), refuses the new one (reject-new) or
+    appends it to a log in the spill directory instead of memory until the
+    lane has been drained (spill-to-disk, where the limits only bound the
+    messages held in memory).
+
+    Messages with a TTL are dropped once it has passed by timers on a
+    hierarchical timing wheel (see mq_wheel.py), rather than by scanning
+    queues.  Whenever the messages held in memory exceed the memory budget,
+    new messages for reject-new and spill-to-disk queues are refused or
+    spilled, and the oldest messages of the largest drop-oldest queues are
+    evicted (see MessageQueue.reclaim).
+
+    Queues keep at most one pending message per key for compacted topics
+    (see CompactedLane).
+    '''
+    EVENTS = ('rejected', 'dropped', 'expired', 'spilled', 'compacted')
+
+    def __init__(self, defaults=None, budget=None, spill_dir=None):
+        self.defaults     = defaults or Limits()
+        self.queue_limits = {}
+        self.topic_limits = {}
+        self.budget       = budget
+        self.memory       = 0
+        self.compacted    = set()
+        self.counters     = collections.Counter()
+        self.wheel        = mq_wheel.TimingWheel(self.expire)
+        self.spill_dir    = spill_dir
+        self.spill        = None
+
+    def limits(self, queue):
+        return self.queue_limits.get(queue, self.defaults)
+
+    def ttl(self, queue, topic):
+        ''' Return the shortest TTL of queue and topic (or None). '''
+        ttls = [limits.ttl for limits in (self.limits(queue), self.topic_limits.get(topic)) if limits and limits.ttl is not None]
+        return min(ttls) if ttls else None
+
+    def over_budget(self):
+        return self.budget is not None and self.memory > self.budget
+
+    def spill_lane(self, queue, topic):
+        ''' Open log lane for topic in queue in the spill directory, which
+        is created on first use and removed on close. '''
+        if self.spill is None:
+            self.spill = mq_storage.Storage(tempfile.mkdtemp(prefix='mq_spill.', dir=self.spill_dir), sync='none')
+        return self.spill.lane(queue, topic, Message)
+
+    def expire(self, item):
+        ''' Drop expired messages of the lane whose timer is due (along with
+        any others due within the same tick). '''
+        queue, topic, level = item
+        queue.expire(topic, level, self.wheel.clock() + self.wheel.tick)
+
+    def close(self):
+        self.wheel.stop()
+        if self.spill is not None:
+            self.spill.close()
+            shutil.rmtree(self.spill.directory, ignore_errors=True)
+
+# Lane
+
+class Lane(object):
+    ''' Messages of one topic in a queue, oldest first.
+
+    Messages are kept in the backlog (a deque, or a durable log with
+    --data-dir), or in the spilled log once the lane spills to disk, until
+    that has been drained.  For every message appended since startup, an
+    entry of its append time, expiry deadline, size and whether it is held
+    in memory is kept, and the bytes, memory and resident attributes sum
+    those entries up.
+    '''
+
+    def __init__(self, backlog):
+        self.backlog  = backlog
+        self.durable  = not isinstance(backlog, collections.deque)
+        self.spilled  = None
+        self.entries  = collections.deque()
+        self.bytes    = 0
+        self.memory   = 0
+        self.resident = 0
+
+    def __len__(self):
+        return len(self.backlog) + (len(self.spilled) if self.spilled else 0)
+
+    def head(self):
+        ''' Return entry of the oldest message (None if it was restored). '''
+        return self.entries[0] if self.entries and len(self.entries) == len(self) else None
+
+    def append(self, message, entry, spill=False):
+        if spill or self.spilled:
+            self.spilled.append(message)
+        else:
+            self.backlog.append(message)
+        self.entries.append(entry)
+        self.account(entry, 1)
+
+    def messages(self):
+        ''' Return messages of lane, oldest first (without removing them). '''
+        return list(itertools.chain(self.backlog, self.spilled or ()))
+
+    def popleft(self):
+        ''' Pop oldest message and return it along with its entry. '''
+        entry = self.head()
+        if entry is not None:
+            self.entries.popleft()
+            self.account(entry, -1)
+        return (self.backlog.popleft() if self.backlog else self.spilled.popleft()), entry
+
+    def account(self, entry, sign):
+        _, _, size, resident = entry
+        self.bytes += sign * size
+        if resident:
+            self.memory   += sign * size
+            self.resident += sign
+
+class CompactedLane(Lane):
+    ''' Lane of a compacted topic, holding at most one message per X-Key.
+
+    Messages are indexed by key in an ordered dict along with their entries:
+    a message whose key is already pending replaces that message in place
+    (keeping its position) and one without a key is always appended.
+    Compacted lanes are kept in memory, even with --data-dir.
+    '''
+
+    def __init__(self):
+        Lane.__init__(self, collections.OrderedDict())
+        self.durable = False
+
+    def __len__(self):
+        return len(self.backlog)
+
+    def head(self):
+        return next(iter(self.backlog.values()))[1] if self.backlog else None
+
+    def append(self, message, entry, spill=False):
+        ''' Append (or replace) message and return the entry of the message
+        it replaced, if any. '''
+        key      = next((value for name, value in message.headers if name == 'X-Key'), None) or object()
+        replaced = self.backlog.get(key)
+        self.backlog[key] = (message, entry)
+        self.account(entry, 1)
+        if replaced is None:
+            return None
+        self.account(replaced[1], -1)
+        return replaced[1]
+
+    def messages(self):
+        return [message for message, _ in self.backlog.values()]
+
+    def popleft(self):
+        _, (message, entry) = self.backlog.popitem(last=False)
+        self.account(entry, -1)
+        return message, entry
+
+# Queue
+
+class Queue(object):
+    ''' Backlog of a single subscriber queue.
+
+    Messages are kept in one FIFO lane per topic and lanes are drained
+    round-robin, so a hot topic cannot starve the other topics of the same
+    queue.  Ordering is preserved within each topic.  Appends are subject
+    to the queue and topic limits (see Retention).
+
+    Prioritized messages are kept in lanes of their own, one set of lanes
+    per priority level (levels[0] being the lanes of normal messages), and
+    popped first, highest level first.  Once BURST of them in a row have
+    been popped ahead of messages of lower levels, one of those lower levels
+    is served instead, rotating between them, so none of them starves.
+    '''
+    BURST = 16
+
+    def __init__(self, name=None, storage=None, retention=None):
+        self.name      = name
+        self.storage   = storage
+        self.retention = retention or Retention()
+        self.stored    = {}
+        self.levels    = [collections.OrderedDict() for _ in range(Message.PRIORITIES)]
+        self.lanes     = self.levels[0]
+        self.expired   = collections.deque()
+        self.passed    = 0
+        self.aged      = 0
+        self.size      = 0
+        self.bytes     = 0
+        self.memory    = 0
+        self.resident  = 0
+        self.enqueued  = mq_stats.Meter()
+        self.dequeued  = mq_stats.Meter()
+        self.waiting   = 0
+        self.ready     = tornado.locks.Condition()
+
+    def __len__(self):
+        return self.size
+
+    @staticmethod
+    def lane_name(topic, level):
+        ''' Return name the lane for topic at priority level is stored under
+        (the topic, suffixed with a NUL and the level if prioritized). '''
+        return '{}\0{}'.format(topic, level) if level else topic
+
+    def lane(self, topic, level=0):
+        ''' Return lane for topic at priority level, opening a durable one if
+        there is storage.  Durable and spilled lanes are kept once opened. '''
+        if topic in self.retention.compacted:
+            return CompactedLane()
+        name = self.lane_name(topic, level)
+        if name in self.stored:
+            return self.stored[name]
+        if self.storage is None:
+            return Lane(collections.deque())
+
+        self.stored[name] = Lane(self.storage.lane(self.name, name, Message))
+        return self.stored[name]
+
+    def restore(self, name, lane):
+        ''' Add durable lane (and its backlog) reloaded from storage. '''
+        topic, _, level = name.partition('\0')
+        self.stored[name] = Lane(lane)
+        if lane:
+            self.levels[int(level or 0)][topic] = self.stored[name]
+            self.size += len(lane)
+
+    def append(self, message):
+        ''' Append message unless the limits refuse it and return whether
+        it was appended. '''
+        retention = self.retention
+        limits    = retention.limits(self.name)
+        size      = len(message.body)
+        level     = message.priority
+        lanes     = self.levels[level]
+        lane      = lanes.get(message.topic) or self.lane(message.topic, level)
+        spill     = False
+
+        for scope, scope_limits in ((lane, retention.topic_limits.get(message.topic)), (self, limits)):
+            if scope_limits is None:
+                continue
+            if scope_limits.overflow == 'spill-to-disk':
+                spill = spill or scope_limits.exceeded(scope.resident + 1, scope.memory + size)
+                continue
+            if not scope_limits.exceeded(len(scope) + 1, scope.bytes + size):
+                continue
+            if scope_limits.overflow == 'reject-new':
+                retention.counters['rejected'] += 1
+                return False
+            while scope_limits.exceeded(len(scope) + 1, scope.bytes + size) and (lane if scope is lane else any(self.levels)):
+                self.drop(message.topic, level) if scope is lane else self.drop()
+
+        if retention.over_budget() and limits.overflow != 'drop-oldest':
+            if limits.overflow == 'reject-new':
+                retention.counters['rejected'] += 1
+                return False
+            spill = True
+
+        # Durable lanes are on disk already and compacted ones are bounded
+        spill = spill and not (lane.durable or isinstance(lane, CompactedLane))
+        if spill and lane.spilled is None:
+            name = self.lane_name(message.topic, level)
+            lane.spilled = retention.spill_lane(self.name, name)
+            self.stored[name] = lane
+
+        now      = tornado.ioloop.IOLoop.current().time()
+        ttl      = retention.ttl(self.name, message.topic)
+        deadline = now + ttl if ttl is not None else None
+        spilling = spill or bool(lane.spilled)
+        entry    = (now, deadline, size, not (lane.durable or spilling))
+        if spilling:
+            retention.counters['spilled'] += 1
+        replaced = lane.append(message, entry, spill)
+        self.account(entry, 1)
+        if deadline is not None:
+            retention.wheel.schedule(deadline, (self, message.topic, level))
+        self.enqueued.mark()
+
+        if replaced is not None:
+            self.account(replaced, -1)
+            retention.counters['compacted'] += 1
+            return True
+
+        if message.topic not in lanes:
+            lanes[message.topic] = lane
+        self.size += 1
+        self.ready.notify()
+        return True
+
+    def level(self):
+        ''' Return priority level the next pop takes from (0 for the
+        requeued messages and lanes), counting how often the lower levels
+        with messages were passed over. '''
+        levels = [level for level in range(Message.PRIORITIES - 1, 0, -1) if self.levels[level]]
+        lower  = levels[1:] + ([0] if self.expired or self.lanes else [])
+        if not levels or not lower:
+            self.passed = 0
+            return levels[0] if levels else 0
+
+        self.passed += 1
+        if self.passed <= self.BURST:
+            return levels[0]
+
+        # Serve the first lower level at or after the aged one
+        lower       = sorted(lower)
+        level       = next((level for level in lower if level >= self.aged), lower[0])
+        self.aged   = (level + 1) % Message.PRIORITIES
+        self.passed = 0
+        return level
+
+    def requeue(self, message):
+        ''' Return message whose lease expired, to be redelivered first. '''
+        self.expired.append(message)
+        self.size += 1
+        self.ready.notify()
+
+    def pop(self, level=None):
+        ''' Pop message from level (the one returned by level() if None). '''
+        self.dequeued.mark()
+        if level is None:
+            level = self.level()
+        if not level and self.expired:
+            self.size -= 1
+            message = self.expired.popleft()
+            return message.stamped() if message.traced else message
+
+        lanes       = self.levels[level]
+        topic, lane = next(iter(lanes.items()))
+        entry       = lane.head()
+        message     = self.take(topic, lane, level)
+        if lane:
+            lanes.move_to_end(topic)
+        if message.traced:
+            return message.stamped(tornado.ioloop.IOLoop.current().time() - entry[0] if entry else None)
+        return message
+
+    def take(self, topic, lane, level=0):
+        ''' Pop oldest message of lane for topic at priority level. '''
+        message, entry = lane.popleft()
+        if entry is not None:
+            self.account(entry, -1)
+        if not lane:
+            del self.levels[level][topic]
+        self.size -= 1
+        return message
+
+    def drop(self, topic=None, level=0, resident=False):
+        ''' Drop oldest message of the lane for topic at priority level (or of
+        the whole queue, only considering messages in memory if resident). '''
+        if topic is None:
+            oldest = [
+                ((lane.head() or (0,))[0], level, name)
+                for level, lanes in enumerate(self.levels) for name, lane in lanes.items()
+                if lane.resident or not resident
+            ]
+            _, level, topic = min(oldest)
+        self.take(topic, self.levels[level][topic], level)
+        self.retention.counters['dropped'] += 1
+
+    def expire(self, topic, level, now):
+        ''' Drop messages at the head of the lane for topic at priority level
+        whose deadline has passed. '''
+        lane = self.levels[level].get(topic)
+        while lane and lane.head() and lane.head()[1] is not None and lane.head()[1] <= now:
+            self.take(topic, lane, level)
+            self.retention.counters['expired'] += 1
+
+    def oldest(self):
+        ''' Return append time of the oldest message (None if there are no
+        messages appended since startup). '''
+        heads = [lane.head()[0] for lanes in self.levels for lane in lanes.values() if lane.head()]
+        return min(heads) if heads else None
+
+    def account(self, entry, sign):
+        _, _, size, resident = entry
+        self.bytes += sign * size
+        if resident:
+            self.memory          += sign * size
+            self.resident        += sign
+            self.retention.memory += sign * size
+
+class Queues(dict):
+    ''' Queues by name, created on first use. '''
+
+    def __init__(self, storage=None, retention=None):
+        dict.__init__(self)
+        self.storage   = storage
+        self.retention = retention
+
+    def __missing__(self, name):
+        queue = self[name] = Queue(name, self.storage, self.retention)
+        return queue
+
+# Group
+
+class Group(object):
+    ''' Members sharing the backlog of a consumer group queue.
+
+    Whenever several members are polling, the policy picks the one that may
+    take the next message: the next in rotation (round-robin) or the one
+    with the fewest leased, unacknowledged messages (least-outstanding, ties
+    broken by rotation).  Members that are not polling are skipped, so a
+    message never waits for an idle member.
+    '''
+    POLICIES = ('round-robin', 'least-outstanding')
+
+    def __init__(self, policy='round-robin'):
+        self.policy      = policy
+        self.members     = []
+        self.next        = 0
+        self.polling     = collections.Counter()
+        self.outstanding = collections.Counter()
+
+    def join(self, member):
+        if member not in self.members:
+            self.members.append(member)
+
+    def leave(self, member):
+        self.members.remove(member)
+        self.next = 0
+
+    def eligible(self, member):
+        ''' Return whether member may take the next message. '''
+        if member not in self.members:
+            return False
+
+        candidates = [other for other in self.members if self.polling[other]] or [member]
+        if self.policy == 'least-outstanding':
+            fewest     = min(self.outstanding[other] for other in candidates)
+            candidates = [other for other in candidates if self.outstanding[other] == fewest]
+
+        order = lambda other: (self.members.index(other) - self.next) % len(self.members)
+        return min(candidates, key=order) == member
+
+    def taken(self, member):
+        ''' Advance rotation past member, which just took a message. '''
+        self.next = (self.members.index(member) + 1) % len(self.members)
+
+# Mailbox
+
+class Mailbox(object):
+    ''' Channel to a peer worker over a socketpair.
+
+    Frames are length-prefixed pickles of ('call', id, operation, args) or
+    ('reply', id, status, result).  Each worker is single-threaded, so
+    neither end needs any locking.
+    '''
+    FRAME = struct.Struct('<I')
+
+    def __init__(self, application, sock):
+        self.application = application
+        self.stream      = tornado.iostream.IOStream(sock)
+        self.pending     = {}
+        self.call_ids    = itertools.count()
+        application.ioloop.spawn_callback(self.receive)
+
+    def send(self, frame):
+        data = pickle.dumps(frame, pickle.HIGHEST_PROTOCOL)
+        self.stream.write(self.FRAME.pack(len(data)) + data)
+
+    def call(self, operation, args):
+        ''' Ask peer to perform operation and return Future of its result. '''
+        call_id = next(self.call_ids)
+        future  = self.pending[call_id] = tornado.concurrent.Future()
+        self.send(('call', call_id, operation, args))
+        return future
+
+    @tornado.gen.coroutine
+    def receive(self):
+        try:
+            while True:
+                length, = self.FRAME.unpack((yield self.stream.read_bytes(self.FRAME.size)))
+                kind, call_id, first, second = pickle.loads((yield self.stream.read_bytes(length)))
+                if kind == 'call':
+                    self.application.ioloop.spawn_callback(self.perform, call_id, first, second)
+                elif first == 200:
+                    self.pending.pop(call_id).set_result(second)
+                else:
+                    self.pending.pop(call_id).set_exception(tornado.web.HTTPError(first, second))
+        except tornado.iostream.StreamClosedError:
+            # Peer exited: the workers only make sense together
+            self.application.ioloop.stop()
+
+    @tornado.gen.coroutine
+    def perform(self, call_id, operation, args):
+        try:
+            result = yield self.application.perform(operation, args)
+            self.send(('reply', call_id, 200, result))
+        except tornado.web.HTTPError as e:
+            self.send(('reply', call_id, e.status_code, e.log_message))
+
 # Base Handler
 
 class BaseHandler(tornado.web.RequestHandler):
+    REPLICA = False     # Whether a replica serves the handler's requests
+
+    @tornado.gen.coroutine
+    def prepare(self):
+        ''' Refuse requests on a replica and process acknowledgements
+        piggybacked on any request. '''
+        replicator = self.application.replicator
+        if replicator and replicator.following and not self.REPLICA:
+            self.set_status(503)
+            self.set_header('X-Replica', replicator.primary)
+            self.finish('Replica of primary: {}\n'.format(replicator.primary))
+            return
+
+        self.acknowledged = 0
+        acks = self.request.headers.get('X-Ack')
+        if acks:
+            self.acknowledged = yield self.application.ack(acks.split(','))
+
     def write_error(self, status_code, **kwargs):
         self.set_status(status_code)
         try:
@@ -37,27 +749,84 @@ class BaseHandler(tornado.web.RequestHandler):
         self.application.logger.info(message.rstrip())
         self.write(message)
 
+    def write_message(self, message, delivery=None):
+        ''' Write message (and its delivery id if it was leased). '''
+        for name, value in message.headers:
+            self.set_header(name, value)
+        self.set_header('X-Topic', message.topic)
+        if delivery:
+            self.set_header('X-Delivery', delivery)
+        self.write_response(message.body)
+
+    def get_lease(self, value):
+        try:
+            return max(float(value), 0) if value else None
+        except ValueError:
+            raise tornado.web.HTTPError(400, 'Invalid lease: {}'.format(value))
+
 # Topic Handler
 
 class TopicHandler(BaseHandler):
+    @tornado.gen.coroutine
     def put(self, topic):
         ''' Publish message (request body) to each queue that is subscribed to topic. '''
-        message     = self.request.body
-        subscribers = 0
-
-        for queue, topics in self.application.subscriptions.items():
-            if topic in topics:
-                self.application.queues[queue].append(message)
-                subscribers += 1
-
-        if subscribers:
-            self.write('Published message ({} bytes) to {} subscribers of {}\n'.format(
-                len(message),
-                subscribers,
-                topic,
-            ))
-        else:
+        message  = Message(topic, self.request.body, self.request.headers.get_all())
+        delay    = self.get_delay()
+        producer = self.get_producer()
+        if delay > 0:
+            if not (yield self.application.call(topic, 'schedule', topic, message, delay, producer)):
+                return self.write_duplicate(producer)
+            self.set_status(202)
+            self.write('Scheduled message ({} bytes) for {} in {:.3f} seconds\n'.format(len(message.body), topic, delay))
+            return
+
+        published = yield self.application.call(topic, 'publish', topic, message, producer)
+        if published is None:
+            return self.write_duplicate(producer)
+
+        subscribers, accepted = published
+
+        if not subscribers:
             raise tornado.web.HTTPError(404, 'There are no subscribers for topic: {}'.format(topic))
+        if not accepted:
+            raise tornado.web.HTTPError(503, 'All queues subscribed to topic are full: {}'.format(topic))
+
+        self.write('Published message ({} bytes) to {} subscribers of {}{}\n'.format(
+            len(message.body),
+            accepted,
+            topic,
+            ' ({} full)'.format(subscribers - accepted) if accepted < subscribers else '',
+        ))
+
+    def get_producer(self):
+        ''' Return (producer, sequence) from the X-Producer and X-Sequence
+        headers, or None if the publish is not identified. '''
+        producer = self.request.headers.get('X-Producer')
+        sequence = self.request.headers.get('X-Sequence')
+        if not producer or not sequence:
+            return None
+        try:
+            return producer, int(sequence)
+        except ValueError:
+            raise tornado.web.HTTPError(400, 'Invalid sequence: {}'.format(sequence))
+
+    def write_duplicate(self, producer):
+        self.set_header('X-Duplicate', 'true')
+        self.write('Ignored duplicate message ({}) from producer ({})\n'.format(producer[1], producer[0]))
+
+    def get_delay(self):
+        ''' Return seconds until message is due from the X-Delay (ms) or
+        X-Deliver-At (Unix time) header. '''
+        delay      = self.request.headers.get('X-Delay')
+        deliver_at = self.request.headers.get('X-Deliver-At')
+        try:
+            if delay:
+                return float(delay) / 1000
+            if deliver_at:
+                return float(deliver_at) - time.time()
+        except ValueError:
+            raise tornado.web.HTTPError(400, 'Invalid delay: {}'.format(delay or deliver_at))
+        return 0
 
 # Queue Handler
 
@@ -65,37 +834,209 @@ class QueueHandler(BaseHandler):
     @tornado.gen.coroutine
     def get(self, queue):
         ''' Retrieve one message from queue (wait until one is available). '''
+        lease  = self.get_lease(self.request.headers.get('X-Lease'))
+        result = None
 
-        if queue not in self.application.queues:
-            raise tornado.web.HTTPError(404, 'There is no queue named: {}'.format(queue))
+        while result is None and not self.request.connection.stream.closed():
+            result = yield self.application.call(queue, 'retrieve', queue, lease, 1)
 
-        while not self.application.queues[queue] and not self.request.connection.stream.closed():
-            yield tornado.gen.sleep(1)
-
-        if self.application.queues[queue]:
-            self.write_response(self.application.queues[queue].pop(0))
+        if result:
+            self.write_message(*result)
         else:
             raise tornado.web.HTTPError(404, 'There are no messages for queue: {}'.format(queue))
 
+# Queues Handler
+
+class QueuesHandler(BaseHandler):
+    @tornado.gen.coroutine
+    def get(self):
+        ''' Retrieve one message from any of the named queues (wait up to one second). '''
+        names    = []
+        leases   = {}
+        for line in self.request.body.decode().splitlines():
+            fields = line.split()
+            if fields:
+                names.append(fields[0])
+                leases[fields[0]] = self.get_lease(fields[1] if len(fields) > 1 else None)
+        deadline = self.application.ioloop.time() + self.application.poll_timeout
+
+        shards   = self.application.shards_for(names)
+
+        while not self.request.connection.stream.closed():
+            # Try one shard at a time, so that only one message is popped
+            for shard in shards:
+                result = yield self.application.call_shard(shard, 'pop', names, leases)
+                if result:
+                    queue, source, message, delivery = result
+                    self.set_header('X-Queue', queue)
+                    if source != queue:
+                        self.set_header('X-Group', source)
+                    self.write_message(message, delivery)
+                    return
+
+            timeout = deadline - self.application.ioloop.time()
+            if timeout <= 0:
+                break
+            yield self.application.call_any(shards, 'wait', names, timeout)
+
+        self.set_status(204)
+
+# Ack Handler
+
+class AckHandler(BaseHandler):
+    def put(self):
+        ''' Acknowledge deliveries in X-Ack header (see BaseHandler.prepare). '''
+        self.write_response('Acknowledged {} deliveries\n'.format(self.acknowledged))
+
+# Group Handler
+
+class GroupHandler(BaseHandler):
+    @tornado.gen.coroutine
+    def put(self, group, member):
+        ''' Add member to group (created with the X-Policy policy). '''
+        policy = self.request.headers.get('X-Policy', Group.POLICIES[0])
+        if policy not in Group.POLICIES:
+            raise tornado.web.HTTPError(400, 'Unknown group policy: {}'.format(policy))
+
+        if (yield self.application.call(group, 'join', group, member, policy)):
+            yield self.application.locate(member, group, 1)
+        self.write_response('Added member ({}) to group ({})\n'.format(member, group))
+
+    @tornado.gen.coroutine
+    def delete(self, group, member):
+        ''' Remove member from group. '''
+        if not (yield self.application.call(group, 'leave', group, member)):
+            raise tornado.web.HTTPError(404, 'There is no member ({}) in group ({})'.format(member, group))
+        yield self.application.locate(member, group, -1)
+
+        self.write_response('Removed member ({}) from group ({})\n'.format(member, group))
+
+# Limits Handler
+
+class LimitsHandler(BaseHandler):
+    def get_limit(self, name, cast):
+        value = self.request.headers.get(name)
+        try:
+            return max(cast(value), 0) if value else None
+        except ValueError:
+            raise tornado.web.HTTPError(400, 'Invalid {}: {}'.format(name, value))
+
+    def shards(self, scope, name):
+        ''' Return shards holding the queue, or every shard for a topic (as
+        its subscribed queues may be owned by any). '''
+        return [self.application.owner(name)] if scope == 'queue' else range(self.application.shards)
+
+    @tornado.gen.coroutine
+    def put(self, scope, name):
+        ''' Set limits of queue (or of every queue's lane for topic). '''
+        try:
+            limits = Limits(
+                self.get_limit('X-Max-Messages', int),
+                self.get_limit('X-Max-Bytes'   , int),
+                self.get_limit('X-TTL'         , float),
+                self.request.headers.get('X-Overflow', self.application.retention.defaults.overflow),
+            )
+        except ValueError as e:
+            raise tornado.web.HTTPError(400, str(e))
+
+        yield [self.application.call_shard(shard, 'limit', scope, name, limits) for shard in self.shards(scope, name)]
+        self.write_response('Set limits of {} ({})\n'.format(scope, name))
+
+    @tornado.gen.coroutine
+    def delete(self, scope, name):
+        ''' Remove limits of queue (or topic). '''
+        yield [self.application.call_shard(shard, 'limit', scope, name, None) for shard in self.shards(scope, name)]
+        self.write_response('Removed limits of {} ({})\n'.format(scope, name))
+
+# Compacted Handler
+
+class CompactedHandler(BaseHandler):
+    @tornado.gen.coroutine
+    def put(self, topic):
+        ''' Compact lanes for topic opened from now on (on every shard). '''
+        yield [self.application.call_shard(shard, 'compact', topic, True) for shard in range(self.application.shards)]
+        self.write_response('Compacting topic ({})\n'.format(topic))
+
+    @tornado.gen.coroutine
+    def delete(self, topic):
+        ''' Stop compacting topic. '''
+        yield [self.application.call_shard(shard, 'compact', topic, False) for shard in range(self.application.shards)]
+        self.write_response('Stopped compacting topic ({})\n'.format(topic))
+
+# Stats Handler
+
+class StatsHandler(BaseHandler):
+    PROMETHEUS = 'text/plain; version=0.0.4; charset=utf-8'
+    REPLICA    = True
+
+    @tornado.gen.coroutine
+    def get(self):
+        ''' Report metrics merged from every shard. '''
+        prometheus = self.wants_prometheus()
+        snapshots  = yield [self.application.call_shard(shard, 'stats') for shard in range(self.application.shards)]
+        stats      = mq_stats.merge(snapshots)
+        if prometheus:
+            self.set_header('Content-Type', self.PROMETHEUS)
+            self.write(mq_stats.prometheus(stats))
+        else:
+            self.write(stats)
+
+    def wants_prometheus(self):
+        ''' Return whether the ?format argument (or else the Accept header,
+        as sent by Prometheus scrapers) asks for the text format. '''
+        format = self.get_query_argument('format', None)
+        if format not in (None, 'json', 'prometheus'):
+            raise tornado.web.HTTPError(400, 'Unknown stats format: {}'.format(format))
+        if format:
+            return format == 'prometheus'
+        accept = self.request.headers.get('Accept', '')
+        return 'text/plain' in accept or 'openmetrics' in accept
+
+# Replication Handler
+
+class ReplicationHandler(BaseHandler):
+    REPLICA = True
+
+    @tornado.gen.coroutine
+    def get(self):
+        ''' Stream a snapshot of this broker and then its journal, in
+        batches, until the replica disconnects. '''
+        if self.application.shards > 1:
+            raise tornado.web.HTTPError(501, 'Replication needs a single worker')
+
+        journal  = self.application.journal
+        address  = self.request.remote_ip
+        follower = journal.follow(address, self.application.snapshot())
+        self.application.logger.info('Replica {} connected'.format(address))
+        try:
+            while not self.request.connection.stream.closed():
+                operations = yield follower.batch()
+                if operations is None:
+                    self.application.logger.warning('Dropping replica {} as it fell too far behind'.format(address))
+                    break
+                self.write(mq_replication.encode(journal.sequence, operations))
+                yield self.flush()
+        except tornado.iostream.StreamClosedError:
+            pass
+        finally:
+            journal.unfollow(follower)
+            self.application.logger.info('Replica {} disconnected'.format(address))
+
 # Subscription Handler
 
 class SubscriptionHandler(BaseHandler):
+    @tornado.gen.coroutine
     def put(self, queue, topic):
         ''' Subscribe queue to topic. '''
-        try:
-            self.application.subscriptions[queue].add(topic)
-            if queue not in self.application.queues:
-                self.application.queues[queue]
-        except KeyError:
-            raise tornado.web.HTTPError(404, 'There is no queue named: {}'.format(queue))
-
+        yield [self.application.call_shard(shard, 'subscribe', queue, topic) for shard in self.application.topic_shards(topic)]
+        yield self.application.call(queue, 'create', queue)
         self.write_response('Subscribed queue ({}) to topic ({})\n'.format(queue, topic))
 
+    @tornado.gen.coroutine
     def delete(self, queue, topic):
         ''' Unsubscribe queue from topic. '''
-        try:
-            self.application.subscriptions[queue].remove(topic)
-        except KeyError:
+        removed = yield [self.application.call_shard(shard, 'unsubscribe', queue, topic) for shard in self.application.topic_shards(topic)]
+        if not any(removed):
             raise tornado.web.HTTPError(404, 'There is no queue named: {}'.format(queue))
 
         self.write_response('Unsubscribed queue ({}) from topic ({})\n'.format(queue, topic))
@@ -103,34 +1044,602 @@ class SubscriptionHandler(BaseHandler):
 # Message Queue
 
 class MessageQueue(tornado.web.Application):
+    ''' Message queue broker (or one shard of it).
+
+    With --workers=N, N worker processes each accept connections on their
+    own SO_REUSEPORT socket and run their own event loop.  Every queue,
+    group and topic (along with its subscriptions) is owned by the worker
+    selected by the CRC32 of its name; a worker performs operations on state
+    it owns directly and hands the others to the owner through its mailbox.
+    '''
     DEFAULT_ADDRESS = '0.0.0.0'
     DEFAULT_PORT    = 9620
+    POLL_TIMEOUT    = 1
+    DEDUP_PRODUCERS = 100000
 
-    def __init__(self, **settings):
+    def __init__(self, shard=0, shards=1, mailboxes=None, **settings):
         tornado.web.Application.__init__(self, **settings)
 
         self.logger        = logging.getLogger()
         self.address       = settings.get('address', self.DEFAULT_ADDRESS)
         self.port          = settings.get('port'   , self.DEFAULT_PORT)
         self.ioloop        = tornado.ioloop.IOLoop.instance()
-        self.queues        = collections.defaultdict(list)
+        self.shard         = shard
+        self.shards        = shards
+        self.mailboxes     = {peer: Mailbox(self, sock) for peer, sock in (mailboxes or {}).items()}
+        self.storage       = None
+        if settings.get('data_dir'):
+            self.storage = mq_storage.Storage(
+                settings['data_dir'] if shards == 1 else os.path.join(settings['data_dir'], 'shard-{}'.format(shard)),
+                sync              = settings.get('sync', 'group'),
+                commit_interval   = settings.get('commit_interval', mq_storage.Storage.COMMIT_INTERVAL),
+                segment_bytes     = settings.get('segment_size', mq_storage.Storage.SEGMENT_BYTES),
+                snapshot_interval = settings.get('snapshot_interval', mq_storage.Storage.SNAPSHOT_INTERVAL),
+            )
+        self.retention     = Retention(
+            Limits(
+                settings.get('max_messages') or None,
+                settings.get('max_bytes') or None,
+                settings.get('ttl') or None,
+                settings.get('overflow', 'drop-oldest'),
+            ),
+            budget    = settings['memory_budget'] / shards if settings.get('memory_budget') else None,
+            spill_dir = settings.get('spill_dir') or None,
+        )
+        self.queues        = Queues(self.storage, self.retention)
+        self.scheduler     = mq_wheel.TimingWheel(self.release)
+        self.producers     = collections.OrderedDict()
+        self.max_producers = settings.get('dedup_producers') or self.DEDUP_PRODUCERS
         self.subscriptions = collections.defaultdict(set)
+        self.trie          = mq_trie.TopicTrie()
+        self.ready         = tornado.locks.Condition()
+        self.poll_timeout  = self.POLL_TIMEOUT
+        self.rotation      = 0
+        self.deliveries    = {}
+        self.delivery_ids  = itertools.count(1)
+        self.groups        = {}
+        self.membership    = collections.defaultdict(set)
+        self.group_shards  = collections.defaultdict(collections.Counter)
+        self.published     = collections.defaultdict(mq_stats.Meter)
+        self.fanout        = {}
+        self.requests      = collections.defaultdict(mq_stats.Histogram)
+        self.sampler       = tornado.ioloop.PeriodicCallback(self.sample, mq_stats.INTERVAL * 1000)
+        self.sampled       = self.ioloop.time()
+        self.journal       = mq_replication.Journal()
+        self.replicator    = None
+        if settings.get('replicate_from'):
+            self.replicator = mq_replication.Replicator(
+                self,
+                settings['replicate_from'],
+                settings.get('failover_timeout') or mq_replication.FAILOVER_TIMEOUT,
+            )
 
         self.add_handlers('.*', (
-            ('.*/topic/(.*)'            , TopicHandler),
-            ('.*/queue/(.*)'            , QueueHandler),
-            ('.*/subscription/(.*)/(.*)', SubscriptionHandler),
+            ('.*/limits/(queue|topic)/(.*)', LimitsHandler),
+            ('.*/compacted/(.*)'           , CompactedHandler),
+            ('.*/queues'                   , QueuesHandler),
+            ('.*/topic/(.*)'               , TopicHandler),
+            ('.*/queue/(.*)'               , QueueHandler),
+            ('.*/subscription/(.*)/(.*)'   , SubscriptionHandler),
+            ('.*/group/(.*)/(.*)'          , GroupHandler),
+            ('.*/ack'                      , AckHandler),
+            ('.*/replication'              , ReplicationHandler),
+            ('.*/stats'                    , StatsHandler),
         ))
 
+        if self.storage:
+            for queue, topic, lane in self.storage.load(Message):
+                self.queues[queue].restore(topic, lane)
+            for queue, topics in self.storage.subscriptions.items():
+                for topic in topics:
+                    self.do_subscribe(queue, topic)
+            self.storage.subscriptions = self.subscriptions
+
+    # Shard routing
+
+    def owner(self, name):
+        ''' Return shard that owns queue, group or topic name. '''
+        return zlib.crc32(name.encode()) % self.shards if self.shards > 1 else 0
+
+    def shards_for(self, names):
+        ''' Return shards owning the named queues or groups they are members
+        of, starting at a different one on every call. '''
+        shards = set(self.owner(name) for name in names)
+        for name in names:
+            shards.update(shard for shard, count in self.group_shards.get(name, {}).items() if count)
+        shards = sorted(shards)
+
+        self.rotation += 1
+        return [shards[(self.rotation + index) % len(shards)] for index in range(len(shards))]
+
+    def locate(self, member, group, delta):
+        ''' Tell every shard that member joined (or left) a group owned by
+        the group's shard. '''
+        return tornado.gen.multi([
+            self.call_shard(shard, 'locate', member, self.owner(group), delta) for shard in range(self.shards)
+        ])
+
+    def topic_shards(self, topic):
+        ''' Return shards holding subscriptions to topic: its owner, or every
+        shard for wildcard patterns (as they can match topics owned by any). '''
+        return range(self.shards) if mq_trie.is_pattern(topic) else [self.owner(topic)]
+
+    def call(self, name, operation, *args):
+        ''' Perform operation on the shard that owns name. '''
+        return self.call_shard(self.owner(name), operation, *args)
+
+    def call_shard(self, shard, operation, *args):
+        ''' Perform operation on shard and return Future of its result. '''
+        if shard != self.shard:
+            return self.mailboxes[shard].call(operation, args)
+        return self.perform(operation, args)
+
+    def call_any(self, shards, operation, *args):
+        ''' Perform operation on shards and return Future resolved once the
+        first of them completes. '''
+        futures = [self.call_shard(shard, operation, *args) for shard in shards]
+        if len(futures) == 1:
+            return futures[0]
+
+        first = tornado.concurrent.Future()
+        for future in futures:
+            future.add_done_callback(lambda future: first.done() or first.set_result(None))
+        return first
+
+    def perform(self, operation, args):
+        ''' Perform operation on this shard and return Future of its result. '''
+        try:
+            result = getattr(self, 'do_' + operation)(*args)
+        except tornado.web.HTTPError as e:
+            result = tornado.concurrent.Future()
+            result.set_exception(e)
+        if not tornado.concurrent.is_future(result):
+            future = tornado.concurrent.Future()
+            future.set_result(result)
+            result = future
+        return result
+
+    # Shard operations
+
+    @tornado.gen.coroutine
+    def do_publish(self, topic, message, producer=None):
+        ''' Append message to every queue subscribed to topic and return how
+        many there were and how many of them accepted it (or None if it was
+        a duplicate from producer). '''
+        if producer and not self.deduplicate(producer):
+            return None
+
+        queues   = self.trie.match(topic)
+        self.published[topic].mark()
+        self.fanout[topic] = len(queues)
+        accepted = yield [self.call(queue, 'append', queue, message) for queue in queues]
+        if producer and not any(accepted) and producer[0] in self.producers:
+            self.producers[producer[0]].discard(producer[1])
+        return len(queues), sum(accepted)
+
+    def do_schedule(self, topic, message, delay, producer=None):
+        ''' Publish message to topic once delay seconds have passed and
+        return whether it was not a duplicate from producer. '''
+        if producer and not self.deduplicate(producer):
+            return False
+        self.scheduler.schedule(self.ioloop.time() + delay, message)
+        return True
+
+    @tornado.gen.coroutine
+    def do_append(self, queue, message):
+        ''' Append message to queue and return whether it was accepted. '''
+        if not self.queues[queue].append(message):
+            return False
+        self.journal.record('append', queue, message)
+        if self.retention.over_budget():
+            self.reclaim()
+        self.ready.notify_all()
+        if self.storage:
+            yield self.storage.commit()
+        return True
+
+    def do_create(self, queue):
+        self.queues[queue]
+        self.journal.record('create', queue)
+
+    def do_subscribe(self, queue, topic):
+        self.subscriptions[queue].add(topic)
+        self.trie.add(topic, queue)
+        self.journal.record('subscribe', queue, topic)
+
+    def do_unsubscribe(self, queue, topic):
+        if not self.trie.remove(topic, queue):
+            return False
+        self.subscriptions[queue].discard(topic)
+        self.journal.record('unsubscribe', queue, topic)
+        return True
+
+    def do_limit(self, scope, name, limits):
+        ''' Set (or with None, remove) limits of queue or topic. '''
+        table = self.retention.queue_limits if scope == 'queue' else self.retention.topic_limits
+        if limits is None:
+            table.pop(name, None)
+        else:
+            table[name] = limits
+        self.journal.record('limit', scope, name, limits)
+
+    def do_compact(self, topic, enabled):
+        if enabled:
+            self.retention.compacted.add(topic)
+        else:
+            self.retention.compacted.discard(topic)
+        self.journal.record('compact', topic, enabled)
+
+    def do_join(self, group, member, policy):
+        ''' Add member to group and return whether it was not one already. '''
+        if group not in self.groups:
+            self.groups[group] = Group(policy)
+        if group in self.membership[member]:
+            return False
+
+        self.groups[group].join(member)
+        self.membership[member].add(group)
+        self.queues[group]
+        self.journal.record('join', group, member, policy)
+        return True
+
+    def do_leave(self, group, member):
+        try:
+            self.groups[group].leave(member)
+            self.membership[member].remove(group)
+        except (KeyError, ValueError):
+            return False
+        self.ready.notify_all()
+        self.journal.record('leave', group, member)
+        return True
+
+    def do_locate(self, member, shard, delta):
+        self.group_shards[member][shard] += delta
+        self.journal.record('locate', member, shard, delta)
+
+    @tornado.gen.coroutine
+    def do_retrieve(self, queue, lease, timeout):
+        ''' Pop message from queue, waiting up to timeout seconds for one.
+        Returns the message and its delivery id, or None. '''
+        if queue not in self.queues:
+            raise tornado.web.HTTPError(404, 'There is no queue named: {}'.format(queue))
+
+        if not self.queues[queue]:
+            self.queues[queue].waiting += 1
+            try:
+                yield self.queues[queue].ready.wait(timeout=self.ioloop.time() + timeout)
+            finally:
+                self.queues[queue].waiting -= 1
+        if not self.queues[queue]:
+            return None
+
+        message = self.dequeue(queue)
+        return message, self.lease(queue, message, lease)
+
+    def do_pop(self, names, leases):
+        ''' Pop message for any of the named queues on this shard.  Returns
+        the name, the queue popped from, the message and its delivery id, or
+        None. '''
+        self.poll(names, 1)
+        try:
+            queue, source, message = self.pop_any(names)
+        finally:
+            self.poll(names, -1)
+
+        if message is None:
+            return None
+        return queue, source, message, self.lease(source, message, leases[queue], queue)
+
+    @tornado.gen.coroutine
+    def do_wait(self, names, timeout):
+        ''' Wait up to timeout seconds for a message for any of the named
+        queues on this shard (returning at once if there is one). '''
+        if any(self.queues.get(name) for name in names) or \
+           any(self.queues[group] for name in names for group in self.membership.get(name, ())):
+            return
+
+        waiting = [self.queues[name] for name in names if name in self.queues]
+        for queue in waiting:
+            queue.waiting += 1
+        self.poll(names, 1)
+        try:
+            yield self.ready.wait(timeout=self.ioloop.time() + timeout)
+        finally:
+            self.poll(names, -1)
+            for queue in waiting:
+                queue.waiting -= 1
+
+    def do_stats(self):
+        ''' Return snapshot of the metrics of this shard (see mq_stats.py). '''
+        now    = self.ioloop.time()
+        queues = {}
+        for name, queue in self.queues.items():
+            oldest = queue.oldest()
+            queues[name] = {
+                'depth'       : len(queue),
+                'bytes'       : queue.bytes,
+                'memory'      : queue.memory,
+                'enqueued'    : queue.enqueued.count,
+                'dequeued'    : queue.dequeued.count,
+                'enqueue_rate': queue.enqueued.rate,
+                'dequeue_rate': queue.dequeued.rate,
+                'oldest_age'  : now - oldest if oldest is not None else 0.0,
+                'waiting'     : queue.waiting,
+            }
+
+        return {
+            'queues'   : queues,
+            'topics'   : {
+                topic: {'subscribers': self.fanout[topic], 'published': meter.count, 'publish_rate': meter.rate}
+                for topic, meter in self.published.items()
+            },
+            'broker'   : {'memory': self.retention.memory, 'in_flight': len(self.deliveries), 'scheduled': len(self.scheduler)},
+            'retention': {event: self.retention.counters[event] for event in Retention.EVENTS},
+            'requests' : {endpoint: histogram.snapshot() for endpoint, histogram in self.requests.items()},
+            'replication': self.replicator.stats() if self.replicator and self.replicator.following else {
+                'role'    : 'primary',
+                'replicas': len(self.journal.followers),
+                'sequence': self.journal.sequence,
+                'pending' : self.journal.pending(),
+            },
+        }
+
+    def do_ack(self, deliveries):
+        ''' Acknowledge deliveries and return how many were still in flight. '''
+        acknowledged = 0
+        for delivery in deliveries:
+            try:
+                _, _, timeout = self.settle(delivery)
+            except KeyError:
+                continue
+            self.ioloop.remove_timeout(timeout)
+            acknowledged += 1
+        return acknowledged
+
+    def do_take(self, queue, topic, level=0):
+        ''' Remove the message a replicated pop took from queue: the oldest
+        of the lane for topic at priority level, or of the requeued messages
+        if None. '''
+        backlog = self.queues[queue]
+        lanes   = backlog.levels[level]
+        if topic is None and backlog.expired:
+            backlog.expired.popleft()
+            backlog.size -= 1
+        elif topic in lanes:
+            backlog.take(topic, lanes[topic], level)
+            if topic in lanes:
+                lanes.move_to_end(topic)
+        self.journal.record('take', queue, topic, level)
+
+    def do_requeue(self, queue, message):
+        self.queues[queue].requeue(message)
+        self.journal.record('requeue', queue, message)
+
+    def do_reset(self):
+        ''' Drop all state, before applying a snapshot of the primary.
+        Queues are drained rather than removed, as their durable lanes stay
+        open. '''
+        for queue in self.queues.values():
+            queue.expired.clear()
+            for level, lanes in enumerate(queue.levels):
+                for topic, lane in list(lanes.items()):
+                    while topic in lanes:
+                        queue.take(topic, lane, level)
+            queue.size = 0
+        for table in (self.retention.queue_limits, self.retention.topic_limits, self.retention.compacted,
+                      self.subscriptions, self.groups, self.membership, self.group_shards):
+            table.clear()
+        self.trie = mq_trie.TopicTrie()
+        self.journal.record('reset')
+
+    # Shard state
+
+    def snapshot(self):
+        ''' Return operations rebuilding the state of this shard on a
+        replica (see mq_replication.py). '''
+        operations = [('reset', ())]
+        operations.extend(('limit', (scope, name, limits))
+            for scope, table in (('queue', self.retention.queue_limits), ('topic', self.retention.topic_limits))
+            for name, limits in table.items())
+        operations.extend(('compact', (topic, True)) for topic in self.retention.compacted)
+        operations.extend(('subscribe', (queue, topic)) for queue, topics in self.subscriptions.items() for topic in topics)
+        operations.extend(('join', (name, member, group.policy)) for name, group in self.groups.items() for member in group.members)
+        operations.extend(('locate', (member, shard, count)) for member, shards in self.group_shards.items() for shard, count in shards.items())
+        for name, queue in self.queues.items():
+            operations.append(('create', (name,)))
+            operations.extend(('requeue', (name, message)) for message in queue.expired)
+            operations.extend(('append', (name, message)) for lanes in queue.levels for lane in lanes.values() for message in lane.messages())
+        return operations
+
+    def dequeue(self, name):
+        ''' Pop message from queue, journaling the level or lane it was
+        taken from. '''
+        queue = self.queues[name]
+        level = queue.level()
+        self.journal.record('take', name, None if not level and queue.expired else next(iter(queue.levels[level])), level)
+        return queue.pop(level)
+
+    def pop_any(self, names):
+        ''' Pop message from the first named queue (or group it is a member
+        of) with one available, rotating the starting queue on every call so
+        that no queue is favoured.  Returns the name, the queue the message
+        was popped from and the message. '''
+        self.rotation += 1
+        for index in range(len(names)):
+            name  = names[(self.rotation + index) % len(names)]
+            queue = self.queues.get(name)
+            if queue:
+                return name, name, self.dequeue(name)
+
+            for group in self.membership.get(name, ()):
+                if self.queues[group] and self.groups[group].eligible(name):
+                    self.groups[group].taken(name)
+                    message = self.dequeue(group)
+                    if self.queues[group]:
+                        self.ready.notify_all()
+                    return name, group, message
+        return None, None, None
+
+    def poll(self, names, delta):
+        ''' Track group members with a pending /queues request. '''
+        for name in names:
+            for group in self.membership.get(name, ()):
+                self.groups[group].polling[name] += delta
+
+    def lease(self, queue, message, seconds, member=None):
+        ''' Keep message in flight for seconds (if set) and return its
+        delivery id, which also identifies this shard. '''
+        if not seconds:
+            return None
+
+        delivery = next(self.delivery_ids) * self.shards + self.shard
+        timeout  = self.ioloop.call_later(seconds, self.expire, delivery)
+        self.deliveries[delivery] = (queue, member or queue, message, timeout)
+        if queue in self.groups:
+            self.groups[queue].outstanding[member] += 1
+        return str(delivery)
+
+    def settle(self, delivery):
+        ''' Remove delivery from flight and return its queue and message. '''
+        queue, member, message, timeout = self.deliveries.pop(delivery)
+        if queue in self.groups:
+            self.groups[queue].outstanding[member] -= 1
+        return queue, message, timeout
+
+    @tornado.gen.coroutine
+    def ack(self, deliveries):
+        ''' Acknowledge deliveries on the shards that leased them and return
+        how many were still in flight. '''
+        shards = collections.defaultdict(list)
+        for delivery in deliveries:
+            try:
+                shards[int(delivery) % self.shards].append(int(delivery))
+            except ValueError:
+                continue
+        counts = yield [self.call_shard(shard, 'ack', ids) for shard, ids in shards.items()]
+        return sum(counts)
+
+    def expire(self, delivery):
+        ''' Redeliver message whose lease expired without acknowledgement. '''
+        queue, message, _ = self.settle(delivery)
+        self.do_requeue(queue, message)
+        self.ready.notify_all()
+
+    def deduplicate(self, producer):
+        ''' Record (producer, sequence) and return whether it is new.  Only
+        the most recently active producers are remembered. '''
+        producer, sequence = producer
+        window = self.producers.get(producer)
+        if window is None:
+            window = self.producers[producer] = DedupWindow()
+            if len(self.producers) > self.max_producers:
+                self.producers.popitem(last=False)
+        else:
+            self.producers.move_to_end(producer)
+        return window.add(sequence)
+
+    def release(self, message):
+        ''' Publish scheduled message that is now due. '''
+        self.ioloop.spawn_callback(self.do_publish, message.topic, message)
+
+    def reclaim(self):
+        ''' Evict the oldest messages held in memory by the largest drop-oldest
+        queues until this shard is 10% under its memory budget, so that the
+        queues need not be scanned on every append. '''
+        target = self.retention.budget * 0.9
+        queues = [
+            queue for queue in self.queues.values()
+            if queue.memory and self.retention.limits(queue.name).overflow == 'drop-oldest'
+        ]
+        for queue in sorted(queues, key=lambda queue: queue.memory, reverse=True):
+            while queue.memory and self.retention.memory > target:
+                queue.drop(resident=True)
+            if self.retention.memory <= target:
+                break
+
+    def sample(self):
+        ''' Fold the counts since the last sample into the rates.  Meters of
+        topics without subscribers or without publishes for a whole rate
+        window are dropped, as topic names are often ephemeral. '''
+        now          = self.ioloop.time()
+        elapsed      = now - self.sampled
+        self.sampled = now
+        for queue in self.queues.values():
+            queue.enqueued.sample(elapsed)
+            queue.dequeued.sample(elapsed)
+        for topic, meter in list(self.published.items()):
+            meter.sample(elapsed)
+            if not self.fanout.get(topic) or meter.idle * mq_stats.INTERVAL >= mq_stats.WINDOW:
+                del self.published[topic]
+                self.fanout.pop(topic, None)
+
+    def log_request(self, handler):
+        ''' Record latency of request by endpoint (handler) and method. '''
+        endpoint = type(handler).__name__.replace('Handler', '').lower()
+        self.requests['{} {}'.format(handler.request.method, endpoint)].add(handler.request.request_time())
+        tornado.web.Application.log_request(self, handler)
+
     def run(self):
         try:
-            print("Port: " + str(self.port) + " Address: " + str(self.address))
-            self.listen(self.port, self.address)
+            if self.shard == 0:
+                print("Port: " + str(self.port) + " Address: " + str(self.address))
+            self.listen(self.port, self.address, reuse_port=self.shards > 1)
         except socket.error as e:
             self.logger.fatal('Unable to listen on {}:{} = {}'.format(self.address, self.port, e))
             sys.exit(1)
 
-        self.ioloop.start()
+        # Subscribed queues owned by other shards are not in this snapshot
+        for queue in self.subscriptions:
+            self.call(queue, 'create', queue)
+
+        self.sampler.start()
+        if self.replicator:
+            self.replicator.start()
+        try:
+            self.ioloop.start()
+        finally:
+            if self.replicator:
+                self.replicator.stop()
+            self.sampler.stop()
+            self.scheduler.stop()
+            self.retention.close()
+            if self.storage:
+                self.storage.close()
+
+# Functions
+
+def fork_workers(workers):
+    ''' Fork worker processes connected by a socketpair per pair of workers.
+    Returns the shard of the calling process and its mailbox sockets. '''
+    pairs    = {(i, j): socket.socketpair() for i in range(workers) for j in range(i + 1, workers)}
+    shard    = 0
+    children = []
+    for index in range(1, workers):
+        pid = os.fork()
+        if pid == 0:
+            shard, children = index, []
+            break
+        children.append(pid)
+
+    mailboxes = {}
+    for (i, j), (left, right) in pairs.items():
+        if shard == i:
+            mailboxes[j] = left
+            right.close()
+        elif shard == j:
+            mailboxes[i] = right
+            left.close()
+        else:
+            left.close()
+            right.close()
+
+    def terminate(signum, frame):
+        for pid in children:
+            os.kill(pid, signal.SIGTERM)
+        sys.exit(0)
+
+    signal.signal(signal.SIGTERM, terminate)
+    return shard, mailboxes
 
 # Main execution
 
@@ -138,8 +1647,31 @@ if __name__ == '__main__':
     tornado.options.define('debug'  , default=False, help='Enable debugging mode')
     tornado.options.define('address', default=MessageQueue.DEFAULT_ADDRESS, help='Address to listen on.')
     tornado.options.define('port'   , default=MessageQueue.DEFAULT_PORT   , help='Port to listen on.')
+    tornado.options.define('workers', default=1, help='Number of worker processes (sharing the port).')
+    tornado.options.define('data_dir', default='', help='Directory for durable queue logs (in-memory if empty).')
+    tornado.options.define('sync'    , default='group', help='Log sync mode: none, group or always.')
+    tornado.options.define('commit_interval', default=mq_storage.Storage.COMMIT_INTERVAL, help='Group commit window in seconds.')
+    tornado.options.define('segment_size'   , default=mq_storage.Storage.SEGMENT_BYTES, help='Maximum log segment size in bytes.')
+    tornado.options.define('snapshot_interval', default=mq_storage.Storage.SNAPSHOT_INTERVAL, help='Seconds between storage snapshots.')
+    tornado.options.define('max_messages' , default=0, help='Default maximum messages per queue (unlimited if 0).')
+    tornado.options.define('max_bytes'    , default=0, help='Default maximum message bytes per queue (unlimited if 0).')
+    tornado.options.define('ttl'          , default=0.0, help='Default message TTL in seconds (unlimited if 0).')
+    tornado.options.define('overflow'     , default='drop-oldest', help='Default overflow policy: drop-oldest, reject-new or spill-to-disk.')
+    tornado.options.define('memory_budget', default=0, help='Bytes of messages held in memory before evicting (unlimited if 0).')
+    tornado.options.define('dedup_producers', default=MessageQueue.DEDUP_PRODUCERS, help='Producers whose recent sequence numbers are remembered.')
+    tornado.options.define('spill_dir'    , default='', help='Directory for spilled messages (system temporary directory if empty).')
+    tornado.options.define('replicate_from'  , default='', help='Address (host:port) of the primary to replicate (primary if empty).')
+    tornado.options.define('failover_timeout', default=mq_replication.FAILOVER_TIMEOUT, help='Seconds without contact before a replica promotes itself.')
     tornado.options.parse_command_line()
 
-    signal.signal(signal.SIGTERM, lambda s, e: sys.exit(0))
-    message_queue = MessageQueue(**tornado.options.options.as_dict())
+    settings = tornado.options.options.as_dict()
+    workers  = max(settings.pop('workers'), 1)
+    if settings['replicate_from'] and workers > 1:
+        logging.fatal('Replication needs a single worker')
+        sys.exit(1)
+    shard, mailboxes = fork_workers(workers) if workers > 1 else (0, {})
+    if workers == 1:
+        signal.signal(signal.SIGTERM, lambda s, e: sys.exit(0))
+
+    message_queue = MessageQueue(shard, workers, mailboxes, **settings)
     message_queue.run()
@@ -0,0 +1,201 @@
+#!/usr/bin/env python3
+
+''' MQ Stats: Broker metrics for the Message Queue Server
+
+Each shard keeps plain integer counters that are bumped on the hot path
+(messages enqueued and dequeued per queue, publishes per topic) and turns
+them into rates every INTERVAL seconds, so no clock is read per message.
+Rates are exponentially weighted moving averages over about WINDOW seconds.
+
+Request latencies are kept per endpoint in histograms with power of two
+buckets, so recording one costs a frexp and an increment.
+
+Everything else (depths, bytes, the age of the oldest message, replication
+lag) is read off the queues and journal when the stats are requested.
+Snapshots of the shards are plain dicts that are merged by the shard serving
+GET /stats and returned as JSON or in the Prometheus text format.
+'''
+
+import math
+
+# Constants
+
+INTERVAL    = 5.0                   # Seconds between rate samples
+WINDOW      = 60.0                  # Seconds averaged over by rates
+ALPHA       = 1 - math.exp(-INTERVAL / WINDOW)
+
+LOWEST      = -20                   # First bucket holds latencies under 2 ** LOWEST seconds
+BUCKETS     = 28                    # Last bucket holds latencies of 2 ** (LOWEST + BUCKETS - 2) and over
+
+PERCENTILES = (50, 90, 99)
+
+# Meter
+
+class Meter(object):
+    ''' Count of events and its rate per second. '''
+    __slots__ = ('count', 'rate', 'sampled', 'started', 'idle')
+
+    def __init__(self):
+        self.count   = 0
+        self.rate    = 0.0
+        self.sampled = 0
+        self.started = False
+        self.idle    = 0        # Samples in a row without events
+
+    def mark(self, count=1):
+        self.count += count
+
+    def sample(self, elapsed):
+        ''' Fold the events since the last sample (elapsed seconds ago) into
+        the rate. '''
+        instant      = (self.count - self.sampled) / elapsed if elapsed > 0 else 0.0
+        self.idle    = self.idle + 1 if self.count == self.sampled else 0
+        self.sampled = self.count
+        if self.started:
+            self.rate += ALPHA * (instant - self.rate)
+        else:
+            self.rate, self.started = instant, True
+
+# Histogram
+
+class Histogram(object):
+    ''' Latencies in seconds, bucketed by powers of two. '''
+    __slots__ = ('buckets', 'count', 'sum')
+
+    def __init__(self):
+        self.buckets = [0] * BUCKETS
+        self.count   = 0
+        self.sum     = 0.0
+
+    def add(self, seconds):
+        if seconds > 0:
+            self.buckets[min(max(math.frexp(seconds)[1] - LOWEST, 0), BUCKETS - 1)] += 1
+        else:
+            self.buckets[0] += 1
+        self.count += 1
+        self.sum   += seconds
+
+    def snapshot(self):
+        return {'count': self.count, 'sum': self.sum, 'buckets': list(self.buckets)}
+
+# Functions
+
+def bound(bucket):
+    ''' Return upper bound of bucket in seconds. '''
+    return 2.0 ** (LOWEST + bucket) if bucket < BUCKETS - 1 else float('inf')
+
+def percentile(histogram, percent):
+    ''' Return upper bound of the bucket holding percentile of histogram
+    snapshot (None if it is empty or the percentile is in the last bucket). '''
+    rank = histogram['count'] * percent / 100.0
+    seen = 0
+    for bucket, count in enumerate(histogram['buckets'][:-1]):
+        seen += count
+        if seen and seen >= rank:
+            return bound(bucket)
+    return None
+
+def merge(snapshots):
+    ''' Merge snapshots of the shards.  Queues and topics are each owned by
+    a single shard, while the counters and request histograms are summed. '''
+    merged = {'queues': {}, 'topics': {}, 'broker': {}, 'retention': {}, 'requests': {}, 'replication': {}}
+    for snapshot in snapshots:
+        for name, value in snapshot.get('replication', {}).items():
+            if name == 'role':
+                merged['replication'][name] = value
+            elif name in ('lag', 'pending'):
+                merged['replication'][name] = max(merged['replication'].get(name, value), value)
+            else:
+                merged['replication'][name] = merged['replication'].get(name, 0) + value
+        merged['queues'].update(snapshot['queues'])
+        merged['topics'].update(snapshot['topics'])
+        for totals in ('broker', 'retention'):
+            for name, value in snapshot[totals].items():
+                merged[totals][name] = merged[totals].get(name, 0) + value
+        for endpoint, histogram in snapshot['requests'].items():
+            total = merged['requests'].setdefault(endpoint, {'count': 0, 'sum': 0.0, 'buckets': [0] * BUCKETS})
+            total['count']  += histogram['count']
+            total['sum']    += histogram['sum']
+            total['buckets'] = [a + b for a, b in zip(total['buckets'], histogram['buckets'])]
+
+    for histogram in merged['requests'].values():
+        for percent in PERCENTILES:
+            histogram['p{}'.format(percent)] = percentile(histogram, percent)
+    return merged
+
+def escape(value):
+    return str(value).replace('\\', '\\\\').replace('"', '\\"').replace('\n', '\\n')
+
+def labels(**values):
+    return '{' + ','.join('{}="{}"'.format(name, escape(value)) for name, value in sorted(values.items())) + '}'
+
+def prometheus(stats):
+    ''' Return merged stats in the Prometheus text exposition format. '''
+    lines = []
+
+    def family(name, kind, help, samples):
+        lines.append('# HELP {} {}'.format(name, help))
+        lines.append('# TYPE {} {}'.format(name, kind))
+        for suffix, label, value in samples:
+            lines.append('{}{}{} {}'.format(name, suffix, label, repr(float(value)) if isinstance(value, float) else value))
+
+    queues = sorted(stats['queues'].items())
+    for field, name, kind, help in (
+        ('depth'       , 'mq_queue_depth'              , 'gauge'  , 'Messages waiting in queue.'),
+        ('bytes'       , 'mq_queue_bytes'              , 'gauge'  , 'Body bytes of messages waiting in queue.'),
+        ('enqueued'    , 'mq_queue_enqueued_total'     , 'counter', 'Messages appended to queue.'),
+        ('dequeued'    , 'mq_queue_dequeued_total'     , 'counter', 'Messages delivered from queue (including redeliveries).'),
+        ('enqueue_rate', 'mq_queue_enqueue_rate'       , 'gauge'  , 'Messages appended to queue per second.'),
+        ('dequeue_rate', 'mq_queue_dequeue_rate'       , 'gauge'  , 'Messages delivered from queue per second.'),
+        ('oldest_age'  , 'mq_queue_oldest_age_seconds' , 'gauge'  , 'Age of the oldest message waiting in queue.'),
+        ('waiting'     , 'mq_queue_waiting_consumers'  , 'gauge'  , 'Requests waiting for a message from queue.'),
+    ):
+        family(name, kind, help, [('', labels(queue=queue), values[field]) for queue, values in queues])
+
+    topics = sorted(stats['topics'].items())
+    for field, name, kind, help in (
+        ('subscribers' , 'mq_topic_subscribers'        , 'gauge'  , 'Queues the last publish to topic was appended to.'),
+        ('published'   , 'mq_topic_published_total'    , 'counter', 'Messages published to topic.'),
+        ('publish_rate', 'mq_topic_publish_rate'       , 'gauge'  , 'Messages published to topic per second.'),
+    ):
+        family(name, kind, help, [('', labels(topic=topic), values[field]) for topic, values in topics])
+
+    for field, name, help in (
+        ('memory'   , 'mq_memory_bytes'   , 'Body bytes of messages held in memory.'),
+        ('in_flight', 'mq_in_flight'      , 'Leased messages awaiting acknowledgement.'),
+        ('scheduled', 'mq_scheduled'      , 'Delayed messages not yet due.'),
+    ):
+        family(name, 'gauge', help, [('', '', stats['broker'][field])])
+
+    family('mq_retention_total', 'counter', 'Messages affected by queue limits and the memory budget.', [
+        ('', labels(event=event), value) for event, value in sorted(stats['retention'].items())
+    ])
+
+    replication = stats.get('replication', {})
+    if replication:
+        family('mq_replication_replica', 'gauge', 'Whether the broker is a replica following a primary.', [
+            ('', '', int(replication['role'] == 'replica'))
+        ])
+    for field, name, kind, help in (
+        ('sequence', 'mq_replication_sequence'   , 'counter', 'Journal operations recorded (or applied, by a replica).'),
+        ('replicas', 'mq_replication_replicas'   , 'gauge'  , 'Replicas streaming the journal of the primary.'),
+        ('pending' , 'mq_replication_pending'    , 'gauge'  , 'Journal operations not yet sent to the replica furthest behind.'),
+        ('lag'     , 'mq_replication_lag_seconds', 'gauge'  , 'Seconds between the primary sending the last frame and the replica applying it.'),
+    ):
+        if field in replication:
+            family(name, kind, help, [('', '', replication[field])])
+
+    samples = []
+    for (endpoint, method), histogram in sorted((tuple(key.split(' ', 1)[::-1]), value) for key, value in stats['requests'].items()):
+        cumulative = 0
+        for bucket, count in enumerate(histogram['buckets']):
+            cumulative += count
+            le = bound(bucket)
+            samples.append(('_bucket', labels(endpoint=endpoint, method=method, le='+Inf' if math.isinf(le) else repr(le)), cumulative))
+        samples.append(('_sum'  , labels(endpoint=endpoint, method=method), histogram['sum']))
+        samples.append(('_count', labels(endpoint=endpoint, method=method), histogram['count']))
+    family('mq_request_duration_seconds', 'histogram', 'Latency of requests by endpoint.', samples)
+
+    return '\n'.join(lines) + '\n'
+
+# vim: set sts=4 sw=4 ts=8 expandtab ft=python:
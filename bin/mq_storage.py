@@ -0,0 +1,424 @@
+#!/usr/bin/env python3
+
+''' MQ Storage: Durable queue lanes for the Message Queue Server
+
+Each (queue, topic) lane is stored as a directory of append-only segment
+files:
+
+    $data_dir/$queue/$topic/00000000000000000000.log    Segment starting at
+                                                        message sequence 0.
+    $data_dir/$queue/$topic/00000000000000000000.idx    Sparse index of the
+                                                        segment.
+    $data_dir/snapshot.json                             Subscriptions and lane
+                                                        cursors.
+
+Queue and topic names are percent-encoded so they are safe to use as file
+names.  Every record in a segment is framed as:
+
+    length (u32) | crc32 (u32) | header length (u32) | header JSON | body
+
+Appends go straight to the segment file (and so the page cache) and are made
+durable according to the sync mode:
+
+    none        Never fdatasync (cursors are still flushed periodically).
+    always      fdatasync after every append (one sync per message).
+    group       Batch every append made within the commit interval into a
+                single fdatasync (group commit).
+
+Records are read back through a read-only mmap of the segment, so a large
+backlog lives in the page cache rather than on the Python heap.  The map is
+only extended once MAP_CHUNK bytes were appended past it (records in that
+tail are read with pread), so alternating appends and reads do not remap
+every time.  Segments that have been completely consumed are removed.
+
+Every INDEX_INTERVAL bytes of log, the sequence number and position of the
+record are appended to the segment's index, so a record can be located by
+sequence number without scanning the segment from its start.
+
+Once a second, all lanes are synced and a compact snapshot of the
+subscription table and each lane's read sequence, tail sequence and synced
+tail position is written.  On restart, a lane only verifies the records
+appended after its snapshot tail and looks up its read cursor in the index.
+'''
+
+import bisect
+import json
+import mmap
+import os
+import struct
+import urllib.parse
+import zlib
+
+import tornado.concurrent
+import tornado.ioloop
+
+# Constants
+
+RECORD          = struct.Struct('<II')  # Length and CRC32 of record payload
+HEADER          = struct.Struct('<I')   # Length of header JSON within payload
+INDEX           = struct.Struct('<QQ')  # Sequence and position of record
+INDEX_INTERVAL  = 16 * 1024             # Log bytes between index entries
+MAP_CHUNK       = 1024 * 1024           # Log bytes appended before the map is extended
+SUFFIX          = '.log'
+INDEX_SUFFIX    = '.idx'
+SNAPSHOT        = 'snapshot.json'
+
+# Functions
+
+def encode_name(name):
+    ''' Encode queue or topic name as a file name. '''
+    return urllib.parse.quote(name, safe='') or '%'
+
+def decode_name(name):
+    ''' Decode queue or topic name from a file name. '''
+    return '' if name == '%' else urllib.parse.unquote(name)
+
+def encode_message(message):
+    ''' Serialize message into record payload. '''
+    header = json.dumps([message.topic, message.headers]).encode()
+    return HEADER.pack(len(header)) + header + message.body
+
+def decode_message(payload, factory):
+    ''' Deserialize record payload into message created by factory. '''
+    length,        = HEADER.unpack_from(payload)
+    topic, headers = json.loads(payload[HEADER.size:HEADER.size + length].decode())
+    return factory(topic, payload[HEADER.size + length:], headers)
+
+# Segment
+
+class Segment(object):
+    ''' Append-only log file holding the records starting at sequence base,
+    along with its sparse index. '''
+
+    def __init__(self, directory, base):
+        self.base = base
+        self.path = os.path.join(directory, '{:020d}{}'.format(base, SUFFIX))
+        self.fd   = os.open(self.path, os.O_RDWR | os.O_CREAT | os.O_APPEND, 0o644)
+        self.size = os.fstat(self.fd).st_size
+        self.map  = None
+
+        self.index_path = os.path.join(directory, '{:020d}{}'.format(base, INDEX_SUFFIX))
+        self.index_fd   = os.open(self.index_path, os.O_RDWR | os.O_CREAT | os.O_APPEND, 0o644)
+        self.index      = []
+        with open(self.index_path, 'rb') as stream:
+            data = stream.read()
+        for offset in range(0, len(data) - INDEX.size + 1, INDEX.size):
+            sequence, position = INDEX.unpack_from(data, offset)
+            if self.index and (sequence, position) <= self.index[-1]:
+                break
+            self.index.append((sequence, position))
+        self.truncate_index()
+
+    def append(self, payload, sequence):
+        ''' Append record with sequence number and return its position. '''
+        position = self.size
+        os.write(self.fd, RECORD.pack(len(payload), zlib.crc32(payload)) + payload)
+        self.size += RECORD.size + len(payload)
+
+        if position - (self.index[-1][1] if self.index else 0) >= INDEX_INTERVAL:
+            os.write(self.index_fd, INDEX.pack(sequence, position))
+            self.index.append((sequence, position))
+        return position
+
+    def read(self, position):
+        ''' Read record at position and return its payload and the position
+        of the following record. '''
+        if self.map is None or self.size - len(self.map) >= MAP_CHUNK:
+            self.remap()
+
+        start = position + RECORD.size
+        if start <= len(self.map):
+            length, _ = RECORD.unpack_from(self.map, position)
+            if start + length <= len(self.map):
+                return self.map[start:start + length], start + length
+        else:
+            length, _ = RECORD.unpack(os.pread(self.fd, RECORD.size, position))
+        return os.pread(self.fd, length, start), start + length
+
+    def seek(self, sequence):
+        ''' Return position of record with sequence number, scanning forward
+        from the closest indexed record before it. '''
+        entry            = bisect.bisect_right(self.index, (sequence, float('inf'))) - 1
+        current, position = self.index[entry] if entry >= 0 else (self.base, 0)
+        if current < sequence and (self.map is None or len(self.map) < self.size):
+            self.remap()
+
+        while current < sequence and position < self.size:
+            length, _ = RECORD.unpack_from(self.map, position)
+            position += RECORD.size + length
+            current  += 1
+        return position
+
+    def recover(self, position=0):
+        ''' Verify records from position (known to be a synced record
+        boundary), truncating any torn or corrupt tail, and return the number
+        of valid records found. '''
+        if self.size:
+            self.remap()
+
+        count = 0
+        while position + RECORD.size <= self.size:
+            length, crc = RECORD.unpack_from(self.map, position)
+            start       = position + RECORD.size
+            if start + length > self.size or zlib.crc32(self.map[start:start + length]) != crc:
+                break
+            position = start + length
+            count   += 1
+
+        if position < self.size:
+            self.unmap()
+            os.ftruncate(self.fd, position)
+            self.size = position
+            self.truncate_index()
+        return count
+
+    def truncate_index(self):
+        ''' Drop index entries beyond the end of the log. '''
+        while self.index and self.index[-1][1] >= self.size:
+            self.index.pop()
+        if os.fstat(self.index_fd).st_size != len(self.index) * INDEX.size:
+            os.ftruncate(self.index_fd, len(self.index) * INDEX.size)
+
+    def remap(self):
+        self.unmap()
+        self.map = mmap.mmap(self.fd, self.size, access=mmap.ACCESS_READ)
+
+    def unmap(self):
+        if self.map is not None:
+            self.map.close()
+            self.map = None
+
+    def sync(self):
+        os.fdatasync(self.fd)
+        os.fdatasync(self.index_fd)
+
+    def close(self):
+        self.unmap()
+        os.close(self.fd)
+        os.close(self.index_fd)
+
+    def remove(self):
+        self.close()
+        os.unlink(self.path)
+        os.unlink(self.index_path)
+
+# Log Lane
+
+class LogLane(object):
+    ''' Durable FIFO lane backed by segmented log files.
+
+    Provides the same append, popleft and len interface as the in-memory
+    deque lanes used by Queue.
+    '''
+
+    def __init__(self, storage, queue, topic, factory, state=None):
+        self.storage   = storage
+        self.queue     = queue
+        self.topic     = topic
+        self.directory = os.path.join(storage.directory, encode_name(queue), encode_name(topic))
+        self.factory   = factory
+        self.dirty     = False
+
+        os.makedirs(self.directory, exist_ok=True)
+        bases = sorted(int(name[:-len(SUFFIX)]) for name in os.listdir(self.directory) if name.endswith(SUFFIX))
+        self.segments = [Segment(self.directory, base) for base in bases] or [Segment(self.directory, 0)]
+
+        # Only verify the records appended after the snapshot
+        last = self.segments[-1]
+        if state and state['base'] == last.base and state['size'] <= last.size:
+            self.tail = state['tail'] + last.recover(state['size'])
+        else:
+            self.tail = last.base + last.recover()
+
+        # Resume at snapshot read cursor, dropping consumed segments
+        self.head = min(max(state['head'] if state else 0, self.segments[0].base), self.tail)
+        while len(self.segments) > 1 and self.segments[1].base <= self.head:
+            self.segments.pop(0).remove()
+        self.position = self.segments[0].seek(self.head)
+
+    def __len__(self):
+        return self.tail - self.head
+
+    def __bool__(self):
+        return self.tail > self.head
+
+    def __iter__(self):
+        ''' Yield messages from the cursor on, without consuming them. '''
+        position = self.position
+        for segment in self.segments:
+            while position < segment.size:
+                payload, position = segment.read(position)
+                yield decode_message(payload, self.factory)
+            position = 0
+
+    def state(self):
+        ''' Return snapshot state: read and tail sequence numbers, and the
+        base and size of the active segment. '''
+        return {
+            'head': self.head,
+            'tail': self.tail,
+            'base': self.segments[-1].base,
+            'size': self.segments[-1].size,
+        }
+
+    def append(self, message):
+        ''' Append message to the active segment, rolling over to a new one
+        when it is full. '''
+        active = self.segments[-1]
+        if active.size >= self.storage.segment_bytes:
+            active.sync()
+            active.unmap()
+            active = Segment(self.directory, self.tail)
+            self.segments.append(active)
+
+        active.append(encode_message(message), self.tail)
+        self.tail += 1
+        self.storage.touch(self)
+
+    def popleft(self):
+        ''' Read message at the cursor and advance it, removing segments that
+        have been completely consumed. '''
+        if not self:
+            raise IndexError('pop from an empty lane')
+
+        while self.position >= self.segments[0].size and len(self.segments) > 1:
+            self.segments.pop(0).remove()
+            self.position = 0
+
+        payload, self.position = self.segments[0].read(self.position)
+        self.head += 1
+        return decode_message(payload, self.factory)
+
+    def sync(self):
+        ''' Flush appends to the active segment. '''
+        self.segments[-1].sync()
+        self.dirty = False
+
+    def close(self):
+        for segment in self.segments:
+            segment.close()
+
+# Storage
+
+class Storage(object):
+    ''' Directory of durable queue lanes with group commit and snapshots.
+
+    The subscriptions attribute holds the subscription table restored from
+    the last snapshot (queue to topics) and may be replaced by the caller's
+    own table, which is then included in every snapshot.
+    '''
+
+    SYNC_MODES        = ('none', 'group', 'always')
+    COMMIT_INTERVAL   = 0.002           # Group commit window (seconds)
+    SNAPSHOT_INTERVAL = 1.0             # Periodic sync and snapshot (seconds)
+    SEGMENT_BYTES     = 64 * 1024 * 1024
+
+    def __init__(self, directory, sync='group', commit_interval=COMMIT_INTERVAL, segment_bytes=SEGMENT_BYTES, snapshot_interval=SNAPSHOT_INTERVAL):
+        if sync not in self.SYNC_MODES:
+            raise ValueError('Unknown sync mode: {}'.format(sync))
+
+        self.directory       = directory
+        self.sync            = sync
+        self.commit_interval = commit_interval
+        self.segment_bytes   = segment_bytes
+        self.dirty           = []
+        self.pending         = None
+        self.lanes           = []
+        self.syncs           = 0
+        self.snapshots       = 0
+
+        os.makedirs(directory, exist_ok=True)
+        try:
+            with open(os.path.join(directory, SNAPSHOT)) as stream:
+                self.restored = json.load(stream)
+        except (OSError, ValueError):
+            self.restored = {}
+        self.written       = None
+        self.subscriptions = {queue: set(topics) for queue, topics in self.restored.get('subscriptions', {}).items()}
+
+        self.snapshotter = tornado.ioloop.PeriodicCallback(self.snapshot, snapshot_interval * 1000)
+        self.snapshotter.start()
+
+    def lane(self, queue, topic, factory):
+        ''' Open (or create) lane for topic in queue. '''
+        state = self.restored.get('lanes', {}).get(queue, {}).get(topic)
+        lane  = LogLane(self, queue, topic, factory, state)
+        self.lanes.append(lane)
+        return lane
+
+    def load(self, factory):
+        ''' Yield (queue, topic, lane) for every lane stored on disk. '''
+        for queue in sorted(os.listdir(self.directory)):
+            path = os.path.join(self.directory, queue)
+            if not os.path.isdir(path):
+                continue
+            for topic in sorted(os.listdir(path)):
+                yield decode_name(queue), decode_name(topic), self.lane(decode_name(queue), decode_name(topic), factory)
+
+    def touch(self, lane):
+        ''' Mark lane as having unsynced appends. '''
+        if not lane.dirty:
+            lane.dirty = True
+            self.dirty.append(lane)
+
+    def commit(self):
+        ''' Return Future resolved once every append made so far is durable
+        according to the sync mode. '''
+        if self.sync == 'always':
+            self.flush()
+
+        if self.sync != 'group':
+            future = tornado.concurrent.Future()
+            future.set_result(None)
+            return future
+
+        if self.pending is None:
+            self.pending = tornado.concurrent.Future()
+            tornado.ioloop.IOLoop.current().call_later(self.commit_interval, self.flush)
+        return self.pending
+
+    def flush(self):
+        ''' Sync all dirty lanes and resolve the pending group commit. '''
+        dirty, self.dirty = self.dirty, []
+        for lane in dirty:
+            if self.sync != 'none':
+                lane.sync()
+                self.syncs += 1
+            lane.dirty = False
+
+        pending, self.pending = self.pending, None
+        if pending is not None:
+            pending.set_result(None)
+
+    def snapshot(self):
+        ''' Sync all lanes and write a snapshot of the subscriptions and lane
+        states if anything changed since the last one. '''
+        self.flush()
+
+        lanes = {}
+        for lane in self.lanes:
+            lanes.setdefault(lane.queue, {})[lane.topic] = lane.state()
+        data = json.dumps({
+            'subscriptions': {queue: sorted(topics) for queue, topics in self.subscriptions.items() if topics},
+            'lanes'        : lanes,
+        }, sort_keys=True)
+        if data == self.written:
+            return
+
+        path = os.path.join(self.directory, SNAPSHOT)
+        with open(path + '.tmp', 'w') as stream:
+            stream.write(data)
+            stream.flush()
+            if self.sync != 'none':
+                os.fdatasync(stream.fileno())
+        os.replace(path + '.tmp', path)
+        self.written    = data
+        self.snapshots += 1
+
+    def close(self):
+        self.snapshotter.stop()
+        self.snapshot()
+        for lane in self.lanes:
+            lane.close()
+
+# vim: set sts=4 sw=4 ts=8 expandtab ft=python:
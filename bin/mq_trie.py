@@ -0,0 +1,116 @@
+#!/usr/bin/env python3
+
+''' MQ Trie: Hierarchical topic subscriptions for the Message Queue Server
+
+Topics are dot separated levels (ie. orders.eu.created).  Subscription
+patterns may use two wildcards in place of a level:
+
+    *           Matches exactly one level (metrics.* matches metrics.cpu).
+    #           Matches zero or more levels (orders.# matches orders and
+                orders.eu.created).
+
+Patterns are stored in a trie with one node per level, so matching a topic
+only visits the nodes along its levels (plus the wildcard branches next to
+them): the cost grows with the depth of the topic, not with the number of
+subscriptions.
+'''
+
+# Constants
+
+SEPARATOR   = '.'
+SINGLE      = '*'
+MULTIPLE    = '#'
+
+# Functions
+
+def is_pattern(topic):
+    ''' Return whether topic contains a wildcard level. '''
+    return any(level in (SINGLE, MULTIPLE) for level in topic.split(SEPARATOR))
+
+# Node
+
+class Node(object):
+    __slots__ = ('children', 'queues')
+
+    def __init__(self):
+        self.children = {}
+        self.queues   = set()
+
+# Topic Trie
+
+class TopicTrie(object):
+    ''' Subscription patterns mapped to the queues subscribed to them. '''
+
+    def __init__(self):
+        self.root = Node()
+        self.size = 0
+
+    def __len__(self):
+        return self.size
+
+    def add(self, pattern, queue):
+        ''' Subscribe queue to pattern and return whether it was not already. '''
+        node = self.root
+        for level in pattern.split(SEPARATOR):
+            node = node.children.setdefault(level, Node())
+
+        if queue in node.queues:
+            return False
+        node.queues.add(queue)
+        self.size += 1
+        return True
+
+    def remove(self, pattern, queue):
+        ''' Unsubscribe queue from pattern (pruning empty nodes) and return
+        whether it was subscribed. '''
+        path = [self.root]
+        for level in pattern.split(SEPARATOR):
+            node = path[-1].children.get(level)
+            if node is None:
+                return False
+            path.append(node)
+
+        if queue not in path[-1].queues:
+            return False
+        path[-1].queues.remove(queue)
+        self.size -= 1
+
+        levels = pattern.split(SEPARATOR)
+        for index in range(len(levels), 0, -1):
+            node = path[index]
+            if node.queues or node.children:
+                break
+            del path[index - 1].children[levels[index - 1]]
+        return True
+
+    def match(self, topic):
+        ''' Return set of queues subscribed to patterns matching topic. '''
+        levels  = topic.split(SEPARATOR)
+        queues  = set()
+        pending = [(self.root, 0)]
+        visited = set()
+
+        while pending:
+            node, index = pending.pop()
+            if (id(node), index) in visited:
+                continue
+            visited.add((id(node), index))
+
+            # Multi-level wildcard consumes any number of the remaining levels
+            multiple = node.children.get(MULTIPLE)
+            if multiple is not None:
+                for rest in range(index, len(levels) + 1):
+                    pending.append((multiple, rest))
+
+            if index == len(levels):
+                queues.update(node.queues)
+                continue
+
+            for level in (levels[index], SINGLE):
+                child = node.children.get(level)
+                if child is not None:
+                    pending.append((child, index + 1))
+
+        return queues
+
+# vim: set sts=4 sw=4 ts=8 expandtab ft=python:
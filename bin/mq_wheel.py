@@ -0,0 +1,123 @@
+#!/usr/bin/env python3
+
+''' MQ Wheel: Hierarchical timing wheel for the Message Queue Server
+
+Time is divided into ticks and timers are kept in LEVELS wheels of SLOTS
+slots each: level 0 holds timers due within the current SLOTS ticks, level 1
+those due within the current SLOTS ** 2 ticks, and so on.  A timer is placed
+in the lowest level whose window also contains the current tick, so
+scheduling is O(1) no matter how many timers are pending.  Whenever the
+current tick enters a new window of a level, the timers in the slot for that
+window are moved down to the lower levels (cascaded), and timers in the
+level 0 slot of each tick are due.  Windows of levels without any timers are
+skipped over whole.
+
+Timers cannot be cancelled: the caller is expected to ignore (or check for)
+timers whose item no longer needs to expire.
+'''
+
+import math
+
+import tornado.ioloop
+
+# Constants
+
+BITS        = 6                     # Slots per level is 2 ** BITS
+SLOTS       = 1 << BITS
+MASK        = SLOTS - 1
+LEVELS      = 4
+
+# Timing Wheel
+
+class TimingWheel(object):
+    ''' Timers calling callback(item) once their deadline (in IOLoop time)
+    has passed, with a resolution of tick seconds. '''
+    TICK = 0.01
+
+    def __init__(self, callback, tick=TICK, clock=None):
+        self.callback = callback
+        self.tick     = tick
+        self.clock    = clock or (lambda: tornado.ioloop.IOLoop.current().time())
+        self.wheels   = [[[] for _ in range(SLOTS)] for _ in range(LEVELS)]
+        self.counts   = [0] * LEVELS
+        self.overflow = []
+        self.current  = 0
+        self.size     = 0
+        self.ticker   = tornado.ioloop.PeriodicCallback(self.advance, tick * 1000)
+
+    def __len__(self):
+        return self.size
+
+    def schedule(self, deadline, item):
+        ''' Call callback with item once deadline has passed. '''
+        if not self.size:
+            # Nothing pending, so skip the ticks since the wheel last turned
+            self.current = self.ticks(self.clock())
+            self.ticker.start()
+
+        self.size += 1
+        self.insert(max(int(math.ceil(deadline / self.tick)), self.current + 1), item)
+
+    def ticks(self, now):
+        return int(now / self.tick)
+
+    def insert(self, expiry, item):
+        ''' Place timer in the lowest level sharing its window with the
+        current tick (or the overflow list past the last level). '''
+        for level in range(LEVELS):
+            if (expiry ^ self.current) >> (BITS * (level + 1)) == 0:
+                self.wheels[level][(expiry >> (BITS * level)) & MASK].append((expiry, item))
+                self.counts[level] += 1
+                return
+        self.overflow.append((expiry, item))
+
+    def take(self, level, slot):
+        timers, self.wheels[level][slot] = self.wheels[level][slot], []
+        self.counts[level] -= len(timers)
+        return timers
+
+    def cascade(self, timers, due):
+        for expiry, item in timers:
+            if expiry <= self.current:
+                due.append(item)
+            else:
+                self.insert(expiry, item)
+
+    def advance(self):
+        ''' Turn the wheel up to the current time, calling back every timer
+        that is due. '''
+        target = self.ticks(self.clock())
+        while self.current < target and self.size:
+            # Skip the rest of the windows of the lowest levels if they are
+            # empty, so an idle stretch costs no more than a tick per slot
+            empty = 0
+            while empty < LEVELS and not self.counts[empty]:
+                empty += 1
+            if empty:
+                self.current = min(self.current | ((1 << (BITS * empty)) - 1), target - 1)
+
+            self.current += 1
+            due = []
+
+            # Cascade the levels whose window just started, highest first
+            level = 1
+            while level < LEVELS and self.current & ((1 << (BITS * level)) - 1) == 0:
+                level += 1
+            if level == LEVELS:
+                timers, self.overflow = self.overflow, []
+                self.cascade(timers, due)
+            for lower in range(level - 1, 0, -1):
+                self.cascade(self.take(lower, (self.current >> (BITS * lower)) & MASK), due)
+            due.extend(item for _, item in self.take(0, self.current & MASK))
+
+            self.size -= len(due)
+            for item in due:
+                self.callback(item)
+
+        if not self.size:
+            self.ticker.stop()
+
+    def stop(self):
+        self.ticker.stop()
+
+# vim: set sts=4 sw=4 ts=8 expandtab ft=python:
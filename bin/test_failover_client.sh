@@ -0,0 +1,58 @@
+#!/bin/bash
+
+FUNCTIONAL=test_failover_client
+WORKSPACE=/tmp/$FUNCTIONAL.$(id -u)
+FAILURES=0
+
+error() {
+    echo "$@"
+    [ -r $WORKSPACE/test ] && (echo; cat $WORKSPACE/test; echo)
+    FAILURES=$((FAILURES + 1))
+}
+
+find_port() {
+    for port in $(seq ${1:-9000} 9999); do
+    	if ! ss -H4tlpn | awk '{print $4}' | cut -d : -f 2 | grep -q $port; then
+    	    echo $port
+    	    break
+	fi
+    done
+}
+
+cleanup() {
+    STATUS=${1:-$FAILURES}
+    kill $SERVERPIDS 2> /dev/null
+    rm -fr $WORKSPACE
+    exit $STATUS
+}
+
+mkdir $WORKSPACE
+
+trap "cleanup" EXIT
+trap "cleanup 1" INT TERM
+
+echo
+printf "%-40s  ... " "Testing $FUNCTIONAL"
+
+if [ ! -x bin/$FUNCTIONAL ]; then
+    echo "Failure: bin/$FUNCTIONAL is not executable!"
+    exit 1
+fi
+
+PRIMARY=$(find_port)
+./bin/mq_server.py --port=$PRIMARY > /dev/null 2>&1 &
+PRIMARYPID=$!
+disown $PRIMARYPID
+SERVERPIDS="$SERVERPIDS $PRIMARYPID"
+
+REPLICA=$(find_port $((PRIMARY + 1)))
+./bin/mq_server.py --port=$REPLICA --replicate-from=localhost:$PRIMARY --failover-timeout=1 > /dev/null 2>&1 &
+SERVERPIDS="$SERVERPIDS $!"
+sleep 1
+
+valgrind --leak-check=full bin/$FUNCTIONAL "localhost:$PRIMARY,localhost:$REPLICA" $PRIMARY $PRIMARYPID &> $WORKSPACE/test
+if [ $? -ne 0 ] || [ $(awk '/ERROR SUMMARY:/ {print $4}' $WORKSPACE/test) -ne 0 ]; then
+    error "Failure"
+else
+    echo "Success"
+fi
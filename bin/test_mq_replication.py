@@ -0,0 +1,159 @@
+#!/usr/bin/env python3
+
+import os
+import subprocess
+import sys
+import time
+import unittest
+
+import requests
+import tornado.ioloop
+
+import mq_replication
+
+# Application
+
+class Application(object):
+    def __init__(self):
+        self.performed = []
+
+    def perform(self, operation, args):
+        self.performed.append((operation, args))
+
+# Journal Test Case
+
+class JournalTestCase(unittest.TestCase):
+    def setUp(self):
+        self.ioloop = tornado.ioloop.IOLoop()
+        self.ioloop.make_current()
+
+    def tearDown(self):
+        self.ioloop.close()
+
+    def test_00_record(self):
+        journal = mq_replication.Journal()
+        journal.record('create', '_queue')
+        self.assertEqual(journal.sequence, 1)
+        self.assertEqual(journal.pending(), 0)
+
+        follower = journal.follow('replica', [('reset', ())])
+        journal.record('subscribe', '_queue', '_topic')
+        self.assertEqual(journal.sequence, 2)
+        self.assertEqual(journal.pending(), 2)
+
+        operations = self.ioloop.run_sync(follower.batch)
+        self.assertEqual(operations, [('reset', ()), ('subscribe', ('_queue', '_topic'))])
+        self.assertEqual(journal.pending(), 0)
+
+        journal.unfollow(follower)
+        journal.record('create', '_other')
+        self.assertEqual(follower.pending, [])
+
+    def test_01_batch(self):
+        journal  = mq_replication.Journal()
+        follower = journal.follow('replica', [])
+
+        # Operations recorded while the batch waits are sent along with it
+        self.ioloop.call_later(mq_replication.BATCH_DELAY / 2, journal.record, 'create', '_late')
+        journal.record('create', '_queue')
+        operations = self.ioloop.run_sync(follower.batch)
+        self.assertEqual(operations, [('create', ('_queue',)), ('create', ('_late',))])
+
+        # An idle primary sends an empty batch as heartbeat
+        started    = self.ioloop.time()
+        operations = self.ioloop.run_sync(follower.batch)
+        self.assertEqual(operations, [])
+        self.assertGreaterEqual(self.ioloop.time() - started, mq_replication.HEARTBEAT / 2)
+
+    def test_02_drop(self):
+        journal  = mq_replication.Journal()
+        follower = journal.follow('replica', [('create', ('_queue',))] * mq_replication.MAX_PENDING)
+        journal.record('create', '_queue')
+        self.assertIsNone(self.ioloop.run_sync(follower.batch))
+
+    def test_03_receive(self):
+        application = Application()
+        replicator  = mq_replication.Replicator(application, 'localhost:0')
+        replicator.contact = 0
+        frames = mq_replication.encode(3, [('create', ('_queue',)), ('subscribe', ('_queue', '_topic'))])
+        frames += mq_replication.encode(4, [('append', ('_queue', b'\0binary\0'))])
+
+        # Frames are applied once complete, whatever the chunking
+        replicator.receive(frames[:3])
+        replicator.receive(frames[3:-1])
+        self.assertEqual(len(application.performed), 2)
+        self.assertEqual(replicator.sequence, 3)
+        replicator.receive(frames[-1:])
+        self.assertEqual(application.performed[-1], ('append', ('_queue', b'\0binary\0')))
+        self.assertEqual(replicator.sequence, 4)
+        self.assertEqual(replicator.applied, 3)
+        self.assertEqual(replicator.stats()['role'], 'replica')
+
+        replicator.stop()
+        self.assertEqual(replicator.stats()['role'], 'primary')
+        with self.assertRaises(RuntimeError):
+            replicator.receive(frames)
+
+# Replication Test Case
+
+class ReplicationTestCase(unittest.TestCase):
+    PRIMARY = 'http://localhost:9640'
+    REPLICA = 'http://localhost:9641'
+    BODY    = 'Replicate me'
+
+    def setUp(self):
+        server       = os.path.join(os.path.dirname(os.path.abspath(__file__)), 'mq_server.py')
+        self.primary = subprocess.Popen([sys.executable, server, '--port=9640'], stdout=subprocess.DEVNULL, stderr=subprocess.DEVNULL)
+        self.replica = subprocess.Popen([sys.executable, server, '--port=9641', '--replicate-from=localhost:9640', '--failover-timeout=1'], stdout=subprocess.DEVNULL, stderr=subprocess.DEVNULL)
+        self.wait(lambda: requests.get(self.PRIMARY + '/stats').json()['replication']['replicas'] == 1)
+
+    def tearDown(self):
+        for process in (self.primary, self.replica):
+            if process.poll() is None:
+                process.terminate()
+                process.wait()
+
+    def wait(self, condition, timeout=10.0):
+        deadline = time.time() + timeout
+        while time.time() < deadline:
+            try:
+                if condition():
+                    return
+            except requests.exceptions.ConnectionError:
+                pass
+            time.sleep(0.1)
+        self.fail('Timed out waiting for replication')
+
+    def test_00_replicate_and_fail_over(self):
+        # Replicas refuse clients and name their primary
+        r = requests.put(self.REPLICA + '/subscription/_queue/_topic')
+        self.assertEqual(r.status_code, 503)
+        self.assertEqual(r.headers['X-Replica'], 'localhost:9640')
+
+        requests.put(self.PRIMARY + '/subscription/_queue/_topic')
+        for index in range(3):
+            r = requests.put(self.PRIMARY + '/topic/_topic', data='{} {}'.format(self.BODY, index))
+            self.assertEqual(r.status_code, 200)
+        r = requests.get(self.PRIMARY + '/queue/_queue')
+        self.assertEqual(r.text.rstrip(), self.BODY + ' 0')
+
+        self.wait(lambda: requests.get(self.REPLICA + '/stats').json()['queues']['_queue']['depth'] == 2)
+        replication = requests.get(self.REPLICA + '/stats').json()['replication']
+        self.assertEqual(replication['role'], 'replica')
+        self.assertGreaterEqual(replication['lag'], 0.0)
+
+        # Once the primary is gone, the replica promotes itself
+        self.primary.terminate()
+        self.primary.wait()
+        self.wait(lambda: requests.get(self.REPLICA + '/stats').json()['replication']['role'] == 'primary')
+        for index in (1, 2):
+            r = requests.get(self.REPLICA + '/queue/_queue')
+            self.assertEqual(r.status_code, 200)
+            self.assertEqual(r.text.rstrip(), '{} {}'.format(self.BODY, index))
+
+# Main execution
+
+if __name__ == '__main__':
+    unittest.main()
+
+# vim: set sts=4 sw=4 ts=8 expandtab ft=python:
@@ -1,8 +1,21 @@
 #!/usr/bin/env python3
 
+import collections
+import os
+import shutil
+import subprocess
+import sys
+import tempfile
+import threading
+import time
+import types
 import unittest
+import urllib.parse
 import requests
 
+import mq_server
+import mq_stats
+
 # Server Test Case
 
 class ServerTestCase(unittest.TestCase):
@@ -36,6 +49,7 @@ class ServerTestCase(unittest.TestCase):
         r = requests.get(self.URL + '/queue/_queue', data=self.BODY)
         self.assertEqual(r.status_code  , 200)
         self.assertEqual(r.text.rstrip(), self.BODY)
+        self.assertEqual(r.headers['X-Topic'], '_topic')
     
     def test_05_retrieve_timeout(self):
         with self.assertRaises(requests.exceptions.ReadTimeout):
@@ -51,6 +65,390 @@ class ServerTestCase(unittest.TestCase):
 
         self.test_00_publish_without_subscribers()
 
+    def test_07_retrieve_any(self):
+        r = requests.get(self.URL + '/queues', data='_missing\n_queue')
+        self.assertEqual(r.status_code, 204)
+
+        self.test_02_subscribe()
+        self.test_03_publish()
+        r = requests.get(self.URL + '/queues', data='_missing\n_queue')
+        self.assertEqual(r.status_code       , 200)
+        self.assertEqual(r.text.rstrip()     , self.BODY)
+        self.assertEqual(r.headers['X-Queue'], '_queue')
+        self.assertEqual(r.headers['X-Topic'], '_topic')
+        self.test_06_unsubscribe()
+
+    def test_08_lease(self):
+        self.test_02_subscribe()
+        self.test_03_publish()
+        r = requests.get(self.URL + '/queue/_queue', headers={'X-Lease': '0.5'})
+        self.assertEqual(r.status_code, 200)
+        self.assertEqual(r.text.rstrip(), self.BODY)
+        delivery = r.headers['X-Delivery']
+
+        # Not acknowledged: redelivered once the lease expires
+        r = requests.get(self.URL + '/queues', data='_queue 0.5')
+        self.assertEqual(r.status_code, 200)
+        self.assertEqual(r.text.rstrip(), self.BODY)
+        self.assertNotEqual(r.headers['X-Delivery'], delivery)
+        delivery = r.headers['X-Delivery']
+
+        # Acknowledged: never redelivered
+        r = requests.get(self.URL + '/queues', data='_queue', headers={'X-Ack': delivery + ',junk'})
+        self.assertEqual(r.status_code, 204)
+        r = requests.put(self.URL + '/ack', headers={'X-Ack': delivery})
+        self.assertEqual(r.text.rstrip(), 'Acknowledged 0 deliveries')
+        r = requests.get(self.URL + '/queues', data='_queue')
+        self.assertEqual(r.status_code, 204)
+        self.test_06_unsubscribe()
+
+    def test_09_group(self):
+        r = requests.put(self.URL + '/group/_group/_member0', headers={'X-Policy': 'bogus'})
+        self.assertEqual(r.status_code, 400)
+        for member in ('_member0', '_member1'):
+            r = requests.put(self.URL + '/group/_group/' + member, headers={'X-Policy': 'least-outstanding'})
+            self.assertEqual(r.status_code  , 200)
+            self.assertEqual(r.text.rstrip(), 'Added member ({}) to group (_group)'.format(member))
+        requests.put(self.URL + '/subscription/_group/_topic')
+
+        # Both members waiting: each message goes to exactly one of them
+        responses = {}
+        def retrieve(member):
+            responses[member] = requests.get(self.URL + '/queues', data=member)
+        threads = [threading.Thread(target=retrieve, args=(member,)) for member in ('_member0', '_member1')]
+        for thread in threads:
+            thread.start()
+        for index in range(2):
+            requests.put(self.URL + '/topic/_topic', data=str(index))
+        for thread in threads:
+            thread.join()
+
+        self.assertEqual(sorted(r.text for r in responses.values()), ['0', '1'])
+        for member, r in responses.items():
+            self.assertEqual(r.headers['X-Queue'], member)
+            self.assertEqual(r.headers['X-Group'], '_group')
+
+        requests.delete(self.URL + '/subscription/_group/_topic')
+        for member in ('_member0', '_member1'):
+            r = requests.delete(self.URL + '/group/_group/' + member)
+            self.assertEqual(r.status_code, 200)
+        r = requests.delete(self.URL + '/group/_group/_member0')
+        self.assertEqual(r.status_code, 404)
+
+    def test_10_wildcard(self):
+        for pattern in ('_metrics.*', '_orders.#'):
+            r = requests.put(self.URL + '/subscription/_wildcard/' + urllib.parse.quote(pattern))
+            self.assertEqual(r.status_code, 200)
+
+        for topic, subscribers in (('_metrics.cpu', 1), ('_metrics.cpu.user', 0), ('_orders', 1), ('_orders.eu.created', 1)):
+            r = requests.put(self.URL + '/topic/' + topic, data=topic)
+            self.assertEqual(r.status_code, 200 if subscribers else 404)
+
+        for topic in ('_metrics.cpu', '_orders', '_orders.eu.created'):
+            r = requests.get(self.URL + '/queue/_wildcard')
+            self.assertEqual(r.text, topic)
+            self.assertEqual(r.headers['X-Topic'], topic)
+
+        for pattern in ('_metrics.*', '_orders.#'):
+            r = requests.delete(self.URL + '/subscription/_wildcard/' + urllib.parse.quote(pattern))
+            self.assertEqual(r.status_code, 200)
+        r = requests.put(self.URL + '/topic/_orders', data='_orders')
+        self.assertEqual(r.status_code, 404)
+
+    def test_11_limits(self):
+        r = requests.put(self.URL + '/limits/queue/_limited', headers={'X-Overflow': 'bogus'})
+        self.assertEqual(r.status_code, 400)
+        requests.put(self.URL + '/subscription/_limited/_capped')
+
+        # Drop oldest, reject new and spill to disk once over two messages
+        for overflow, expected in (('drop-oldest', '34'), ('reject-new', '01'), ('spill-to-disk', '01234')):
+            r = requests.put(self.URL + '/limits/queue/_limited', headers={'X-Max-Messages': '2', 'X-Overflow': overflow})
+            self.assertEqual(r.status_code  , 200)
+            self.assertEqual(r.text.rstrip(), 'Set limits of queue (_limited)')
+
+            statuses = [requests.put(self.URL + '/topic/_capped', data=str(index)).status_code for index in range(5)]
+            self.assertEqual(statuses, [200, 200, 503, 503, 503] if overflow == 'reject-new' else [200] * 5)
+            for message in expected:
+                r = requests.get(self.URL + '/queue/_limited')
+                self.assertEqual(r.text, message)
+            r = requests.get(self.URL + '/queues', data='_limited')
+            self.assertEqual(r.status_code, 204)
+
+        # Messages for topic expire after its TTL
+        requests.delete(self.URL + '/limits/queue/_limited')
+        requests.put(self.URL + '/limits/topic/_capped', headers={'X-TTL': '0.2'})
+        requests.put(self.URL + '/topic/_capped', data='expired')
+        time.sleep(0.5)
+        r = requests.get(self.URL + '/queues', data='_limited')
+        self.assertEqual(r.status_code, 204)
+
+        r = requests.delete(self.URL + '/limits/topic/_capped')
+        self.assertEqual(r.text.rstrip(), 'Removed limits of topic (_capped)')
+        requests.delete(self.URL + '/subscription/_limited/_capped')
+
+    def test_12_delayed(self):
+        requests.put(self.URL + '/subscription/_delayed/_later')
+        r = requests.put(self.URL + '/topic/_later', data='later', headers={'X-Delay': 'soon'})
+        self.assertEqual(r.status_code, 400)
+
+        started = time.time()
+        r = requests.put(self.URL + '/topic/_later', data='later', headers={'X-Delay': '300'})
+        self.assertEqual(r.status_code, 202)
+        r = requests.put(self.URL + '/topic/_later', data='now', headers={'X-Deliver-At': str(time.time() - 1)})
+        self.assertEqual(r.status_code, 200)
+
+        for body in ('now', 'later'):
+            r = requests.get(self.URL + '/queue/_delayed')
+            self.assertEqual(r.text, body)
+        self.assertGreaterEqual(time.time() - started, 0.3)
+        requests.delete(self.URL + '/subscription/_delayed/_later')
+
+    def test_13_dedup(self):
+        requests.put(self.URL + '/subscription/_deduped/_resent')
+        r = requests.put(self.URL + '/topic/_resent', data='0', headers={'X-Producer': '_producer', 'X-Sequence': 'first'})
+        self.assertEqual(r.status_code, 400)
+
+        # Resent and reordered publishes are only appended once
+        for sequence, duplicate in ((1, False), (1, True), (3, False), (2, False), (3, True)):
+            r = requests.put(self.URL + '/topic/_resent', data=str(sequence), headers={'X-Producer': '_producer', 'X-Sequence': str(sequence)})
+            self.assertEqual(r.status_code, 200)
+            self.assertEqual(r.headers.get('X-Duplicate') == 'true', duplicate)
+        for body in '132':
+            r = requests.get(self.URL + '/queue/_deduped')
+            self.assertEqual(r.text, body)
+            self.assertEqual(r.headers['X-Producer'], '_producer')
+        r = requests.get(self.URL + '/queues', data='_deduped')
+        self.assertEqual(r.status_code, 204)
+        requests.delete(self.URL + '/subscription/_deduped/_resent')
+
+    def test_14_compacted(self):
+        r = requests.put(self.URL + '/compacted/_state')
+        self.assertEqual(r.status_code  , 200)
+        self.assertEqual(r.text.rstrip(), 'Compacting topic (_state)')
+        requests.put(self.URL + '/subscription/_compacted/_state')
+
+        # Only the latest value per key is kept, in the position of the first
+        for key, value in (('a', 'a0'), ('b', 'b0'), ('a', 'a1'), (None, 'none'), ('c', 'c0'), ('b', 'b1')):
+            r = requests.put(self.URL + '/topic/_state', data=value, headers={'X-Key': key} if key else {})
+            self.assertEqual(r.status_code, 200)
+        for value in ('a1', 'b1', 'none', 'c0'):
+            r = requests.get(self.URL + '/queue/_compacted')
+            self.assertEqual(r.text, value)
+        r = requests.get(self.URL + '/queues', data='_compacted')
+        self.assertEqual(r.status_code, 204)
+
+        requests.delete(self.URL + '/subscription/_compacted/_state')
+        r = requests.delete(self.URL + '/compacted/_state')
+        self.assertEqual(r.text.rstrip(), 'Stopped compacting topic (_state)')
+
+    def test_15_stats(self):
+        requests.put(self.URL + '/subscription/_measured/_metrics')
+        for body in ('one', 'two', 'three'):
+            requests.put(self.URL + '/topic/_metrics', data=body)
+        requests.get(self.URL + '/queue/_measured')
+
+        r = requests.get(self.URL + '/stats')
+        self.assertEqual(r.status_code, 200)
+        self.assertTrue(r.headers['Content-Type'].startswith('application/json'))
+        stats = r.json()
+        queue = stats['queues']['_measured']
+        self.assertEqual((queue['depth'], queue['bytes']), (2, len('twothree')))
+        self.assertEqual((queue['enqueued'], queue['dequeued']), (3, 1))
+        self.assertGreater(queue['oldest_age'], 0)
+        self.assertEqual(stats['topics']['_metrics']['subscribers'], 1)
+        self.assertEqual(stats['topics']['_metrics']['published'], 3)
+        self.assertGreaterEqual(stats['requests']['PUT topic']['count'], 3)
+
+        for headers, params in (({'Accept': 'text/plain;version=0.0.4'}, None), ({}, {'format': 'prometheus'})):
+            r = requests.get(self.URL + '/stats', headers=headers, params=params)
+            self.assertEqual(r.status_code, 200)
+            self.assertTrue(r.headers['Content-Type'].startswith('text/plain'))
+            self.assertIn('mq_queue_depth{queue="_measured"} 2', r.text.splitlines())
+            self.assertIn('mq_topic_published_total{topic="_metrics"} 3', r.text.splitlines())
+        r = requests.get(self.URL + '/stats', params={'format': 'xml'})
+        self.assertEqual(r.status_code, 400)
+
+        requests.delete(self.URL + '/subscription/_measured/_metrics')
+        requests.get(self.URL + '/queue/_measured')
+        requests.get(self.URL + '/queue/_measured')
+
+    def test_16_trace(self):
+        requests.put(self.URL + '/subscription/_traced/_trace')
+        published = int(time.time() * 1000000)
+        requests.put(self.URL + '/topic/_trace', data='traced', headers={'X-Trace': '_id', 'X-Trace-Published': str(published)})
+        requests.put(self.URL + '/topic/_trace', data='plain')
+
+        # Traced messages are stamped on the way through the queue
+        r = requests.get(self.URL + '/queue/_traced', headers={'X-Lease': '0.5'})
+        self.assertEqual(r.text, 'traced')
+        self.assertEqual(r.headers['X-Trace'], '_id')
+        enqueued = int(r.headers['X-Trace-Enqueued'])
+        dequeued = int(r.headers['X-Trace-Dequeued'])
+        self.assertTrue(published <= enqueued <= dequeued <= time.time() * 1000000)
+
+        r = requests.get(self.URL + '/queue/_traced')
+        self.assertEqual(r.text, 'plain')
+        self.assertNotIn('X-Trace-Dequeued', r.headers)
+
+        # Redeliveries keep the enqueue stamp of the first delivery
+        r = requests.get(self.URL + '/queue/_traced')
+        self.assertEqual(r.text, 'traced')
+        self.assertEqual(int(r.headers['X-Trace-Enqueued']), enqueued)
+        self.assertGreater(int(r.headers['X-Trace-Dequeued']), dequeued)
+        requests.delete(self.URL + '/subscription/_traced/_trace')
+
+    def test_17_replication(self):
+        replication = requests.get(self.URL + '/stats').json()['replication']
+        self.assertEqual(replication['role'], 'primary')
+        self.assertEqual(replication['replicas'], 0)
+
+    def test_18_priority(self):
+        requests.put(self.URL + '/subscription/_prioritized/_priority')
+        for index in range(3):
+            requests.put(self.URL + '/topic/_priority', data='bulk {}'.format(index))
+        requests.put(self.URL + '/topic/_priority', data='high', headers={'X-Priority': '1'})
+        requests.put(self.URL + '/topic/_priority', data='urgent', headers={'X-Priority': '2'})
+
+        # Higher levels are delivered first, with their priority
+        r = requests.get(self.URL + '/queue/_prioritized')
+        self.assertEqual(r.text, 'urgent')
+        self.assertEqual(r.headers['X-Priority'], '2')
+        for body in ('high', 'bulk 0', 'bulk 1', 'bulk 2'):
+            self.assertEqual(requests.get(self.URL + '/queue/_prioritized').text, body)
+
+        # Lower levels are served after a burst of higher ones
+        requests.put(self.URL + '/topic/_priority', data='bulk')
+        for index in range(17):
+            requests.put(self.URL + '/topic/_priority', data='urgent', headers={'X-Priority': '3'})
+        bodies = [requests.get(self.URL + '/queue/_prioritized').text for _ in range(18)]
+        self.assertEqual(bodies.index('bulk'), 16)
+        requests.delete(self.URL + '/subscription/_prioritized/_priority')
+
+    def test_19_priority_limits(self):
+        requests.put(self.URL + '/subscription/_urgent/_urgent_capped')
+        urgent = {'X-Priority': '2'}
+
+        # Prioritized messages count towards the limits of their queue
+        for overflow, expected in (('reject-new', ('urgent 0', 'bulk')), ('drop-oldest', ('urgent 0', 'urgent 1'))):
+            requests.put(self.URL + '/limits/queue/_urgent', headers={'X-Max-Messages': '2', 'X-Overflow': overflow})
+            statuses = [requests.put(self.URL + '/topic/_urgent_capped', data='bulk').status_code]
+            for index in range(2):
+                r = requests.put(self.URL + '/topic/_urgent_capped', data='urgent {}'.format(index), headers=urgent)
+                statuses.append(r.status_code)
+            self.assertEqual(statuses, [200, 200, 503] if overflow == 'reject-new' else [200] * 3)
+            for body in expected:
+                self.assertEqual(requests.get(self.URL + '/queue/_urgent').text, body)
+            r = requests.get(self.URL + '/queues', data='_urgent')
+            self.assertEqual(r.status_code, 204)
+
+        # And expire after the TTL of their topic
+        requests.delete(self.URL + '/limits/queue/_urgent')
+        requests.put(self.URL + '/limits/topic/_urgent_capped', headers={'X-TTL': '0.2'})
+        requests.put(self.URL + '/topic/_urgent_capped', data='expired', headers=urgent)
+        time.sleep(0.5)
+        r = requests.get(self.URL + '/queues', data='_urgent')
+        self.assertEqual(r.status_code, 204)
+
+        requests.delete(self.URL + '/limits/topic/_urgent_capped')
+        requests.delete(self.URL + '/subscription/_urgent/_urgent_capped')
+
+# Storage Test Case
+
+class StorageTestCase(unittest.TestCase):
+    URL = 'http://localhost:9642'
+
+    def setUp(self):
+        self.directory = tempfile.mkdtemp(prefix='test_mq_server.')
+        self.server    = None
+
+    def tearDown(self):
+        self.stop()
+        shutil.rmtree(self.directory, ignore_errors=True)
+
+    def start(self):
+        server      = os.path.join(os.path.dirname(os.path.abspath(__file__)), 'mq_server.py')
+        self.server = subprocess.Popen([sys.executable, server, '--port=9642', '--data-dir=' + self.directory],
+                                       stdout=subprocess.DEVNULL, stderr=subprocess.DEVNULL)
+        deadline = time.time() + 10
+        while time.time() < deadline:
+            try:
+                requests.get(self.URL + '/stats')
+                return
+            except requests.exceptions.ConnectionError:
+                time.sleep(0.1)
+        self.fail('Timed out waiting for server')
+
+    def stop(self):
+        if self.server is not None and self.server.poll() is None:
+            self.server.terminate()
+            self.server.wait()
+
+    def test_00_priority_restart(self):
+        self.start()
+        requests.put(self.URL + '/subscription/_stored/_durable')
+        requests.put(self.URL + '/topic/_durable', data='bulk')
+        requests.put(self.URL + '/topic/_durable', data='urgent', headers={'X-Priority': '3'})
+
+        # Prioritized messages are stored like any other and keep their level
+        self.stop()
+        self.start()
+        r = requests.get(self.URL + '/queue/_stored')
+        self.assertEqual(r.text, 'urgent')
+        self.assertEqual(r.headers['X-Priority'], '3')
+        self.assertEqual(requests.get(self.URL + '/queue/_stored').text, 'bulk')
+
+# Dedup Window Test Case
+
+class DedupWindowTestCase(unittest.TestCase):
+    def test_00_add(self):
+        window = mq_server.DedupWindow()
+        for sequence, new in ((1, True), (1, False), (3, True), (2, True), (3, False)):
+            self.assertEqual(window.add(sequence), new)
+
+        # Sequence numbers behind the window are duplicates
+        self.assertTrue(window.add(3 + window.SIZE))
+        self.assertFalse(window.add(3))
+        self.assertTrue(window.add(4))
+
+    def test_01_jump(self):
+        window = mq_server.DedupWindow()
+        window.add(1)
+
+        # A huge jump resets the window rather than shifting it that far
+        started = time.time()
+        self.assertTrue(window.add(10 ** 18))
+        self.assertLess(time.time() - started, 0.1)
+        self.assertEqual(window.seen, 1)
+        self.assertFalse(window.add(10 ** 18))
+        self.assertFalse(window.add(1))
+        self.assertTrue(window.add(10 ** 18 - 1))
+
+# Sample Test Case
+
+class SampleTestCase(unittest.TestCase):
+    def test_00_topics(self):
+        broker = types.SimpleNamespace(
+            queues    = {},
+            published = collections.defaultdict(mq_stats.Meter),
+            fanout    = {},
+            sampled   = 0.0,
+            ioloop    = types.SimpleNamespace(time=lambda: broker.sampled + mq_stats.INTERVAL),
+        )
+        for topic, subscribers in (('active', 1), ('idle', 1), ('unsubscribed', 0)):
+            broker.published[topic].mark()
+            broker.fanout[topic] = subscribers
+
+        # Topics without subscribers are dropped right away
+        mq_server.MessageQueue.sample(broker)
+        self.assertEqual(sorted(broker.published), ['active', 'idle'])
+
+        # Topics without publishes are dropped after a whole rate window
+        for _ in range(int(mq_stats.WINDOW / mq_stats.INTERVAL)):
+            broker.published['active'].mark()
+            mq_server.MessageQueue.sample(broker)
+        self.assertEqual(sorted(broker.published), ['active'])
+        self.assertEqual(sorted(broker.fanout), ['active'])
+
 # Main execution
 
 if __name__ == '__main__':
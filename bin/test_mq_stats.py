@@ -0,0 +1,104 @@
+#!/usr/bin/env python3
+
+import unittest
+
+import mq_stats
+
+# Stats Test Case
+
+class StatsTestCase(unittest.TestCase):
+    def snapshot(self, queue, topic, latencies):
+        histogram = mq_stats.Histogram()
+        for seconds in latencies:
+            histogram.add(seconds)
+        return {
+            'queues'   : {queue: {
+                'depth': 2, 'bytes': 10, 'memory': 10, 'enqueued': 3, 'dequeued': 1,
+                'enqueue_rate': 0.5, 'dequeue_rate': 0.25, 'oldest_age': 1.5, 'waiting': 1,
+            }},
+            'topics'   : {topic: {'subscribers': 2, 'published': 3, 'publish_rate': 0.5}},
+            'broker'   : {'memory': 10, 'in_flight': 1, 'scheduled': 0},
+            'retention': {'dropped': 1, 'expired': 0},
+            'requests' : {'PUT topic': histogram.snapshot()},
+            'replication': {'role': 'primary', 'replicas': 1, 'sequence': 5, 'pending': len(latencies)},
+        }
+
+    def test_00_meter(self):
+        meter = mq_stats.Meter()
+        meter.mark(50)
+        meter.sample(5.0)
+        self.assertEqual(meter.rate, 10.0)
+
+        # Rate decays towards the new instantaneous rate
+        meter.sample(5.0)
+        self.assertAlmostEqual(meter.rate, 10.0 * (1 - mq_stats.ALPHA))
+        for _ in range(100):
+            meter.mark(5)
+            meter.sample(5.0)
+        self.assertAlmostEqual(meter.rate, 1.0, places=2)
+        self.assertEqual(meter.count, 550)
+
+        # Samples without events in a row are counted until the next event
+        self.assertEqual(meter.idle, 0)
+        meter.sample(5.0)
+        meter.sample(5.0)
+        self.assertEqual(meter.idle, 2)
+        meter.mark()
+        meter.sample(5.0)
+        self.assertEqual(meter.idle, 0)
+
+    def test_01_histogram(self):
+        histogram = mq_stats.Histogram()
+        for seconds in (0, 1e-9, 0.0003, 0.0003, 0.0003, 0.1, 1e6):
+            histogram.add(seconds)
+
+        snapshot = histogram.snapshot()
+        self.assertEqual(snapshot['count'], 7)
+        self.assertEqual(snapshot['buckets'][0], 2)
+        self.assertEqual(snapshot['buckets'][-1], 1)
+        self.assertEqual(mq_stats.percentile(snapshot, 50), 2.0 ** -11)
+        self.assertEqual(mq_stats.percentile(snapshot, 80), 0.125)
+        self.assertIsNone(mq_stats.percentile(snapshot, 100))
+        self.assertIsNone(mq_stats.percentile(mq_stats.Histogram().snapshot(), 50))
+
+    def test_02_merge(self):
+        merged = mq_stats.merge([
+            self.snapshot('a', 'x', (0.001, 0.002)),
+            self.snapshot('b', 'y', (0.001,)),
+        ])
+        self.assertEqual(sorted(merged['queues']), ['a', 'b'])
+        self.assertEqual(sorted(merged['topics']), ['x', 'y'])
+        self.assertEqual(merged['broker']['in_flight'], 2)
+        self.assertEqual(merged['retention'], {'dropped': 2, 'expired': 0})
+        self.assertEqual(merged['requests']['PUT topic']['count'], 3)
+        self.assertEqual(sum(merged['requests']['PUT topic']['buckets']), 3)
+        self.assertEqual(merged['requests']['PUT topic']['p50'], 2.0 ** -9)
+        self.assertEqual(merged['replication'], {'role': 'primary', 'replicas': 2, 'sequence': 10, 'pending': 2})
+
+    def test_03_prometheus(self):
+        snapshot = self.snapshot('a"\\\n', 'x', (0.001, 0.002))
+        text     = mq_stats.prometheus(mq_stats.merge([snapshot]))
+        lines    = text.splitlines()
+
+        self.assertIn('# TYPE mq_queue_depth gauge', lines)
+        self.assertIn('mq_queue_depth{queue="a\\"\\\\\\n"} 2', lines)
+        self.assertIn('mq_topic_publish_rate{topic="x"} 0.5', lines)
+        self.assertIn('mq_retention_total{event="dropped"} 1', lines)
+        self.assertIn('mq_in_flight 1', lines)
+        self.assertIn('mq_replication_replica 0', lines)
+        self.assertIn('mq_replication_pending 2', lines)
+        self.assertIn('# TYPE mq_request_duration_seconds histogram', lines)
+        self.assertIn('mq_request_duration_seconds_bucket{endpoint="topic",le="+Inf",method="PUT"} 2', lines)
+        self.assertIn('mq_request_duration_seconds_count{endpoint="topic",method="PUT"} 2', lines)
+
+        # Buckets are cumulative
+        buckets = [int(line.split()[-1]) for line in lines if line.startswith('mq_request_duration_seconds_bucket')]
+        self.assertEqual(len(buckets), mq_stats.BUCKETS)
+        self.assertEqual(buckets, sorted(buckets))
+
+# Main execution
+
+if __name__ == '__main__':
+    unittest.main()
+
+# vim: set sts=4 sw=4 ts=8 expandtab ft=python:
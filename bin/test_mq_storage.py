@@ -0,0 +1,183 @@
+#!/usr/bin/env python3
+
+import os
+import shutil
+import tempfile
+import unittest
+
+import tornado.gen
+import tornado.ioloop
+
+import mq_storage
+
+# Message
+
+class Message(object):
+    def __init__(self, topic, body, headers=()):
+        self.topic   = topic
+        self.body    = body
+        self.headers = [tuple(header) for header in headers]
+
+# Storage Test Case
+
+class StorageTestCase(unittest.TestCase):
+    def setUp(self):
+        self.ioloop    = tornado.ioloop.IOLoop()
+        self.directory = tempfile.mkdtemp()
+
+    def tearDown(self):
+        shutil.rmtree(self.directory)
+        self.ioloop.close()
+
+    def open(self, **settings):
+        storage = mq_storage.Storage(self.directory, **settings)
+        return storage, storage.lane('_queue', '_topic/x', Message)
+
+    def test_00_append_pop(self):
+        storage, lane = self.open()
+        lane.append(Message('_topic/x', b'\0binary\0', [('X-Codec', 'lz')]))
+        lane.append(Message('_topic/x', b'second'))
+        self.assertEqual(len(lane), 2)
+
+        message = lane.popleft()
+        self.assertEqual(message.topic  , '_topic/x')
+        self.assertEqual(message.body   , b'\0binary\0')
+        self.assertEqual(message.headers, [('X-Codec', 'lz')])
+        self.assertEqual(lane.popleft().body, b'second')
+        self.assertFalse(lane)
+        self.assertRaises(IndexError, lane.popleft)
+        storage.close()
+
+    def test_01_resume_cursor(self):
+        storage, lane = self.open()
+        for index in range(10):
+            lane.append(Message('_topic/x', str(index).encode()))
+        for index in range(4):
+            lane.popleft()
+        storage.close()
+
+        storage = mq_storage.Storage(self.directory)
+        lanes   = list(storage.load(Message))
+        self.assertEqual([(queue, topic) for queue, topic, _ in lanes], [('_queue', '_topic/x')])
+
+        lane = lanes[0][2]
+        self.assertEqual(len(lane), 6)
+        self.assertEqual([lane.popleft().body for _ in range(6)], [str(index).encode() for index in range(4, 10)])
+        storage.close()
+
+    def test_02_segments(self):
+        storage, lane = self.open(segment_bytes=256)
+        for index in range(100):
+            lane.append(Message('_topic/x', b'x' * 64))
+        segments = len(lane.segments)
+        self.assertGreater(segments, 10)
+
+        # Iterating spans segments without consuming
+        for index in range(10):
+            lane.popleft()
+        self.assertEqual(len(list(lane)), 90)
+        self.assertEqual(len(lane), 90)
+
+        for index in range(90):
+            lane.popleft()
+        self.assertEqual(len(lane.segments), 1)
+
+        self.assertEqual(sorted(os.listdir(lane.directory)), [
+            '{:020d}{}'.format(lane.segments[0].base, suffix) for suffix in (mq_storage.INDEX_SUFFIX, mq_storage.SUFFIX)
+        ])
+        storage.close()
+
+    def test_03_torn_tail(self):
+        storage, lane = self.open()
+        for index in range(3):
+            lane.append(Message('_topic/x', b'complete'))
+        path = lane.segments[-1].path
+        storage.close()
+
+        with open(path, 'ab') as stream:
+            stream.write(b'\x40\0\0\0torn')
+
+        storage, lane = self.open()
+        self.assertEqual(len(lane), 3)
+        lane.append(Message('_topic/x', b'after'))
+        self.assertEqual([lane.popleft().body for _ in range(4)], [b'complete'] * 3 + [b'after'])
+        storage.close()
+
+    def test_04_group_commit(self):
+        storage, lane = self.open(sync='group')
+
+        async def publish(index):
+            lane.append(Message('_topic/x', str(index).encode()))
+            await storage.commit()
+
+        async def publish_all():
+            await tornado.gen.multi([publish(index) for index in range(50)])
+
+        self.ioloop.run_sync(publish_all)
+        self.assertEqual(storage.syncs, 1)
+        storage.close()
+
+    def test_05_snapshot(self):
+        storage, lane = self.open(segment_bytes=1024 * 1024)
+        storage.subscriptions = {'_queue': {'_topic/x'}, '_empty': set()}
+        for index in range(5000):
+            lane.append(Message('_topic/x', str(index).encode() * 8))
+        for index in range(3000):
+            lane.popleft()
+        self.assertGreater(len(lane.segments[0].index), 1)
+        storage.snapshot()
+        self.assertEqual(storage.snapshots, 1)
+        storage.snapshot()
+        self.assertEqual(storage.snapshots, 1)
+
+        lane.append(Message('_topic/x', b'tail'))
+        storage.flush()
+        for segment in lane.segments:
+            segment.close()
+
+        storage = mq_storage.Storage(self.directory)
+        self.assertEqual(storage.subscriptions, {'_queue': {'_topic/x'}})
+
+        lane = storage.lane('_queue', '_topic/x', Message)
+        self.assertEqual(len(lane), 2001)
+        self.assertEqual(lane.popleft().body, b'3000' * 8)
+        for index in range(1999):
+            lane.popleft()
+        self.assertEqual(lane.popleft().body, b'tail')
+        storage.close()
+
+    def test_06_seek(self):
+        storage, lane = self.open()
+        for index in range(10000):
+            lane.append(Message('_topic/x', str(index).encode()))
+        segment = lane.segments[0]
+        self.assertGreater(len(segment.index), 10)
+
+        for sequence in (0, 1, 4321, 9999):
+            payload, _ = segment.read(segment.seek(sequence))
+            self.assertEqual(mq_storage.decode_message(payload, Message).body, str(sequence).encode())
+        self.assertEqual(segment.seek(10000), segment.size)
+        storage.close()
+
+    def test_07_remap(self):
+        storage, lane = self.open()
+        remaps  = []
+        lane.append(Message('_topic/x', b'first'))
+        segment = lane.segments[0]
+        remap   = segment.remap
+        segment.remap = lambda: remaps.append(segment.size) or remap()
+
+        # Alternating appends and pops read the tail past the map with pread
+        body = b'x' * 1024
+        for index in range(2 * mq_storage.MAP_CHUNK // len(body)):
+            lane.append(Message('_topic/x', body))
+            self.assertEqual(lane.popleft().body, b'first' if index == 0 else body)
+        self.assertLessEqual(len(remaps), 3)
+        storage.close()
+
+# Main execution
+
+if __name__ == '__main__':
+    unittest.main()
+
+# vim: set sts=4 sw=4 ts=8 expandtab ft=python:
@@ -0,0 +1,52 @@
+#!/usr/bin/env python3
+
+import unittest
+
+import mq_trie
+
+# Trie Test Case
+
+class TrieTestCase(unittest.TestCase):
+    def setUp(self):
+        self.trie = mq_trie.TopicTrie()
+        for pattern, queue in (
+            ('orders.eu.created', 'exact'),
+            ('orders.*.created' , 'single'),
+            ('orders.#'         , 'multiple'),
+            ('#.created'        , 'suffix'),
+            ('metrics.*'        , 'metrics'),
+            ('#'                , 'everything'),
+        ):
+            self.assertTrue(self.trie.add(pattern, queue))
+
+    def test_00_is_pattern(self):
+        self.assertTrue(mq_trie.is_pattern('metrics.*'))
+        self.assertTrue(mq_trie.is_pattern('#'))
+        self.assertFalse(mq_trie.is_pattern('metrics.cpu'))
+        self.assertFalse(mq_trie.is_pattern('metrics*.cpu'))
+
+    def test_01_match(self):
+        self.assertEqual(self.trie.match('orders.eu.created'), {'exact', 'single', 'multiple', 'suffix', 'everything'})
+        self.assertEqual(self.trie.match('orders.us.created'), {'single', 'multiple', 'suffix', 'everything'})
+        self.assertEqual(self.trie.match('orders')           , {'multiple', 'everything'})
+        self.assertEqual(self.trie.match('orders.eu')        , {'multiple', 'everything'})
+        self.assertEqual(self.trie.match('metrics.cpu')      , {'metrics', 'everything'})
+        self.assertEqual(self.trie.match('metrics.cpu.user') , {'everything'})
+        self.assertEqual(self.trie.match('created')          , {'suffix', 'everything'})
+
+    def test_02_remove(self):
+        self.assertEqual(len(self.trie), 6)
+        self.assertFalse(self.trie.add('metrics.*', 'metrics'))
+        self.assertTrue(self.trie.remove('metrics.*', 'metrics'))
+        self.assertFalse(self.trie.remove('metrics.*', 'metrics'))
+        self.assertFalse(self.trie.remove('metrics.cpu.user', 'metrics'))
+        self.assertNotIn('metrics', self.trie.root.children)
+        self.assertEqual(self.trie.match('metrics.cpu'), {'everything'})
+        self.assertEqual(len(self.trie), 5)
+
+# Main execution
+
+if __name__ == '__main__':
+    unittest.main()
+
+# vim: set sts=4 sw=4 ts=8 expandtab ft=python:
@@ -0,0 +1,69 @@
+#!/usr/bin/env python3
+
+import random
+import unittest
+
+import tornado.ioloop
+
+import mq_wheel
+
+# Wheel Test Case
+
+class WheelTestCase(unittest.TestCase):
+    def setUp(self):
+        self.ioloop = tornado.ioloop.IOLoop()
+        self.now    = 1000.0
+        self.fired  = []
+        self.wheel  = mq_wheel.TimingWheel(self.fire, tick=0.01, clock=lambda: self.now)
+
+    def tearDown(self):
+        self.wheel.stop()
+        self.ioloop.close()
+
+    def fire(self, item):
+        self.fired.append((item, self.now))
+
+    def test_00_schedule(self):
+        self.wheel.schedule(self.now + 0.05, 'a')
+        self.wheel.schedule(self.now - 1.00, 'late')
+        self.assertEqual(len(self.wheel), 2)
+
+        self.now += 0.01
+        self.wheel.advance()
+        self.assertEqual([item for item, _ in self.fired], ['late'])
+
+        self.now += 0.04
+        self.wheel.advance()
+        self.assertEqual([item for item, _ in self.fired], ['late', 'a'])
+        self.assertEqual(len(self.wheel), 0)
+
+    def test_01_cascade(self):
+        ''' Timers across every level (and the overflow) fire no earlier than
+        their deadline and at most one tick after it. '''
+        generator = random.Random(0)
+        deadlines = {}
+        for index in range(2000):
+            horizon = generator.choice((1, 100, 10000, 50000000))
+            deadlines[index] = self.now + generator.uniform(0, horizon * 0.01)
+            self.wheel.schedule(deadlines[index], index)
+
+        # Turn the wheel a tick at a time around each deadline
+        for deadline in sorted(deadlines.values()):
+            if self.now < deadline - 0.01:
+                self.now = deadline - 0.01
+                self.wheel.advance()
+            while self.now < deadline + 0.01:
+                self.now += 0.005
+                self.wheel.advance()
+
+        self.assertEqual(len(self.fired), len(deadlines))
+        for item, fired in self.fired:
+            self.assertGreaterEqual(fired, deadlines[item])
+            self.assertLess(fired, deadlines[item] + 0.02)
+
+# Main execution
+
+if __name__ == '__main__':
+    unittest.main()
+
+# vim: set sts=4 sw=4 ts=8 expandtab ft=python:
@@ -3,11 +3,19 @@
 #ifndef CLIENT_H
 #define CLIENT_H
 
+#include "mq/endpoint.h"
 #include "mq/queue.h"
+#include "mq/stats.h"
+#include "mq/table.h"
 
 #include <netdb.h>
 #include <stdbool.h>
 
+/* Constants */
+
+#define MQ_BROKERS      8       // Maximum brokers in a cluster map
+#define MQ_BROKER_SHIFT 56      // Bits of delivery id below the broker index
+
 /* Structures */
 
 enum HTTP_METHOD {
@@ -16,35 +24,77 @@ enum HTTP_METHOD {
     DELETE,
 };
 
+enum GROUP_POLICY {
+    ROUND_ROBIN,		// Members take turns
+    LEAST_OUTSTANDING,		// Member with fewest unacknowledged leases
+};
+
 typedef struct MessageQueue MessageQueue;
+
+typedef struct Broker Broker;
+struct Broker {
+    MessageQueue* mq;		// Message queue the broker belongs to
+    Endpoint*	  endpoint;	// Shared connections and puller for broker
+    Queue*	  outgoing;	// Requests to be sent to broker
+    pthread_t	  pusher;	// Thread sending outgoing requests
+};
+
 struct MessageQueue {
     char    name[NI_MAXHOST];	// Name of message queue
     char    host[NI_MAXHOST];	// Host of server
     char    port[NI_MAXSERV];	// Port of server
 
-    Queue*  outgoing;		// Requests to be sent to server
+    Queue*  outgoing;		// Requests to be sent to (first) broker
     Queue*  incoming;		// Requests received from server
+    Table*  topics;		// Per-topic incoming queues (see mq_retrieve_topic)
+    Table*  traces;		// Per-topic MQTrace of retrieved traced messages
+    char    producer[64];	// Producer id sent with every publish
+    uint64_t sequence;		// Sequence number of last publish sent
+    uint64_t created;		// Publishes created (sampled by tracing)
+    size_t  compression;	// Minimum body length to compress (0 disables)
+    unsigned int lease;		// Visibility timeout of leased delivery (0 disables)
+    double  tracing;		// Fraction of publishes traced (0 disables)
     bool    shutdown;		// Whether or not to shutdown
 
     /* TODO: Add any necessary thread and synchronization primitives */
-    pthread_t pusher;
-    pthread_t puller;
+    Endpoint* endpoint;		// Shared connections and puller of (first) broker
+    Broker    brokers[MQ_BROKERS];	// Brokers of cluster map, owning topics by hash
+    size_t    nbrokers;		// Number of brokers
+    Mutex     lock;		// Protects topics and traces
+    Stats*    stats;		// Per-thread counters (see mq_stats)
 };
 
 MessageQueue *	mq_create(const char *name, const char *host, const char *port);
 void		mq_delete(MessageQueue *mq);
 
 void		mq_publish(MessageQueue *mq, const char *topic, const char *body);
+void		mq_publish_buf(MessageQueue *mq, const char *topic, void *buf, size_t len, Release free_fn);
+void		mq_publish_keyed(MessageQueue *mq, const char *topic, const char *key, const char *body);
+void		mq_publish_delayed(MessageQueue *mq, const char *topic, const char *body, uint64_t delay_ms);
+void		mq_publish_priority(MessageQueue *mq, const char *topic, const char *body, enum REQUEST_PRIORITY priority);
 char *		mq_retrieve(MessageQueue *mq);
+void *		mq_retrieve_buf(MessageQueue *mq, size_t *len);
+char *		mq_retrieve_topic(MessageQueue *mq, const char *topic);
+char *		mq_retrieve_lease(MessageQueue *mq, uint64_t *delivery);
+void		mq_ack(MessageQueue *mq, uint64_t delivery);
 
 void		mq_subscribe(MessageQueue *mq, const char *topic);
 void		mq_unsubscribe(MessageQueue *mq, const char *topic);
+void		mq_join(MessageQueue *mq, const char *group, const char *topic, enum GROUP_POLICY policy);
+void		mq_leave(MessageQueue *mq, const char *group);
 
 void		mq_start(MessageQueue *mq);
 void		mq_stop(MessageQueue *mq);
 
 bool		mq_shutdown(MessageQueue *mq);
 
+void		mq_set_compression(MessageQueue *mq, size_t threshold);
+void		mq_set_lease(MessageQueue *mq, unsigned int seconds);
+void		mq_set_tracing(MessageQueue *mq, double rate);
+
+void		mq_stats(MessageQueue *mq, MQStats *out);
+bool		mq_trace(MessageQueue *mq, const char *topic, MQTrace *out);
+
 char*       mq_get_method(enum HTTP_METHOD method);
 #endif
 
@@ -0,0 +1,21 @@
+/* compress.h: LZ compression of message bodies */
+
+#ifndef COMPRESS_H
+#define COMPRESS_H
+
+#include <stddef.h>
+#include <sys/types.h>
+
+/* Constants */
+
+#define LZ_CODEC    "lz"        // Value of X-Codec header for lz_compress bodies
+
+/* Functions */
+
+size_t	    lz_bound(size_t length);
+size_t	    lz_compress(const void *source, size_t length, void *destination, size_t capacity);
+ssize_t	    lz_decompress(const void *source, size_t length, void *destination, size_t capacity);
+
+#endif
+
+/* vim: set expandtab sts=4 sw=4 ts=8 ft=c: */
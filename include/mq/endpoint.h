@@ -0,0 +1,106 @@
+/* endpoint.h: Shared broker connections */
+
+#ifndef ENDPOINT_H
+#define ENDPOINT_H
+
+#include "mq/request.h"
+#include "mq/stats.h"
+#include "mq/table.h"
+#include "mq/thread.h"
+
+#include <netdb.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <time.h>
+
+/* Constants */
+
+#define ENDPOINT_CONNECTIONS    4       // Maximum open connections per endpoint
+#define ENDPOINT_SERVERS        8       // Maximum servers an endpoint fails over between
+#define ENDPOINT_ACKS           256     // Maximum delivery ids per X-Ack header
+
+/* Structures */
+
+typedef struct Server Server;
+struct Server {
+    char	host[NI_MAXHOST];
+    char	port[NI_MAXSERV];
+};
+
+typedef struct Connection Connection;
+struct Connection {
+    FILE *	    stream;	// Keep-alive socket file stream
+    size_t	    server;	// Index of server connected to
+    size_t	    requests;	// Requests sent over this connection
+    size_t	    bytes;	// Bytes sent over this connection
+
+    Connection *    next;
+};
+
+typedef struct EndpointStats EndpointStats;
+struct EndpointStats {
+    size_t	references;	// MessageQueues using the endpoint
+    size_t	members;	// MessageQueues polled by the shared puller
+    size_t	connections;	// Currently open connections
+    size_t	opened;		// Connections opened since creation
+    size_t	requests;	// Requests sent since creation
+    size_t	bytes;		// Bytes sent since creation
+    size_t	failovers;	// Switches to the next server since creation
+    size_t	server;		// Index of server in use
+    double	elapsed;	// Seconds since creation
+};
+
+typedef struct Endpoint Endpoint;
+struct Endpoint {
+    char	    host[NI_MAXHOST];	// Host of server (or list of servers)
+    char	    port[NI_MAXSERV];	// Port of server (default port of list)
+    size_t	    references;		// MessageQueues using the endpoint
+
+    Server	    servers[ENDPOINT_SERVERS];	// Servers to fail over between
+    size_t	    nservers;		// Number of servers
+    size_t	    server;		// Index of server in use
+
+    Connection *    idle;		// Pooled keep-alive connections
+    size_t	    connections;	// Currently open connections
+    size_t	    capacity;		// Maximum open connections
+    Cond	    available;		// Signalled when a connection is returned
+
+    Table *	    members;		// Started MessageQueues by name
+    Thread	    puller;		// Shared puller thread
+    bool	    pulling;		// Whether or not puller was started
+    bool	    closing;		// Whether or not puller should exit
+    Cond	    changed;		// Signalled when members change
+
+    uint64_t *	    acks;		// Delivery ids to acknowledge
+    size_t	    nacks;		// Number of pending acknowledgements
+    size_t	    acks_capacity;	// Capacity of acks array
+
+    size_t	    opened;		// Connections opened since creation
+    size_t	    requests;		// Requests sent since creation
+    size_t	    bytes;		// Bytes sent since creation
+    size_t	    failovers;		// Switches to the next server since creation
+    struct timespec created;		// Creation time
+
+    Mutex	    lock;
+    Endpoint *	    next;
+};
+
+/* Functions */
+
+Endpoint *	endpoint_acquire(const char *host, const char *port);
+void		endpoint_release(Endpoint *e);
+
+Connection *	endpoint_checkout(Endpoint *e, Stats *s);
+void		endpoint_checkin(Endpoint *e, Connection *c, bool reuse);
+Request *	endpoint_send(Endpoint *e, Request *r, Stats *s);
+
+void		endpoint_ack(Endpoint *e, uint64_t delivery);
+char *		endpoint_take_acks(Endpoint *e);
+void		endpoint_restore_acks(Endpoint *e, const char *acks);
+void		endpoint_flush_acks(Endpoint *e, size_t keep);
+
+void		endpoint_stats(Endpoint *e, EndpointStats *s);
+
+#endif
+
+/* vim: set expandtab sts=4 sw=4 ts=8 ft=c: */
@@ -9,18 +9,52 @@
 
 #include <pthread.h>
 
+/* Constants */
+
+enum LOG_LEVEL {
+    LOG_LEVEL_DEBUG,
+    LOG_LEVEL_INFO,
+    LOG_LEVEL_ERROR,
+    LOG_LEVEL_NONE,		// Disables logging
+};
+
+/* Variables */
+
+extern int LogLevel;		// Minimum level logged (see log_set_level)
+
+/* Macros */
+
+/* Messages below the current level are skipped before any formatting, and
+ * debug messages are compiled out altogether with NDEBUG */
+#define log_message(level, ...) \
+    do { \
+        if ((level) >= __atomic_load_n(&LogLevel, __ATOMIC_RELAXED)) { \
+            log_write(level, __VA_ARGS__); \
+        } \
+    } while (0)
+
 #ifndef NDEBUG
 #define debug(M, ...) \
-    fprintf(stderr, "[%09lu] DEBUG %s:%d:%s: " M "\n", (unsigned long) pthread_self(), __FILE__, __LINE__, __func__, ##__VA_ARGS__)
+    log_message(LOG_LEVEL_DEBUG, "%s:%d:%s: " M, __FILE__, __LINE__, __func__, ##__VA_ARGS__)
 #else
 #define debug(M, ...)
 #endif
 
 #define info(M, ...) \
-    fprintf(stderr, "[%09lu] INFO  " M "\n", (unsigned long) pthread_self(), ##__VA_ARGS__)
+    log_message(LOG_LEVEL_INFO, M, ##__VA_ARGS__)
 
 #define error(M, ...) \
-    fprintf(stderr, "[%09lu] ERROR " M "\n", (unsigned long) pthread_self(), ##__VA_ARGS__)
+    log_message(LOG_LEVEL_ERROR, M, ##__VA_ARGS__)
+
+/* Functions */
+
+void	    log_write(enum LOG_LEVEL level, const char *format, ...) __attribute__((format(printf, 2, 3)));
+void	    log_flush();
+
+void	    log_set_level(enum LOG_LEVEL level);
+void	    log_set_burst(unsigned int burst);
+void	    log_set_stream(FILE *stream);
+unsigned long log_dropped();
 
 #endif
 
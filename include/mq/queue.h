@@ -6,28 +6,64 @@
 #include "mq/request.h"
 #include "mq/thread.h"
 
+/* Constants */
+
+#define QUEUE_PRIORITY_BURST    16  // Pops ahead of lower priority levels before serving one
+#define QUEUE_RING_CAPACITY     1024    // Slots in a single-producer/single-consumer ring
+#define QUEUE_RING_BATCH        32      // Pops between publications of the ring's head
+
 /* Structures */
 
 typedef struct Queue Queue;
+typedef struct QueueBackend QueueBackend;
+
 struct Queue {
     Request *head;
     Request *tail;
     size_t   size;
+    size_t   high;              // High-water mark of size
 
     /* TODO: Add any necessary thread and synchronization primitives */
     pthread_mutex_t mutex;      // allows single access to the queue
     pthread_cond_t notEmpty;    // condition to keep track when queue is not empty
     pthread_cond_t empty;       // condition to track when queue is empty
+    uint64_t lock_waits;        // Contended acquisitions of the queue's locks
+    uint64_t lock_wait_ns;      // Time spent waiting for them
+
+    const QueueBackend *backend;    // operations implementing the queue
+    void *              impl;       // backend specific state
 };
 
+struct QueueBackend {
+    const char *name;
+    void        (*push)(Queue *q, Request *r);
+    Request *   (*pop)(Queue *q);
+    void        (*delete)(Queue *q);    // release impl and queued requests
+    size_t      (*size)(Queue *q);      // optional, if q->size is not maintained
+};
+
+/* Backends */
+
+extern const QueueBackend LockedQueue;     // single list behind one mutex
+extern const QueueBackend ShardedQueue;    // per-thread shards with stealing
+extern const QueueBackend PriorityQueue;   // list per priority level with bitmap
+extern const QueueBackend SPSCQueue;       // lock-free ring for one pusher (poppers take turns)
+
 /* Functions */
 
 Queue *	    queue_create();
+Queue *	    queue_create_sharded(size_t shards);
+Queue *	    queue_create_priority();
+Queue *	    queue_create_spsc(size_t capacity);
 void        queue_delete(Queue *q);
 
 void	    queue_push(Queue *q, Request *r);
 Request *   queue_pop(Queue *q);
 
+size_t      queue_size(Queue *q);
+size_t      queue_high_water(Queue *q);
+void        queue_lock(Queue *q, Mutex *lock);
+void        queue_lock_wait(Queue *q, uint64_t *waits, uint64_t *ns);
 void        queue_status(Queue* q);
 
 #endif
@@ -3,24 +3,60 @@
 #ifndef REQUEST_H
 #define REQUEST_H
 
+#include <stdint.h>
 #include <stdio.h>
 
+/* Constants */
+
+#define REQUEST_PRIORITIES  4       // Priority levels of requests (and messages)
+
 /* Structures */
 
+enum REQUEST_PRIORITY {
+    PRIORITY_NORMAL,		// Bulk traffic (the default)
+    PRIORITY_HIGH,
+    PRIORITY_URGENT,
+    PRIORITY_CONTROL,		// Subscriptions and group membership
+};
+
+typedef void (*Release)(void *);
+
+typedef struct Header Header;
+struct Header {
+    char *	name;
+    char *	value;
+
+    Header *	next;
+};
+
 typedef struct Request Request;
 struct Request {
     char *	method;
     char *	uri;
     char *	body;
-    
+
     Request *	next;
+
+    Header *	headers;	// Extra headers (ie. X-Topic)
+    int		status;		// Response status code (responses only)
+    size_t	length;		// Length of body (may contain NUL bytes)
+    Release	release;	// Function used to release body (NULL to keep)
+    uint64_t	queued;		// When pushed to outgoing queue (ns, 0 if unset)
+    int		priority;	// Priority level (sent as X-Priority if not normal)
 };
 
 /* Functions */
 
 Request *   request_create(const char *method, const char *uri, const char *body);
+Request *   request_create_buf(const char *method, const char *uri, void *body, size_t length, Release release);
 void	    request_delete(Request *r);
-void        request_write(Request *r, FILE *fs);
+size_t	    request_length(Request *r);
+size_t      request_write(Request *r, FILE *fs);
+size_t      request_send(Request *r, int fd);
+Request *   request_read(FILE *fs);
+
+void	    request_set_header(Request *r, const char *name, const char *value);
+const char *request_get_header(Request *r, const char *name);
 
 #endif
 
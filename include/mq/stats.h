@@ -0,0 +1,100 @@
+/* stats.h: Per-thread client counters and latency histograms */
+
+#ifndef STATS_H
+#define STATS_H
+
+#include "mq/thread.h"
+
+#include <stdint.h>
+#include <time.h>
+
+/* Constants */
+
+#define HISTOGRAM_BUCKETS   40      // Bucket i counts samples in [2^i, 2^(i+1)) ns
+
+/* Structures */
+
+typedef struct Histogram Histogram;
+struct Histogram {
+    uint64_t	count;				// Number of samples
+    uint64_t	total;				// Sum of samples (nanoseconds)
+    uint64_t	buckets[HISTOGRAM_BUCKETS];	// Samples by log2 of nanoseconds
+};
+
+typedef struct MQStats MQStats;
+struct MQStats {
+    uint64_t	published;	// Publishes accepted by the server
+    uint64_t	retrieved;	// Messages handed to the application
+    uint64_t	bytes_published;    // Body bytes of accepted publishes
+    uint64_t	bytes_retrieved;    // Body bytes of retrieved messages
+    uint64_t	errors;		// Failed sends and error responses
+    uint64_t	reconnects;	// Connections replacing ones that failed
+
+    size_t	outgoing;	// Requests waiting to be sent
+    size_t	outgoing_high;	// High-water mark of outgoing
+    size_t	incoming;	// Messages waiting to be retrieved
+    size_t	incoming_high;	// High-water mark of incoming
+
+    Histogram	connect;	// Connection establishment latency
+    Histogram	publish;	// Publish round-trip latency (including retries)
+    Histogram	queued;		// Delay between enqueue and send in outgoing
+};
+
+typedef struct MQTrace MQTrace;
+struct MQTrace {
+    Histogram	publish;	// Publish to enqueue on the server
+    Histogram	queued;		// Enqueue to dequeue (time in the server's queue)
+    Histogram	deliver;	// Dequeue to receipt by the puller
+    Histogram	retrieve;	// Receipt to retrieval by the application
+    Histogram	total;		// Publish to retrieval
+};
+
+typedef struct StatsShard StatsShard;
+struct StatsShard {
+    MQStats	    stats;	// Counters written only by owner thread
+    pthread_t	    owner;
+    StatsShard *    next;
+};
+
+typedef struct Stats Stats;
+struct Stats {
+    uint64_t	    id;		// Unique id (thread caches are keyed by it)
+    StatsShard *    shards;	// One shard per thread that recorded anything
+    Mutex	    lock;	// Protects shards list
+};
+
+/* Macros */
+
+/* Add n to counter of the calling thread's shard (no atomic read-modify-write
+ * is needed, as only the owner thread writes to it) */
+#define stats_add(s, counter, n) \
+    do { \
+        if (s) { \
+            MQStats *_local = stats_local(s); \
+            __atomic_store_n(&_local->counter, _local->counter + (n), __ATOMIC_RELAXED); \
+        } \
+    } while (0)
+
+#define stats_record(s, histogram, ns) \
+    do { \
+        if (s) { \
+            histogram_add(&stats_local(s)->histogram, ns); \
+        } \
+    } while (0)
+
+/* Functions */
+
+Stats *	    stats_create();
+void	    stats_delete(Stats *s);
+MQStats *   stats_local(Stats *s);
+void	    stats_collect(Stats *s, MQStats *out);
+
+uint64_t    stats_now();
+uint64_t    stats_epoch();
+
+void	    histogram_add(Histogram *h, uint64_t ns);
+uint64_t    histogram_percentile(const Histogram *h, double percentile);
+
+#endif
+
+/* vim: set expandtab sts=4 sw=4 ts=8 ft=c: */
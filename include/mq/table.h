@@ -0,0 +1,39 @@
+/* table.h: String keyed hash table */
+
+#ifndef TABLE_H
+#define TABLE_H
+
+#include <stddef.h>
+
+/* Structures */
+
+typedef struct Entry Entry;
+struct Entry {
+    char *	key;
+    void *	value;
+
+    Entry *	next;
+};
+
+typedef struct Table Table;
+struct Table {
+    Entry **	buckets;
+    size_t	capacity;
+    size_t	size;
+};
+
+typedef void (*TableFunc)(const char *key, void *value, void *arg);
+
+/* Functions */
+
+Table *	    table_create(size_t capacity);
+void	    table_delete(Table *t, void (*release)(void *));
+
+void	    table_insert(Table *t, const char *key, void *value);
+void *	    table_search(Table *t, const char *key);
+void *	    table_remove(Table *t, const char *key);
+void	    table_each(Table *t, TableFunc func, void *arg);
+
+#endif
+
+/* vim: set expandtab sts=4 sw=4 ts=8 ft=c: */
@@ -12,6 +12,10 @@ char chat[BUFSIZ] = "";
 #define DEFAULT_PORT "9002"
 #define DEFAULT_HOST "0.0.0.0"
 #define SPACE " "
+#define MAX_CHATS 64
+
+char chats[MAX_CHATS][NI_MAXHOST];
+size_t nchats = 0;
 
 void* worker(void* arg) {
   while (!mq_shutdown(mq)) {
@@ -22,6 +26,15 @@ void* worker(void* arg) {
   return NULL;
 }
 
+int find_chat(const char* name) {
+  for (size_t i = 0; i < nchats; i++) {
+    if (strcmp(chats[i], name) == 0) {
+      return i;
+    }
+  }
+  return -1;
+}
+
 struct cli_args {
   char name[NI_MAXHOST];
   char host[NI_MAXHOST];
@@ -144,31 +157,37 @@ int main(int argc, char* argv[]) {
     } else if (strcmp(command, "/subscribe") == 0) {
       if (strcmp(argument, "") == 0) {
         error("invalid arg\n");
-      }
-      if (strcmp(chat, "") != 0) {
-        error("already subscribe to a chat, /unsubscribe %s first before subscribing\n", chat);
         continue;
       }
-      strcpy(chat, argument);
-
       char* token = strchr(argument, ' ');
-      if (token != NULL) {
+      if (token != NULL || strlen(argument) >= NI_MAXHOST) {
         error("invalid topic to subscribe\n");
         continue;
       }
-      mq_subscribe(mq, argument);
+
+      // subscribing to a chat again just switches to it
+      if (find_chat(argument) < 0) {
+        if (nchats == MAX_CHATS) {
+          error("subscribed to too many chats, /unsubscribe one first\n");
+          continue;
+        }
+        strcpy(chats[nchats++], argument);
+        mq_subscribe(mq, argument);
+      }
+      strcpy(chat, argument);
     } else if (strcmp(command, "/unsubscribe") == 0) {
-      if (strcmp(argument, chat) != 0) {
+      int idx = find_chat(argument);
+      if (idx < 0) {
         error("invalid arg\n");
         continue;
       }
-      char* token = strchr(argument, ' ');
-      if (token != NULL) {
-        error("invalid topic to unsubscribe\n");
-        continue;
-      }
 
-      strcpy(chat, "");
+      if (idx != --nchats) {
+        strcpy(chats[idx], chats[nchats]);
+      }
+      if (strcmp(argument, chat) == 0) {
+        strcpy(chat, nchats > 0 ? chats[nchats - 1] : "");
+      }
       mq_unsubscribe(mq, argument);
     } else {
       if (strcmp(chat, "") == 0) {
@@ -1,29 +1,58 @@
 /* client.c: Message Queue Client */
 
 #include "mq/client.h"
+#include "mq/compress.h"
 #include "mq/logging.h"
-#include "mq/socket.h"
 #include "mq/string.h"
 
-#include <unistd.h>
 #include <errno.h>
+#include <inttypes.h>
+#include <unistd.h>
 
 /* Internal Constants */
 
 #define SENTINEL "SHUTDOWN"
 
+#define PUSH_RETRIES    5               // Attempts to resend after failure
+#define PUSH_BACKOFF    50000           // Microseconds before first retry
+
 /* Internal Prototypes */
 
+bool   mq_copy_body(const char *body, char **copy, size_t *length);
+Request * mq_publish_request(MessageQueue *mq, const char *topic, void *buf, size_t len, Release free_fn);
+void   mq_sequence(MessageQueue *mq, Request *req);
+bool   mq_open_brokers(MessageQueue *mq);
+void   mq_close_brokers(MessageQueue *mq);
+Queue* mq_route(MessageQueue *mq, const char *topic);
+void   mq_push(MessageQueue *mq, const char *topic, const char *method, const char *uri, const char *header, const char *value);
 void * mq_pusher(void *);
 void * mq_puller(void *);
+void   mq_deliver(MessageQueue *mq, Request *r);
+void   mq_compress(Request *r);
+bool   mq_decompress(Request *r);
+void   mq_wake(const char *topic, void *q, void *arg);
+void   mq_measure_name(const char *name, void *mq, void *arg);
+void   mq_append_name(const char *name, void *mq, void *arg);
+char * mq_take(MessageQueue *mq, Queue *q, size_t *length, uint64_t *delivery);
+void   mq_trace_record(MessageQueue *mq, Request *r);
 
 /* External Functions */
 
 /**
  * Create Message Queue withs specified name, host, and port.
+ *
+ * host may also be a cluster map: a semicolon separated list of brokers,
+ * each of which owns the topics hashing to it (see mq_route).  Publishes
+ * are sent to the broker owning their topic and messages are retrieved from
+ * every broker into the same incoming queue.
+ *
+ * For a single broker the incoming queue is a single-producer ring, whose
+ * fast path is taken when one thread retrieves (several take turns).
  * @param   name        Name of client's queue.
- * @param   host        Address of server.
- * @param   port        Port of server.
+ * @param   host        Address of server (or comma separated list of
+ *                      host[:port] servers to fail over between, or
+ *                      semicolon separated list of such brokers).
+ * @param   port        Port of server (default port of list).
  * @return  Newly allocated Message Queue structure.
  */
 MessageQueue * mq_create(const char *name, const char *host, const char *port) {
@@ -40,23 +69,66 @@ MessageQueue * mq_create(const char *name, const char *host, const char *port) {
     strncpy(mq->port, port, NI_MAXSERV - 1);
     mq->port[NI_MAXSERV - 1] = '\0';
 
-    // Initialize outgoing
-    Queue* outgoing = queue_create();
-    if (outgoing == NULL) {
+    // Initialize per-topic incoming queues
+    Table* topics = table_create(0);
+    if (topics == NULL) {
         free(mq);
         return NULL;
     }
-    mq->outgoing = outgoing;
+    mq->topics = topics;
 
-    // Initialize incoming
-    Queue* incoming = queue_create();
+    // Initialize outgoing queue of every broker, sharing connections with
+    // every other queue using the same broker
+    if (!mq_open_brokers(mq)) {
+        table_delete(topics, NULL);
+        free(mq);
+        return NULL;
+    }
+
+    // Initialize incoming: with a single broker it is only pushed to by its
+    // puller (under the endpoint lock), so a ring whose producer is
+    // lock-free on the fast path will do (retrieving threads are serialized)
+    Queue* incoming = mq->nbrokers == 1 ? queue_create_spsc(QUEUE_RING_CAPACITY) : queue_create();
     if (incoming == NULL) {
-        queue_delete(outgoing);
+        mq_close_brokers(mq);
+        table_delete(topics, NULL);
         free(mq);
         return NULL;
     }
     mq->incoming = incoming;
-    mq->shutdown = false;
+
+    // Initialize counters and per-topic traces
+    Stats* stats  = stats_create();
+    Table* traces = table_create(0);
+    if (stats == NULL || traces == NULL) {
+        if (stats) {
+            stats_delete(stats);
+        }
+        if (traces) {
+            table_delete(traces, NULL);
+        }
+        queue_delete(incoming);
+        mq_close_brokers(mq);
+        table_delete(topics, NULL);
+        free(mq);
+        return NULL;
+    }
+    mq->stats  = stats;
+    mq->traces = traces;
+    mutex_init(&mq->lock, NULL);
+
+    // Identify publishes of this queue for deduplication of retries
+    struct timespec now;
+    clock_gettime(CLOCK_REALTIME, &now);
+    snprintf(mq->producer, sizeof(mq->producer), "%x-%lx-%lx",
+        (unsigned int)getpid(), (unsigned long)(now.tv_sec * 1000000000UL + now.tv_nsec), (unsigned long)(uintptr_t)mq);
+    mq->sequence    = 0;
+    mq->created     = 0;
+
+    mq->compression = 0;
+    mq->lease       = 0;
+    mq->tracing     = 0;
+    mq->shutdown    = false;
     return mq;
 }
 
@@ -65,29 +137,116 @@ MessageQueue * mq_create(const char *name, const char *host, const char *port) {
  * @param   mq      Message Queue structure.
  */
 void mq_delete(MessageQueue *mq) {
-    queue_delete(mq->outgoing);
+    mq_close_brokers(mq);
     queue_delete(mq->incoming);
+    table_delete(mq->topics, (void (*)(void *))queue_delete);
+    stats_delete(mq->stats);
+    table_delete(mq->traces, free);
+    pthread_mutex_destroy(&mq->lock);
     free(mq);
 }
 
 /**
  * Publish one message to topic (by placing new Request in outgoing queue).
+ * Nothing is queued if the body cannot be copied.
  * @param   mq      Message Queue structure.
  * @param   topic   Topic to publish to.
  * @param   body    Message body to publish.
  */
 void mq_publish(MessageQueue *mq, const char *topic, const char *body) {
-    // get parameters
-    char* method = mq_get_method(PUT);
-    char fmt_string[] = "/topic/%s";
-    int size = snprintf(NULL, 0, fmt_string, topic);
-    char uri[size + 1];
-    sprintf(uri, fmt_string, topic);
+    char*  copy;
+    size_t length;
+    if (!mq_copy_body(body, &copy, &length)) {
+        return;
+    }
+    mq_publish_buf(mq, topic, copy, length, free);
+}
 
-    // insert request
-    Request* req = request_create(method, uri, body);
-    queue_push(mq->outgoing, req);
-    free(method);
+/**
+ * Publish one binary message to topic without copying it.
+ *
+ * The MessageQueue takes ownership of buf: it is written directly to the
+ * socket and then released with free_fn (if not NULL).
+ * @param   mq      Message Queue structure.
+ * @param   topic   Topic to publish to.
+ * @param   buf     Message body buffer (may contain NUL bytes).
+ * @param   len     Length of message body buffer.
+ * @param   free_fn Function used to release buf once sent (or NULL).
+ */
+void mq_publish_buf(MessageQueue *mq, const char *topic, void *buf, size_t len, Release free_fn) {
+    queue_push(mq_route(mq, topic), mq_publish_request(mq, topic, buf, len, free_fn));
+}
+
+/**
+ * Publish one message to topic, to be delivered to its subscribers once
+ * delay_ms milliseconds have passed.
+ *
+ * The server holds the message until it is due, so no thread has to wait
+ * for it (subscribers are those subscribed when the message is delivered).
+ * @param   mq          Message Queue structure.
+ * @param   topic       Topic to publish to.
+ * @param   body        Message body to publish.
+ * @param   delay_ms    Milliseconds before the message is delivered.
+ */
+void mq_publish_delayed(MessageQueue *mq, const char *topic, const char *body, uint64_t delay_ms) {
+    char*  copy;
+    size_t length;
+    if (!mq_copy_body(body, &copy, &length)) {
+        return;
+    }
+
+    Request* req = mq_publish_request(mq, topic, copy, length, free);
+    char delay[32];
+    snprintf(delay, sizeof(delay), "%" PRIu64, delay_ms);
+    request_set_header(req, "X-Delay", delay);
+    queue_push(mq_route(mq, topic), req);
+}
+
+/**
+ * Publish one message to topic under key.  On compacted topics, a message
+ * still pending in a subscriber's queue is replaced by the next one
+ * published with the same key.
+ * @param   mq          Message Queue structure.
+ * @param   topic       Topic to publish to.
+ * @param   key         Key of message (if NULL, published without key).
+ * @param   body        Message body to publish.
+ */
+void mq_publish_keyed(MessageQueue *mq, const char *topic, const char *key, const char *body) {
+    if (key == NULL) {
+        mq_publish(mq, topic, body);
+        return;
+    }
+
+    char*  copy;
+    size_t length;
+    if (!mq_copy_body(body, &copy, &length)) {
+        return;
+    }
+
+    Request* req = mq_publish_request(mq, topic, copy, length, free);
+    request_set_header(req, "X-Key", key);
+    queue_push(mq_route(mq, topic), req);
+}
+
+/**
+ * Publish one message to topic at priority: it is sent ahead of queued
+ * publishes of lower priority and the server delivers it ahead of queued
+ * messages of lower priority (see Request.priority).
+ * @param   mq          Message Queue structure.
+ * @param   topic       Topic to publish to.
+ * @param   body        Message body to publish.
+ * @param   priority    Priority level (PRIORITY_NORMAL to PRIORITY_URGENT).
+ */
+void mq_publish_priority(MessageQueue *mq, const char *topic, const char *body, enum REQUEST_PRIORITY priority) {
+    char*  copy;
+    size_t length;
+    if (!mq_copy_body(body, &copy, &length)) {
+        return;
+    }
+
+    Request* req  = mq_publish_request(mq, topic, copy, length, free);
+    req->priority = priority < PRIORITY_CONTROL ? priority : PRIORITY_URGENT;
+    queue_push(mq_route(mq, topic), req);
 }
 
 /**
@@ -96,16 +255,73 @@ void mq_publish(MessageQueue *mq, const char *topic, const char *body) {
  * @return  Newly allocated message body (must be freed).
  */
 char * mq_retrieve(MessageQueue *mq) {
-    Request* req = queue_pop(mq->incoming);
-    // TODO: relook at this req memory (need to free - currently not freed)
-    if (strcmp(req->body, SENTINEL) == 0) {
-        request_delete(req);
-        return NULL;
+    return mq_take(mq, mq->incoming, NULL, NULL);
+}
+
+/**
+ * Retrieve one binary message (by taking Request from incoming queue).
+ * @param   mq      Message Queue structure.
+ * @param   len     Where to store length of message body.
+ * @return  Message body buffer received from the server (must be freed), or
+ *          NULL on shutdown.
+ */
+void * mq_retrieve_buf(MessageQueue *mq, size_t *len) {
+    return mq_take(mq, mq->incoming, len, NULL);
+}
+
+/**
+ * Retrieve one message published to the specified topic.
+ *
+ * The first call for a topic registers a dedicated incoming queue; from then
+ * on the puller routes messages for that topic there instead of the shared
+ * incoming queue, so a busy topic cannot delay a quiet one.
+ * @param   mq      Message Queue structure.
+ * @param   topic   Topic to retrieve from.
+ * @return  Newly allocated message body (must be freed).
+ */
+char * mq_retrieve_topic(MessageQueue *mq, const char *topic) {
+    mutex_lock(&mq->lock);
+    Queue* q = table_search(mq->topics, topic);
+    if (q == NULL) {
+        q = queue_create();
+        table_insert(mq->topics, topic, q);
+        if (mq_shutdown(mq)) {
+            queue_push(q, request_create(NULL, NULL, SENTINEL));
+        }
+    }
+    mutex_unlock(&mq->lock);
+    return mq_take(mq, q, NULL, NULL);
+}
+
+/**
+ * Retrieve one message without acknowledging it.
+ *
+ * With leased delivery enabled (see mq_set_lease), the message stays in
+ * flight on the server until it is acknowledged with mq_ack and is
+ * redelivered if that does not happen before the lease expires.  The other
+ * retrieve functions acknowledge messages as soon as they are handed over.
+ * @param   mq          Message Queue structure.
+ * @param   delivery    Where to store delivery id (0 if not leased).
+ * @return  Newly allocated message body (must be freed).
+ */
+char * mq_retrieve_lease(MessageQueue *mq, uint64_t *delivery) {
+    return mq_take(mq, mq->incoming, NULL, delivery);
+}
+
+/**
+ * Acknowledge leased delivery so the server does not redeliver it.
+ *
+ * Acknowledgements are batched and piggybacked on the next request for new
+ * messages to the broker that delivered the message (whose index is kept
+ * in the top bits of the delivery id).
+ * @param   mq          Message Queue structure.
+ * @param   delivery    Delivery id returned by mq_retrieve_lease.
+ */
+void mq_ack(MessageQueue *mq, uint64_t delivery) {
+    size_t broker = delivery >> MQ_BROKER_SHIFT;
+    if (delivery && broker < mq->nbrokers) {
+        endpoint_ack(mq->brokers[broker].endpoint, delivery & ((1ULL << MQ_BROKER_SHIFT) - 1));
     }
-    char* body = malloc(sizeof(char) * (strlen(req->body) + 1));
-    strcpy(body, req->body);
-    request_delete(req);
-    return body;
 }
 
 /**
@@ -120,8 +336,7 @@ void mq_subscribe(MessageQueue *mq, const char *topic) {
     char uri[size + 1];
     sprintf(uri, fmt_string, mq->name, topic);
 
-    Request* req = request_create(method, uri, NULL);
-    queue_push(mq->outgoing, req);
+    mq_push(mq, topic, method, uri, NULL, NULL);
     free(method);
 }
 
@@ -137,21 +352,78 @@ void mq_unsubscribe(MessageQueue *mq, const char *topic) {
     char uri[size + 1];
     sprintf(uri, fmt_string, mq->name, topic);
 
-    Request* req = request_create(method, uri, NULL);
-    queue_push(mq->outgoing, req);
+    mq_push(mq, topic, method, uri, NULL, NULL);
+    free(method);
+}
+
+/**
+ * Join consumer group for topic: the group (a queue shared by its members)
+ * is subscribed to topic and each of its messages is delivered to only one
+ * member, chosen by the group's policy.
+ * @param   mq      Message Queue structure.
+ * @param   group   Name of consumer group.
+ * @param   topic   Topic string to subscribe group to.
+ * @param   policy  How to pick the member that receives the next message
+ *                  (only applies when the group is created; least
+ *                  outstanding requires leased delivery, see mq_set_lease).
+ **/
+void mq_join(MessageQueue *mq, const char *group, const char *topic, enum GROUP_POLICY policy) {
+    char* method = mq_get_method(PUT);
+    char fmt_string[] = "/group/%s/%s";
+    int size = snprintf(NULL, 0, fmt_string, group, mq->name);
+    char uri[size + 1];
+    sprintf(uri, fmt_string, group, mq->name);
+
+    mq_push(mq, NULL, method, uri, "X-Policy", policy == LEAST_OUTSTANDING ? "least-outstanding" : "round-robin");
+
+    size = snprintf(NULL, 0, "/subscription/%s/%s", group, topic);
+    char subscription[size + 1];
+    sprintf(subscription, "/subscription/%s/%s", group, topic);
+    mq_push(mq, topic, method, subscription, NULL, NULL);
+    free(method);
+}
+
+/**
+ * Leave consumer group.
+ * @param   mq      Message Queue structure.
+ * @param   group   Name of consumer group.
+ **/
+void mq_leave(MessageQueue *mq, const char *group) {
+    char* method = mq_get_method(DELETE);
+    char fmt_string[] = "/group/%s/%s";
+    int size = snprintf(NULL, 0, fmt_string, group, mq->name);
+    char uri[size + 1];
+    sprintf(uri, fmt_string, group, mq->name);
+
+    mq_push(mq, NULL, method, uri, NULL, NULL);
     free(method);
 }
 
 /**
- * Start running the background threads:
+ * Start running the background threads of every broker:
  *  1. First thread should continuously send requests from outgoing queue.
  *  2. Second thread should continuously receive reqeusts to incoming queue.
+ *
+ * The second thread is shared by every MessageQueue using the same server
+ * and is started by the first one.
  * @param   mq      Message Queue structure.
  */
 void mq_start(MessageQueue *mq) {
-    mq_subscribe(mq, "SHUTDOWN");
-    pthread_create(&mq->pusher, NULL, mq_pusher, (void*) mq);
-    pthread_create(&mq->puller, NULL, mq_puller, (void*) mq);
+    for (size_t b = 0; b < mq->nbrokers; b++) {
+        Broker*   broker = &mq->brokers[b];
+        Endpoint* e      = broker->endpoint;
+
+        pthread_create(&broker->pusher, NULL, mq_pusher, (void*) broker);
+
+        mutex_lock(&e->lock);
+        table_insert(e->members, mq->name, mq);
+        if (!e->pulling) {
+            e->pulling = true;
+            thread_create(&e->puller, NULL, mq_puller, (void*) e);
+        }
+        cond_broadcast(&e->changed);
+        mutex_unlock(&e->lock);
+    }
 }
 
 /**
@@ -162,10 +434,30 @@ void mq_start(MessageQueue *mq) {
 void mq_stop(MessageQueue *mq) {
     mq->shutdown = true;
 
-    // Send sentinel message
-    mq_publish(mq, "SHUTDOWN", "SHUTDOWN");
-    pthread_join(mq->pusher, NULL);
-    pthread_join(mq->puller, NULL);
+    // Flush outgoing requests and stop pushers
+    for (size_t b = 0; b < mq->nbrokers; b++) {
+        queue_push(mq->brokers[b].outgoing, request_create(NULL, NULL, SENTINEL));
+    }
+    for (size_t b = 0; b < mq->nbrokers; b++) {
+        pthread_join(mq->brokers[b].pusher, NULL);
+    }
+
+    // Stop receiving from shared pullers
+    for (size_t b = 0; b < mq->nbrokers; b++) {
+        Endpoint* e = mq->brokers[b].endpoint;
+        mutex_lock(&e->lock);
+        if (table_search(e->members, mq->name) == mq) {
+            table_remove(e->members, mq->name);
+        }
+        cond_broadcast(&e->changed);
+        mutex_unlock(&e->lock);
+    }
+
+    // Send sentinel message to every retriever
+    mutex_lock(&mq->lock);
+    mq_wake(NULL, mq->incoming, NULL);
+    table_each(mq->topics, mq_wake, NULL);
+    mutex_unlock(&mq->lock);
 }
 
 /**
@@ -176,84 +468,624 @@ bool mq_shutdown(MessageQueue *mq) {
     return mq->shutdown;
 }
 
+/**
+ * Compress published message bodies of at least threshold bytes.
+ * @param   mq          Message Queue structure.
+ * @param   threshold   Minimum body length to compress (0 disables).
+ */
+void mq_set_compression(MessageQueue *mq, size_t threshold) {
+    mq->compression = threshold;
+}
+
+/**
+ * Lease retrieved messages: the server keeps each message in flight for
+ * seconds and redelivers it unless it is acknowledged, so messages are not
+ * lost if the client fails before handing them over.  Must be set before
+ * mq_start.
+ * @param   mq          Message Queue structure.
+ * @param   seconds     Visibility timeout (0 disables).
+ */
+void mq_set_lease(MessageQueue *mq, unsigned int seconds) {
+    mq->lease = seconds;
+}
+
+/**
+ * Trace a fraction of publishes from now on: they carry a trace id and
+ * their publish time, the server stamps when they were enqueued and
+ * dequeued and the puller when they were received, so subscribers can
+ * break the latency of each topic down by hop (see mq_trace).  Publishes
+ * are sampled evenly in the order they are created.  Stamps are wall-clock
+ * times, so hops across hosts are only as accurate as their clock
+ * synchronization.
+ * @param   mq          Message Queue structure.
+ * @param   rate        Fraction of publishes traced (0 disables, 1 traces all).
+ */
+void mq_set_tracing(MessageQueue *mq, double rate) {
+    mq->tracing = rate < 0 ? 0 : (rate > 1 ? 1 : rate);
+}
+
+/**
+ * Snapshot counters, latency histograms and queue depths of Message Queue.
+ *
+ * Every thread counts into its own shard, so this sums the shards rather
+ * than the hot paths sharing (and contending on) one set of counters.
+ * Outgoing depths are summed over the brokers of a cluster map.
+ * @param   mq      Message Queue structure.
+ * @param   out     MQStats structure to fill.
+ */
+void mq_stats(MessageQueue *mq, MQStats *out) {
+    stats_collect(mq->stats, out);
+    out->outgoing      = 0;
+    out->outgoing_high = 0;
+    for (size_t b = 0; b < mq->nbrokers; b++) {
+        out->outgoing      += queue_size(mq->brokers[b].outgoing);
+        out->outgoing_high += queue_high_water(mq->brokers[b].outgoing);
+    }
+    out->incoming      = queue_size(mq->incoming);
+    out->incoming_high = queue_high_water(mq->incoming);
+}
+
+/**
+ * Snapshot per-hop latency histograms of the traced messages retrieved
+ * from topic.
+ * @param   mq      Message Queue structure.
+ * @param   topic   Topic messages were published to.
+ * @param   out     MQTrace structure to fill.
+ * @return  Whether or not any traced message was retrieved from topic.
+ */
+bool mq_trace(MessageQueue *mq, const char *topic, MQTrace *out) {
+    mutex_lock(&mq->lock);
+    MQTrace* trace = table_search(mq->traces, topic);
+    if (trace) {
+        *out = *trace;
+    }
+    mutex_unlock(&mq->lock);
+    return trace != NULL;
+}
+
 /* Internal Functions */
 
 /**
- * Pusher thread takes messages from outgoing queue and sends them to server.
- * @param   arg     Message Queue structure.
+ * Copy NUL terminated message body, so it can be published without copying
+ * it again (see mq_publish_buf).
+ * @param   body    Message body to copy.
+ * @param   copy    Where to store newly allocated copy (must be freed).
+ * @param   length  Where to store length of body.
+ * @return  Whether or not body could be copied.
+ **/
+bool mq_copy_body(const char *body, char **copy, size_t *length) {
+    *length = strlen(body);
+    *copy   = malloc(*length + 1);
+    if (*copy == NULL) {
+        error("Unable to allocate message body of %zu bytes", *length);
+        return false;
+    }
+    memcpy(*copy, body, *length + 1);
+    return true;
+}
+
+/**
+ * Create Request publishing buffer to topic (compressed if it is at least
+ * the compression threshold), tagged with the producer id so the server can
+ * drop resent duplicates (its sequence number is only assigned when it is
+ * sent, see mq_sequence).
+ * @param   mq      Message Queue structure.
+ * @param   topic   Topic to publish to.
+ * @param   buf     Message body buffer (ownership is transferred).
+ * @param   len     Length of message body buffer.
+ * @param   free_fn Function used to release buf once sent (or NULL).
+ * @return  Newly allocated Request structure.
+ **/
+Request * mq_publish_request(MessageQueue *mq, const char *topic, void *buf, size_t len, Release free_fn) {
+    // get parameters
+    char* method = mq_get_method(PUT);
+    char fmt_string[] = "/topic/%s";
+    int size = snprintf(NULL, 0, fmt_string, topic);
+    char uri[size + 1];
+    sprintf(uri, fmt_string, topic);
+
+    Request* req = request_create_buf(method, uri, buf, len, free_fn);
+    if (mq->compression && len >= mq->compression) {
+        mq_compress(req);
+    }
+    request_set_header(req, "X-Producer", mq->producer);
+
+    // Trace publishes whose number crosses a multiple of 1 / rate
+    uint64_t number = __atomic_add_fetch(&mq->created, 1, __ATOMIC_SEQ_CST);
+    double   rate   = mq->tracing;
+    if (rate > 0 && (uint64_t)(number * rate) != (uint64_t)((number - 1) * rate)) {
+        char trace[96];
+        char published[32];
+        snprintf(trace, sizeof(trace), "%s-%" PRIu64, mq->producer, number);
+        snprintf(published, sizeof(published), "%" PRIu64, stats_epoch());
+        request_set_header(req, "X-Trace", trace);
+        request_set_header(req, "X-Trace-Published", published);
+    }
+    req->queued = stats_now();
+    free(method);
+    return req;
+}
+
+/**
+ * Tag publish with the next sequence number, just before it is first sent.
+ *
+ * Sequence numbers are assigned in the order publishes are sent rather
+ * than created, as the priority of outgoing queues reorders them and the
+ * server treats numbers far below the highest it has seen as duplicates.
+ * Retries resend the same Request, and so the same number.
+ * @param   mq      Message Queue structure.
+ * @param   req     Publish Request structure.
+ **/
+void mq_sequence(MessageQueue *mq, Request *req) {
+    char     sequence[32];
+    uint64_t number = __atomic_add_fetch(&mq->sequence, 1, __ATOMIC_SEQ_CST);
+    snprintf(sequence, sizeof(sequence), "%" PRIu64, number);
+    request_set_header(req, "X-Sequence", sequence);
+}
+
+/**
+ * Open every broker of the cluster map in host: acquire its shared Endpoint
+ * and create its outgoing queue, which sends requests by priority.  The
+ * first broker's are also kept as mq->endpoint and mq->outgoing.
+ * @param   mq      Message Queue structure.
+ * @return  Whether or not every broker was opened (none are left open
+ *          otherwise).
+ **/
+bool mq_open_brokers(MessageQueue *mq) {
+    char        map[NI_MAXHOST];
+    char*       state = NULL;
+    const char* host;
+
+    strcpy(map, mq->host);
+    mq->nbrokers = 0;
+    for (host = strtok_r(map, ";", &state); host; host = strtok_r(NULL, ";", &state)) {
+        if (mq->nbrokers == MQ_BROKERS) {
+            error("Ignoring brokers of %s beyond the first %d", mq->host, MQ_BROKERS);
+            break;
+        }
+
+        Broker* broker   = &mq->brokers[mq->nbrokers];
+        broker->mq       = mq;
+        broker->outgoing = queue_create_priority();
+        broker->endpoint = broker->outgoing ? endpoint_acquire(host, mq->port) : NULL;
+        if (broker->endpoint == NULL) {
+            if (broker->outgoing) {
+                queue_delete(broker->outgoing);
+            }
+            mq_close_brokers(mq);
+            return false;
+        }
+        mq->nbrokers++;
+    }
+
+    if (mq->nbrokers == 0) {
+        return false;
+    }
+    mq->outgoing = mq->brokers[0].outgoing;
+    mq->endpoint = mq->brokers[0].endpoint;
+    return true;
+}
+
+/**
+ * Delete outgoing queues of the brokers and release their Endpoints.
+ * @param   mq      Message Queue structure.
+ **/
+void mq_close_brokers(MessageQueue *mq) {
+    for (size_t b = 0; b < mq->nbrokers; b++) {
+        queue_delete(mq->brokers[b].outgoing);
+        endpoint_release(mq->brokers[b].endpoint);
+    }
+    mq->nbrokers = 0;
+}
+
+/**
+ * Return outgoing queue of the broker owning topic: brokers own the topics
+ * whose FNV-1a hash modulo the number of brokers is their index in the
+ * cluster map, so every client with the same map agrees on the owner.
+ * @param   mq      Message Queue structure.
+ * @param   topic   Topic name.
+ * @return  Outgoing Queue structure.
+ **/
+Queue * mq_route(MessageQueue *mq, const char *topic) {
+    if (mq->nbrokers == 1) {
+        return mq->outgoing;
+    }
+
+    uint64_t hash = 14695981039346656037ULL;
+    for (const char *c = topic; *c; c++) {
+        hash ^= (unsigned char)*c;
+        hash *= 1099511628211ULL;
+    }
+    return mq->brokers[hash % mq->nbrokers].outgoing;
+}
+
+/**
+ * Push control request (with an optional header) to the broker owning
+ * topic, or to every broker if topic is NULL or a wildcard pattern (which
+ * can match topics owned by any of them).  Control requests are sent ahead
+ * of queued publishes.
+ * @param   mq      Message Queue structure.
+ * @param   topic   Topic name (or NULL).
+ * @param   method  HTTP method.
+ * @param   uri     Request URI.
+ * @param   header  Header name (or NULL).
+ * @param   value   Header value.
+ **/
+void mq_push(MessageQueue *mq, const char *topic, const char *method, const char *uri, const char *header, const char *value) {
+    bool everywhere = topic == NULL || strpbrk(topic, "*#") != NULL;
+    for (size_t b = 0; b < mq->nbrokers; b++) {
+        Queue*   outgoing = everywhere ? mq->brokers[b].outgoing : mq_route(mq, topic);
+        Request* req      = request_create(method, uri, NULL);
+        req->priority     = PRIORITY_CONTROL;
+        if (header) {
+            request_set_header(req, header, value);
+        }
+        queue_push(outgoing, req);
+        if (!everywhere) {
+            break;
+        }
+    }
+}
+
+/**
+ * Pusher thread takes messages from outgoing queue of broker and sends them
+ * to it.
+ *
+ * Requests that fail to get a response are resent with exponential backoff;
+ * publishes carry a sequence number (assigned here, so in the order they are
+ * sent), so the server ignores any that it had received after all.
+ * @param   arg     Broker structure.
  **/
 void * mq_pusher(void *arg) {
     // Producer
-    MessageQueue* mq = (MessageQueue*) arg;
-    while (!mq_shutdown(mq)) {
-        // Send message to server
-        Request* req = queue_pop(mq->outgoing);
-        FILE* socket = socket_connect(mq->host, mq->port);
-        if (socket == NULL) {
-            error("socket is null!\n");
+    Broker*       broker = (Broker*) arg;
+    MessageQueue* mq     = broker->mq;
+    while (true) {
+        // Send message to server (sentinel has no method)
+        Request* req = queue_pop(broker->outgoing);
+        if (req->method == NULL) {
+            request_delete(req);
+            break;
+        }
+
+        uint64_t started = stats_now();
+        if (req->queued) {
+            stats_record(mq->stats, queued, started - req->queued);
+            mq_sequence(mq, req);
+        }
+
+        Request* res = endpoint_send(broker->endpoint, req, mq->stats);
+        for (int attempt = 0; res == NULL && attempt < PUSH_RETRIES; attempt++) {
+            usleep(PUSH_BACKOFF << attempt);
+            res = endpoint_send(broker->endpoint, req, mq->stats);
+        }
+        if (res) {
+            if (res->status >= 400) {
+                stats_add(mq->stats, errors, 1);
+            } else if (req->queued) {
+                stats_record(mq->stats, publish, stats_now() - started);
+                stats_add(mq->stats, published, 1);
+                stats_add(mq->stats, bytes_published, req->length);
+            }
+            request_delete(res);
+        } else {
+            error("Dropping %s %s after %d retries", req->method, req->uri, PUSH_RETRIES);
         }
-        request_write(req, socket);
-        fflush(socket);
         request_delete(req);
     }
     return NULL;
 }
 
 /**
- * Puller thread requests new messages from server and then puts them in
- * incoming queue.
- * @param   arg     Message Queue structure.
+ * Puller thread requests new messages from server for every started
+ * MessageQueue sharing the endpoint and then puts them in the incoming queue
+ * of the MessageQueue named by the response.
+ * @param   arg     Endpoint structure.
  **/
 void * mq_puller(void *arg) {
     // Consumer
-    MessageQueue* mq = (MessageQueue*) arg;
-    while (!mq_shutdown(mq)) {
-        char* method = mq_get_method(GET);
-        char fmt_string[] = "/queue/%s";
-        int size = snprintf(NULL, 0, fmt_string, mq->name);
-        char uri[size + 1];
-        sprintf(uri, fmt_string, mq->name);
-        Request* req = request_create(method, uri, NULL);
-
-        FILE* socket = socket_connect(mq->host, mq->port);
-        request_write(req, socket);
-        fflush(socket);
-        char response[BUFSIZ];
-        int x = read(fileno(socket), response, BUFSIZ);
-        if (x == -1) {
-            error("THERE IS AN ERROR from reading by puller %d\n", errno);
+    Endpoint* e = (Endpoint*) arg;
+    char* method = mq_get_method(GET);
+
+    while (true) {
+        // Wait for started queues and collect their names
+        mutex_lock(&e->lock);
+        while (e->members->size == 0 && !e->closing) {
+            cond_wait(&e->changed, &e->lock);
         }
-        response[x] = '\0';
-        // Parse response into response code and body
-        int response_code;
-        if (sscanf(response, "HTTP/1.%*d %d", &response_code) == -1) {
-            error("Error parsing response code\n");
+        if (e->closing) {
+            mutex_unlock(&e->lock);
+            break;
         }
 
-        if (response_code == 200) {
-            int content_length;
-            char* content_length_start = strstr(response, "Content-Length:");
-            if (sscanf(content_length_start, "Content-Length: %d", &content_length) == -1) {
-                error("error parsing content length\n");
+        size_t length = 0;
+        table_each(e->members, mq_measure_name, &length);
+        char* names  = malloc(length + 1);
+        char* cursor = names;
+        table_each(e->members, mq_append_name, &cursor);
+        *cursor = '\0';
+        mutex_unlock(&e->lock);
+
+        // Wait for message on any of the queues (acknowledging earlier ones:
+        // a backlog beyond one header's worth is sent with PUT /ack first)
+        endpoint_flush_acks(e, ENDPOINT_ACKS);
+        Request* req  = request_create(method, "/queues", names);
+        char*    acks = endpoint_take_acks(e);
+        if (acks) {
+            request_set_header(req, "X-Ack", acks);
+        }
+        Request* res = endpoint_send(e, req, NULL);
+        request_delete(req);
+        free(names);
+
+        if (res == NULL) {
+            if (acks) {
+                endpoint_restore_acks(e, acks);
+                free(acks);
             }
+            sleep(1);
+            continue;
+        }
+        free(acks);
 
-            char* body = strstr(response, "\r\n\r\n");
-            body += 4; // move past the whitespaces
-            body[content_length] = '\0';
-            // Create the Request   
-            Request* r = request_create(NULL, NULL, body);
+        // Decompress outside of the endpoint lock; a corrupt message is
+        // acknowledged anyway as redelivery cannot fix it
+        if (res->status == 200 && res->body && request_get_header(res, "X-Codec") && !mq_decompress(res)) {
+            const char* delivery = request_get_header(res, "X-Delivery");
+            error("Unable to decompress message for %s", request_get_header(res, "X-Queue"));
+            if (delivery) {
+                endpoint_ack(e, strtoull(delivery, NULL, 10));
+            }
+            request_delete(res);
+            continue;
+        }
 
-            // Put into incoming queue
-            queue_push(mq->incoming, r);
+        // Route message to the MessageQueue it was retrieved for
+        if (res->status == 200 && res->body) {
+            const char* queue = request_get_header(res, "X-Queue");
+            if (request_get_header(res, "X-Trace")) {
+                char received[32];
+                snprintf(received, sizeof(received), "%" PRIu64, stats_epoch());
+                request_set_header(res, "X-Trace-Received", received);
+            }
+            mutex_lock(&e->lock);
+            MessageQueue* mq = queue ? table_search(e->members, queue) : NULL;
+            if (mq) {
+                // Tag deliveries of other brokers of a cluster map for mq_ack
+                for (size_t b = 1; b < mq->nbrokers; b++) {
+                    if (mq->brokers[b].endpoint == e) {
+                        char broker[16];
+                        snprintf(broker, sizeof(broker), "%zu", b);
+                        request_set_header(res, "X-Broker", broker);
+                        break;
+                    }
+                }
+                mq_deliver(mq, res);
+                res = NULL;
+            }
+            mutex_unlock(&e->lock);
         }
 
         // cleanup resources
-        request_delete(req);
-        free(method);
+        if (res) {
+            request_delete(res);
+        }
     }
+    free(method);
     return NULL;
 }
 
+/**
+ * Route received (and decompressed) message to its topic's incoming queue if
+ * one has been registered by mq_retrieve_topic, otherwise to the shared
+ * incoming queue.
+ * @param   mq      Message Queue structure.
+ * @param   r       Received message (ownership is transferred).
+ **/
+void mq_deliver(MessageQueue *mq, Request *r) {
+    const char* topic = request_get_header(r, "X-Topic");
+    Queue* q = mq->incoming;
+
+    if (topic) {
+        mutex_lock(&mq->lock);
+        Queue* tq = table_search(mq->topics, topic);
+        if (tq) {
+            q = tq;
+        }
+        mutex_unlock(&mq->lock);
+    }
+
+    queue_push(q, r);
+}
+
+/**
+ * Replace Request body with its compressed form (if that is smaller) and
+ * record the codec and original length in the X-Codec and X-Length headers.
+ * @param   r       Request structure.
+ **/
+void mq_compress(Request *r) {
+    size_t capacity = lz_bound(r->length);
+    char*  buffer   = malloc(capacity);
+    size_t length   = buffer ? lz_compress(r->body, r->length, buffer, capacity) : 0;
+    if (length == 0 || length >= r->length) {
+        free(buffer);
+        return;
+    }
+
+    char original[32];
+    snprintf(original, sizeof(original), "%zu", r->length);
+    request_set_header(r, "X-Codec", LZ_CODEC);
+    request_set_header(r, "X-Length", original);
+
+    if (r->release) {
+        r->release(r->body);
+    }
+    r->body    = buffer;
+    r->length  = length;
+    r->release = free;
+}
+
+/**
+ * Replace compressed Request body with the original body.
+ * @param   r       Request structure.
+ * @return  Whether or not the body was decompressed.
+ **/
+bool mq_decompress(Request *r) {
+    const char* codec    = request_get_header(r, "X-Codec");
+    const char* original = request_get_header(r, "X-Length");
+    if (!streq(codec, LZ_CODEC) || original == NULL) {
+        return false;
+    }
+
+    size_t length = strtoull(original, NULL, 10);
+    char*  buffer = malloc(length + 1);
+    if (buffer == NULL || lz_decompress(r->body, r->length, buffer, length) != (ssize_t)length) {
+        free(buffer);
+        return false;
+    }
+    buffer[length] = '\0';
+
+    if (r->release) {
+        r->release(r->body);
+    }
+    r->body    = buffer;
+    r->length  = length;
+    r->release = free;
+    return true;
+}
+
+/**
+ * Accumulate length of newline terminated queue name (and lease).
+ * @param   name    Queue name.
+ * @param   mq      Message Queue structure.
+ * @param   arg     Total length.
+ **/
+void mq_measure_name(const char *name, void *mq, void *arg) {
+    unsigned int lease = ((MessageQueue *)mq)->lease;
+    *(size_t *)arg += lease ? snprintf(NULL, 0, "%s %u\n", name, lease) : strlen(name) + 1;
+}
+
+/**
+ * Append newline terminated queue name to buffer, followed by its lease in
+ * seconds if leased delivery is enabled.
+ * @param   name    Queue name.
+ * @param   mq      Message Queue structure.
+ * @param   arg     Pointer to end of buffer (advanced).
+ **/
+void mq_append_name(const char *name, void *mq, void *arg) {
+    char**       cursor = (char **)arg;
+    unsigned int lease  = ((MessageQueue *)mq)->lease;
+    if (lease) {
+        *cursor += sprintf(*cursor, "%s %u\n", name, lease);
+        return;
+    }
+
+    size_t length = strlen(name);
+    memcpy(*cursor, name, length);
+    (*cursor)[length] = '\n';
+    *cursor += length + 1;
+}
+
+/**
+ * Push shutdown sentinel onto an incoming queue.
+ * @param   topic   Topic name (unused).
+ * @param   q       Incoming Queue structure.
+ * @param   arg     Unused.
+ **/
+void mq_wake(const char *topic, void *q, void *arg) {
+    queue_push(q, request_create(NULL, NULL, SENTINEL));
+}
+
+/**
+ * Take one message body from queue (blocks until one is available).
+ * @param   mq          Message Queue structure.
+ * @param   q           Queue structure.
+ * @param   length      Where to store length of body (may be NULL).
+ * @param   delivery    Where to store delivery id of leased message, or NULL
+ *                      to acknowledge it immediately.
+ * @return  Newly allocated message body (must be freed), or NULL on shutdown.
+ **/
+char * mq_take(MessageQueue *mq, Queue *q, size_t *length, uint64_t *delivery) {
+    Request* req = queue_pop(q);
+    if (req->status == 0 || req->body == NULL) {     // Sentinels are never received
+        request_delete(req);
+        if (delivery) {
+            *delivery = 0;
+        }
+        return NULL;
+    }
+
+    if (length) {
+        *length = req->length;
+    }
+    stats_add(mq->stats, retrieved, 1);
+    stats_add(mq->stats, bytes_retrieved, req->length);
+    if (request_get_header(req, "X-Trace")) {
+        mq_trace_record(mq, req);
+    }
+
+    const char* leased = request_get_header(req, "X-Delivery");
+    const char* broker = request_get_header(req, "X-Broker");
+    uint64_t    id     = leased ? strtoull(leased, NULL, 10) : 0;
+    if (id && broker) {
+        id |= strtoull(broker, NULL, 10) << MQ_BROKER_SHIFT;
+    }
+    if (delivery) {
+        *delivery = id;
+    } else {
+        mq_ack(mq, id);
+    }
+
+    // Hand the body over rather than copying it
+    char* body = req->body;
+    req->body = NULL;
+    request_delete(req);
+    return body;
+}
+
+/**
+ * Record hops of traced message retrieved now in the MQTrace of its topic.
+ * Hops with a missing stamp are skipped and ones made negative by clock
+ * skew between hosts are counted as zero.  Nothing is recorded if the
+ * MQTrace of a new topic cannot be allocated.
+ * @param   mq      Message Queue structure.
+ * @param   r       Traced message.
+ **/
+void mq_trace_record(MessageQueue *mq, Request *r) {
+    const char* names[] = {"X-Trace-Published", "X-Trace-Enqueued", "X-Trace-Dequeued", "X-Trace-Received"};
+    uint64_t    stamps[5];
+    for (size_t i = 0; i < 4; i++) {
+        const char* value = request_get_header(r, names[i]);
+        stamps[i] = value ? strtoull(value, NULL, 10) : 0;
+    }
+    stamps[4] = stats_epoch();
+
+    const char* topic = request_get_header(r, "X-Topic");
+    if (topic == NULL || stamps[0] == 0) {
+        return;
+    }
+
+    mutex_lock(&mq->lock);
+    MQTrace* trace = table_search(mq->traces, topic);
+    if (trace == NULL) {
+        trace = calloc(1, sizeof(MQTrace));
+        if (trace == NULL) {
+            mutex_unlock(&mq->lock);
+            return;
+        }
+        table_insert(mq->traces, topic, trace);
+    }
+
+    Histogram* hops[] = {&trace->publish, &trace->queued, &trace->deliver, &trace->retrieve};
+    for (size_t i = 0; i < 4; i++) {
+        if (stamps[i] && stamps[i + 1]) {
+            histogram_add(hops[i], stamps[i + 1] > stamps[i] ? (stamps[i + 1] - stamps[i]) * 1000 : 0);
+        }
+    }
+    histogram_add(&trace->total, stamps[4] > stamps[0] ? (stamps[4] - stamps[0]) * 1000 : 0);
+    mutex_unlock(&mq->lock);
+}
+
 /**
  * Retrieves a string HTTP method.
  * @param   method    HTTP_METHOD enum.
@@ -0,0 +1,244 @@
+/* compress.c: LZ compression of message bodies */
+
+#include "mq/compress.h"
+
+#include <stdbool.h>
+#include <stdint.h>
+#include <string.h>
+
+/*
+ * Block format (same layout as an LZ4 block):
+ *
+ *  Each sequence starts with a token byte whose high nibble is the number
+ *  of literals and low nibble is the match length minus LZ_MIN_MATCH.  A
+ *  nibble of 15 is followed by extra length bytes (255 means keep adding).
+ *  The literals follow, then a 2 byte little-endian match offset and any
+ *  extra match length bytes.  The last sequence only has literals.
+ */
+
+/* Internal Constants */
+
+#define LZ_HASH_BITS    12
+#define LZ_MIN_MATCH    4
+#define LZ_MAX_OFFSET   65535
+#define LZ_SKIP_SHIFT   6       // Search faster through incompressible data
+
+/* Internal Functions */
+
+static inline uint32_t lz_read32(const uint8_t *p) {
+    uint32_t value;
+    memcpy(&value, p, sizeof(value));
+    return value;
+}
+
+static inline uint32_t lz_hash(uint32_t sequence) {
+    return (sequence * 2654435761U) >> (32 - LZ_HASH_BITS);
+}
+
+/**
+ * Write extra length bytes for length nibble of 15.
+ * @param   op          Pointer to output position (advanced).
+ * @param   oend        End of output buffer.
+ * @param   length      Remaining length (after subtracting 15).
+ * @return  Whether or not there was enough room.
+ */
+static bool lz_write_length(uint8_t **op, uint8_t *oend, size_t length) {
+    for (; length >= 255; length -= 255) {
+        if (*op >= oend) {
+            return false;
+        }
+        *(*op)++ = 255;
+    }
+    if (*op >= oend) {
+        return false;
+    }
+    *(*op)++ = length;
+    return true;
+}
+
+/**
+ * Read extra length bytes for length nibble of 15.
+ * @param   ip          Pointer to input position (advanced).
+ * @param   iend        End of input buffer.
+ * @param   length      Length to add to.
+ * @return  Whether or not the input was long enough.
+ */
+static bool lz_read_length(const uint8_t **ip, const uint8_t *iend, size_t *length) {
+    uint8_t byte;
+    do {
+        if (*ip >= iend) {
+            return false;
+        }
+        byte     = *(*ip)++;
+        *length += byte;
+    } while (byte == 255);
+    return true;
+}
+
+/**
+ * Write one sequence.
+ * @param   op          Pointer to output position (advanced).
+ * @param   oend        End of output buffer.
+ * @param   literals    Literal bytes.
+ * @param   nliterals   Number of literal bytes.
+ * @param   offset      Match offset (0 for the final literals only sequence).
+ * @param   nmatch      Match length minus LZ_MIN_MATCH.
+ * @return  Whether or not there was enough room.
+ */
+static bool lz_write_sequence(uint8_t **op, uint8_t *oend, const uint8_t *literals, size_t nliterals, size_t offset, size_t nmatch) {
+    if (*op >= oend) {
+        return false;
+    }
+
+    uint8_t *token = (*op)++;
+    *token = (nliterals < 15 ? nliterals : 15) << 4;
+    if (nliterals >= 15 && !lz_write_length(op, oend, nliterals - 15)) {
+        return false;
+    }
+
+    if ((size_t)(oend - *op) < nliterals) {
+        return false;
+    }
+    memcpy(*op, literals, nliterals);
+    *op += nliterals;
+
+    if (offset == 0) {
+        return true;
+    }
+
+    if (oend - *op < 2) {
+        return false;
+    }
+    *(*op)++ = offset & 0xFF;
+    *(*op)++ = offset >> 8;
+
+    *token |= nmatch < 15 ? nmatch : 15;
+    return nmatch < 15 || lz_write_length(op, oend, nmatch - 15);
+}
+
+/* External Functions */
+
+/**
+ * Compute maximum compressed size of input.
+ * @param   length      Length of input.
+ * @return  Capacity needed by lz_compress for any input of that length.
+ */
+size_t lz_bound(size_t length) {
+    return length + length / 255 + 16;
+}
+
+/**
+ * Compress buffer.
+ * @param   source      Input buffer.
+ * @param   length      Length of input buffer.
+ * @param   destination Output buffer.
+ * @param   capacity    Capacity of output buffer.
+ * @return  Compressed size, or 0 if it did not fit in the output buffer.
+ */
+size_t lz_compress(const void *source, size_t length, void *destination, size_t capacity) {
+    const uint8_t *src    = source;
+    const uint8_t *ip     = src;
+    const uint8_t *anchor = src;
+    const uint8_t *end    = src + length;
+    const uint8_t *mlimit = length > LZ_MIN_MATCH ? end - LZ_MIN_MATCH : src;
+    uint8_t       *op     = destination;
+    uint8_t       *oend   = op + capacity;
+    uint32_t       table[1 << LZ_HASH_BITS] = {0};
+
+    while (ip < mlimit) {
+        uint32_t       sequence = lz_read32(ip);
+        uint32_t       hash     = lz_hash(sequence);
+        const uint8_t *ref      = src + table[hash];
+        table[hash] = ip - src;
+
+        if (ref >= ip || ip - ref > LZ_MAX_OFFSET || lz_read32(ref) != sequence) {
+            ip += 1 + ((ip - anchor) >> LZ_SKIP_SHIFT);
+            continue;
+        }
+
+        // Extend match as far as possible
+        const uint8_t *mp = ip  + LZ_MIN_MATCH;
+        const uint8_t *rp = ref + LZ_MIN_MATCH;
+        while (mp < end && *mp == *rp) {
+            mp++;
+            rp++;
+        }
+
+        if (!lz_write_sequence(&op, oend, anchor, ip - anchor, ip - ref, mp - ip - LZ_MIN_MATCH)) {
+            return 0;
+        }
+        ip = anchor = mp;
+    }
+
+    if (!lz_write_sequence(&op, oend, anchor, end - anchor, 0, 0)) {
+        return 0;
+    }
+    return op - (uint8_t *)destination;
+}
+
+/**
+ * Decompress buffer produced by lz_compress.
+ * @param   source      Compressed buffer.
+ * @param   length      Length of compressed buffer.
+ * @param   destination Output buffer.
+ * @param   capacity    Capacity of output buffer.
+ * @return  Decompressed size, or -1 if the input is corrupt or does not fit.
+ */
+ssize_t lz_decompress(const void *source, size_t length, void *destination, size_t capacity) {
+    const uint8_t *ip   = source;
+    const uint8_t *iend = ip + length;
+    uint8_t       *dst  = destination;
+    uint8_t       *op   = dst;
+    uint8_t       *oend = op + capacity;
+
+    while (ip < iend) {
+        uint8_t token     = *ip++;
+        size_t  nliterals = token >> 4;
+        if (nliterals == 15 && !lz_read_length(&ip, iend, &nliterals)) {
+            return -1;
+        }
+        if ((size_t)(iend - ip) < nliterals || (size_t)(oend - op) < nliterals) {
+            return -1;
+        }
+        memcpy(op, ip, nliterals);
+        op += nliterals;
+        ip += nliterals;
+
+        if (ip == iend) {
+            break;      // Final literals only sequence
+        }
+
+        if (iend - ip < 2) {
+            return -1;
+        }
+        size_t offset = ip[0] | (ip[1] << 8);
+        ip += 2;
+        if (offset == 0 || offset > (size_t)(op - dst)) {
+            return -1;
+        }
+
+        size_t nmatch = token & 15;
+        if (nmatch == 15 && !lz_read_length(&ip, iend, &nmatch)) {
+            return -1;
+        }
+        nmatch += LZ_MIN_MATCH;
+        if ((size_t)(oend - op) < nmatch) {
+            return -1;
+        }
+
+        // Matches may overlap the bytes they produce
+        const uint8_t *match = op - offset;
+        if (offset >= nmatch) {
+            memcpy(op, match, nmatch);
+            op += nmatch;
+        } else {
+            while (nmatch--) {
+                *op++ = *match++;
+            }
+        }
+    }
+
+    return op - dst;
+}
+
+/* vim: set expandtab sts=4 sw=4 ts=8 ft=c: */
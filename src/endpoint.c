@@ -0,0 +1,440 @@
+/* endpoint.c: Shared broker connections */
+
+#include "mq/endpoint.h"
+#include "mq/logging.h"
+#include "mq/socket.h"
+
+#include <inttypes.h>
+#include <signal.h>
+#include <strings.h>
+
+/* Internal Variables */
+
+static Endpoint *       Endpoints     = NULL;   // Process-wide endpoint registry
+static Mutex            EndpointsLock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_once_t   EndpointsOnce = PTHREAD_ONCE_INIT;
+
+/* Internal Functions */
+
+/**
+ * Ignore SIGPIPE so writing to a keep-alive connection the server already
+ * closed fails with EPIPE instead of terminating the process.
+ */
+static void endpoint_ignore_sigpipe() {
+    signal(SIGPIPE, SIG_IGN);
+}
+
+/**
+ * Split host into the servers of the endpoint: a comma separated list of
+ * host or host:port entries, where entries without a port use port.
+ * @param   e           Endpoint structure.
+ * @param   host        Address of server (or list of servers).
+ * @param   port        Port of server (default port of list).
+ */
+static void endpoint_parse_servers(Endpoint *e, const char *host, const char *port) {
+    const char* cursor = host;
+    while (e->nservers < ENDPOINT_SERVERS) {
+        size_t      length = strcspn(cursor, ",");
+        const char* colon  = memchr(cursor, ':', length);
+        Server*     server = &e->servers[e->nservers];
+
+        // Entries with more than one colon are IPv6 addresses without a port
+        if (colon && memchr(colon + 1, ':', length - (colon + 1 - cursor)) == NULL) {
+            snprintf(server->host, NI_MAXHOST, "%.*s", (int)(colon - cursor), cursor);
+            snprintf(server->port, NI_MAXSERV, "%.*s", (int)(length - (colon + 1 - cursor)), colon + 1);
+        } else {
+            snprintf(server->host, NI_MAXHOST, "%.*s", (int)length, cursor);
+            snprintf(server->port, NI_MAXSERV, "%s", port);
+        }
+        if (server->host[0]) {
+            e->nservers++;
+        }
+
+        if (cursor[length] == '\0') {
+            break;
+        }
+        cursor += length + 1;
+    }
+}
+
+/**
+ * Switch from server to the next one on the list (unless another thread
+ * already has), closing pooled connections to it.
+ * @param   e           Endpoint structure.
+ * @param   server      Index of server that failed.
+ */
+static void endpoint_failover(Endpoint *e, size_t server) {
+    mutex_lock(&e->lock);
+    if (e->nservers > 1 && e->server == server) {
+        e->server = (server + 1) % e->nservers;
+        e->failovers++;
+        while (e->idle) {
+            Connection* c = e->idle;
+            e->idle = c->next;
+            fclose(c->stream);
+            free(c);
+            e->connections--;
+        }
+        cond_broadcast(&e->available);
+        info("Failing over from %s:%s to %s:%s",
+            e->servers[server].host, e->servers[server].port, e->servers[e->server].host, e->servers[e->server].port);
+    }
+    mutex_unlock(&e->lock);
+}
+
+/* External Functions */
+
+/**
+ * Acquire shared Endpoint for host and port (created on first use).
+ * @param   host        Address of server.
+ * @param   port        Port of server.
+ * @return  Endpoint structure (must be released with endpoint_release).
+ */
+Endpoint * endpoint_acquire(const char *host, const char *port) {
+    pthread_once(&EndpointsOnce, endpoint_ignore_sigpipe);
+
+    mutex_lock(&EndpointsLock);
+    Endpoint* e = Endpoints;
+    while (e && (strcmp(e->host, host) != 0 || strcmp(e->port, port) != 0)) {
+        e = e->next;
+    }
+
+    if (e == NULL) {
+        e = calloc(1, sizeof(Endpoint));
+        if (e == NULL) {
+            mutex_unlock(&EndpointsLock);
+            return NULL;
+        }
+
+        e->members = table_create(0);
+        if (e->members == NULL) {
+            free(e);
+            mutex_unlock(&EndpointsLock);
+            return NULL;
+        }
+
+        strncpy(e->host, host, NI_MAXHOST - 1);
+        strncpy(e->port, port, NI_MAXSERV - 1);
+        endpoint_parse_servers(e, e->host, e->port);
+        e->capacity = ENDPOINT_CONNECTIONS;
+        clock_gettime(CLOCK_MONOTONIC, &e->created);
+        mutex_init(&e->lock, NULL);
+        cond_init(&e->available, NULL);
+        cond_init(&e->changed, NULL);
+
+        e->next   = Endpoints;
+        Endpoints = e;
+    }
+    e->references++;
+    mutex_unlock(&EndpointsLock);
+    return e;
+}
+
+/**
+ * Release reference to Endpoint; the last reference stops the shared puller,
+ * closes pooled connections and deletes the Endpoint.
+ * @param   e           Endpoint structure.
+ */
+void endpoint_release(Endpoint *e) {
+    mutex_lock(&EndpointsLock);
+    if (--e->references > 0) {
+        mutex_unlock(&EndpointsLock);
+        return;
+    }
+
+    Endpoint** link = &Endpoints;
+    while (*link != e) {
+        link = &(*link)->next;
+    }
+    *link = e->next;
+    mutex_unlock(&EndpointsLock);
+
+    // Stop shared puller
+    mutex_lock(&e->lock);
+    e->closing = true;
+    cond_broadcast(&e->changed);
+    mutex_unlock(&e->lock);
+    if (e->pulling) {
+        thread_join(e->puller, NULL);
+    }
+
+    // Flush acknowledgements the puller did not get to piggyback
+    endpoint_flush_acks(e, 0);
+
+    // Close pooled connections
+    while (e->idle) {
+        Connection* c = e->idle;
+        e->idle = c->next;
+        fclose(c->stream);
+        free(c);
+    }
+
+    table_delete(e->members, NULL);
+    free(e->acks);
+    pthread_mutex_destroy(&e->lock);
+    pthread_cond_destroy(&e->available);
+    pthread_cond_destroy(&e->changed);
+    free(e);
+}
+
+/**
+ * Check out a connection from the pool, opening a new one to the server in
+ * use if none are idle and the endpoint is below capacity (blocks
+ * otherwise).  Failing to connect fails over to the next server.
+ * @param   e           Endpoint structure.
+ * @param   s           Stats to record connect latency in (or NULL).
+ * @return  Connection structure, or NULL if unable to connect.
+ */
+Connection * endpoint_checkout(Endpoint *e, Stats *s) {
+    mutex_lock(&e->lock);
+    while (e->idle == NULL && e->connections >= e->capacity) {
+        cond_wait(&e->available, &e->lock);
+    }
+
+    Connection* c = e->idle;
+    if (c) {
+        e->idle = c->next;
+        mutex_unlock(&e->lock);
+        return c;
+    }
+    e->connections++;
+    e->opened++;
+    size_t server = e->server;
+    mutex_unlock(&e->lock);
+
+    uint64_t started = stats_now();
+    FILE*    stream  = socket_connect(e->servers[server].host, e->servers[server].port);
+    stats_record(s, connect, stats_now() - started);
+    if (stream == NULL) {
+        mutex_lock(&e->lock);
+        e->connections--;
+        cond_signal(&e->available);
+        mutex_unlock(&e->lock);
+        endpoint_failover(e, server);
+        return NULL;
+    }
+
+    c = calloc(1, sizeof(Connection));
+    c->stream = stream;
+    c->server = server;
+    return c;
+}
+
+/**
+ * Return connection to the pool (or close it, if it is not reusable or is
+ * connected to a server the endpoint failed over from).
+ * @param   e           Endpoint structure.
+ * @param   c           Connection structure.
+ * @param   reuse       Whether or not the connection can be reused.
+ */
+void endpoint_checkin(Endpoint *e, Connection *c, bool reuse) {
+    mutex_lock(&e->lock);
+    if (reuse && c->server == e->server) {
+        c->next = e->idle;
+        e->idle = c;
+    } else {
+        fclose(c->stream);
+        free(c);
+        e->connections--;
+    }
+    cond_signal(&e->available);
+    mutex_unlock(&e->lock);
+}
+
+/**
+ * Send Request over a pooled keep-alive connection and read the response.
+ *
+ * A reused connection may have been closed by the server while idle, in
+ * which case the request is retried once on a new connection.  With a list
+ * of servers, a server that cannot be reached (or is a replica refusing
+ * requests) is failed over from, and the request is retried on each of
+ * the others in turn.
+ * @param   e           Endpoint structure.
+ * @param   r           Request structure.
+ * @param   s           Stats to record connects and failures in (or NULL).
+ * @return  Newly allocated response, or NULL on failure.
+ */
+Request * endpoint_send(Endpoint *e, Request *r, Stats *s) {
+    if (request_get_header(r, "Connection") == NULL) {
+        request_set_header(r, "Connection", "keep-alive");
+    }
+
+    for (size_t attempt = 0; attempt < e->nservers + 1; attempt++) {
+        Connection* c = endpoint_checkout(e, s);
+        if (c == NULL) {
+            stats_add(s, errors, 1);
+            if (e->nservers == 1) {
+                return NULL;
+            }
+            continue;
+        }
+        if (attempt > 0) {
+            stats_add(s, reconnects, 1);
+        }
+
+        bool     fresh  = c->requests == 0;
+        size_t   server = c->server;
+        size_t   bytes  = request_send(r, fileno(c->stream));
+        Request* res    = bytes ? request_read(c->stream) : NULL;
+        if (res && res->status == 503 && request_get_header(res, "X-Replica") && e->nservers > 1) {
+            endpoint_checkin(e, c, false);
+            endpoint_failover(e, server);
+            stats_add(s, errors, 1);
+            request_delete(res);
+            continue;
+        }
+        if (res) {
+            const char* connection = request_get_header(res, "Connection");
+            c->requests++;
+            c->bytes += bytes;
+
+            mutex_lock(&e->lock);
+            e->requests++;
+            e->bytes += bytes;
+            mutex_unlock(&e->lock);
+
+            endpoint_checkin(e, c, connection && strcasecmp(connection, "keep-alive") == 0);
+            return res;
+        }
+
+        endpoint_checkin(e, c, false);
+        stats_add(s, errors, 1);
+        if (fresh && e->nservers == 1) {
+            break;
+        }
+        if (fresh) {
+            endpoint_failover(e, server);
+        }
+    }
+
+    if (e->nservers > 1) {
+        error("Unable to send %s %s to any of %s", r->method, r->uri, e->host);
+    } else {
+        error("Unable to send %s %s to %s:%s", r->method, r->uri, e->host, e->port);
+    }
+    return NULL;
+}
+
+/**
+ * Queue acknowledgement of leased delivery, to be piggybacked on the next
+ * request made by the shared puller.
+ * @param   e           Endpoint structure.
+ * @param   delivery    Delivery id (from the X-Delivery header).
+ */
+void endpoint_ack(Endpoint *e, uint64_t delivery) {
+    mutex_lock(&e->lock);
+    if (e->nacks == e->acks_capacity) {
+        size_t    capacity = e->acks_capacity ? 2 * e->acks_capacity : 16;
+        uint64_t* acks     = realloc(e->acks, capacity * sizeof(uint64_t));
+        if (acks == NULL) {
+            // Unacknowledged deliveries are redelivered once their lease expires
+            mutex_unlock(&e->lock);
+            return;
+        }
+        e->acks          = acks;
+        e->acks_capacity = capacity;
+    }
+    e->acks[e->nacks++] = delivery;
+    mutex_unlock(&e->lock);
+}
+
+/**
+ * Take (at most ENDPOINT_ACKS of the) pending acknowledgements as a comma
+ * separated X-Ack header value, so the header stays well below the
+ * server's header size limit.
+ * @param   e           Endpoint structure.
+ * @return  Newly allocated header value (must be freed), or NULL if there
+ *          are no pending acknowledgements.
+ */
+char * endpoint_take_acks(Endpoint *e) {
+    mutex_lock(&e->lock);
+    size_t count = e->nacks < ENDPOINT_ACKS ? e->nacks : ENDPOINT_ACKS;
+    char*  value = count ? malloc(count * 21) : NULL;
+    if (value == NULL) {
+        mutex_unlock(&e->lock);
+        return NULL;
+    }
+
+    char* cursor = value;
+    for (size_t i = 0; i < count; i++) {
+        cursor += sprintf(cursor, "%s%" PRIu64, i ? "," : "", e->acks[i]);
+    }
+    e->nacks -= count;
+    memmove(e->acks, e->acks + count, e->nacks * sizeof(uint64_t));
+    mutex_unlock(&e->lock);
+    return value;
+}
+
+/**
+ * Put acknowledgements taken with endpoint_take_acks back, after the
+ * request carrying them failed (acknowledging twice is harmless).
+ * @param   e           Endpoint structure.
+ * @param   acks        Comma separated X-Ack header value.
+ */
+void endpoint_restore_acks(Endpoint *e, const char *acks) {
+    const char* cursor = acks;
+    while (*cursor) {
+        char* end;
+        endpoint_ack(e, strtoull(cursor, &end, 10));
+        cursor = *end == ',' ? end + 1 : end;
+    }
+}
+
+/**
+ * Send pending acknowledgements with PUT /ack, one batch of ENDPOINT_ACKS
+ * at a time, until at most keep of them are left (to be piggybacked).
+ * @param   e           Endpoint structure.
+ * @param   keep        Number of acknowledgements that may be left.
+ */
+void endpoint_flush_acks(Endpoint *e, size_t keep) {
+    while (true) {
+        mutex_lock(&e->lock);
+        size_t pending = e->nacks;
+        mutex_unlock(&e->lock);
+
+        char* acks = pending > keep ? endpoint_take_acks(e) : NULL;
+        if (acks == NULL) {
+            return;
+        }
+
+        Request* req = request_create("PUT", "/ack", NULL);
+        request_set_header(req, "X-Ack", acks);
+        Request* res = endpoint_send(e, req, NULL);
+        request_delete(req);
+        if (res == NULL) {
+            // Keep them for the next attempt (or lease expiry)
+            endpoint_restore_acks(e, acks);
+            free(acks);
+            return;
+        }
+        request_delete(res);
+        free(acks);
+    }
+}
+
+/**
+ * Snapshot Endpoint connection statistics.
+ * @param   e           Endpoint structure.
+ * @param   s           EndpointStats structure to fill.
+ */
+void endpoint_stats(Endpoint *e, EndpointStats *s) {
+    struct timespec now;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+
+    mutex_lock(&EndpointsLock);
+    s->references = e->references;
+    mutex_unlock(&EndpointsLock);
+
+    mutex_lock(&e->lock);
+    s->members     = e->members->size;
+    s->connections = e->connections;
+    s->opened      = e->opened;
+    s->requests    = e->requests;
+    s->bytes       = e->bytes;
+    s->failovers   = e->failovers;
+    s->server      = e->server;
+    s->elapsed     = (now.tv_sec - e->created.tv_sec) + (now.tv_nsec - e->created.tv_nsec) / 1e9;
+    mutex_unlock(&e->lock);
+}
+
+/* vim: set expandtab sts=4 sw=4 ts=8 ft=c: */
@@ -0,0 +1,327 @@
+/* logging.c: Asynchronous logger with per-thread ring buffers */
+
+#include "mq/logging.h"
+
+#include <stdarg.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <strings.h>
+#include <time.h>
+
+/* Internal Constants */
+
+#define LOG_RING        256             // Entries per thread (power of two)
+#define LOG_MESSAGE     240             // Bytes of formatted message per entry
+#define LOG_SITES       64              // Call sites rate limited per thread
+#define LOG_BURST       20              // Default messages per call site per second
+#define LOG_INTERVAL    10000000        // Nanoseconds flusher sleeps when idle
+
+/* Internal Structures */
+
+typedef struct LogEntry LogEntry;
+struct LogEntry {
+    struct timespec time;
+    unsigned long   thread;
+    int		    level;
+    char	    message[LOG_MESSAGE];
+};
+
+typedef struct LogSite LogSite;
+struct LogSite {
+    const char *    format;		// Format string identifying call site
+    time_t	    window;		// Second counted in
+    unsigned int    count;		// Messages logged in window
+    unsigned long   suppressed;		// Messages dropped in window
+};
+
+/* Single producer (owner thread), single consumer (flusher) ring */
+typedef struct LogRing LogRing;
+struct LogRing {
+    LogEntry	    entries[LOG_RING];
+    size_t	    head;		// Next entry written by owner
+    size_t	    tail;		// Next entry read by flusher
+    unsigned long   dropped;		// Messages dropped as ring was full
+    unsigned long   reported;		// Drops already reported by flusher
+    bool	    orphaned;		// Owner exited (ring may be claimed)
+    LogSite	    sites[LOG_SITES];	// Rate limits of owner's call sites
+    LogRing *	    next;
+};
+
+/* Internal Variables */
+
+int			LogLevel    = LOG_LEVEL_DEBUG;
+
+static unsigned int	Burst	    = LOG_BURST;
+static FILE *		Stream	    = NULL;         // NULL is stderr
+static LogRing *	Rings	    = NULL;         // Every ring ever allocated
+static __thread LogRing *Ring	    = NULL;         // Calling thread's ring
+static pthread_once_t	Once	    = PTHREAD_ONCE_INIT;
+static pthread_key_t	Owner;                      // Orphans ring on thread exit
+static pthread_t	Flusher;
+static pthread_mutex_t	Draining    = PTHREAD_MUTEX_INITIALIZER;
+static bool		Stopping    = false;
+
+static const char *	LEVELS[]    = { "DEBUG", "INFO", "ERROR", "NONE" };
+
+/* Internal Prototypes */
+
+static void	    log_start();
+static void	    log_stop();
+static void	    log_orphan(void *ring);
+static LogRing *    log_ring();
+static void	    log_push(LogRing *ring, const struct timespec *now, int level, const char *format, va_list args);
+static void	    log_pushf(LogRing *ring, const struct timespec *now, int level, const char *format, ...);
+static void	    log_print(FILE *stream, const struct timespec *time, unsigned long thread, int level, const char *message);
+static size_t	    log_drain();
+static void *	    log_flusher(void *arg);
+
+/* External Functions */
+
+/**
+ * Queue message for the flusher thread to write (with a timestamp and the
+ * calling thread's id).
+ *
+ * Messages are formatted into the calling thread's ring without taking any
+ * lock; they are dropped (and counted) if the ring is full, rather than
+ * blocking the caller.  Each call site (format string) may log up to the
+ * burst limit every second; the number of messages suppressed past that is
+ * reported along with the next message of the call site.
+ * @param   level   Level of message.
+ * @param   format  printf-style format string.
+ */
+void log_write(enum LOG_LEVEL level, const char *format, ...) {
+    LogRing* ring = Ring ? Ring : log_ring();
+    if (ring == NULL) {
+        return;
+    }
+
+    struct timespec now;
+    clock_gettime(CLOCK_REALTIME, &now);
+
+    unsigned int burst = __atomic_load_n(&Burst, __ATOMIC_RELAXED);
+    if (burst) {
+        LogSite* site = &ring->sites[((uintptr_t)format >> 3) % LOG_SITES];
+        if (site->format != format || site->window != now.tv_sec) {
+            if (site->suppressed) {
+                log_pushf(ring, &now, level, "Suppressed %lu repeats of: %s", site->suppressed, site->format);
+            }
+            site->format     = format;
+            site->window     = now.tv_sec;
+            site->count      = 0;
+            site->suppressed = 0;
+        }
+        if (++site->count > burst) {
+            site->suppressed++;
+            return;
+        }
+    }
+
+    va_list args;
+    va_start(args, format);
+    log_push(ring, &now, level, format, args);
+    va_end(args);
+}
+
+/**
+ * Write every queued message before returning.
+ */
+void log_flush() {
+    pthread_once(&Once, log_start);
+    log_drain();
+}
+
+/**
+ * Set minimum level of messages logged (also set by the MQ_LOG_LEVEL
+ * environment variable to DEBUG, INFO, ERROR or NONE).
+ * @param   level   Minimum level.
+ */
+void log_set_level(enum LOG_LEVEL level) {
+    __atomic_store_n(&LogLevel, level, __ATOMIC_RELAXED);
+}
+
+/**
+ * Set messages each call site may log per second.
+ * @param   burst   Messages per second (0 disables rate limiting).
+ */
+void log_set_burst(unsigned int burst) {
+    __atomic_store_n(&Burst, burst, __ATOMIC_RELAXED);
+}
+
+/**
+ * Set stream messages are written to (stderr by default).  Messages queued
+ * already are written to the previous stream first.
+ * @param   stream  Output stream.
+ */
+void log_set_stream(FILE *stream) {
+    log_flush();
+    pthread_mutex_lock(&Draining);
+    Stream = stream;
+    pthread_mutex_unlock(&Draining);
+}
+
+/**
+ * Return number of messages dropped as their thread's ring was full.
+ */
+unsigned long log_dropped() {
+    unsigned long dropped = 0;
+    for (LogRing* ring = __atomic_load_n(&Rings, __ATOMIC_ACQUIRE); ring; ring = ring->next) {
+        dropped += __atomic_load_n(&ring->dropped, __ATOMIC_RELAXED);
+    }
+    return dropped;
+}
+
+/* Internal Functions */
+
+/**
+ * Read MQ_LOG_LEVEL before main runs (and so before any message is logged).
+ */
+__attribute__((constructor)) static void log_init() {
+    const char* level = getenv("MQ_LOG_LEVEL");
+    for (int l = LOG_LEVEL_DEBUG; level && l <= LOG_LEVEL_NONE; l++) {
+        if (strcasecmp(level, LEVELS[l]) == 0) {
+            LogLevel = l;
+        }
+    }
+}
+
+/**
+ * Start flusher thread (which is stopped at exit after a final drain).
+ */
+static void log_start() {
+    pthread_key_create(&Owner, log_orphan);
+    if (pthread_create(&Flusher, NULL, log_flusher, NULL) == 0) {
+        atexit(log_stop);
+    }
+}
+
+static void log_stop() {
+    __atomic_store_n(&Stopping, true, __ATOMIC_RELEASE);
+    pthread_join(Flusher, NULL);
+    log_drain();
+}
+
+/**
+ * Release ring of exiting thread to be claimed by a new thread.
+ * @param   ring    LogRing structure.
+ */
+static void log_orphan(void *ring) {
+    __atomic_store_n(&((LogRing *)ring)->orphaned, true, __ATOMIC_RELEASE);
+}
+
+/**
+ * Return ring of calling thread, claiming an orphaned ring or allocating
+ * a new one on first use.
+ */
+static LogRing * log_ring() {
+    pthread_once(&Once, log_start);
+
+    LogRing* ring = __atomic_load_n(&Rings, __ATOMIC_ACQUIRE);
+    for (bool orphaned = true; ring; ring = ring->next, orphaned = true) {
+        if (__atomic_compare_exchange_n(&ring->orphaned, &orphaned, false, false, __ATOMIC_ACQ_REL, __ATOMIC_RELAXED)) {
+            memset(ring->sites, 0, sizeof(ring->sites));
+            break;
+        }
+    }
+
+    if (ring == NULL) {
+        ring = calloc(1, sizeof(LogRing));
+        if (ring == NULL) {
+            return NULL;
+        }
+        ring->next = __atomic_load_n(&Rings, __ATOMIC_RELAXED);
+        while (!__atomic_compare_exchange_n(&Rings, &ring->next, ring, true, __ATOMIC_RELEASE, __ATOMIC_RELAXED));
+    }
+
+    pthread_setspecific(Owner, ring);
+    Ring = ring;
+    return ring;
+}
+
+/**
+ * Format message into the next entry of ring (or drop it if it is full).
+ */
+static void log_push(LogRing *ring, const struct timespec *now, int level, const char *format, va_list args) {
+    size_t head = ring->head;
+    if (head - __atomic_load_n(&ring->tail, __ATOMIC_ACQUIRE) >= LOG_RING) {
+        __atomic_store_n(&ring->dropped, ring->dropped + 1, __ATOMIC_RELAXED);
+        return;
+    }
+
+    LogEntry* entry = &ring->entries[head % LOG_RING];
+    entry->time   = *now;
+    entry->thread = (unsigned long)pthread_self();
+    entry->level  = level;
+    vsnprintf(entry->message, LOG_MESSAGE, format, args);
+    __atomic_store_n(&ring->head, head + 1, __ATOMIC_RELEASE);
+}
+
+static void log_pushf(LogRing *ring, const struct timespec *now, int level, const char *format, ...) {
+    va_list args;
+    va_start(args, format);
+    log_push(ring, now, level, format, args);
+    va_end(args);
+}
+
+/**
+ * Write message to stream, prefixed with its local time, thread and level.
+ */
+static void log_print(FILE *stream, const struct timespec *time, unsigned long thread, int level, const char *message) {
+    char      stamp[32];
+    struct tm local;
+    localtime_r(&time->tv_sec, &local);
+    strftime(stamp, sizeof(stamp), "%Y-%m-%d %H:%M:%S", &local);
+    fprintf(stream, "%s.%06ld [%09lu] %-5s %s\n", stamp, time->tv_nsec / 1000, thread, LEVELS[level], message);
+}
+
+/**
+ * Write queued messages of every ring to the stream.
+ * @return  Number of messages written.
+ */
+static size_t log_drain() {
+    size_t written = 0;
+
+    pthread_mutex_lock(&Draining);
+    FILE* stream = Stream ? Stream : stderr;
+    for (LogRing* ring = __atomic_load_n(&Rings, __ATOMIC_ACQUIRE); ring; ring = ring->next) {
+        size_t head = __atomic_load_n(&ring->head, __ATOMIC_ACQUIRE);
+        size_t tail = ring->tail;
+        for (; tail != head; tail++) {
+            LogEntry* entry = &ring->entries[tail % LOG_RING];
+            log_print(stream, &entry->time, entry->thread, entry->level, entry->message);
+            written++;
+        }
+        __atomic_store_n(&ring->tail, tail, __ATOMIC_RELEASE);
+
+        unsigned long dropped = __atomic_load_n(&ring->dropped, __ATOMIC_RELAXED);
+        if (dropped != ring->reported) {
+            struct timespec now;
+            char            message[64];
+            clock_gettime(CLOCK_REALTIME, &now);
+            snprintf(message, sizeof(message), "Dropped %lu log messages", dropped - ring->reported);
+            log_print(stream, &now, (unsigned long)pthread_self(), LOG_LEVEL_ERROR, message);
+            ring->reported = dropped;
+            written++;
+        }
+    }
+    if (written) {
+        fflush(stream);
+    }
+    pthread_mutex_unlock(&Draining);
+    return written;
+}
+
+/**
+ * Flusher thread writes queued messages until the process exits, sleeping
+ * whenever there are none.
+ */
+static void * log_flusher(void *arg) {
+    struct timespec interval = { 0, LOG_INTERVAL };
+    while (!__atomic_load_n(&Stopping, __ATOMIC_ACQUIRE)) {
+        if (log_drain() == 0) {
+            nanosleep(&interval, NULL);
+        }
+    }
+    return NULL;
+}
+
+/* vim: set expandtab sts=4 sw=4 ts=8 ft=c: */
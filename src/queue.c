@@ -3,6 +3,24 @@
 #include "mq/queue.h"
 
 #include <assert.h>
+#include <errno.h>
+#include <time.h>
+
+/* Internal Prototypes */
+
+static void      locked_push(Queue *q, Request *r);
+static Request * locked_pop(Queue *q);
+
+/* Backends */
+
+const QueueBackend LockedQueue = {
+    .name   = "locked",
+    .push   = locked_push,
+    .pop    = locked_pop,
+    .delete = NULL,
+};
+
+/* External Functions */
 
 /**
  * Create queue structure.
@@ -16,6 +34,9 @@ Queue * queue_create() {
     q->head = NULL;
     q->tail = NULL;
     q->size = 0;
+    q->high = 0;
+    q->lock_waits = 0;
+    q->lock_wait_ns = 0;
     int res = pthread_mutex_init(&q->mutex, NULL);
     if (res != 0) {
         fprintf(stderr, "Something went wrong with mutex init err=%d\n", res);
@@ -40,6 +61,8 @@ Queue * queue_create() {
         return NULL;
     }
 
+    q->backend = &LockedQueue;
+    q->impl    = NULL;
     return q;
 }
 
@@ -48,6 +71,10 @@ Queue * queue_create() {
  * @param   q       Queue structure.
  */
 void queue_delete(Queue *q) {
+    if (q->backend->delete) {
+        q->backend->delete(q);
+    }
+
     Request* cur = q->head;
     while (cur) {
         Request* next = cur->next;
@@ -66,27 +93,113 @@ void queue_delete(Queue *q) {
  * @param   r       Request structure.
  */
 void queue_push(Queue *q, Request *r) {
-    pthread_mutex_lock(&q->mutex);
+    q->backend->push(q, r);
+}
+
+/**
+ * Pop request to the front of queue (block until there is something to return).
+ * @param   q       Queue structure.
+ * @return  Request structure.
+ */
+Request * queue_pop(Queue *q) {
+    return q->backend->pop(q);
+}
+
+/**
+ * Return number of requests in queue (read without the lock, so it is only
+ * a snapshot for statistics).
+ * @param   q       Queue structure.
+ * @return  Number of queued requests.
+ */
+size_t queue_size(Queue *q) {
+    if (q->backend->size) {
+        return q->backend->size(q);
+    }
+    return __atomic_load_n(&q->size, __ATOMIC_RELAXED);
+}
+
+/**
+ * Return largest number of requests the queue has held.
+ * @param   q       Queue structure.
+ * @return  High-water mark of queued requests.
+ */
+size_t queue_high_water(Queue *q) {
+    return __atomic_load_n(&q->high, __ATOMIC_RELAXED);
+}
+
+/**
+ * Acquire one of the queue's locks, counting the acquisition and the time
+ * waited if the lock was held by another thread (uncontended acquisitions
+ * cost a single trylock).
+ * @param   q       Queue structure.
+ * @param   lock    Lock owned by queue (or its backend).
+ */
+void queue_lock(Queue *q, Mutex *lock) {
+    int rc = pthread_mutex_trylock(lock);
+    if (rc == 0) {
+        return;
+    }
+    if (rc != EBUSY) {
+        error("%s", strerror(rc));
+        exit(EXIT_FAILURE);
+    }
+
+    struct timespec start, end;
+    clock_gettime(CLOCK_MONOTONIC, &start);
+    mutex_lock(lock);
+    clock_gettime(CLOCK_MONOTONIC, &end);
+    __atomic_add_fetch(&q->lock_waits, 1, __ATOMIC_RELAXED);
+    __atomic_add_fetch(&q->lock_wait_ns, (end.tv_sec - start.tv_sec) * 1000000000UL + end.tv_nsec - start.tv_nsec, __ATOMIC_RELAXED);
+}
+
+/**
+ * Return contention of the queue's locks so far.
+ * @param   q       Queue structure.
+ * @param   waits   Set to number of contended acquisitions.
+ * @param   ns      Set to nanoseconds spent waiting for them.
+ */
+void queue_lock_wait(Queue *q, uint64_t *waits, uint64_t *ns) {
+    *waits = __atomic_load_n(&q->lock_waits, __ATOMIC_RELAXED);
+    *ns    = __atomic_load_n(&q->lock_wait_ns, __ATOMIC_RELAXED);
+}
+
+void queue_status(Queue* q) {
+    assert(q != NULL);
+    printf("Queue size: %zu\n", queue_size(q));
+}
+
+/* Internal Functions */
+
+/**
+ * Push request to the back of the list (locked backend).
+ * @param   q       Queue structure.
+ * @param   r       Request structure.
+ */
+static void locked_push(Queue *q, Request *r) {
+    queue_lock(q, &q->mutex);
     if (q->size == 0) {
         q->head = r;
         q->tail = r;
-        q->size = 1;
+        __atomic_store_n(&q->size, 1, __ATOMIC_RELAXED);
     } else {
         q->tail->next = r;
         q->tail = r;
-        q->size++;
+        __atomic_store_n(&q->size, q->size + 1, __ATOMIC_RELAXED);
+    }
+    if (q->size > q->high) {
+        __atomic_store_n(&q->high, q->size, __ATOMIC_RELAXED);
     }
     pthread_mutex_unlock(&q->mutex);
     pthread_cond_signal(&q->notEmpty);
 }
 
 /**
- * Pop request to the front of queue (block until there is something to return).
+ * Pop request from the front of the list (locked backend).
  * @param   q       Queue structure.
  * @return  Request structure.
  */
-Request * queue_pop(Queue *q) {
-    pthread_mutex_lock(&q->mutex);
+static Request * locked_pop(Queue *q) {
+    queue_lock(q, &q->mutex);
     while (q->size == 0) {
       pthread_cond_wait(&q->notEmpty, &q->mutex);
     }
@@ -94,21 +207,18 @@ Request * queue_pop(Queue *q) {
         Request* req = q->head;
         q->head = NULL;
         q->tail = NULL;
-        q->size = 0;
+        __atomic_store_n(&q->size, 0, __ATOMIC_RELAXED);
         pthread_mutex_unlock(&q->mutex);
+        req->next = NULL;
         return req;
     }
 
     Request* req = q->head;
     q->head = req->next;
-    q->size--;
+    __atomic_store_n(&q->size, q->size - 1, __ATOMIC_RELAXED);
     pthread_mutex_unlock(&q->mutex);
+    req->next = NULL;
     return req;
 }
 
-void queue_status(Queue* q) {
-    assert(q != NULL);
-    printf("Queue size: %zu\n", q->size);
-}
-
 /* vim: set expandtab sts=4 sw=4 ts=8 ft=c: */
@@ -0,0 +1,184 @@
+/* queue_priority.c: Multi-level priority Queue of Requests */
+
+#include "mq/queue.h"
+
+#include <stdbool.h>
+#include <stdint.h>
+
+/*
+ * Requests are kept in one FIFO list per priority level (see
+ * REQUEST_PRIORITIES) and a bitmap records which levels are non-empty, so
+ * both push and pop are O(1): pop takes from the highest set bit.
+ *
+ * To keep bulk traffic from starving, once QUEUE_PRIORITY_BURST requests
+ * in a row have been popped ahead of non-empty lower levels, the next pop
+ * serves one of those lower levels instead, rotating between them.
+ * Ordering is FIFO per level only.
+ */
+
+/* Internal Structures */
+
+typedef struct Level Level;
+struct Level {
+    Request *   head;
+    Request *   tail;
+};
+
+typedef struct Levels Levels;
+struct Levels {
+    Level       levels[REQUEST_PRIORITIES];
+    unsigned    bitmap;     // Levels with requests
+    size_t      passed;     // Pops in a row ahead of non-empty lower levels
+    unsigned    aged;       // Lower level served next by starvation protection
+};
+
+/* Internal Prototypes */
+
+static void      priority_push(Queue *q, Request *r);
+static Request * priority_pop(Queue *q);
+static void      priority_delete(Queue *q);
+
+/* Backends */
+
+const QueueBackend PriorityQueue = {
+    .name   = "priority",
+    .push   = priority_push,
+    .pop    = priority_pop,
+    .delete = priority_delete,
+};
+
+/* External Functions */
+
+/**
+ * Create priority queue structure.
+ * @return  Newly allocated queue structure.
+ */
+Queue * queue_create_priority() {
+    Queue* q = queue_create();
+    if (q == NULL) {
+        return NULL;
+    }
+
+    Levels* l = calloc(1, sizeof(Levels));
+    if (l == NULL) {
+        queue_delete(q);
+        return NULL;
+    }
+
+    q->backend = &PriorityQueue;
+    q->impl    = l;
+    return q;
+}
+
+/* Internal Functions */
+
+/**
+ * Return level of request, clamped to the valid levels.
+ * @param   r       Request structure.
+ * @return  Priority level.
+ */
+static inline unsigned priority_level(Request *r) {
+    if (r->priority <= 0) {
+        return 0;
+    }
+    return r->priority < REQUEST_PRIORITIES ? r->priority : REQUEST_PRIORITIES - 1;
+}
+
+/**
+ * Push request to the back of its priority level.
+ * @param   q       Queue structure.
+ * @param   r       Request structure.
+ */
+static void priority_push(Queue *q, Request *r) {
+    Levels*  l     = q->impl;
+    unsigned index = priority_level(r);
+    Level*   level = &l->levels[index];
+
+    r->next = NULL;
+    queue_lock(q, &q->mutex);
+    if (level->tail) {
+        level->tail->next = r;
+    } else {
+        level->head = r;
+        l->bitmap  |= 1U << index;
+    }
+    level->tail = r;
+    __atomic_store_n(&q->size, q->size + 1, __ATOMIC_RELAXED);
+    if (q->size > q->high) {
+        __atomic_store_n(&q->high, q->size, __ATOMIC_RELAXED);
+    }
+    mutex_unlock(&q->mutex);
+    cond_signal(&q->notEmpty);
+}
+
+/**
+ * Return level to pop from (queue must not be empty): the highest non-empty
+ * one, unless lower levels have been passed over too often.
+ * @param   l       Levels structure.
+ * @return  Priority level.
+ */
+static unsigned priority_next(Levels *l) {
+    unsigned top   = 31 - __builtin_clz(l->bitmap);
+    unsigned lower = l->bitmap & ~(1U << top);
+    if (lower == 0) {
+        l->passed = 0;
+        return top;
+    }
+    if (++l->passed <= QUEUE_PRIORITY_BURST) {
+        return top;
+    }
+
+    // Serve the first non-empty lower level at or after the aged one
+    unsigned rotated = lower & ~((1U << l->aged) - 1);
+    unsigned index   = __builtin_ctz(rotated ? rotated : lower);
+    l->aged   = (index + 1) % REQUEST_PRIORITIES;
+    l->passed = 0;
+    return index;
+}
+
+/**
+ * Pop request from the front of the next level (block until there is
+ * something to return).
+ * @param   q       Queue structure.
+ * @return  Request structure.
+ */
+static Request * priority_pop(Queue *q) {
+    Levels* l = q->impl;
+
+    queue_lock(q, &q->mutex);
+    while (q->size == 0) {
+        cond_wait(&q->notEmpty, &q->mutex);
+    }
+
+    Level*   level = &l->levels[priority_next(l)];
+    Request* r     = level->head;
+    level->head = r->next;
+    if (level->head == NULL) {
+        level->tail = NULL;
+        l->bitmap  &= ~(1U << (level - l->levels));
+    }
+    __atomic_store_n(&q->size, q->size - 1, __ATOMIC_RELAXED);
+    mutex_unlock(&q->mutex);
+
+    r->next = NULL;
+    return r;
+}
+
+/**
+ * Delete levels and any requests left in them.
+ * @param   q       Queue structure.
+ */
+static void priority_delete(Queue *q) {
+    Levels* l = q->impl;
+    for (size_t i = 0; i < REQUEST_PRIORITIES; i++) {
+        Request* r = l->levels[i].head;
+        while (r) {
+            Request* next = r->next;
+            request_delete(r);
+            r = next;
+        }
+    }
+    free(l);
+}
+
+/* vim: set expandtab sts=4 sw=4 ts=8 ft=c: */
@@ -0,0 +1,217 @@
+/* queue_sharded.c: Sharded Queue of Requests with work stealing */
+
+#include "mq/queue.h"
+
+#include <stdbool.h>
+#include <stdint.h>
+
+/*
+ * Each thread is assigned a home shard the first time it touches a sharded
+ * queue.  Producers push to their home shard and consumers pop from their
+ * home shard first, then steal from the other shards, so threads mostly
+ * contend on different locks and cache lines.  Ordering is FIFO per shard
+ * only.
+ *
+ * q->size counts requests across all shards and is updated atomically.
+ * Consumers that find every shard empty sleep on q->notEmpty under
+ * q->mutex; producers only take q->mutex when a consumer is sleeping.
+ */
+
+/* Internal Constants */
+
+#define CACHE_LINE  64
+
+/* Internal Structures */
+
+typedef struct Shard Shard;
+struct Shard {
+    Mutex       lock;
+    Request *   head;
+    Request *   tail;
+    size_t      size;
+} __attribute__((aligned(CACHE_LINE)));
+
+typedef struct Shards Shards;
+struct Shards {
+    size_t      count;      // Number of shards
+    size_t      sleepers;   // Consumers waiting on q->notEmpty
+    Shard *     shards;
+};
+
+/* Internal Variables */
+
+static size_t           NextHome = 0;           // Next home shard to assign
+static __thread size_t  Home     = SIZE_MAX;    // Calling thread's home shard
+
+/* Internal Prototypes */
+
+static void      sharded_push(Queue *q, Request *r);
+static Request * sharded_pop(Queue *q);
+static void      sharded_delete(Queue *q);
+
+/* Backends */
+
+const QueueBackend ShardedQueue = {
+    .name   = "sharded",
+    .push   = sharded_push,
+    .pop    = sharded_pop,
+    .delete = sharded_delete,
+};
+
+/* External Functions */
+
+/**
+ * Create sharded queue structure.
+ * @param   shards  Number of shards (ie. number of producers or cores).
+ * @return  Newly allocated queue structure.
+ */
+Queue * queue_create_sharded(size_t shards) {
+    Queue* q = queue_create();
+    if (q == NULL) {
+        return NULL;
+    }
+
+    Shards* s = malloc(sizeof(Shards));
+    if (s == NULL || posix_memalign((void **)&s->shards, CACHE_LINE, (shards ? shards : 1) * sizeof(Shard)) != 0) {
+        free(s);
+        queue_delete(q);
+        return NULL;
+    }
+
+    s->count    = shards ? shards : 1;
+    s->sleepers = 0;
+    for (size_t i = 0; i < s->count; i++) {
+        mutex_init(&s->shards[i].lock, NULL);
+        s->shards[i].head = NULL;
+        s->shards[i].tail = NULL;
+        s->shards[i].size = 0;
+    }
+
+    q->backend = &ShardedQueue;
+    q->impl    = s;
+    return q;
+}
+
+/* Internal Functions */
+
+/**
+ * Return calling thread's home shard index.
+ * @param   s       Shards structure.
+ * @return  Index of home shard.
+ */
+static inline size_t sharded_home(Shards *s) {
+    if (Home == SIZE_MAX) {
+        Home = __atomic_fetch_add(&NextHome, 1, __ATOMIC_RELAXED);
+    }
+    return Home % s->count;
+}
+
+/**
+ * Push request to the back of the calling thread's home shard.
+ * @param   q       Queue structure.
+ * @param   r       Request structure.
+ */
+static void sharded_push(Queue *q, Request *r) {
+    Shards* s     = q->impl;
+    Shard*  shard = &s->shards[sharded_home(s)];
+
+    r->next = NULL;
+    queue_lock(q, &shard->lock);
+    if (shard->tail) {
+        shard->tail->next = r;
+    } else {
+        shard->head = r;
+    }
+    shard->tail = r;
+    __atomic_store_n(&shard->size, shard->size + 1, __ATOMIC_RELAXED);
+    mutex_unlock(&shard->lock);
+
+    size_t size = __atomic_add_fetch(&q->size, 1, __ATOMIC_SEQ_CST);
+    size_t high = __atomic_load_n(&q->high, __ATOMIC_RELAXED);
+    while (size > high && !__atomic_compare_exchange_n(&q->high, &high, size, true, __ATOMIC_RELAXED, __ATOMIC_RELAXED));
+    if (__atomic_load_n(&s->sleepers, __ATOMIC_SEQ_CST) > 0) {
+        queue_lock(q, &q->mutex);
+        cond_signal(&q->notEmpty);
+        mutex_unlock(&q->mutex);
+    }
+}
+
+/**
+ * Try to pop request from the home shard, then steal from the others.
+ * @param   q       Queue structure.
+ * @return  Request structure, or NULL if every shard was empty.
+ */
+static Request * sharded_steal(Queue *q) {
+    Shards* s    = q->impl;
+    size_t  home = sharded_home(s);
+
+    for (size_t i = 0; i < s->count; i++) {
+        Shard* shard = &s->shards[(home + i) % s->count];
+        if (__atomic_load_n(&shard->size, __ATOMIC_RELAXED) == 0) {
+            continue;
+        }
+
+        queue_lock(q, &shard->lock);
+        Request* r = shard->head;
+        if (r) {
+            shard->head = r->next;
+            if (shard->head == NULL) {
+                shard->tail = NULL;
+            }
+            __atomic_store_n(&shard->size, shard->size - 1, __ATOMIC_RELAXED);
+        }
+        mutex_unlock(&shard->lock);
+
+        if (r) {
+            __atomic_sub_fetch(&q->size, 1, __ATOMIC_SEQ_CST);
+            r->next = NULL;
+            return r;
+        }
+    }
+    return NULL;
+}
+
+/**
+ * Pop request (block until there is something to return).
+ * @param   q       Queue structure.
+ * @return  Request structure.
+ */
+static Request * sharded_pop(Queue *q) {
+    Shards* s = q->impl;
+
+    while (true) {
+        Request* r = sharded_steal(q);
+        if (r) {
+            return r;
+        }
+
+        queue_lock(q, &q->mutex);
+        __atomic_add_fetch(&s->sleepers, 1, __ATOMIC_SEQ_CST);
+        while (__atomic_load_n(&q->size, __ATOMIC_SEQ_CST) == 0) {
+            cond_wait(&q->notEmpty, &q->mutex);
+        }
+        __atomic_sub_fetch(&s->sleepers, 1, __ATOMIC_SEQ_CST);
+        mutex_unlock(&q->mutex);
+    }
+}
+
+/**
+ * Delete shards and any requests left in them.
+ * @param   q       Queue structure.
+ */
+static void sharded_delete(Queue *q) {
+    Shards* s = q->impl;
+    for (size_t i = 0; i < s->count; i++) {
+        Request* r = s->shards[i].head;
+        while (r) {
+            Request* next = r->next;
+            request_delete(r);
+            r = next;
+        }
+        pthread_mutex_destroy(&s->shards[i].lock);
+    }
+    free(s->shards);
+    free(s);
+}
+
+/* vim: set expandtab sts=4 sw=4 ts=8 ft=c: */
@@ -0,0 +1,296 @@
+/* queue_spsc.c: Single-producer/single-consumer ring Queue of Requests */
+
+#include "mq/queue.h"
+
+#include <linux/futex.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/syscall.h>
+#include <unistd.h>
+
+/*
+ * Requests are passed through a power of two ring of slots.  The producer
+ * owns the tail index and the consumer the head index, each on its own
+ * cache line, and each side keeps a cached copy of the other's index so it
+ * only reads the shared one when the ring looks full (or empty).  The
+ * consumer publishes its head only every QUEUE_RING_BATCH pops (or when it
+ * runs out of requests), so the producer's cache line is rarely touched.
+ *
+ * When the ring is full, requests overflow into the locked list of the
+ * Queue (q->head under q->mutex) and keep going there until the consumer
+ * has drained it, which preserves FIFO order.
+ *
+ * A consumer that finds nothing to pop sets the sleeping flag and waits on
+ * it with a futex; the producer only makes the wake up system call when the
+ * flag is set.  Only one thread may push at a time (threads may take turns
+ * if they synchronize with each other).
+ *
+ * Pops are serialized by the popping flag, which doubles as a futex lock:
+ * a single consumer only pays for one uncontended exchange, while further
+ * consumers wait on it for their turn instead of racing on the head.
+ */
+
+/* Internal Constants */
+
+#define CACHE_LINE  64
+
+/* Internal Structures */
+
+typedef struct Ring Ring;
+struct Ring {
+    /* Producer */
+    size_t      tail __attribute__((aligned(CACHE_LINE)));  // Next slot pushed to (published)
+    size_t      head_cache;     // Producer's copy of released
+    size_t      high;           // Largest size seen by the producer
+
+    /* Consumer */
+    size_t      released __attribute__((aligned(CACHE_LINE)));  // Head published to producer
+    size_t      head;           // Next slot popped from
+    size_t      tail_cache;     // Consumer's copy of tail
+    int         popping;        // Pop in progress (0 none, 1 one, 2 with waiters)
+
+    /* Shared slow path */
+    int         sleeping __attribute__((aligned(CACHE_LINE)));  // Consumer is (about to be) waiting
+    size_t      overflow;       // Requests in the overflow list
+
+    size_t      mask __attribute__((aligned(CACHE_LINE)));      // Capacity - 1
+    Request **  slots;
+};
+
+/* Internal Prototypes */
+
+static void      spsc_push(Queue *q, Request *r);
+static Request * spsc_pop(Queue *q);
+static void      spsc_delete(Queue *q);
+static size_t    spsc_size(Queue *q);
+
+/* Backends */
+
+const QueueBackend SPSCQueue = {
+    .name   = "spsc",
+    .push   = spsc_push,
+    .pop    = spsc_pop,
+    .delete = spsc_delete,
+    .size   = spsc_size,
+};
+
+/* External Functions */
+
+/**
+ * Create single-producer/single-consumer queue structure.
+ * @param   capacity    Slots in the ring (rounded up to a power of two).
+ * @return  Newly allocated queue structure.
+ */
+Queue * queue_create_spsc(size_t capacity) {
+    Queue* q = queue_create();
+    if (q == NULL) {
+        return NULL;
+    }
+
+    size_t slots = 2;
+    while (slots < capacity) {
+        slots <<= 1;
+    }
+
+    Ring* ring = NULL;
+    if (posix_memalign((void **)&ring, CACHE_LINE, sizeof(Ring)) != 0) {
+        queue_delete(q);
+        return NULL;
+    }
+    memset(ring, 0, sizeof(Ring));
+    ring->mask  = slots - 1;
+    ring->slots = malloc(slots * sizeof(Request *));
+    if (ring->slots == NULL) {
+        free(ring);
+        queue_delete(q);
+        return NULL;
+    }
+
+    q->backend = &SPSCQueue;
+    q->impl    = ring;
+    return q;
+}
+
+/* Internal Functions */
+
+/**
+ * Wait until sleeping is no longer set (or a spurious wake up).
+ * @param   ring    Ring structure.
+ */
+static inline void spsc_wait(Ring *ring) {
+    syscall(SYS_futex, &ring->sleeping, FUTEX_WAIT_PRIVATE, 1, NULL, NULL, 0);
+}
+
+/**
+ * Wake consumer if it is sleeping.
+ * @param   ring    Ring structure.
+ */
+static inline void spsc_wake(Ring *ring) {
+    if (__atomic_load_n(&ring->sleeping, __ATOMIC_SEQ_CST) && __atomic_exchange_n(&ring->sleeping, 0, __ATOMIC_SEQ_CST)) {
+        syscall(SYS_futex, &ring->sleeping, FUTEX_WAKE_PRIVATE, 1, NULL, NULL, 0);
+    }
+}
+
+/**
+ * Acquire consumer side of ring, waiting for any other popping thread.
+ * @param   ring    Ring structure.
+ */
+static inline void spsc_acquire(Ring *ring) {
+    int popping = 0;
+    if (__atomic_compare_exchange_n(&ring->popping, &popping, 1, false, __ATOMIC_ACQUIRE, __ATOMIC_RELAXED)) {
+        return;
+    }
+
+    // Mark the flag as waited on, so the releasing thread wakes us up
+    while (__atomic_exchange_n(&ring->popping, 2, __ATOMIC_ACQUIRE) != 0) {
+        syscall(SYS_futex, &ring->popping, FUTEX_WAIT_PRIVATE, 2, NULL, NULL, 0);
+    }
+}
+
+/**
+ * Release consumer side of ring, waking up a waiting popping thread.
+ * @param   ring    Ring structure.
+ */
+static inline void spsc_release(Ring *ring) {
+    if (__atomic_exchange_n(&ring->popping, 0, __ATOMIC_RELEASE) == 2) {
+        syscall(SYS_futex, &ring->popping, FUTEX_WAKE_PRIVATE, 1, NULL, NULL, 0);
+    }
+}
+
+/**
+ * Push request to the back of the ring (or of the overflow list, if the
+ * ring is full or the list is not yet drained).
+ * @param   q       Queue structure.
+ * @param   r       Request structure.
+ */
+static void spsc_push(Queue *q, Request *r) {
+    Ring*  ring = q->impl;
+    size_t tail = ring->tail;
+
+    r->next = NULL;
+    if (tail - ring->head_cache > ring->mask) {
+        ring->head_cache = __atomic_load_n(&ring->released, __ATOMIC_ACQUIRE);
+    }
+
+    size_t overflow = __atomic_load_n(&ring->overflow, __ATOMIC_ACQUIRE);
+    if (overflow == 0 && tail - ring->head_cache <= ring->mask) {
+        ring->slots[tail & ring->mask] = r;
+        __atomic_store_n(&ring->tail, ++tail, __ATOMIC_SEQ_CST);
+    } else {
+        queue_lock(q, &q->mutex);
+        if (q->tail) {
+            q->tail->next = r;
+        } else {
+            q->head = r;
+        }
+        q->tail  = r;
+        overflow = __atomic_add_fetch(&ring->overflow, 1, __ATOMIC_SEQ_CST);
+        mutex_unlock(&q->mutex);
+    }
+
+    // The cached head can only overestimate the size, so the published one
+    // is read only when the high-water mark might have been passed
+    if (tail - ring->head_cache + overflow > ring->high) {
+        ring->head_cache = __atomic_load_n(&ring->released, __ATOMIC_ACQUIRE);
+        size_t size = tail - ring->head_cache + overflow;
+        if (size > ring->high) {
+            ring->high = size;
+            __atomic_store_n(&q->high, size, __ATOMIC_SEQ_CST);
+        }
+    }
+    spsc_wake(ring);
+}
+
+/**
+ * Pop request from the front of the ring, then of the overflow list.
+ * @param   q       Queue structure.
+ * @param   ring    Ring structure.
+ * @return  Request structure, or NULL if both are empty.
+ */
+static Request * spsc_take(Queue *q, Ring *ring) {
+    size_t head = ring->head;
+    if (head == ring->tail_cache) {
+        ring->tail_cache = __atomic_load_n(&ring->tail, __ATOMIC_SEQ_CST);
+    }
+
+    if (head != ring->tail_cache) {
+        Request* r = ring->slots[head & ring->mask];
+        __atomic_store_n(&ring->head, ++head, __ATOMIC_RELAXED);
+        if (head - ring->released >= QUEUE_RING_BATCH || head == ring->tail_cache) {
+            __atomic_store_n(&ring->released, head, __ATOMIC_RELEASE);
+        }
+        return r;
+    }
+
+    if (__atomic_load_n(&ring->overflow, __ATOMIC_SEQ_CST) == 0) {
+        return NULL;
+    }
+
+    queue_lock(q, &q->mutex);
+    Request* r = q->head;
+    q->head = r->next;
+    if (q->head == NULL) {
+        q->tail = NULL;
+    }
+    __atomic_sub_fetch(&ring->overflow, 1, __ATOMIC_SEQ_CST);
+    mutex_unlock(&q->mutex);
+    r->next = NULL;
+    return r;
+}
+
+/**
+ * Pop request (block until there is something to return).
+ * @param   q       Queue structure.
+ * @return  Request structure.
+ */
+static Request * spsc_pop(Queue *q) {
+    Ring* ring = q->impl;
+    spsc_acquire(ring);
+
+    Request* r;
+    while ((r = spsc_take(q, ring)) == NULL) {
+        // Announce sleep, then check again so a concurrent push either sees
+        // the flag or is seen here
+        __atomic_store_n(&ring->sleeping, 1, __ATOMIC_SEQ_CST);
+        if ((r = spsc_take(q, ring))) {
+            __atomic_store_n(&ring->sleeping, 0, __ATOMIC_SEQ_CST);
+            break;
+        }
+        spsc_wait(ring);
+        __atomic_store_n(&ring->sleeping, 0, __ATOMIC_SEQ_CST);
+    }
+
+    spsc_release(ring);
+    return r;
+}
+
+/**
+ * Return number of requests in ring and overflow list (reading the
+ * consumer's private head, as this is only needed for statistics).
+ * @param   q       Queue structure.
+ * @return  Number of queued requests.
+ */
+static size_t spsc_size(Queue *q) {
+    Ring*  ring = q->impl;
+    size_t head = __atomic_load_n(&ring->head, __ATOMIC_RELAXED);
+    size_t tail = __atomic_load_n(&ring->tail, __ATOMIC_ACQUIRE);
+    return (tail > head ? tail - head : 0) + __atomic_load_n(&ring->overflow, __ATOMIC_ACQUIRE);
+}
+
+/**
+ * Delete ring and any requests left in it (the overflow list is deleted by
+ * queue_delete).
+ * @param   q       Queue structure.
+ */
+static void spsc_delete(Queue *q) {
+    Ring* ring = q->impl;
+    for (size_t slot = ring->head; slot != ring->tail; slot++) {
+        request_delete(ring->slots[slot & ring->mask]);
+    }
+    free(ring->slots);
+    free(ring);
+}
+
+/* vim: set expandtab sts=4 sw=4 ts=8 ft=c: */
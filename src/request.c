@@ -3,8 +3,11 @@
 #include "mq/request.h"
 #include "mq/logging.h"
 
+#include <errno.h>
 #include <stdlib.h>
 #include <string.h>
+#include <strings.h>
+#include <sys/uio.h>
 
 /**
  * Create Request structure.
@@ -32,17 +35,65 @@ Request * request_create(const char *method, const char *uri, const char *body)
     }
 
     if (body == NULL) {
-        req->body = NULL;
+        req->body   = NULL;
+        req->length = 0;
     } else {
         int size = strlen(body);
-        req->body = malloc(sizeof(char) * ++size);
-        strcpy(req->body, body);
+        req->body   = malloc(sizeof(char) * (size + 1));
+        req->length = size;
+        memcpy(req->body, body, size + 1);
     }
 
-    req->next = NULL;
+    req->next     = NULL;
+    req->headers  = NULL;
+    req->status   = 0;
+    req->release  = free;
+    req->queued   = 0;
+    req->priority = PRIORITY_NORMAL;
     return req;
 }
 
+/**
+ * Create Request structure that takes ownership of a binary body buffer
+ * (the body is not copied).
+ * @param   method      Request method string.
+ * @param   uri         Request uri string.
+ * @param   body        Request body buffer.
+ * @param   length      Length of body buffer.
+ * @param   release     Function used to release body (NULL to not release).
+ * @return  Newly allocated Request structure.
+ */
+Request * request_create_buf(const char *method, const char *uri, void *body, size_t length, Release release) {
+    Request* req = request_create(method, uri, NULL);
+    if (length == 0) {
+        // Empty bodies are stored as NULL (see request_length)
+        if (release) {
+            release(body);
+        }
+        return req;
+    }
+
+    req->body    = body;
+    req->length  = length;
+    req->release = release;
+    return req;
+}
+
+/**
+ * Compute length of Request body.
+ *
+ * Requests that were not built by request_create (ie. statically
+ * initialized) have no length set and a NUL terminated body.
+ * @param   r           Request structure.
+ * @return  Length of body.
+ */
+size_t request_length(Request *r) {
+    if (r->body == NULL) {
+        return 0;
+    }
+    return r->length ? r->length : strlen(r->body);
+}
+
 /**
  * Delete Request structure.
  * @param   r           Request structure.
@@ -50,29 +101,210 @@ Request * request_create(const char *method, const char *uri, const char *body)
 void request_delete(Request *r) {
     free(r->method);
     free(r->uri);
-    free(r->body);
+    if (r->release) {
+        r->release(r->body);
+    }
+
+    Header* header = r->headers;
+    while (header) {
+        Header* next = header->next;
+        free(header->name);
+        free(header->value);
+        free(header);
+        header = next;
+    }
     free(r);
 }
 
+/**
+ * Write HTTP Request line and headers to stream.
+ * @param   r           Request structure.
+ * @param   fs          File stream.
+ * @return  Number of bytes written.
+ */
+static size_t request_write_head(Request *r, FILE *fs) {
+    int bytes = fprintf(fs, "%s %s HTTP/1.0\r\nContent-Length: %zu\r\n", r->method, r->uri, request_length(r));
+    if (r->priority > PRIORITY_NORMAL) {
+        bytes += fprintf(fs, "X-Priority: %d\r\n", r->priority);
+    }
+    for (Header* header = r->headers; header; header = header->next) {
+        bytes += fprintf(fs, "%s: %s\r\n", header->name, header->value);
+    }
+    bytes += fprintf(fs, "\r\n");
+    return bytes < 0 ? 0 : bytes;
+}
+
 /**
  * Write HTTP Request to stream:
  *  
  *  $METHOD $URI HTTP/1.0\r\n
  *  Content-Length: Length($BODY)\r\n
+ *  X-Priority: $PRIORITY\r\n            (unless normal priority)
+ *  $HEADER: $VALUE\r\n
  *  \r\n
  *  $BODY
- *      
+ *
+ * Content-Length is always sent (0 without a body) so the server can keep
+ * the connection alive.  The body may contain NUL bytes.
  * @param   r           Request structure.
  * @param   fs          Socket file stream.
+ * @return  Number of bytes written.
  */
-void request_write(Request *r, FILE *fs) {
-    if (r->body == NULL) {
-        fprintf(fs, "%s %s HTTP/1.0\r\n\r\n",
-                r->method, r->uri);
-    } else {
-        fprintf(fs, "%s %s HTTP/1.0\r\nContent-Length: %zu\r\n\r\n%s",
-                r->method, r->uri, strlen(r->body), r->body);
+size_t request_write(Request *r, FILE *fs) {
+    size_t bytes = request_write_head(r, fs);
+    if (r->body != NULL) {
+        bytes += fwrite(r->body, 1, request_length(r), fs);
+    }
+    return bytes;
+}
+
+/**
+ * Send HTTP Request directly to socket (same format as request_write).
+ *
+ * Only the head is formatted into a buffer; it is sent together with the
+ * body using a single gathering write, so the body is never copied.
+ * @param   r           Request structure.
+ * @param   fd          Socket file descriptor.
+ * @return  Number of bytes sent, or 0 on failure.
+ */
+size_t request_send(Request *r, int fd) {
+    char*  head   = NULL;
+    size_t length = 0;
+    FILE*  fs     = open_memstream(&head, &length);
+    if (fs == NULL) {
+        return 0;
+    }
+    request_write_head(r, fs);
+    fclose(fs);
+
+    struct iovec iov[2] = {
+        { .iov_base = head   , .iov_len = length },
+        { .iov_base = r->body, .iov_len = request_length(r) },
+    };
+    size_t total = iov[0].iov_len + iov[1].iov_len;
+    size_t sent  = 0;
+    int    index = 0;
+
+    while (sent < total) {
+        ssize_t n = writev(fd, iov + index, 2 - index);
+        if (n < 0) {
+            if (errno == EINTR) {
+                continue;
+            }
+            sent = 0;
+            break;
+        }
+        sent += n;
+        while (index < 2 && (size_t)n >= iov[index].iov_len) {
+            n -= iov[index++].iov_len;
+        }
+        if (index < 2) {
+            iov[index].iov_base = (char *)iov[index].iov_base + n;
+            iov[index].iov_len -= n;
+        }
+    }
+
+    free(head);
+    return sent;
+}
+
+/**
+ * Read HTTP Response from stream into a Request structure:
+ *
+ *  HTTP/1.$MINOR $STATUS $REASON\r\n
+ *  $HEADER: $VALUE\r\n
+ *  \r\n
+ *  $BODY
+ *
+ * The body is read according to the Content-Length header and the priority
+ * of delivered messages according to the X-Priority header.
+ * @param   fs          Socket file stream.
+ * @return  Newly allocated Request structure (status and headers set), or
+ *          NULL if the stream did not contain a valid response.
+ */
+Request * request_read(FILE *fs) {
+    char buffer[BUFSIZ];
+    int  status;
+
+    if (!fgets(buffer, BUFSIZ, fs)) {
+        return NULL;
+    }
+    if (sscanf(buffer, "HTTP/1.%*d %d", &status) != 1) {
+        error("Unable to parse response status line");
+        return NULL;
+    }
+
+    Request* res = request_create(NULL, NULL, NULL);
+    res->status = status;
+
+    // Parse headers until the empty line
+    long content_length = -1;
+    while (fgets(buffer, BUFSIZ, fs) && strcmp(buffer, "\r\n") != 0 && strcmp(buffer, "\n") != 0) {
+        char* value = strchr(buffer, ':');
+        if (value == NULL) {
+            continue;
+        }
+        *value++ = '\0';
+        value   += strspn(value, " \t");
+        value[strcspn(value, "\r\n")] = '\0';
+
+        if (strcasecmp(buffer, "Content-Length") == 0) {
+            content_length = strtol(value, NULL, 10);
+        } else if (strcasecmp(buffer, "X-Priority") == 0) {
+            int priority  = atoi(value);
+            res->priority = priority < 0 ? 0 : (priority >= REQUEST_PRIORITIES ? REQUEST_PRIORITIES - 1 : priority);
+            request_set_header(res, buffer, value);
+        } else {
+            request_set_header(res, buffer, value);
+        }
+    }
+
+    // Read body
+    if (content_length >= 0) {
+        res->body = malloc(content_length + 1);
+        if (fread(res->body, 1, content_length, fs) != (size_t)content_length) {
+            error("Unable to read response body of %ld bytes", content_length);
+            request_delete(res);
+            return NULL;
+        }
+        res->body[content_length] = '\0';
+        res->length = content_length;
+    }
+    return res;
+}
+
+/**
+ * Set (append) header on Request structure.
+ * @param   r           Request structure.
+ * @param   name        Header name.
+ * @param   value       Header value.
+ */
+void request_set_header(Request *r, const char *name, const char *value) {
+    Header* header = malloc(sizeof(Header));
+    header->name   = strdup(name);
+    header->value  = strdup(value);
+    header->next   = NULL;
+
+    Header** tail = &r->headers;
+    while (*tail) {
+        tail = &(*tail)->next;
+    }
+    *tail = header;
+}
+
+/**
+ * Lookup header value on Request structure (case insensitive).
+ * @param   r           Request structure.
+ * @param   name        Header name.
+ * @return  Header value if present, otherwise NULL.
+ */
+const char *request_get_header(Request *r, const char *name) {
+    for (Header* header = r->headers; header; header = header->next) {
+        if (strcasecmp(header->name, name) == 0) {
+            return header->value;
+        }
     }
+    return NULL;
 }
 
 /* vim: set expandtab sts=4 sw=4 ts=8 ft=c: */ 
@@ -0,0 +1,195 @@
+/* stats.c: Per-thread client counters and latency histograms */
+
+#include "mq/stats.h"
+
+#include <stdlib.h>
+#include <string.h>
+
+/* Internal Constants */
+
+#define CACHE_LINE      64
+#define STATS_CACHE     8       // Shards remembered by each thread
+
+/* Internal Variables */
+
+typedef struct StatsCacheEntry StatsCacheEntry;
+struct StatsCacheEntry {
+    uint64_t	id;
+    MQStats *	stats;
+};
+
+static uint64_t                 NextId = 1;                 // Next Stats id
+static __thread StatsCacheEntry Cache[STATS_CACHE];         // Calling thread's shards
+static __thread size_t          CacheNext = 0;              // Next cache entry to replace
+
+/* Internal Prototypes */
+
+static void histogram_merge(Histogram *h, const Histogram *other);
+
+/* External Functions */
+
+/**
+ * Create Stats structure.
+ * @return  Newly allocated Stats structure.
+ */
+Stats * stats_create() {
+    Stats* s = calloc(1, sizeof(Stats));
+    if (s == NULL) {
+        return NULL;
+    }
+    s->id = __atomic_fetch_add(&NextId, 1, __ATOMIC_RELAXED);
+    mutex_init(&s->lock, NULL);
+    return s;
+}
+
+/**
+ * Delete Stats structure (and the shards of every thread).
+ * @param   s       Stats structure.
+ */
+void stats_delete(Stats *s) {
+    while (s->shards) {
+        StatsShard* shard = s->shards;
+        s->shards = shard->next;
+        free(shard);
+    }
+    pthread_mutex_destroy(&s->lock);
+    free(s);
+}
+
+/**
+ * Return counters of the calling thread, allocating its shard on first use.
+ *
+ * Each thread caches its most recently used shards by Stats id, so the hot
+ * path takes no lock and threads never write to each other's cache lines.
+ * @param   s       Stats structure.
+ * @return  Counters owned by the calling thread.
+ */
+MQStats * stats_local(Stats *s) {
+    for (size_t i = 0; i < STATS_CACHE; i++) {
+        if (Cache[i].id == s->id) {
+            return Cache[i].stats;
+        }
+    }
+
+    pthread_t   self  = pthread_self();
+    StatsShard* shard = NULL;
+
+    mutex_lock(&s->lock);
+    for (shard = s->shards; shard && !pthread_equal(shard->owner, self); shard = shard->next);
+    if (shard == NULL) {
+        if (posix_memalign((void **)&shard, CACHE_LINE, sizeof(StatsShard)) != 0) {
+            mutex_unlock(&s->lock);
+            error("Unable to allocate stats shard");
+            exit(EXIT_FAILURE);
+        }
+        memset(shard, 0, sizeof(StatsShard));
+        shard->owner = self;
+        shard->next  = s->shards;
+        s->shards    = shard;
+    }
+    mutex_unlock(&s->lock);
+
+    Cache[CacheNext].id    = s->id;
+    Cache[CacheNext].stats = &shard->stats;
+    CacheNext = (CacheNext + 1) % STATS_CACHE;
+    return &shard->stats;
+}
+
+/**
+ * Sum the counters and histograms of every thread into out (queue depths
+ * are left for the caller to fill in).
+ * @param   s       Stats structure.
+ * @param   out     MQStats structure to fill.
+ */
+void stats_collect(Stats *s, MQStats *out) {
+    memset(out, 0, sizeof(MQStats));
+
+    mutex_lock(&s->lock);
+    for (StatsShard* shard = s->shards; shard; shard = shard->next) {
+        MQStats* local = &shard->stats;
+        out->published       += __atomic_load_n(&local->published, __ATOMIC_RELAXED);
+        out->retrieved       += __atomic_load_n(&local->retrieved, __ATOMIC_RELAXED);
+        out->bytes_published += __atomic_load_n(&local->bytes_published, __ATOMIC_RELAXED);
+        out->bytes_retrieved += __atomic_load_n(&local->bytes_retrieved, __ATOMIC_RELAXED);
+        out->errors          += __atomic_load_n(&local->errors, __ATOMIC_RELAXED);
+        out->reconnects      += __atomic_load_n(&local->reconnects, __ATOMIC_RELAXED);
+        histogram_merge(&out->connect, &local->connect);
+        histogram_merge(&out->publish, &local->publish);
+        histogram_merge(&out->queued , &local->queued);
+    }
+    mutex_unlock(&s->lock);
+}
+
+/**
+ * Return monotonic time in nanoseconds.
+ */
+uint64_t stats_now() {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000000000UL + ts.tv_nsec;
+}
+
+/**
+ * Return wall-clock time in microseconds since the Unix epoch (comparable
+ * across processes and, if their clocks are synchronized, hosts).
+ */
+uint64_t stats_epoch() {
+    struct timespec ts;
+    clock_gettime(CLOCK_REALTIME, &ts);
+    return (uint64_t)ts.tv_sec * 1000000UL + ts.tv_nsec / 1000;
+}
+
+/**
+ * Add sample to histogram (must be owned by the calling thread).
+ * @param   h       Histogram structure.
+ * @param   ns      Sample in nanoseconds.
+ */
+void histogram_add(Histogram *h, uint64_t ns) {
+    size_t bucket = ns ? 63 - __builtin_clzll(ns) : 0;
+    if (bucket >= HISTOGRAM_BUCKETS) {
+        bucket = HISTOGRAM_BUCKETS - 1;
+    }
+    __atomic_store_n(&h->buckets[bucket], h->buckets[bucket] + 1, __ATOMIC_RELAXED);
+    __atomic_store_n(&h->count, h->count + 1, __ATOMIC_RELAXED);
+    __atomic_store_n(&h->total, h->total + ns, __ATOMIC_RELAXED);
+}
+
+/**
+ * Estimate percentile of histogram samples.
+ * @param   h           Histogram structure.
+ * @param   percentile  Percentile (0 to 100).
+ * @return  Upper bound of the bucket holding the percentile (nanoseconds),
+ *          or 0 if there are no samples.
+ */
+uint64_t histogram_percentile(const Histogram *h, double percentile) {
+    uint64_t rank = (uint64_t)(h->count * percentile / 100.0 + 0.5);
+    uint64_t seen = 0;
+    if (h->count == 0) {
+        return 0;
+    }
+
+    for (size_t bucket = 0; bucket < HISTOGRAM_BUCKETS; bucket++) {
+        seen += h->buckets[bucket];
+        if (seen >= rank && seen > 0) {
+            return (2UL << bucket) - 1;
+        }
+    }
+    return UINT64_MAX;
+}
+
+/* Internal Functions */
+
+/**
+ * Add samples of other histogram (owned by another thread) to h.
+ * @param   h       Histogram structure.
+ * @param   other   Histogram structure to merge.
+ */
+static void histogram_merge(Histogram *h, const Histogram *other) {
+    h->count += __atomic_load_n(&other->count, __ATOMIC_RELAXED);
+    h->total += __atomic_load_n(&other->total, __ATOMIC_RELAXED);
+    for (size_t bucket = 0; bucket < HISTOGRAM_BUCKETS; bucket++) {
+        h->buckets[bucket] += __atomic_load_n(&other->buckets[bucket], __ATOMIC_RELAXED);
+    }
+}
+
+/* vim: set expandtab sts=4 sw=4 ts=8 ft=c: */
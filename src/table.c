@@ -0,0 +1,181 @@
+/* table.c: String keyed hash table */
+
+#include "mq/table.h"
+
+#include <stdlib.h>
+#include <string.h>
+
+/* Internal Constants */
+
+#define DEFAULT_CAPACITY    (1<<6)
+#define MAXIMUM_LOAD        2
+
+/* Internal Functions */
+
+/**
+ * Compute FNV-1a hash of string.
+ * @param   key         String to hash.
+ * @return  Hash of key.
+ */
+static size_t table_hash(const char *key) {
+    size_t hash = 14695981039346656037ULL;
+    for (const unsigned char *c = (const unsigned char *)key; *c; c++) {
+        hash ^= *c;
+        hash *= 1099511628211ULL;
+    }
+    return hash;
+}
+
+/**
+ * Double the number of buckets and rehash every entry.
+ * @param   t           Table structure.
+ */
+static void table_resize(Table *t) {
+    size_t  capacity = t->capacity * 2;
+    Entry** buckets  = calloc(capacity, sizeof(Entry *));
+    if (buckets == NULL) {
+        return;
+    }
+
+    for (size_t b = 0; b < t->capacity; b++) {
+        Entry* e = t->buckets[b];
+        while (e) {
+            Entry* next  = e->next;
+            size_t index = table_hash(e->key) % capacity;
+            e->next = buckets[index];
+            buckets[index] = e;
+            e = next;
+        }
+    }
+
+    free(t->buckets);
+    t->buckets  = buckets;
+    t->capacity = capacity;
+}
+
+/* External Functions */
+
+/**
+ * Create Table structure.
+ * @param   capacity    Initial number of buckets (0 for default).
+ * @return  Newly allocated Table structure.
+ */
+Table * table_create(size_t capacity) {
+    Table* t = malloc(sizeof(Table));
+    if (t == NULL) {
+        return NULL;
+    }
+
+    t->capacity = capacity ? capacity : DEFAULT_CAPACITY;
+    t->size     = 0;
+    t->buckets  = calloc(t->capacity, sizeof(Entry *));
+    if (t->buckets == NULL) {
+        free(t);
+        return NULL;
+    }
+    return t;
+}
+
+/**
+ * Delete Table structure.
+ * @param   t           Table structure.
+ * @param   release     Function used to release each value (may be NULL).
+ */
+void table_delete(Table *t, void (*release)(void *)) {
+    for (size_t b = 0; b < t->capacity; b++) {
+        Entry* e = t->buckets[b];
+        while (e) {
+            Entry* next = e->next;
+            if (release) {
+                release(e->value);
+            }
+            free(e->key);
+            free(e);
+            e = next;
+        }
+    }
+    free(t->buckets);
+    free(t);
+}
+
+/**
+ * Insert or update key in Table.
+ * @param   t           Table structure.
+ * @param   key         String key (copied).
+ * @param   value       Value to associate with key.
+ */
+void table_insert(Table *t, const char *key, void *value) {
+    size_t index = table_hash(key) % t->capacity;
+    for (Entry* e = t->buckets[index]; e; e = e->next) {
+        if (strcmp(e->key, key) == 0) {
+            e->value = value;
+            return;
+        }
+    }
+
+    Entry* e = malloc(sizeof(Entry));
+    e->key   = strdup(key);
+    e->value = value;
+    e->next  = t->buckets[index];
+    t->buckets[index] = e;
+
+    if (++t->size > t->capacity * MAXIMUM_LOAD) {
+        table_resize(t);
+    }
+}
+
+/**
+ * Search Table for key.
+ * @param   t           Table structure.
+ * @param   key         String key.
+ * @return  Value associated with key, otherwise NULL.
+ */
+void * table_search(Table *t, const char *key) {
+    size_t index = table_hash(key) % t->capacity;
+    for (Entry* e = t->buckets[index]; e; e = e->next) {
+        if (strcmp(e->key, key) == 0) {
+            return e->value;
+        }
+    }
+    return NULL;
+}
+
+/**
+ * Remove key from Table.
+ * @param   t           Table structure.
+ * @param   key         String key.
+ * @return  Value that was associated with key, otherwise NULL.
+ */
+void * table_remove(Table *t, const char *key) {
+    size_t  index = table_hash(key) % t->capacity;
+    Entry** link  = &t->buckets[index];
+    while (*link) {
+        Entry* e = *link;
+        if (strcmp(e->key, key) == 0) {
+            void* value = e->value;
+            *link = e->next;
+            free(e->key);
+            free(e);
+            t->size--;
+            return value;
+        }
+        link = &e->next;
+    }
+    return NULL;
+}
+
+/**
+ * Call function on each key and value in Table.
+ * @param   t           Table structure.
+ * @param   func        Function to call.
+ * @param   arg         User argument passed to func.
+ */
+void table_each(Table *t, TableFunc func, void *arg) {
+    for (size_t b = 0; b < t->capacity; b++) {
+        for (Entry* e = t->buckets[b]; e; e = e->next) {
+            func(e->key, e->value, arg);
+        }
+    }
+}
+
+/* vim: set expandtab sts=4 sw=4 ts=8 ft=c: */
@@ -0,0 +1,79 @@
+/* test_cluster_client.c: Message Queue cluster map test against several local brokers */
+
+#include "mq/client.h"
+
+#include <assert.h>
+#include <unistd.h>
+
+/* Constants */
+
+const size_t NTOPICS   = 16;
+const size_t NMESSAGES = 10;
+
+/* Main execution */
+
+int main(int argc, char *argv[]) {
+    /* Parse command-line arguments: cluster map of the local brokers */
+    char *host = "localhost:9620;localhost:9621;localhost:9622";
+    char *port = "9620";
+    char  name[BUFSIZ];
+    char  topic[64];
+    char  body[BUFSIZ];
+
+    if (argc > 1) { host = argv[1]; }
+    if (argc > 2) { port = argv[2]; }
+    sprintf(name, "cluster_client_test_%d", getpid());
+
+    /* Subscribe to topics owned by every broker */
+    MessageQueue *mq = mq_create(name, host, port);
+    assert(mq);
+    assert(mq->nbrokers > 1);
+    for (size_t t = 0; t < NTOPICS; t++) {
+        sprintf(topic, "cluster_%zu", t);
+        mq_subscribe(mq, topic);
+    }
+    mq_set_lease(mq, 2);
+    mq_start(mq);
+
+    for (size_t m = 0; m < NMESSAGES; m++) {
+        for (size_t t = 0; t < NTOPICS; t++) {
+            sprintf(topic, "cluster_%zu", t);
+            snprintf(body, sizeof(body), "%zu. Hello to %s", m, topic);
+            mq_publish(mq, topic, body);
+        }
+    }
+
+    /* Messages of every broker are merged into one incoming queue and are
+     * acknowledged to the broker that delivered them */
+    size_t counts[NTOPICS];
+    memset(counts, 0, sizeof(counts));
+    for (size_t m = 0; m < NMESSAGES * NTOPICS; m++) {
+        uint64_t delivery;
+        size_t   index, t;
+        char *message = mq_retrieve_lease(mq, &delivery);
+        assert(message);
+        assert(delivery);
+        assert(sscanf(message, "%zu. Hello to cluster_%zu", &index, &t) == 2);
+        assert(t < NTOPICS && index == counts[t]);
+        counts[t]++;
+        mq_ack(mq, delivery);
+        free(message);
+    }
+
+    /* Every broker served some of the topics */
+    MQStats stats;
+    mq_stats(mq, &stats);
+    assert(stats.published == NMESSAGES * NTOPICS);
+    assert(stats.retrieved == NMESSAGES * NTOPICS);
+    for (size_t b = 0; b < mq->nbrokers; b++) {
+        EndpointStats s;
+        endpoint_stats(mq->brokers[b].endpoint, &s);
+        assert(s.requests > NTOPICS / mq->nbrokers);
+    }
+
+    mq_stop(mq);
+    mq_delete(mq);
+    return 0;
+}
+
+/* vim: set expandtab sts=4 sw=4 ts=8 ft=c: */
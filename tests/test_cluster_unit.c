@@ -0,0 +1,134 @@
+/* test_cluster_unit.c: Test Message Queue cluster map routing (Unit) */
+
+#include "mq/client.h"
+#include "mq/string.h"
+
+#include <assert.h>
+#include <stdio.h>
+#include <stdlib.h>
+
+/* Constants */
+
+const char * CLUSTER   = "localhost:9701;localhost:9702;localhost:9703";
+const size_t NTOPICS   = 64;
+
+/* Functions */
+
+size_t owner(MessageQueue *mq) {
+    for (size_t b = 0; b < mq->nbrokers; b++) {
+        if (queue_size(mq->brokers[b].outgoing)) {
+            return b;
+        }
+    }
+    return mq->nbrokers;
+}
+
+void drain(MessageQueue *mq) {
+    for (size_t b = 0; b < mq->nbrokers; b++) {
+        while (queue_size(mq->brokers[b].outgoing)) {
+            request_delete(queue_pop(mq->brokers[b].outgoing));
+        }
+    }
+}
+
+int test_00_cluster_create() {
+    MessageQueue *mq = mq_create("cluster_unit", CLUSTER, "9620");
+    assert(mq);
+    assert(mq->nbrokers == 3);
+    assert(mq->endpoint == mq->brokers[0].endpoint);
+    assert(mq->outgoing == mq->brokers[0].outgoing);
+    assert(streq(mq->brokers[1].endpoint->servers[0].port, "9702"));
+    assert(mq->brokers[1].endpoint != mq->brokers[2].endpoint);
+    mq_delete(mq);
+
+    /* A single broker (with failover) is not a cluster */
+    mq = mq_create("cluster_unit", "localhost:9701,localhost:9702", "9620");
+    assert(mq);
+    assert(mq->nbrokers == 1);
+    assert(mq->endpoint->nservers == 2);
+    mq_delete(mq);
+    return EXIT_SUCCESS;
+}
+
+int test_01_cluster_route() {
+    MessageQueue *mq = mq_create("cluster_unit", CLUSTER, "9620");
+    size_t counts[3] = {0};
+    char   topic[BUFSIZ];
+
+    for (size_t t = 0; t < NTOPICS; t++) {
+        /* Publishes and subscriptions to a topic go to the same broker */
+        sprintf(topic, "topic_%zu", t);
+        mq_publish(mq, topic, "payload");
+        size_t broker = owner(mq);
+        assert(broker < 3);
+        assert(queue_size(mq->brokers[broker].outgoing) == 1);
+        drain(mq);
+
+        mq_subscribe(mq, topic);
+        assert(owner(mq) == broker);
+        drain(mq);
+        counts[broker]++;
+    }
+
+    /* Topics are spread over every broker */
+    for (size_t b = 0; b < 3; b++) {
+        assert(counts[b] > 0);
+    }
+
+    /* Patterns and groups are sent to every broker */
+    mq_subscribe(mq, "topic.#");
+    mq_leave(mq, "group");
+    for (size_t b = 0; b < 3; b++) {
+        assert(queue_size(mq->brokers[b].outgoing) == 2);
+    }
+
+    mq_delete(mq);
+    return EXIT_SUCCESS;
+}
+
+int test_02_cluster_ack() {
+    MessageQueue *mq = mq_create("cluster_unit", CLUSTER, "9620");
+
+    /* Deliveries are acknowledged to the broker in their top bits */
+    mq_ack(mq, 5);
+    mq_ack(mq, (2ULL << MQ_BROKER_SHIFT) | 7);
+    mq_ack(mq, (9ULL << MQ_BROKER_SHIFT) | 8);
+
+    char *acks = endpoint_take_acks(mq->brokers[0].endpoint);
+    assert(acks && streq(acks, "5"));
+    free(acks);
+    assert(endpoint_take_acks(mq->brokers[1].endpoint) == NULL);
+    acks = endpoint_take_acks(mq->brokers[2].endpoint);
+    assert(acks && streq(acks, "7"));
+    free(acks);
+
+    mq_delete(mq);
+    return EXIT_SUCCESS;
+}
+
+/* Main execution */
+
+int main(int argc, char *argv[]) {
+    if (argc != 2) {
+        fprintf(stderr, "Usage: %s NUMBER\n\n", argv[0]);
+        fprintf(stderr, "Where NUMBER is right of the following:\n");
+        fprintf(stderr, "    0. Test cluster_create\n");
+        fprintf(stderr, "    1. Test cluster_route\n");
+        fprintf(stderr, "    2. Test cluster_ack\n");
+        return EXIT_FAILURE;
+    }
+
+    int number = atoi(argv[1]);
+    int status = EXIT_FAILURE;
+
+    switch (number) {
+        case 0:  status = test_00_cluster_create(); break;
+        case 1:  status = test_01_cluster_route(); break;
+        case 2:  status = test_02_cluster_ack(); break;
+        default: fprintf(stderr, "Unknown NUMBER: %d\n", number); break;
+    }
+
+    return status;
+}
+
+/* vim: set expandtab sts=4 sw=4 ts=8 ft=c: */
@@ -0,0 +1,129 @@
+/* test_compress_unit.c: Test LZ compression of message bodies (Unit) */
+
+#include "mq/compress.h"
+
+#include <assert.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+/* Constants */
+
+const char * INPUTS[] = {
+    "",
+    "a",
+    "abcd",
+    "aaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaa",
+    "{\"id\": 1, \"name\": \"alpha\"}, {\"id\": 2, \"name\": \"beta\"}, {\"id\": 3, \"name\": \"gamma\"}",
+    NULL,
+};
+
+/* Functions */
+
+int roundtrip(const char *input, size_t length) {
+    size_t capacity   = lz_bound(length);
+    char  *compressed = malloc(capacity);
+    char  *original   = malloc(length + 1);
+
+    size_t n = lz_compress(input, length, compressed, capacity);
+    assert(n > 0);
+    assert(n <= capacity);
+    assert(lz_decompress(compressed, n, original, length) == (ssize_t)length);
+    assert(memcmp(original, input, length) == 0);
+
+    free(compressed);
+    free(original);
+    return n;
+}
+
+int test_00_lz_bound() {
+    for (size_t length = 0; length < (1<<20); length = length * 2 + 1) {
+        assert(lz_bound(length) > length);
+    }
+    return EXIT_SUCCESS;
+}
+
+int test_01_lz_compress() {
+    for (size_t i = 0; INPUTS[i]; i++) {
+        roundtrip(INPUTS[i], strlen(INPUTS[i]));
+    }
+
+    /* Repetitive input shrinks */
+    size_t length = 1<<16;
+    char  *input  = malloc(length);
+    for (size_t i = 0; i < length; i++) {
+        input[i] = "{\"key\": \"value\", \"count\": 42}"[i % 30];
+    }
+    assert(roundtrip(input, length) < length / 10);
+
+    free(input);
+    return EXIT_SUCCESS;
+}
+
+int test_02_lz_compress_incompressible() {
+    size_t length = 1<<16;
+    char  *input  = malloc(length);
+    char  *output = malloc(length);
+
+    srand(0);
+    for (size_t i = 0; i < length; i++) {
+        input[i] = rand();
+    }
+
+    assert(lz_compress(input, length, output, length / 2) == 0);
+    roundtrip(input, length);
+
+    free(input);
+    free(output);
+    return EXIT_SUCCESS;
+}
+
+int test_03_lz_decompress_corrupt() {
+    const char *input  = INPUTS[4];
+    size_t      length = strlen(input);
+    char        compressed[BUFSIZ];
+    char        original[BUFSIZ];
+
+    size_t n = lz_compress(input, length, compressed, sizeof(compressed));
+    assert(n > 0);
+
+    /* Truncated input and short output are rejected */
+    for (size_t i = 1; i < n; i++) {
+        assert(lz_decompress(compressed, i, original, sizeof(original)) != (ssize_t)length);
+    }
+    assert(lz_decompress(compressed, n, original, length - 1) == -1);
+
+    /* Match offset before start of output is rejected */
+    char bad[] = { 0x10, 'a', 0x05, 0x00, 0x00 };
+    assert(lz_decompress(bad, sizeof(bad), original, sizeof(original)) == -1);
+    return EXIT_SUCCESS;
+}
+
+/* Main execution */
+
+int main(int argc, char *argv[]) {
+    if (argc != 2) {
+        fprintf(stderr, "Usage: %s NUMBER\n\n", argv[0]);
+        fprintf(stderr, "Where NUMBER is right of the following:\n");
+        fprintf(stderr, "    0. Test lz_bound\n");
+        fprintf(stderr, "    1. Test lz_compress\n");
+        fprintf(stderr, "    2. Test lz_compress_incompressible\n");
+        fprintf(stderr, "    3. Test lz_decompress_corrupt\n");
+        return EXIT_FAILURE;
+    }
+
+    int number = atoi(argv[1]);
+    int status = EXIT_FAILURE;
+
+    switch (number) {
+        case 0:  status = test_00_lz_bound(); break;
+        case 1:  status = test_01_lz_compress(); break;
+        case 2:  status = test_02_lz_compress_incompressible(); break;
+        case 3:  status = test_03_lz_decompress_corrupt(); break;
+        default: fprintf(stderr, "Unknown NUMBER: %d\n", number); break;
+    }
+
+    return status;
+}
+
+/* vim: set expandtab sts=4 sw=4 ts=8 ft=c: */
@@ -0,0 +1,62 @@
+/* test_delayed_client.c: Message Queue delayed publish test */
+
+#include "mq/client.h"
+#include "mq/string.h"
+
+#include <assert.h>
+#include <time.h>
+#include <unistd.h>
+
+/* Constants */
+
+const char *   TOPIC   = "delayed";
+const uint64_t DELAY   = 1000;  // Milliseconds the delayed message is held
+const int      TIMEOUT = 60;    // Seconds before the test is failed
+
+/* Functions */
+
+double now_ms() {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec * 1000.0 + ts.tv_nsec / 1000000.0;
+}
+
+/* Main execution */
+
+int main(int argc, char *argv[]) {
+    /* Parse command-line arguments */
+    char *host = "localhost";
+    char *port = "9620";
+    char  name[BUFSIZ];
+
+    if (argc > 1) { host = argv[1]; }
+    if (argc > 2) { port = argv[2]; }
+    sprintf(name, "delayed_client_test_%d", getpid());
+    alarm(TIMEOUT);
+
+    MessageQueue *mq = mq_create(name, host, port);
+    assert(mq);
+    mq_subscribe(mq, TOPIC);
+    mq_start(mq);
+
+    /* The delayed message is overtaken by the one published after it */
+    double started = now_ms();
+    mq_publish_delayed(mq, TOPIC, "later", DELAY);
+    mq_publish(mq, TOPIC, "now");
+
+    char *message = mq_retrieve(mq);
+    assert(message && streq(message, "now"));
+    free(message);
+
+    /* And is only delivered once it is due */
+    message = mq_retrieve(mq);
+    assert(message && streq(message, "later"));
+    assert(now_ms() - started >= DELAY);
+    free(message);
+
+    mq_stop(mq);
+    mq_delete(mq);
+    return 0;
+}
+
+/* vim: set expandtab sts=4 sw=4 ts=8 ft=c: */
@@ -0,0 +1,79 @@
+/* test_failover_client.c: Message Queue failover test against a primary and its replica */
+
+#include "mq/client.h"
+#include "mq/string.h"
+
+#include <assert.h>
+#include <signal.h>
+#include <unistd.h>
+
+/* Constants */
+
+const size_t NMESSAGES = 10;
+const int    PROMOTE   = 3;     // Seconds to wait for the replica to promote itself
+const int    TIMEOUT   = 60;    // Seconds before the test is failed
+
+/* Functions */
+
+void publish_retrieve(MessageQueue *mq, const char *phase) {
+    char body[BUFSIZ];
+
+    for (size_t m = 0; m < NMESSAGES; m++) {
+        snprintf(body, sizeof(body), "%zu. Hello %s", m, phase);
+        mq_publish(mq, "failover", body);
+    }
+
+    for (size_t m = 0; m < NMESSAGES; m++) {
+        char *message = mq_retrieve(mq);
+        assert(message);
+        snprintf(body, sizeof(body), "%zu. Hello %s", m, phase);
+        assert(streq(message, body));
+        free(message);
+    }
+}
+
+/* Main execution */
+
+int main(int argc, char *argv[]) {
+    /* Parse command-line arguments: failover list and process of the primary */
+    char *host = "localhost:9640,localhost:9641";
+    char *port = "9640";
+    pid_t primary = 0;
+    char  name[BUFSIZ];
+
+    if (argc > 1) { host = argv[1]; }
+    if (argc > 2) { port = argv[2]; }
+    if (argc > 3) { primary = atoi(argv[3]); }
+    sprintf(name, "failover_client_test_%d", getpid());
+    alarm(TIMEOUT);
+
+    MessageQueue *mq = mq_create(name, host, port);
+    assert(mq);
+    mq_subscribe(mq, "failover");
+    mq_start(mq);
+
+    /* Served by the primary (the replica refuses with 503 and X-Replica) */
+    publish_retrieve(mq, "primary");
+
+    /* Give the subscription time to reach the replica, then kill the primary
+     * and wait for the replica to take over */
+    if (primary > 0) {
+        sleep(1);
+        assert(kill(primary, SIGKILL) == 0);
+        sleep(PROMOTE);
+    }
+
+    /* Publishes and retrieves continue against the promoted replica */
+    publish_retrieve(mq, "replica");
+
+    MQStats stats;
+    mq_stats(mq, &stats);
+    assert(stats.published == 2 * NMESSAGES);
+    assert(stats.retrieved == 2 * NMESSAGES);
+
+    mq_stop(mq);
+    mq_delete(mq);
+    return 0;
+}
+
+/* vim: set expandtab sts=4 sw=4 ts=8 ft=c: */
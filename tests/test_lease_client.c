@@ -0,0 +1,105 @@
+/* test_lease_client.c: Message Queue leased retrieval test */
+
+#include "mq/client.h"
+#include "mq/string.h"
+
+#include <assert.h>
+#include <unistd.h>
+
+/* Constants */
+
+const char * TOPIC     = "leased";
+const size_t NMESSAGES = 10;
+const size_t NBACKLOG  = 100;
+const size_t NSTALE    = 4000;  // Unknown ids overflowing one X-Ack header
+const int    TIMEOUT   = 60;    // Seconds before the test is failed
+
+/* Main execution */
+
+int main(int argc, char *argv[]) {
+    /* Parse command-line arguments */
+    char *host = "localhost";
+    char *port = "9620";
+    char  name[BUFSIZ];
+    char  body[BUFSIZ];
+
+    if (argc > 1) { host = argv[1]; }
+    if (argc > 2) { port = argv[2]; }
+    sprintf(name, "lease_client_test_%d", getpid());
+    alarm(TIMEOUT);
+
+    /* Create and start message queue leasing its deliveries */
+    MessageQueue *mq = mq_create(name, host, port);
+    assert(mq);
+    mq_subscribe(mq, TOPIC);
+    mq_set_lease(mq, 1);
+    mq_start(mq);
+
+    for (size_t m = 0; m < NMESSAGES; m++) {
+        sprintf(body, "%zu. Hello from %d", m, getpid());
+        mq_publish(mq, TOPIC, body);
+    }
+
+    /* Acknowledge every message but the first one */
+    uint64_t first;
+    char    *message = mq_retrieve_lease(mq, &first);
+    assert(message && strncmp(message, "0. ", 3) == 0);
+    assert(first);
+    free(message);
+
+    for (size_t m = 1; m < NMESSAGES; m++) {
+        uint64_t delivery;
+        message = mq_retrieve_lease(mq, &delivery);
+        assert(message && strstr(message, "Hello from"));
+        assert(delivery && delivery != first);
+        mq_ack(mq, delivery);
+        free(message);
+    }
+
+    /* The unacknowledged message is redelivered once its lease expires */
+    uint64_t delivery;
+    message = mq_retrieve_lease(mq, &delivery);
+    assert(message && strncmp(message, "0. ", 3) == 0);
+    assert(delivery && delivery != first);
+    mq_ack(mq, delivery);
+    free(message);
+
+    /* Acknowledgements piling up while the puller waits are all accepted,
+     * even when they do not fit in one X-Ack header (ids the server does not
+     * know, as after a restart, are ignored) */
+    mq_set_lease(mq, TIMEOUT);
+    for (size_t m = 0; m < NBACKLOG; m++) {
+        mq_publish(mq, TOPIC, "backlog");
+    }
+
+    uint64_t *deliveries = calloc(NBACKLOG, sizeof(uint64_t));
+    assert(deliveries);
+    for (size_t m = 0; m < NBACKLOG; m++) {
+        message = mq_retrieve_lease(mq, &deliveries[m]);
+        assert(message && streq(message, "backlog"));
+        free(message);
+    }
+    for (size_t m = 0; m < NSTALE; m++) {
+        mq_ack(mq, (1ULL << MQ_BROKER_SHIFT) - 1 - m);
+    }
+    for (size_t m = 0; m < NBACKLOG; m++) {
+        mq_ack(mq, deliveries[m]);
+    }
+    free(deliveries);
+
+    mq_stop(mq);
+    mq_delete(mq);
+
+    /* Nothing is left in flight on the server */
+    Endpoint *e   = endpoint_acquire(host, port);
+    Request  *req = request_create("GET", "/stats", NULL);
+    Request  *res = endpoint_send(e, req, NULL);
+    assert(res && res->status == 200 && res->body);
+    assert(strstr(res->body, "\"in_flight\": 0,"));
+    request_delete(res);
+    request_delete(req);
+    endpoint_release(e);
+    return 0;
+}
+
+/* vim: set expandtab sts=4 sw=4 ts=8 ft=c: */
@@ -0,0 +1,168 @@
+/* test_logging_unit.c: Test asynchronous logger (Unit) */
+
+#include "mq/logging.h"
+#include "mq/thread.h"
+
+#include <assert.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+/* Constants */
+
+#define THREADS     4
+#define MESSAGES    100
+
+/* Functions */
+
+/**
+ * Flush logger into stream and count lines containing needle.
+ */
+size_t count(FILE *stream, const char *needle) {
+    char   line[BUFSIZ];
+    size_t n = 0;
+
+    log_flush();
+    rewind(stream);
+    while (fgets(line, BUFSIZ, stream)) {
+        n += strstr(line, needle) != NULL;
+    }
+    return n;
+}
+
+void wait_next_second() {
+    struct timespec now;
+    clock_gettime(CLOCK_REALTIME, &now);
+    struct timespec rest = { 0, 1000000000L - now.tv_nsec };
+    nanosleep(&rest, NULL);
+}
+
+void * writer(void *arg) {
+    for (size_t m = 0; m < MESSAGES; m++) {
+        info("writer %zu message %zu", (size_t)arg, m);
+    }
+    return NULL;
+}
+
+int test_00_log_set_level() {
+    FILE *stream = tmpfile();
+    log_set_stream(stream);
+
+    log_set_level(LOG_LEVEL_INFO);
+    debug("hidden %d", 0);
+    info("shown %d", 1);
+    error("shown %d", 2);
+    assert(count(stream, "shown") == 2);
+    assert(count(stream, "hidden") == 0);
+    assert(count(stream, " INFO  shown 1") == 1);
+    assert(count(stream, " ERROR shown 2") == 1);
+
+    log_set_level(LOG_LEVEL_NONE);
+    error("silenced");
+    log_set_level(LOG_LEVEL_DEBUG);
+    debug("debug %s", "shown");
+    assert(count(stream, "silenced") == 0);
+    assert(count(stream, "test_logging_unit.c") == 1);
+
+    log_set_stream(NULL);
+    fclose(stream);
+    return EXIT_SUCCESS;
+}
+
+int test_01_log_set_burst() {
+    FILE *stream = tmpfile();
+    log_set_stream(stream);
+    log_set_burst(5);
+
+    /* Repeats past the burst are suppressed and counted in the next second */
+    wait_next_second();
+    for (size_t m = 0; m <= 50; m++) {
+        if (m == 50) {
+            info("other call site");
+            assert(count(stream, "storm") == 5);
+            assert(count(stream, "other call site") == 1);
+            wait_next_second();
+        }
+        error("storm %zu", m);
+    }
+    assert(count(stream, "Suppressed 45 repeats of: storm") == 1);
+    assert(count(stream, "storm 50") == 1);
+
+    log_set_burst(20);
+    log_set_stream(NULL);
+    fclose(stream);
+    return EXIT_SUCCESS;
+}
+
+int test_02_log_threads() {
+    FILE   *stream = tmpfile();
+    Thread  threads[THREADS];
+    log_set_stream(stream);
+    log_set_burst(0);
+
+    for (size_t t = 0; t < THREADS; t++) {
+        thread_create(&threads[t], NULL, writer, (void *)t);
+    }
+    for (size_t t = 0; t < THREADS; t++) {
+        thread_join(threads[t], NULL);
+    }
+    assert(count(stream, "writer") + log_dropped() == THREADS * MESSAGES);
+    assert(count(stream, "writer 0 message 0\n") == 1);
+
+    log_set_burst(20);
+    log_set_stream(NULL);
+    fclose(stream);
+    return EXIT_SUCCESS;
+}
+
+int test_03_log_dropped() {
+    FILE *stream = tmpfile();
+    log_set_stream(stream);
+    log_set_burst(0);
+
+    /* Full rings drop messages rather than block, and report how many */
+    size_t total = 10000;
+    for (size_t m = 0; m < total; m++) {
+        info("flood %zu", m);
+    }
+    unsigned long dropped = log_dropped();
+    assert(count(stream, "flood") + dropped == total);
+    if (dropped) {
+        assert(count(stream, "Dropped") >= 1);
+    }
+
+    log_set_burst(20);
+    log_set_stream(NULL);
+    fclose(stream);
+    return EXIT_SUCCESS;
+}
+
+/* Main execution */
+
+int main(int argc, char *argv[]) {
+    if (argc != 2) {
+        fprintf(stderr, "Usage: %s NUMBER\n\n", argv[0]);
+        fprintf(stderr, "Where NUMBER is right of the following:\n");
+        fprintf(stderr, "    0. Test log_set_level\n");
+        fprintf(stderr, "    1. Test log_set_burst\n");
+        fprintf(stderr, "    2. Test log_threads\n");
+        fprintf(stderr, "    3. Test log_dropped\n");
+        return EXIT_FAILURE;
+    }
+
+    int number = atoi(argv[1]);
+    int status = EXIT_FAILURE;
+
+    switch (number) {
+        case 0:  status = test_00_log_set_level(); break;
+        case 1:  status = test_01_log_set_burst(); break;
+        case 2:  status = test_02_log_threads(); break;
+        case 3:  status = test_03_log_dropped(); break;
+        default: fprintf(stderr, "Unknown NUMBER: %d\n", number); break;
+    }
+
+    return status;
+}
+
+/* vim: set expandtab sts=4 sw=4 ts=8 ft=c: */
@@ -0,0 +1,67 @@
+/* test_priority_client.c: Message Queue priority publish test */
+
+#include "mq/client.h"
+#include "mq/string.h"
+
+#include <assert.h>
+#include <unistd.h>
+
+/* Constants */
+
+const char * TOPIC     = "priority";
+const size_t NMESSAGES = 1500;  // More than the server's deduplication window
+const int    TIMEOUT   = 120;   // Seconds before the test is failed
+
+/* Main execution */
+
+int main(int argc, char *argv[]) {
+    /* Parse command-line arguments */
+    char *host = "localhost";
+    char *port = "9620";
+    char  name[BUFSIZ];
+    char  body[BUFSIZ];
+
+    if (argc > 1) { host = argv[1]; }
+    if (argc > 2) { port = argv[2]; }
+    sprintf(name, "priority_client_test_%d", getpid());
+    alarm(TIMEOUT);
+
+    /* Queue a backlog of bulk publishes, then one urgent publish that is
+     * sent ahead of all of them */
+    MessageQueue *mq = mq_create(name, host, port);
+    assert(mq);
+    mq_subscribe(mq, TOPIC);
+    for (size_t m = 0; m < NMESSAGES; m++) {
+        sprintf(body, "%zu", m);
+        mq_publish(mq, TOPIC, body);
+    }
+    mq_publish_priority(mq, TOPIC, "urgent", PRIORITY_URGENT);
+    mq_start(mq);
+
+    /* Every message arrives, none dropped as a duplicate */
+    char  *message = mq_retrieve(mq);
+    assert(message && streq(message, "urgent"));
+    free(message);
+
+    char seen[NMESSAGES];
+    memset(seen, 0, sizeof(seen));
+    for (size_t m = 0; m < NMESSAGES; m++) {
+        message = mq_retrieve(mq);
+        assert(message);
+        size_t index = strtoul(message, NULL, 10);
+        assert(index < NMESSAGES && !seen[index]);
+        seen[index] = 1;
+        free(message);
+    }
+
+    MQStats stats;
+    mq_stats(mq, &stats);
+    assert(stats.published == NMESSAGES + 1);
+    assert(stats.retrieved == NMESSAGES + 1);
+
+    mq_stop(mq);
+    mq_delete(mq);
+    return 0;
+}
+
+/* vim: set expandtab sts=4 sw=4 ts=8 ft=c: */
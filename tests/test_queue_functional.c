@@ -60,28 +60,110 @@ void *producer(void *arg) {
     return NULL;
 }
 
+void *spsc_consumer(void *arg) {
+    Queue *q = (Queue *)arg;
+
+    /* A single producer's requests arrive in order */
+    for (size_t m = 0; m < NPRODUCERS * NMESSAGES; m++) {
+        Request *r = queue_pop(q);
+        assert(r);
+        assert((size_t)atol(r->body) == m);
+        request_delete(r);
+    }
+    return NULL;
+}
+
+void *spsc_shared_consumer(void *arg) {
+    Queue *q = (Queue *)arg;
+    size_t last = 0;
+
+    /* Consumers take turns, so each still sees its requests in order */
+    for (size_t m = 0; m < NPRODUCERS * NMESSAGES / NCONSUMERS; m++) {
+        Request *r = queue_pop(q);
+        assert(r);
+        size_t n = atol(r->body);
+        assert(m == 0 || n > last);
+        last = n;
+        request_delete(r);
+    }
+    return NULL;
+}
+
+void *spsc_producer(void *arg) {
+    Queue *q = (Queue *)arg;
+    char body[BUFSIZ];
+
+    for (size_t m = 0; m < NPRODUCERS * NMESSAGES; m++) {
+        sprintf(body, "%zu", m);
+        queue_push(q, request_create("1", "2", body));
+    }
+    return NULL;
+}
+
+/* Backends */
+
+Queue *create_locked() {
+    return queue_create();
+}
+
+Queue *create_sharded() {
+    return queue_create_sharded(NPRODUCERS);
+}
+
+Queue *(*BACKENDS[])() = { create_locked, create_sharded, NULL };
+
 /* Main execution */
 
 int main(int arg, char *argv[]) {
-    Thread consumers[NCONSUMERS];
-    Thread producers[NPRODUCERS];
-    Queue *q = queue_create();
+    for (size_t b = 0; BACKENDS[b]; b++) {
+        Thread consumers[NCONSUMERS];
+        Thread producers[NPRODUCERS];
+        Queue *q = BACKENDS[b]();
 
-    for (size_t c = 0; c < NCONSUMERS; c++) {
-    	thread_create(&consumers[c], NULL, consumer, q);
-    }
+        for (size_t c = 0; c < NCONSUMERS; c++) {
+            thread_create(&consumers[c], NULL, consumer, q);
+        }
+
+        for (size_t p = 0; p < NPRODUCERS; p++) {
+            thread_create(&producers[p], NULL, producer, q);
+        }
+
+        for (size_t c = 0; c < NCONSUMERS; c++) {
+            thread_join(consumers[c], NULL);
+        }
 
-    for (size_t p = 0; p < NPRODUCERS; p++) {
-    	thread_create(&producers[p], NULL, producer, q);
+        for (size_t p = 0; p < NPRODUCERS; p++) {
+            thread_join(producers[p], NULL);
+        }
+
+        queue_delete(q);
     }
 
+    /* Single-producer/single-consumer ring, small enough to overflow */
+    Thread consumer;
+    Thread producer;
+    Queue *q = queue_create_spsc(64);
+
+    thread_create(&consumer, NULL, spsc_consumer, q);
+    thread_create(&producer, NULL, spsc_producer, q);
+    thread_join(consumer, NULL);
+    thread_join(producer, NULL);
+    assert(queue_size(q) == 0);
+    queue_delete(q);
+
+    /* Single producer with several (serialized) consumers */
+    Thread consumers[NCONSUMERS];
+    q = queue_create_spsc(64);
+
     for (size_t c = 0; c < NCONSUMERS; c++) {
-    	thread_join(consumers[c], NULL);
+        thread_create(&consumers[c], NULL, spsc_shared_consumer, q);
     }
-
-    for (size_t p = 0; p < NPRODUCERS; p++) {
-    	thread_join(producers[p], NULL);
+    thread_create(&producer, NULL, spsc_producer, q);
+    for (size_t c = 0; c < NCONSUMERS; c++) {
+        thread_join(consumers[c], NULL);
     }
+    thread_join(producer, NULL);
+    assert(queue_size(q) == 0);
 
     queue_delete(q);
     return EXIT_SUCCESS;
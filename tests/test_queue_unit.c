@@ -85,6 +85,114 @@ int test_03_queue_delete() {
     return EXIT_SUCCESS;
 }
 
+int test_04_queue_sharded() {
+    Queue *q = queue_create_sharded(4);
+    assert(q);
+    assert(q->backend == &ShardedQueue);
+    assert(q->size == 0);
+
+    /* A single thread uses a single shard, which is FIFO */
+    for (size_t r = 0; REQUESTS[r].method; r++) {
+        queue_push(q, request_create(REQUESTS[r].method, REQUESTS[r].uri, REQUESTS[r].body));
+        assert(q->size == r + 1);
+    }
+
+    for (size_t r = 0; r < 3; r++) {
+        Request *n = queue_pop(q);
+        assert(streq(n->body, REQUESTS[r].body));
+        assert(n->next == NULL);
+        request_delete(n);
+    }
+    assert(q->size == 2);
+
+    queue_delete(q);
+    return EXIT_SUCCESS;
+}
+
+int test_05_queue_priority() {
+    Queue *q = queue_create_priority();
+    assert(q);
+    assert(q->backend == &PriorityQueue);
+
+    /* Higher levels are popped first, each in FIFO order */
+    int priorities[] = { PRIORITY_NORMAL, PRIORITY_CONTROL, PRIORITY_HIGH, PRIORITY_CONTROL, PRIORITY_NORMAL };
+    for (size_t r = 0; REQUESTS[r].method; r++) {
+        Request *n = request_create(REQUESTS[r].method, REQUESTS[r].uri, REQUESTS[r].body);
+        n->priority = priorities[r];
+        queue_push(q, n);
+    }
+    assert(q->size == 5);
+
+    const char *order[] = { "b1", "b3", "b2", "b0", "b4" };
+    for (size_t r = 0; r < 5; r++) {
+        Request *n = queue_pop(q);
+        assert(streq(n->body, order[r]));
+        request_delete(n);
+    }
+
+    /* Lower levels are served once per QUEUE_PRIORITY_BURST pops ahead of them */
+    for (size_t r = 0; r < 3 * QUEUE_PRIORITY_BURST; r++) {
+        Request *n = request_create("PUT", "/control", NULL);
+        n->priority = PRIORITY_CONTROL;
+        queue_push(q, n);
+    }
+    queue_push(q, request_create("PUT", "/normal", "first"));
+    queue_push(q, request_create("PUT", "/normal", "second"));
+
+    for (size_t r = 0; r < 2 * (QUEUE_PRIORITY_BURST + 1); r++) {
+        Request *n = queue_pop(q);
+        int served = (r + 1) % (QUEUE_PRIORITY_BURST + 1) == 0;
+        assert(streq(n->uri, served ? "/normal" : "/control"));
+        request_delete(n);
+    }
+    assert(q->size == QUEUE_PRIORITY_BURST);
+
+    queue_delete(q);
+    return EXIT_SUCCESS;
+}
+
+int test_06_queue_spsc() {
+    Queue *q = queue_create_spsc(4);
+    assert(q);
+    assert(q->backend == &SPSCQueue);
+
+    /* Requests beyond the ring's capacity overflow into the list, in order */
+    for (size_t r = 0; REQUESTS[r].method; r++) {
+        queue_push(q, request_create(REQUESTS[r].method, REQUESTS[r].uri, REQUESTS[r].body));
+    }
+    assert(queue_size(q) == 5);
+    assert(queue_high_water(q) == 5);
+    assert(q->head && streq(q->head->body, "b4"));
+
+    for (size_t r = 0; r < 3; r++) {
+        Request *n = queue_pop(q);
+        assert(streq(n->body, REQUESTS[r].body));
+        request_delete(n);
+    }
+    assert(queue_size(q) == 2);
+    assert(queue_high_water(q) == 5);
+
+    /* Pushes keep overflowing until the list is drained */
+    queue_push(q, request_create("m5", "u5", "b5"));
+    const char *order[] = { "b3", "b4", "b5" };
+    for (size_t r = 0; r < 3; r++) {
+        Request *n = queue_pop(q);
+        assert(streq(n->body, order[r]));
+        assert(n->next == NULL);
+        request_delete(n);
+    }
+    assert(queue_size(q) == 0);
+    assert(q->head == NULL);
+
+    /* Requests left in the ring are deleted with it */
+    queue_push(q, request_create("m6", "u6", "b6"));
+    queue_push(q, request_create("m7", "u7", "b7"));
+    assert(queue_size(q) == 2);
+
+    queue_delete(q);
+    return EXIT_SUCCESS;
+}
+
 /* Main execution */
 
 int main(int argc, char *argv[]) {
@@ -95,6 +203,9 @@ int main(int argc, char *argv[]) {
         fprintf(stderr, "    1. Test queue_push\n");
         fprintf(stderr, "    2. Test queue_pop\n");
         fprintf(stderr, "    3. Test queue_delete\n");
+        fprintf(stderr, "    4. Test queue_sharded\n");
+        fprintf(stderr, "    5. Test queue_priority\n");
+        fprintf(stderr, "    6. Test queue_spsc\n");
         return EXIT_FAILURE;
     }
 
@@ -106,6 +217,9 @@ int main(int argc, char *argv[]) {
         case 1:  status = test_01_queue_push(); break;
         case 2:  status = test_02_queue_pop(); break;
         case 3:  status = test_03_queue_delete(); break;
+        case 4:  status = test_04_queue_sharded(); break;
+        case 5:  status = test_05_queue_priority(); break;
+        case 6:  status = test_06_queue_spsc(); break;
         default: fprintf(stderr, "Unknown NUMBER: %d\n", number); break;
     }   
 
@@ -114,6 +114,102 @@ failure:
     return status;
 }
 
+int test_03_request_read() {
+    char tempfile[BUFSIZ] = "test.XXXXXX";
+    int status = EXIT_FAILURE;
+    int fd = mkstemp(tempfile);
+    Request *r = NULL;
+
+    if (fd < 0) {
+        fprintf(stderr, "mkstemp: %s\n", strerror(errno));
+        return EXIT_FAILURE;
+    }
+
+    FILE *fs = fdopen(fd, "w+");
+    if (!fs) {
+        fprintf(stderr, "fdopen: %s\n", strerror(errno));
+        goto failure;
+    }
+
+    fputs("HTTP/1.1 200 OK\r\nContent-Length: 12\r\nX-Topic: HOT\r\n\r\nSOME LIKE IT", fs);
+    fseek(fs, 0, SEEK_SET);
+
+    r = request_read(fs);
+    if (!r) {
+        goto failure;
+    }
+    if (r->status != 200 || !streq(r->body, "SOME LIKE IT")) {
+        fprintf(stderr, "%d %s != 200 SOME LIKE IT\n", r->status, r->body);
+        goto failure;
+    }
+    if (!request_get_header(r, "x-topic") || !streq(request_get_header(r, "X-Topic"), "HOT")) {
+        fprintf(stderr, "X-Topic != HOT\n");
+        goto failure;
+    }
+    if (request_get_header(r, "Content-Length")) {
+        fprintf(stderr, "Content-Length should not be an extra header\n");
+        goto failure;
+    }
+
+    status = EXIT_SUCCESS;
+
+failure:
+    unlink(tempfile);
+    if (r) request_delete(r);
+    if (fs) fclose(fs);
+    return status;
+}
+
+size_t Released = 0;
+
+void release(void *buf) {
+    Released++;
+}
+
+int test_04_request_create_buf() {
+    char body[] = { 'A', 'B', '\0', 'C', 'D' };
+    int fds[2];
+    int status = EXIT_FAILURE;
+
+    if (pipe(fds) < 0) {
+        fprintf(stderr, "pipe: %s\n", strerror(errno));
+        return EXIT_FAILURE;
+    }
+
+    Request *r = request_create_buf("PUT", "/topic/BIN", body, sizeof(body), release);
+    assert(r);
+    assert(r->body == body);
+    assert(r->length == sizeof(body));
+
+    char *target = "PUT /topic/BIN HTTP/1.0\r\nContent-Length: 5\r\n\r\nAB\0CD";
+    size_t length = strlen(target) + 3;
+    if (request_send(r, fds[1]) != length) {
+        fprintf(stderr, "request_send did not send %zu bytes\n", length);
+        goto failure;
+    }
+
+    char buffer[BUFSIZ];
+    if (read(fds[0], buffer, BUFSIZ) != length || memcmp(buffer, target, length) != 0) {
+        fprintf(stderr, "request_send did not send binary body\n");
+        goto failure;
+    }
+
+    request_delete(r);
+    r = NULL;
+    if (Released != 1) {
+        fprintf(stderr, "body was not released\n");
+        goto failure;
+    }
+
+    status = EXIT_SUCCESS;
+
+failure:
+    if (r) request_delete(r);
+    close(fds[0]);
+    close(fds[1]);
+    return status;
+}
+
 /* Main execution */
 
 int main(int argc, char *argv[]) {
@@ -123,6 +219,8 @@ int main(int argc, char *argv[]) {
         fprintf(stderr, "    0. Test request_create\n");
         fprintf(stderr, "    1. Test request_delete\n");
         fprintf(stderr, "    2. Test request_write\n");
+        fprintf(stderr, "    3. Test request_read\n");
+        fprintf(stderr, "    4. Test request_create_buf\n");
         return EXIT_FAILURE;
     }
 
@@ -133,6 +231,8 @@ int main(int argc, char *argv[]) {
         case 0:  status = test_00_request_create(); break;
         case 1:  status = test_01_request_delete(); break;
         case 2:  status = test_02_request_write(); break;
+        case 3:  status = test_03_request_read(); break;
+        case 4:  status = test_04_request_create_buf(); break;
         default: fprintf(stderr, "Unknown NUMBER: %d\n", number); break;
     }   
 
@@ -0,0 +1,65 @@
+/* test_stats_client.c: Message Queue client statistics test */
+
+#include "mq/client.h"
+#include "mq/string.h"
+
+#include <assert.h>
+#include <unistd.h>
+
+/* Constants */
+
+const char * TOPIC     = "measured";
+const size_t NMESSAGES = 10;
+const int    TIMEOUT   = 60;    // Seconds before the test is failed
+
+/* Main execution */
+
+int main(int argc, char *argv[]) {
+    /* Parse command-line arguments */
+    char *host = "localhost";
+    char *port = "9620";
+    char  name[BUFSIZ];
+    char  body[BUFSIZ];
+    size_t bytes = 0;
+
+    if (argc > 1) { host = argv[1]; }
+    if (argc > 2) { port = argv[2]; }
+    sprintf(name, "stats_client_test_%d", getpid());
+    alarm(TIMEOUT);
+
+    MessageQueue *mq = mq_create(name, host, port);
+    assert(mq);
+    mq_subscribe(mq, TOPIC);
+    mq_start(mq);
+
+    for (size_t m = 0; m < NMESSAGES; m++) {
+        sprintf(body, "%zu. Hello from %d", m, getpid());
+        mq_publish(mq, TOPIC, body);
+        bytes += strlen(body);
+    }
+    for (size_t m = 0; m < NMESSAGES; m++) {
+        char *message = mq_retrieve(mq);
+        assert(message);
+        free(message);
+    }
+
+    /* Every publish was accepted and every message retrieved (stopping
+     * first, so every response has been counted) */
+    mq_stop(mq);
+
+    MQStats stats;
+    mq_stats(mq, &stats);
+    assert(stats.published == NMESSAGES);
+    assert(stats.retrieved == NMESSAGES);
+    assert(stats.bytes_published == bytes);
+    assert(stats.bytes_retrieved == bytes);
+    assert(stats.publish.count == stats.published);
+    assert(stats.queued.count  == stats.published);
+    assert(stats.outgoing == 0 && stats.outgoing_high > 0);
+    assert(stats.incoming_high > 0);
+
+    mq_delete(mq);
+    return 0;
+}
+
+/* vim: set expandtab sts=4 sw=4 ts=8 ft=c: */
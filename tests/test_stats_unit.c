@@ -0,0 +1,140 @@
+/* test_stats_unit.c: Test per-thread client counters (Unit) */
+
+#include "mq/queue.h"
+#include "mq/stats.h"
+
+#include <assert.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+/* Constants */
+
+#define THREADS     4
+#define INCREMENTS  10000
+
+/* Functions */
+
+void * increment(void *arg) {
+    Stats* s = (Stats *)arg;
+    for (size_t i = 0; i < INCREMENTS; i++) {
+        stats_add(s, published, 1);
+        stats_add(s, bytes_published, 2);
+        stats_record(s, publish, i);
+    }
+    return NULL;
+}
+
+int test_00_histogram_add() {
+    Histogram h;
+    memset(&h, 0, sizeof(h));
+
+    histogram_add(&h, 0);
+    histogram_add(&h, 1);
+    histogram_add(&h, 1000);        // [512, 1024)
+    histogram_add(&h, 1023);
+    histogram_add(&h, 1024);        // [1024, 2048)
+    histogram_add(&h, UINT64_MAX);  // Clamped to last bucket
+
+    assert(h.count == 6);
+    assert(h.buckets[0] == 2);
+    assert(h.buckets[9] == 2);
+    assert(h.buckets[10] == 1);
+    assert(h.buckets[HISTOGRAM_BUCKETS - 1] == 1);
+    return EXIT_SUCCESS;
+}
+
+int test_01_histogram_percentile() {
+    Histogram h;
+    memset(&h, 0, sizeof(h));
+    assert(histogram_percentile(&h, 50) == 0);
+
+    for (uint64_t ns = 1; ns <= 100; ns++) {
+        histogram_add(&h, ns * 1000);
+    }
+    assert(h.total == 5050 * 1000);
+    assert(histogram_percentile(&h, 0) == 1023);
+    assert(histogram_percentile(&h, 50) == 65535);
+    assert(histogram_percentile(&h, 99) == 131071);
+    assert(histogram_percentile(&h, 100) == 131071);
+    return EXIT_SUCCESS;
+}
+
+int test_02_stats_collect() {
+    Stats*  s = stats_create();
+    Thread  threads[THREADS];
+    MQStats out;
+    assert(s);
+
+    stats_add((Stats *)NULL, published, 1);
+    stats_add(s, errors, 1);
+    for (size_t t = 0; t < THREADS; t++) {
+        thread_create(&threads[t], NULL, increment, s);
+    }
+    for (size_t t = 0; t < THREADS; t++) {
+        thread_join(threads[t], NULL);
+    }
+
+    stats_collect(s, &out);
+    assert(out.published == THREADS * INCREMENTS);
+    assert(out.bytes_published == 2 * THREADS * INCREMENTS);
+    assert(out.errors == 1);
+    assert(out.publish.count == THREADS * INCREMENTS);
+    assert(out.connect.count == 0);
+
+    /* Shards outlive their threads */
+    stats_add(s, published, 1);
+    stats_collect(s, &out);
+    assert(out.published == THREADS * INCREMENTS + 1);
+
+    stats_delete(s);
+    return EXIT_SUCCESS;
+}
+
+int test_03_queue_high_water() {
+    Queue* q = queue_create();
+    assert(q);
+    assert(queue_size(q) == 0 && queue_high_water(q) == 0);
+
+    for (size_t i = 0; i < 5; i++) {
+        queue_push(q, request_create("PUT", "/topic/t", "body"));
+    }
+    for (size_t i = 0; i < 3; i++) {
+        request_delete(queue_pop(q));
+    }
+    queue_push(q, request_create("PUT", "/topic/t", "body"));
+    assert(queue_size(q) == 3);
+    assert(queue_high_water(q) == 5);
+
+    queue_delete(q);
+    return EXIT_SUCCESS;
+}
+
+/* Main execution */
+
+int main(int argc, char *argv[]) {
+    if (argc != 2) {
+        fprintf(stderr, "Usage: %s NUMBER\n\n", argv[0]);
+        fprintf(stderr, "Where NUMBER is right of the following:\n");
+        fprintf(stderr, "    0. Test histogram_add\n");
+        fprintf(stderr, "    1. Test histogram_percentile\n");
+        fprintf(stderr, "    2. Test stats_collect\n");
+        fprintf(stderr, "    3. Test queue_high_water\n");
+        return EXIT_FAILURE;
+    }
+
+    int number = atoi(argv[1]);
+    int status = EXIT_FAILURE;
+
+    switch (number) {
+        case 0:  status = test_00_histogram_add(); break;
+        case 1:  status = test_01_histogram_percentile(); break;
+        case 2:  status = test_02_stats_collect(); break;
+        case 3:  status = test_03_queue_high_water(); break;
+        default: fprintf(stderr, "Unknown NUMBER: %d\n", number); break;
+    }
+
+    return status;
+}
+
+/* vim: set expandtab sts=4 sw=4 ts=8 ft=c: */
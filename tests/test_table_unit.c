@@ -0,0 +1,116 @@
+/* test_table_unit.c: Test String Keyed Hash Table (Unit) */
+
+#include "mq/table.h"
+#include "mq/string.h"
+
+#include <assert.h>
+#include <stdio.h>
+#include <stdlib.h>
+
+/* Constants */
+
+const char * KEYS[] = { "alpha", "beta", "gamma", "delta", "epsilon", NULL };
+
+/* Functions */
+
+void count(const char *key, void *value, void *arg) {
+    (*(size_t *)arg) += (size_t)value;
+}
+
+int test_00_table_create() {
+    Table *t = table_create(0);
+    assert(t);
+    assert(t->buckets);
+    assert(t->capacity > 0);
+    assert(t->size == 0);
+
+    table_delete(t, NULL);
+    return EXIT_SUCCESS;
+}
+
+int test_01_table_insert() {
+    Table *t = table_create(2);
+    assert(t);
+
+    for (size_t k = 0; KEYS[k]; k++) {
+        table_insert(t, KEYS[k], (void *)(k + 1));
+        assert(t->size == k + 1);
+    }
+
+    /* Updating existing key does not change size */
+    table_insert(t, KEYS[0], (void *)42);
+    assert(t->size == 5);
+    assert(t->capacity > 2);
+
+    table_delete(t, NULL);
+    return EXIT_SUCCESS;
+}
+
+int test_02_table_search() {
+    Table *t = table_create(2);
+    assert(t);
+
+    for (size_t k = 0; KEYS[k]; k++) {
+        table_insert(t, KEYS[k], (void *)(k + 1));
+    }
+
+    for (size_t k = 0; KEYS[k]; k++) {
+        assert(table_search(t, KEYS[k]) == (void *)(k + 1));
+    }
+    assert(table_search(t, "omega") == NULL);
+
+    size_t total = 0;
+    table_each(t, count, &total);
+    assert(total == 1 + 2 + 3 + 4 + 5);
+
+    table_delete(t, NULL);
+    return EXIT_SUCCESS;
+}
+
+int test_03_table_remove() {
+    Table *t = table_create(0);
+    assert(t);
+
+    for (size_t k = 0; KEYS[k]; k++) {
+        table_insert(t, KEYS[k], strdup(KEYS[k]));
+    }
+
+    char *value = table_remove(t, "gamma");
+    assert(value && streq(value, "gamma"));
+    assert(t->size == 4);
+    assert(table_search(t, "gamma") == NULL);
+    assert(table_remove(t, "gamma") == NULL);
+    free(value);
+
+    table_delete(t, free);
+    return EXIT_SUCCESS;
+}
+
+/* Main execution */
+
+int main(int argc, char *argv[]) {
+    if (argc != 2) {
+        fprintf(stderr, "Usage: %s NUMBER\n\n", argv[0]);
+        fprintf(stderr, "Where NUMBER is right of the following:\n");
+        fprintf(stderr, "    0. Test table_create\n");
+        fprintf(stderr, "    1. Test table_insert\n");
+        fprintf(stderr, "    2. Test table_search\n");
+        fprintf(stderr, "    3. Test table_remove\n");
+        return EXIT_FAILURE;
+    }
+
+    int number = atoi(argv[1]);
+    int status = EXIT_FAILURE;
+
+    switch (number) {
+        case 0:  status = test_00_table_create(); break;
+        case 1:  status = test_01_table_insert(); break;
+        case 2:  status = test_02_table_search(); break;
+        case 3:  status = test_03_table_remove(); break;
+        default: fprintf(stderr, "Unknown NUMBER: %d\n", number); break;
+    }
+
+    return status;
+}
+
+/* vim: set expandtab sts=4 sw=4 ts=8 ft=c: */
@@ -0,0 +1,60 @@
+/* test_trace_client.c: Message Queue end to end tracing test */
+
+#include "mq/client.h"
+#include "mq/string.h"
+
+#include <assert.h>
+#include <unistd.h>
+
+/* Constants */
+
+const char * TOPIC     = "traced";
+const size_t NMESSAGES = 10;
+const int    TIMEOUT   = 60;    // Seconds before the test is failed
+
+/* Main execution */
+
+int main(int argc, char *argv[]) {
+    /* Parse command-line arguments */
+    char *host = "localhost";
+    char *port = "9620";
+    char  name[BUFSIZ];
+    char  body[BUFSIZ];
+
+    if (argc > 1) { host = argv[1]; }
+    if (argc > 2) { port = argv[2]; }
+    sprintf(name, "trace_client_test_%d", getpid());
+    alarm(TIMEOUT);
+
+    MessageQueue *mq = mq_create(name, host, port);
+    assert(mq);
+    mq_subscribe(mq, TOPIC);
+    mq_set_tracing(mq, 1);
+    mq_start(mq);
+
+    for (size_t m = 0; m < NMESSAGES; m++) {
+        sprintf(body, "%zu. Hello from %d", m, getpid());
+        mq_publish(mq, TOPIC, body);
+    }
+    for (size_t m = 0; m < NMESSAGES; m++) {
+        char *message = mq_retrieve(mq);
+        assert(message);
+        free(message);
+    }
+
+    /* Every message was traced through each hop */
+    MQTrace trace;
+    assert(mq_trace(mq, TOPIC, &trace));
+    assert(trace.total.count    == NMESSAGES);
+    assert(trace.publish.count  == NMESSAGES);
+    assert(trace.queued.count   == NMESSAGES);
+    assert(trace.deliver.count  == NMESSAGES);
+    assert(trace.retrieve.count == NMESSAGES);
+    assert(!mq_trace(mq, "missing", &trace));
+
+    mq_stop(mq);
+    mq_delete(mq);
+    return 0;
+}
+
+/* vim: set expandtab sts=4 sw=4 ts=8 ft=c: */